@@ -0,0 +1,179 @@
+/* avr-gang.cpp - SPI transfers to several AVR targets at once
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <Arduino.h>
+#include "joat.h"
+#include "timing.h"
+#include "avr-programmer.h"
+#include "avr-isp.h"
+
+/* Gang programming
+ *
+ * All the targets share SCK and MOSI, so every ISP instruction is broadcast: the page loads, the page
+ * writes and the polling all happen in parallel. Each target has its own MISO pin. The three MISO
+ * pins are sampled on the same clock edge and the bytes received from each target are stored in
+ * avrpdata.gang_rx[], so the standalone programmer can check every target's responses separately.
+ *
+ * The SPI hardware can only receive from one MISO pin, so the transfers are always bit-banged.
+ * spi_bitbang() calls gang_xfer() when there's more than one target, so the rest of the ISP layer
+ * doesn't need to know about it. A target that fails is dropped from avrpdata.active but still receives
+ * the broadcast instructions; its responses are ignored.
+*/
+
+static void gang_reset(uint8_t reset);
+static inline void gang_halfbit(void);
+
+/* gang_xfer() - transfer a byte to all targets
+ *
+ * Returns the byte received from target 1.
+*/
+uint8_t gang_xfer(uint8_t b)
+{
+	uint8_t r0 = 0, r1 = 0, r2 = 0;
+
+	for ( uint8_t i = 0; i < 8; i++ )
+	{
+		if ( b & 0x80 )
+			SPI_PORT |= _BV(SPI_MOSI_BIT);
+		else
+			SPI_PORT &= ~_BV(SPI_MOSI_BIT);
+		b <<= 1;
+		gang_halfbit();
+
+		SPI_PORT |= _BV(SPI_SCK_BIT);
+
+		// Sample all the MISO pins as close together as possible
+		uint8_t pb = SPI_PIN;
+		uint8_t pc = GANG_PIN;
+
+		r0 = (r0 << 1) | ((pb >> SPI_MISO_BIT) & 0x01);
+		r1 = (r1 << 1) | ((pc >> GANG_MISO2_BIT) & 0x01);
+		r2 = (r2 << 1) | ((pc >> GANG_MISO3_BIT) & 0x01);
+		gang_halfbit();
+
+		SPI_PORT &= ~_BV(SPI_SCK_BIT);
+	}
+
+	avrpdata.gang_rx[0] = r0;
+	avrpdata.gang_rx[1] = r1;
+	avrpdata.gang_rx[2] = r2;
+
+	return r0;
+}
+
+/* gang_busy() - combine the results of a "Poll RDY/BSY" instruction
+ *
+ * Returns the OR of the bytes received from the targets that are still active, so bit 0
+ * is set if any of them is busy.
+*/
+uint8_t gang_busy(void)
+{
+	uint8_t busy = 0;
+
+	for ( uint8_t t = 0; t < AVRG_NTARGETS; t++ )
+	{
+		if ( avrpdata.active & (1 << t) )
+			busy |= avrpdata.gang_rx[t];
+	}
+
+	return busy;
+}
+
+/* gang_start_pmode() - reset all the targets and send the programming enable instruction
+ *
+ * The bytes received during the third byte of the instruction are left in gang_rx[]. A target that
+ * is in sync echoes 0x53; the caller checks them. The clock is not negotiated.
+*/
+void gang_start_pmode(void)
+{
+	uint8_t echo[AVRG_NTARGETS];
+
+	gang_reset(1);
+	PIN_RESET::output();
+	PIN_RESET2::output();
+	PIN_RESET3::output();
+
+	SPCR = 0;
+	SPI_PORT &= ~(_BV(SPI_MOSI_BIT) | _BV(SPI_SCK_BIT));
+	SPI_DDR |= _BV(SPI_MOSI_BIT) | _BV(SPI_SCK_BIT);
+
+	// An empty socket reads as 0xff, which is never a valid response
+	PIN_MISO::input_pullup();
+	PIN_MISO2::input_pullup();
+	PIN_MISO3::input_pullup();
+
+	avrpdata.spi_halfbit = AVRG_HALFBIT;	// Non-zero, so that spi_xfer() goes to spi_bitbang()
+	avrpdata.spi_level = AVRP_SPI_NCLK;
+
+	// Same sequence as enter_progmode()
+	tick_delay(MILLIS_TO_TICKS(20));
+	gang_reset(0);
+	tick_delay(MICROS_TO_TICKS(100));
+	gang_reset(1);
+
+	tick_delay(MILLIS_TO_TICKS(50));
+	spi_xfer(0xAC);
+	spi_xfer(0x53);
+	spi_xfer(0x00);
+	for ( uint8_t t = 0; t < AVRG_NTARGETS; t++ )
+		echo[t] = avrpdata.gang_rx[t];
+	spi_xfer(0x00);
+	for ( uint8_t t = 0; t < AVRG_NTARGETS; t++ )
+		avrpdata.gang_rx[t] = echo[t];
+
+	avrpdata.erased = 0;
+	avrpdata.pmode = 1;
+}
+
+/* gang_end_pmode() - release all the targets
+*/
+void gang_end_pmode(void)
+{
+	end_pmode();
+	gang_reset(0);
+	PIN_RESET2::input();
+	PIN_RESET3::input();
+	PIN_MISO::input();
+	PIN_MISO2::input();
+	PIN_MISO3::input();
+}
+
+/* gang_reset() - control the RESET pins of all the targets (active low)
+*/
+static void gang_reset(uint8_t reset)
+{
+	uint8_t pval = reset ? LOW : HIGH;
+
+	PIN_RESET::set(pval);
+	PIN_RESET2::set(pval);
+	PIN_RESET3::set(pval);
+}
+
+/* gang_halfbit() - wait for half an SPI clock cycle
+ *
+ * The delay is too short for tick_delay(), which has a lot of overhead, so timer1 is read directly.
+*/
+static inline void gang_halfbit(void)
+{
+	uint16_t t0 = TCNT1;
+
+	while ( (uint16_t)(TCNT1 - t0) < (uint16_t)AVRG_HALFBIT )
+	{	// Wait
+	}
+}
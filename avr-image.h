@@ -0,0 +1,59 @@
+/* avr-image.h - the image that is programmed by the standalone AVR programmer
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AVR_IMAGE_H
+#define AVR_IMAGE_H	1
+
+/* Replace this file with your own image. The flash contents come from a binary file:
+ *	avr-objcopy -O binary -R .eeprom myprog.elf myprog.bin
+ *	xxd -i myprog.bin
+ * Paste the bytes into avri_image[] and set the device parameters to match the target.
+ * The image must fit into the spare flash of the nano (about 10 kB at the moment).
+ *
+ * The example is a blinker for an ATtiny85 running from its internal oscillator: it toggles PB0 about
+ * once a second. Address 0 (the reset vector) is the start of the program; no interrupts are used.
+*/
+
+#include <Arduino.h>
+
+// Target device: signature, flash page size in bytes, flash size in bytes
+#define AVRI_SIG0		0x1e
+#define AVRI_SIG1		0x93
+#define AVRI_SIG2		0x0b
+#define AVRI_PAGESIZE	64
+#define AVRI_FLASHSIZE	8192
+
+// Fuses to program after the flash. Leave undefined to leave a fuse unchanged.
+// #define AVRI_LFUSE	0x62
+// #define AVRI_HFUSE	0xdf
+// #define AVRI_EFUSE	0xff
+
+static const uint8_t PROGMEM avri_image[] =
+{
+	0xb8, 0x9a,		// 0000:	sbi		DDRB, 0
+	0xb0, 0x9a,		// 0001:	sbi		PINB, 0		; toggle PB0
+	0x23, 0xe0,		// 0002:	ldi		r18, 3
+	0x01, 0x97,		// 0003:	sbiw	r24, 1
+	0xf1, 0xf7,		// 0004:	brne	0003
+	0x2a, 0x95,		// 0005:	dec		r18
+	0xe1, 0xf7,		// 0006:	brne	0003
+	0xf9, 0xcf		// 0007:	rjmp	0001
+};
+
+#endif
@@ -0,0 +1,139 @@
+/* avr-isp.h - ISP primitives shared by the AVR programmer's protocol engines
+ *
+ * (c) David Haworth & Randall Bohn
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AVR_ISP_H
+#define AVR_ISP_H	1
+
+/* This header is only for the files that make up the AVR programmer.
+ * The STK500v1 engine (avrisp()) and the SPI/ISP layer are in avr-programmer.cpp.
+ * The STK500v2 engine is in stk500v2.cpp.
+ * The TPI layer (ATtiny4/5/9/10, STK500v2 only) is in avr-tpi.cpp.
+*/
+
+#include <Arduino.h>
+#include "joat.h"
+#include "timing.h"
+#include "avr-programmer.h"
+
+#define avrpdata	joat_data.avrp_data
+
+// Converts a short interval for the statistics. HZ is a multiple of 1 MHz, so it's cheaper than ticks_to_micros()
+#define AVRP_TICKS_TO_US(t)	((t) / (HZ / 1000000))
+
+extern void avrp_error(uint8_t code);
+extern uint8_t avrp_getc(void);
+extern void avrp_read(uint8_t *buf, uint16_t n);
+extern void avrp_update_stats(void);
+extern uint8_t spi_transaction(uint8_t a, uint8_t b, uint8_t c, uint8_t d);
+extern uint8_t spi_bitbang(uint8_t b);
+extern uint8_t start_pmode(void);
+extern void end_pmode(void);
+extern uint8_t read_sig_byte(uint8_t n);
+extern uint8_t commit(unsigned int addr);
+extern void start_commit(uint8_t cmd, unsigned int addr);
+extern uint8_t finish_commit(void);
+extern void note_poll(uint8_t rdcmd, unsigned int addr, uint8_t value);
+extern uint8_t wait_ready(uint8_t rdcmd, unsigned int addr, uint8_t value, uint32_t maxtime);
+extern void prog_lamp(int state);
+extern void vcc(uint8_t power);
+extern char hexdigit(uint8_t h);
+extern uint16_t flash_crc(unsigned int addr, uint16_t length);
+extern uint8_t crc_check(uint8_t *crcs, uint16_t blksize, uint8_t n);
+
+extern uint8_t gang_xfer(uint8_t b);
+extern uint8_t gang_busy(void);
+extern void gang_start_pmode(void);
+extern void gang_end_pmode(void);
+
+// Results of the TPI functions (0 = OK)
+#define TPI_ERR_FAILED		1	// The target didn't answer, or the answer had a parity or framing error
+#define TPI_ERR_TIMEOUT		2	// The NVM controller stayed busy
+
+extern uint8_t tpi_start_pmode(void);
+extern void tpi_end_pmode(void);
+extern uint8_t tpi_read(uint16_t addr, uint8_t *buf, uint16_t n);
+extern uint8_t tpi_write(uint16_t addr, const uint8_t *data, uint16_t n);
+extern uint8_t tpi_erase(uint8_t chip, uint16_t addr);
+
+extern void stk500v2_init(void);
+extern void stk500v2(void);
+
+static inline uint16_t beget16(uint8_t *addr)
+{
+	return addr[0]*256 + addr[1];
+}
+
+/* Direct-register SPI engine
+ *
+ * spi_xfer() sends a byte and returns the byte that was received at the same time. At the fast clock
+ * settings a byte only takes a few dozen cycles, which is less than the overhead of the SPI library's
+ * calls, so the hardware transfer is inlined wherever an ISP instruction is sent.
+*/
+static inline uint8_t spi_xfer(uint8_t b)
+{
+	if ( avrpdata.spi_halfbit != 0 )
+		return spi_bitbang(b);
+
+	SPDR = b;
+	while ( (SPSR & _BV(SPIF)) == 0 )
+	{	// Wait
+	}
+	return SPDR;
+}
+
+static inline void flash(uint8_t hilo, unsigned int addr, uint8_t data)
+{
+	spi_xfer(0x40 + 8 * hilo);
+	spi_xfer(addr >> 8 & 0xFF);
+	spi_xfer(addr & 0xFF);
+	spi_xfer(data);
+}
+
+static inline uint8_t flash_read(uint8_t hilo, unsigned int addr)
+{
+	spi_xfer(0x20 + hilo * 8);
+	spi_xfer((addr >> 8) & 0xFF);
+	spi_xfer(addr & 0xFF);
+	return spi_xfer(0);
+}
+
+/* Differential flash programming (AVRP_OPT_DIFF)
+ *
+ * Reading a byte over SPI takes a few microseconds, but a page write takes several milliseconds.
+ * So each byte of a page is checked as it is loaded, and the page is only written if it differs from
+ * what the target already holds. Once one byte is known to differ, the rest of the page isn't checked.
+ * After a chip erase the target is blank, so only pages that contain something other than 0xff are written.
+ *
+ * diff_begin() must be called at the start of each page. Without the option, every page is dirty.
+*/
+static inline void diff_begin(void)
+{
+	avrpdata.page_dirty = (avrpdata.options & AVRP_OPT_DIFF) == 0;
+}
+
+static inline void diff_byte(uint8_t hilo, unsigned int addr, uint8_t b)
+{
+	if ( avrpdata.page_dirty )
+		return;
+
+	if ( avrpdata.erased ? (b != 0xff) : (flash_read(hilo, addr) != b) )
+		avrpdata.page_dirty = 1;
+}
+
+#endif
@@ -26,70 +26,95 @@
 // http://www.opensource.org/licenses/bsd-license.php
 
 #include <Arduino.h>
-#include <SPI.h>
+#include <util/crc16.h>
 #include "joat.h"
 #include "timing.h"
+#include "uart.h"
 #include "avr-programmer.h"
-
-#define avrpdata	joat_data.avrp_data
-
-static inline uint16_t beget16(uint8_t *addr)
-{
-	return addr[0]*256 + addr[1];
-}
-
-static void avrp_init(void);
+#include "avr-isp.h"
+#include "trace.h"
+
+static void avrp_init(uint8_t protocol);
+static void select_options(void);
+static void nosync(uint8_t code);
+static void show_stats(uint8_t screen);
+static uint8_t percent(uint32_t part, uint32_t whole);
+static void send_stats(void);
 static void reset_target(uint8_t reset);
-static uint8_t getch(void);
-static void fill(int n);
-static void prog_lamp(int state);
-static uint8_t spi_transaction(uint8_t a, uint8_t b, uint8_t c, uint8_t d);
+static void spi_set_clock(uint8_t level);
+static uint8_t enter_progmode(void);
+static uint8_t signature_ok(void);
 static void empty_reply(void);
 static void breply(uint8_t b);
 static void set_parameters(void);
+static void set_ext_parameters(void);
 static void get_version(uint8_t c);
-static void start_pmode(void);
-static void end_pmode(void);
 static void universal(void);
-static void flash(uint8_t hilo, unsigned int addr, uint8_t data);
-static void commit(unsigned int addr);
 static unsigned int current_page(void);
 static void write_flash(int length);
-static uint8_t write_flash_pages(int length);
+static uint8_t write_flash_pages(int length, unsigned int *lastpage, uint16_t got);
+static uint8_t block_byte(uint16_t i, uint16_t length, uint16_t *got);
 static uint8_t write_eeprom(unsigned int length);
 static uint8_t write_eeprom_chunk(unsigned int start, unsigned int length);
+static uint8_t ee_poll_cmd(uint8_t value);
 static void program_page(void);
-static uint8_t flash_read(uint8_t hilo, unsigned int addr);
 static char flash_read_page(int length);
 static char eeprom_read_page(int length);
 static void read_page(void);
 static void read_signature(void);
+static void verify_crc(void);
 static void avrisp(void);
-static void vcc(uint8_t power);
-static char hexdigit(uint8_t h);
 
 static const char PROGMEM twiddle[4]	= { '-', 0x8c, '|', '/' };
 static const char PROGMEM beat[4]		= { '.', 'o', 'O', 'o' };
 
-void avr_programmer(void)
+// Number of screens shown at the end of a session, including "Remove AVR"
+#define AVRP_NSCREENS	7
+
+// SPI clock settings for auto-negotiation, fastest first.
+// The serial programming interface needs the SCK high and low times to be more than 2 target clock
+// cycles (3 above 12 MHz), so each setting works for targets clocked at more than 4 to 6 times its frequency.
+// The hardware can't go slower than 125 kHz, so the slowest settings are bit-banged.
+typedef struct spi_clock_s
 {
-	avrp_init();
+	uint8_t spcr;		// Clock rate bits for SPCR
+	uint8_t spsr;		// SPI2X bit for SPSR
+	uint16_t halfbit;	// Bit-bang: ticks per half clock cycle. 0 = use the hardware
+} spi_clock_t;
+
+static const spi_clock_t PROGMEM spi_clocks[AVRP_SPI_NCLK] =
+{
+	{	_BV(SPR0),				_BV(SPI2X),	0	},								// 2 MHz
+	{	_BV(SPR0),				0,			0	},								// 1 MHz
+	{	_BV(SPR1),				_BV(SPI2X),	0	},								// 500 kHz
+	{	_BV(SPR1),				0,			0	},								// 250 kHz
+	{	_BV(SPR1) | _BV(SPR0),	0,			0	},								// 125 kHz
+	{	0,						0,			(uint16_t)MICROS_TO_TICKS(25)	},	// 20 kHz, e.g. 128 kHz targets
+	{	0,						0,			(uint16_t)MICROS_TO_TICKS(125)	}	// 4 kHz, e.g. 32 kHz targets
+};
+
+void avr_programmer(uint8_t protocol)
+{
+	avrp_init(protocol);
+	select_options();
 
 	for (;;)
 	{
 		uint8_t t0 = 4;
 		unsigned err0 = 0;
 
-		lcd->setCursor(0,1);
-		lcd->print(F("Insert AVR  [OK]"));
+		lcd.setCursor(0,1);
+		lcd.print(F("Insert AVR  [OK]"));
 
 		while ( button() != btn_ok )
 		{	// Wait
 		}
 
+		memset(&avrpdata.stats, 0, sizeof(avrpdata.stats));
+
 		// Turn on power to Vcc
 		wipe_row(1);
-		lcd->print(F("Vcc on"));
+		lcd.print(F("Vcc on"));
 		vcc(1);
 		tick_delay(MILLIS_TO_TICKS(500));
 
@@ -100,22 +125,29 @@ void avr_programmer(void)
 			if ( t != t0 )
 			{
 				t0 = t;
-				lcd->setCursor(15, 1);
-				lcd->print((char)pgm_read_byte(&beat[t]));
+				lcd.setCursor(15, 1);
+				lcd.print((char)pgm_read_byte(&beat[t]));
 			}
 
 			if ( avrpdata.errorcode != err0 )
 			{
-				lcd->setCursor(7, 1);
-				lcd->print('E');
-				lcd->print(hexdigit((avrpdata.errorcode >> 4) & 0xf));
-				lcd->print(hexdigit((avrpdata.errorcode) & 0xf));
+				lcd.setCursor(7, 1);
+				lcd.print('E');
+				lcd.print(hexdigit((avrpdata.errorcode >> 4) & 0xf));
+				lcd.print(hexdigit((avrpdata.errorcode) & 0xf));
 				err0 = avrpdata.errorcode;
 			}
 			
-			if (Serial.available())
+			if ( uart_available() )
 			{
-				avrisp();
+				uint32_t tc = (uint32_t)read_ticks();
+
+				if ( protocol == AVRP_STK500V2 )
+					stk500v2();
+				else
+					avrisp();
+
+				avrpdata.stats.t_busy += AVRP_TICKS_TO_US((uint32_t)read_ticks() - tc);
 			}
 		}
 
@@ -128,18 +160,36 @@ void avr_programmer(void)
 
 		avrpdata.pmode = 0;
 
-		lcd->setCursor(0,1);
-		lcd->print(F("Remove AVR  [OK]"));
+		// "Remove AVR" and the statistics. CHANGE steps through them.
+		uint8_t screen = 0;
+		uint8_t b;
+		uint8_t update = 1;
 
-		while ( button() != btn_ok )
-		{	// Wait
-		}
+		do
+		{
+			if ( update )
+			{
+				show_stats(screen);
+				update = 0;
+			}
+
+			b = button();
+			scpi_poll();
+
+			if ( b == btn_change )
+			{
+				screen++;
+				if ( screen >= AVRP_NSCREENS )
+					screen = 0;
+				update = 1;
+			}
+		} while ( b != btn_ok );
 	}
 }
 
-static void vcc(uint8_t power)
+void vcc(uint8_t power)
 {
-	digitalWrite(PIN_VCC, power ? HIGH : LOW);
+	PIN_VCC::set(power);
 }
 
 static void reset_target(uint8_t reset)
@@ -150,55 +200,146 @@ static void reset_target(uint8_t reset)
 	else
 		pval = avrpdata.rst_active_high ? LOW : HIGH;
 
-	digitalWrite(PIN_RESET, pval);
+	PIN_RESET::set(pval);
+}
+
+static inline uint8_t getch(void)
+{
+	return avrp_getc();
 }
 
-static uint8_t getch(void)
+static inline void fill(int n)
 {
-	while ( !Serial.available() )
-	{	// Wait
+	avrp_read(avrpdata.buff, n);
+}
+
+/* avrp_getc() - wait for a character from the host and return it
+ *
+ * The time spent waiting is counted in the statistics.
+*/
+uint8_t avrp_getc(void)
+{
+	if ( uart_available() == 0 )
+	{
+		uint32_t t0 = (uint32_t)read_ticks();
+		uint32_t t;
+
+		do {
+			t = (uint32_t)read_ticks();		// At least every 4 ms, or the time is wrong
+		} while ( uart_available() == 0 );
+
+		avrpdata.stats.t_rxwait += AVRP_TICKS_TO_US(t - t0);
 	}
-	return Serial.read();
+
+	return uart_getc();
 }
 
-static void fill(int n)
+/* avrp_read() - read a block of characters from the host
+*/
+void avrp_read(uint8_t *buf, uint16_t n)
 {
-	for (int x = 0; x < n; x++)
+	while ( n > 0 )
 	{
-		avrpdata.buff[x] = getch();
+		*buf++ = avrp_getc();
+		n--;
 	}
 }
 
-static void prog_lamp(int state)
+/* avrp_error() - record an error
+*/
+void avrp_error(uint8_t code)
+{
+	trace(TR_ERROR, code);
+	avrpdata.errorcount++;
+	avrpdata.errorcode = code;
+	avrpdata.stats.errors++;
+}
+
+/* nosync() - record an error and tell avrdude that the command was out of sync
+*/
+static void nosync(uint8_t code)
+{
+	avrp_error(code);
+	avrpdata.stats.nosync++;
+	uart_putc(STK_NOSYNC);
+}
+
+void prog_lamp(int state)
 {
 	if ( state )
 	{
-		lcd->setCursor(14, 1);
-		lcd->print((char)pgm_read_byte(&twiddle[avrpdata.prog_lamp_count & 0x3]));
+		lcd.setCursor(14, 1);
+		lcd.print((char)pgm_read_byte(&twiddle[avrpdata.prog_lamp_count & 0x3]));
 		avrpdata.prog_lamp_count++;
 	}
 }
 
-static uint8_t spi_transaction(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+uint8_t spi_transaction(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+	spi_xfer(a);
+	spi_xfer(b);
+	spi_xfer(c);
+	return spi_xfer(d);
+}
+
+/* spi_bitbang() - transfer a byte in SPI mode 0, MSB first, using port I/O
+ *
+ * With gang programming, gang_xfer() does the transfer instead.
+*/
+uint8_t spi_bitbang(uint8_t b)
 {
-	SPI.transfer(a);
-	SPI.transfer(b);
-	SPI.transfer(c);
-	return SPI.transfer(d);
+	uint8_t r = 0;
+
+	if ( avrpdata.ntargets > 1 )
+		return gang_xfer(b);
+
+	for ( uint8_t i = 0; i < 8; i++ )
+	{
+		if ( b & 0x80 )
+			SPI_PORT |= _BV(SPI_MOSI_BIT);
+		else
+			SPI_PORT &= ~_BV(SPI_MOSI_BIT);
+		b <<= 1;
+		tick_delay(avrpdata.spi_halfbit);
+
+		SPI_PORT |= _BV(SPI_SCK_BIT);
+		r <<= 1;
+		if ( SPI_PIN & _BV(SPI_MISO_BIT) )
+			r |= 0x01;
+		tick_delay(avrpdata.spi_halfbit);
+
+		SPI_PORT &= ~_BV(SPI_SCK_BIT);
+	}
+
+	return r;
+}
+
+/* spi_set_clock() - select one of the SPI clock settings
+*/
+static void spi_set_clock(uint8_t level)
+{
+	const spi_clock_t *c = &spi_clocks[level];
+
+	avrpdata.spi_level = level;
+	avrpdata.spi_halfbit = pgm_read_word(&c->halfbit);
+
+	SPSR = pgm_read_byte(&c->spsr);
+	if ( avrpdata.spi_halfbit == 0 )
+		SPCR = _BV(SPE) | _BV(MSTR) | pgm_read_byte(&c->spcr);
+	else
+		SPCR = 0;		// Port I/O controls the pins
 }
 
 static void empty_reply(void)
 {
 	if ( getch() == CRC_EOP )
 	{
-		Serial.print((char)STK_INSYNC);
-		Serial.print((char)STK_OK);
+		uart_putc(STK_INSYNC);
+		uart_putc(STK_OK);
 	}
 	else
 	{
-		avrpdata.errorcount++;
-		avrpdata.errorcode = 0x01;
-		Serial.print((char)STK_NOSYNC);
+		nosync(0x01);
 	}
 }
 
@@ -206,15 +347,13 @@ static void breply(uint8_t b)
 {
 	if ( getch() == CRC_EOP )
 	{
-		Serial.print((char)STK_INSYNC);
-		Serial.print((char)b);
-		Serial.print((char)STK_OK);
+		uart_putc(STK_INSYNC);
+		uart_putc(b);
+		uart_putc(STK_OK);
 	}
 	else
 	{
-		avrpdata.errorcount++;
-		avrpdata.errorcode = 0x02;
-		Serial.print((char)STK_NOSYNC);
+		nosync(0x02);
 	}
 }
 
@@ -257,25 +396,80 @@ static void set_parameters(void)
 
 	// AVR devices have active low reset, AT89Sx are active high
 	avrpdata.rst_active_high = (avrpdata.param.devicecode >= 0xe0);
+
+	avrpdata.commit_wait = MILLIS_TO_TICKS(AVRP_FLASH_WAIT);
+
+	// Byte-by-byte EEPROM writes until the extended parameters say otherwise
+	avrpdata.param.eepagesize = 1;
+}
+
+static void set_ext_parameters(void)
+{
+	// call this after reading extended parameter packet into buff[]
+	// buff[0] is the command size, buff[2..4] are pagel, bs2 and reset disposition (not used)
+	uint8_t eps = avrpdata.buff[1];
+
+	// Only use EEPROM page mode for sensible page sizes (a power of 2).
+	if ( eps > 1 && (eps & (eps - 1)) == 0 )
+		avrpdata.param.eepagesize = eps;
+	else
+		avrpdata.param.eepagesize = 1;
 }
 
-static void start_pmode(void)
+/* start_pmode() - put the target into programming mode
+ *
+ * Returns 1 if OK, 0 if the target didn't respond at any SPI clock speed
+*/
+uint8_t start_pmode(void)
 {
+	uint8_t level;
+
 	// Reset target before driving PIN_SCK or PIN_MOSI
 
-	// SPI.begin() will configure SS as output, so SPI master mode is selected.
-	// We have defined RESET as pin 10, which for many Arduinos is not the SS pin.
-	// So we have to configure RESET as output here,
+	// The SPI hardware only stays in master mode if SS is an output.
+	// On the nano, SS is pin 10, which is PIN_RESET, so configure it here.
 	// (reset_target() first sets the correct level)
 	reset_target(1);
-	pinMode(PIN_RESET, OUTPUT);
-	SPI.begin();
-	SPI.beginTransaction(SPISettings(SPI_CLOCK, MSBFIRST, SPI_MODE0));
+	PIN_RESET::output();
+	SPI_PORT &= ~(_BV(SPI_MOSI_BIT) | _BV(SPI_SCK_BIT));
+	SPI_DDR |= _BV(SPI_MOSI_BIT) | _BV(SPI_SCK_BIT);
+
+	// Negotiate the SPI clock: start with the fastest and slow down until the target responds correctly.
+	for ( level = 0; level < AVRP_SPI_NCLK; level++ )
+	{
+		spi_set_clock(level);
+
+		if ( enter_progmode() )
+			break;
+	}
+
+	if ( level >= AVRP_SPI_NCLK )
+	{
+		// No sensible response at any speed. Stay at the slowest; avrdude will report the signature.
+		avrp_error(0x0d);
+	}
+
+	lcd.setCursor(11, 1);
+	lcd.print('c');
+	lcd.print(hexdigit(avrpdata.spi_level));
+
+	avrpdata.erased = 0;
+	avrpdata.pmode = 1;
+	avrpdata.session_t0 = read_ticks();
+	return level < AVRP_SPI_NCLK;
+}
+
+/* enter_progmode() - reset the target and send the programming enable instruction
+ *
+ * Returns 1 if the target is in sync and its signature can be read reliably, 0 otherwise
+*/
+static uint8_t enter_progmode(void)
+{
+	uint8_t echo;
 
 	// See AVR datasheets, chapter "SERIAL_PRG Programming Algorithm":
 
 	// Pulse RESET after PIN_SCK is low:
-	digitalWrite(PIN_SCK, LOW);
 	tick_delay(MILLIS_TO_TICKS(20));	// discharge PIN_SCK, value arbitrarily chosen
 	reset_target(0);
 	// Pulse must be minimum 2 target CPU clock cycles so 100 usec is ok for CPU
@@ -285,44 +479,186 @@ static void start_pmode(void)
 
 	// Send the enable programming command:
 	tick_delay(MILLIS_TO_TICKS(50));	// datasheet: must be > 20 msec
-	spi_transaction(0xAC, 0x53, 0x00, 0x00);
-	avrpdata.pmode = 1;
+	spi_xfer(0xAC);
+	spi_xfer(0x53);
+	echo = spi_xfer(0x00);				// An AVR in sync echoes the second byte
+	spi_xfer(0x00);
+
+	if ( echo != 0x53 && !avrpdata.rst_active_high )
+		return 0;
+
+	return signature_ok();
 }
 
-static void end_pmode(void)
+/* signature_ok() - verify the target's signature
+ *
+ * The first byte must be the manufacturer code (0x1e for Atmel) and the whole signature must read
+ * back identically twice. A clock that is too fast for the target usually fails one of those tests.
+*/
+static uint8_t signature_ok(void)
 {
-	SPI.end();
+	uint8_t sig[3];
+	uint8_t i;
+
+	for ( i = 0; i < 3; i++ )
+		sig[i] = read_sig_byte(i);
+
+	if ( sig[0] != 0x1e || sig[1] == 0xff || sig[1] == 0x00 )
+		return 0;
+
+	for ( i = 0; i < 3; i++ )
+	{
+		if ( read_sig_byte(i) != sig[i] )
+			return 0;
+	}
+
+	return 1;
+}
+
+uint8_t read_sig_byte(uint8_t n)
+{
+	return spi_transaction(0x30, 0x00, n, 0x00);
+}
+
+void end_pmode(void)
+{
+	finish_commit();
+	avrp_update_stats();
+	SPCR = 0;
 
 	// We're about to take the target out of reset so configure SPI pins as input
-	pinMode(PIN_MOSI, INPUT);
-	pinMode(PIN_SCK, INPUT);
+	PIN_MOSI::input();
+	PIN_SCK::input();
 	reset_target(0);
-	pinMode(PIN_RESET, INPUT);
+	PIN_RESET::input();
 	avrpdata.pmode = 2;
 }
 
 static void universal(void)
 {
 	fill(4);
+
+	// avrdude sends the chip erase instruction this way. Remember it for differential programming.
+	if ( avrpdata.buff[0] == 0xAC && avrpdata.buff[1] == 0x80 )
+		avrpdata.erased = 1;
+
 	breply(spi_transaction(avrpdata.buff[0], avrpdata.buff[1], avrpdata.buff[2], avrpdata.buff[3]));
 }
 
-static void flash(uint8_t hilo, unsigned int addr, uint8_t data)
+/* commit() - write the target's page buffer to flash and wait for completion
+ *
+ * Returns 0 if OK, nonzero if the target didn't become ready in time
+*/
+uint8_t commit(unsigned int addr)
 {
-	spi_transaction(0x40 + 8 * hilo,
-					addr >> 8 & 0xFF,
-					addr & 0xFF,
-					data);
+	start_commit(0x4C, addr);
+	return finish_commit();
 }
 
-static void commit(unsigned int addr)
+/* start_commit() - start writing the target's page buffer to memory
+ *
+ * cmd is the write page instruction (0x4C for flash, 0xC2 for EEPROM)
+ * The target is busy until the write completes. finish_commit() must be called before
+ * sending any other instruction to the target.
+*/
+void start_commit(uint8_t cmd, unsigned int addr)
 {
 	prog_lamp(0);
+	trace(TR_COMMIT, addr);
 
-	spi_transaction(0x4C, (addr >> 8) & 0xFF, addr & 0xFF, 0);
+	spi_transaction(cmd, (addr >> 8) & 0xFF, addr & 0xFF, 0);
+	avrpdata.commit_pending = 1;
+	avrpdata.commit_t0 = (uint32_t)read_ticks();
+	avrpdata.stats.pages_written++;
+}
 
-	tick_delay(MILLIS_TO_TICKS(20));
-	prog_lamp(1);
+/* finish_commit() - wait for a page write started by start_commit() to complete
+ *
+ * Returns 0 if OK or if there's no write in progress, nonzero if the target didn't become ready in time
+*/
+uint8_t finish_commit(void)
+{
+	uint8_t err = 0;
+
+	if ( avrpdata.commit_pending )
+	{
+		avrpdata.stats.t_overlap += AVRP_TICKS_TO_US((uint32_t)read_ticks() - avrpdata.commit_t0);
+		err = wait_ready(avrpdata.poll_cmd, avrpdata.poll_addr, avrpdata.poll_value, avrpdata.commit_wait);
+		avrpdata.poll_cmd = 0;
+		avrpdata.commit_pending = 0;
+		trace(TR_COMMIT_DONE, err);
+
+		if ( err )
+		{
+			avrp_error(0x0b);
+		}
+
+		prog_lamp(1);
+	}
+
+	return err;
+}
+
+/* note_poll() - remember a flash location that can be used for value polling
+ *
+ * While the page is being written, a read of any location in the page returns the poll value.
+ * A location whose new contents differ from the poll value can therefore be used to detect completion.
+*/
+void note_poll(uint8_t rdcmd, unsigned int addr, uint8_t value)
+{
+	if ( value != avrpdata.param.flashpoll )
+	{
+		avrpdata.poll_cmd = rdcmd;
+		avrpdata.poll_addr = addr;
+		avrpdata.poll_value = value;
+	}
+}
+
+/* wait_ready() - wait for the target to complete a write operation
+ *
+ * If the device supports it (param.polling), the "Poll RDY/BSY" instruction is used.
+ * Otherwise, if a suitable location is known (rdcmd != 0), the location is read back until it
+ * contains the value that was written. If neither method is possible, wait for the full time.
+ *
+ * Returns 0 if OK, nonzero if the target is still busy after maxtime ticks.
+ * The time spent waiting is counted in the statistics.
+*/
+uint8_t wait_ready(uint8_t rdcmd, unsigned int addr, uint8_t value, uint32_t maxtime)
+{
+	uint32_t t0 = (uint32_t)read_ticks();
+	uint32_t el;
+	uint8_t err = 0;
+
+	for (;;)
+	{
+		if ( avrpdata.param.polling )
+		{
+			uint8_t busy = spi_transaction(0xF0, 0x00, 0x00, 0x00);
+
+			if ( avrpdata.ntargets > 1 )
+				busy = gang_busy();
+
+			if ( (busy & 0x01) == 0 )
+				break;
+		}
+		else if ( rdcmd != 0 )
+		{
+			if ( spi_transaction(rdcmd, (addr >> 8) & 0xFF, addr & 0xFF, 0) == value )
+				break;
+		}
+
+		el = (uint32_t)read_ticks() - t0;
+
+		if ( el >= maxtime )
+		{
+			// In timed mode the full delay has elapsed, otherwise it's a timeout
+			err = ( avrpdata.param.polling || rdcmd != 0 );
+			break;
+		}
+	}
+
+	avrpdata.stats.t_commit += AVRP_TICKS_TO_US((uint32_t)read_ticks() - t0);
+	return err;
 }
 
 static unsigned int current_page(void)
@@ -343,42 +679,126 @@ static unsigned int current_page(void)
 }
 
 
+/* write_flash() - program (length) bytes of flash at (here)
+ *
+ * This is a pipeline. The write of the final page is started but not waited for: the reply goes back
+ * to avrdude straight away and the target does the write while the host sends the next block.
+ * The result of that write is reported in the reply to the next block (or to 'Q').
+ *
+ * The block is received into buff, and each byte is loaded into the target's page buffer as soon as it
+ * has arrived, so the serial reception and the SPI transfers overlap. The uart's ring buffer only has
+ * to hold what arrives during the wait for the previous page write and the transfers for one byte
+ * (see block_byte()), so it doesn't overflow even when the SPI clock is slower than the serial link.
+ * At the slowest clock the transfers for one byte (eight SPI bytes with AVRP_OPT_DIFF) take longer than
+ * half the ring buffer covers, so the whole block is received first.
+*/
 static void write_flash(int length)
 {
-	fill(length);
+	uint8_t result = STK_OK;
+	unsigned int page;
+	uint16_t got = 0;
+
+	if ( (uint32_t)avrpdata.spi_halfbit * 2 * 64 > (UART_RXBUF_SIZE / 2) * ((uint32_t)HZ * 10 / BAUDRATE)
+			&& length <= AVRP_BUFFSIZE )
+	{
+		fill(length);
+		got = length;
+	}
+
+	// The previous block's page write must be complete before loading the page buffer again
+	if ( finish_commit() )
+		result = STK_FAILED;
+
+	if ( write_flash_pages(length, &page, got) != STK_OK )
+		result = STK_FAILED;
+
 	if ( getch() == CRC_EOP )
 	{
-		Serial.print((char) STK_INSYNC);
-		Serial.print((char) write_flash_pages(length));
+		if ( avrpdata.page_dirty )
+		{
+			start_commit(0x4C, page);
+#if !AVRP_PIPELINE
+			if ( finish_commit() )
+				result = STK_FAILED;
+#endif
+		}
+		else
+		{
+			avrpdata.stats.pages_skipped++;
+		}
+		uart_putc(STK_INSYNC);
+		uart_putc(result);
 	}
 	else
 	{
-		avrpdata.errorcount++;
-		avrpdata.errorcode = 0x03;
-		Serial.print((char) STK_NOSYNC);
+		nosync(0x03);
 	}
 }
 
-static uint8_t write_flash_pages(int length)
+/* write_flash_pages() - load (length) bytes from the host into the target's page buffer
+ *
+ * got is the number of bytes that are already in buff.
+ * If the block crosses a page boundary, the full pages are written on the way.
+ * The last page is left in the page buffer; its address is returned in *lastpage.
+ * Pages that don't need writing (see diff_byte()) are not written; for the last page, the
+ * caller checks avrpdata.page_dirty.
+*/
+static uint8_t write_flash_pages(int length, unsigned int *lastpage, uint16_t got)
 {
-	int x = 0;
 	unsigned int page = current_page();
+	uint8_t err = 0;
+
+	avrpdata.poll_cmd = 0;
+	diff_begin();
 
-	while ( x < length )
+	for ( int x = 0; x < length; x += 2 )
 	{
+		uint8_t b;
+
 		if ( page != current_page() )
 		{
-			commit(page);
+			if ( avrpdata.page_dirty )
+				err |= commit(page);
+			else
+				avrpdata.stats.pages_skipped++;
 			page = current_page();
+			diff_begin();
 		}
-		flash(LOW, avrpdata.here, avrpdata.buff[x++]);
-		flash(HIGH, avrpdata.here, avrpdata.buff[x++]);
+		b = block_byte(x, length, &got);
+		diff_byte(LOW, avrpdata.here, b);
+		flash(LOW, avrpdata.here, b);
+		note_poll(0x20, avrpdata.here, b);
+		b = block_byte(x + 1, length, &got);
+		diff_byte(HIGH, avrpdata.here, b);
+		flash(HIGH, avrpdata.here, b);
+		note_poll(0x28, avrpdata.here, b);
 		avrpdata.here++;
 	}
 
-	commit(page);
+	*lastpage = page;
+	avrpdata.stats.bytes_written += length;
 
-	return STK_OK;
+	return err ? STK_FAILED : STK_OK;
+}
+
+/* block_byte() - byte i of a block of (length) bytes that is being received into buff
+ *
+ * Waits for byte i if it hasn't arrived yet, and takes whatever else has arrived too, so that the uart's
+ * ring buffer is emptied between the SPI transfers for each byte. *got counts the bytes in buff.
+ * A block that doesn't fit in buff is taken straight from the uart.
+*/
+static uint8_t block_byte(uint16_t i, uint16_t length, uint16_t *got)
+{
+	if ( length > AVRP_BUFFSIZE )
+		return getch();
+
+	while ( *got <= i || (*got < length && uart_available() != 0) )
+	{
+		avrpdata.buff[*got] = getch();
+		(*got)++;
+	}
+
+	return avrpdata.buff[i];
 }
 
 static uint8_t write_eeprom(unsigned int length)
@@ -389,41 +809,74 @@ static uint8_t write_eeprom(unsigned int length)
 
 	if (length > avrpdata.param.eepromsize)
 	{
-		avrpdata.errorcount++;
-		avrpdata.errorcode = 0x04;
+		avrp_error(0x04);
 		return STK_FAILED;
 	}
 
 	while (remaining > EECHUNK)
 	{
-		write_eeprom_chunk(start, EECHUNK);
+		if ( write_eeprom_chunk(start, EECHUNK) != STK_OK )
+			return STK_FAILED;
 		start += EECHUNK;
 		remaining -= EECHUNK;
 	}
 
-	write_eeprom_chunk(start, remaining);
-
-	return STK_OK;
+	return write_eeprom_chunk(start, remaining);
 }
 
 
 // write (length) bytes, (start) is a byte address
+//
+// If the device has an EEPROM page buffer (eepagesize from the extended parameters), the bytes are
+// loaded into the page buffer and written a page at a time. Otherwise they are written byte-by-byte.
 static uint8_t write_eeprom_chunk(unsigned int start, unsigned int length)
 {
-	// this writes byte-by-byte, page writing may be faster (4 bytes at a time)
+	unsigned int mask = avrpdata.param.eepagesize - 1;
+
 	fill(length);
 	prog_lamp(0);
+	avrpdata.stats.bytes_written += length;
 
 	for ( unsigned int x = 0; x < length; x++)
 	{
 		unsigned int addr = start + x;
-		spi_transaction(0xC0, (addr >> 8) & 0xFF, addr & 0xFF, avrpdata.buff[x]);
-		tick_delay(MILLIS_TO_TICKS(45));
+		uint8_t value = avrpdata.buff[x];
+
+		if ( avrpdata.param.eepagesize > 1 )
+		{
+			// Load the byte into the page buffer. Write the page at the end of the page or chunk.
+			spi_transaction(0xC1, 0x00, addr & mask, value);
+
+			if ( ((addr & mask) != mask) && (x + 1 < length) )
+				continue;
+
+			spi_transaction(0xC2, (addr >> 8) & 0xFF, addr & ~mask & 0xFF, 0x00);
+		}
+		else
+		{
+			spi_transaction(0xC0, (addr >> 8) & 0xFF, addr & 0xFF, value);
+		}
+
+		if ( wait_ready(ee_poll_cmd(value), addr, value, MILLIS_TO_TICKS(AVRP_EEPROM_WAIT)) )
+		{
+			avrp_error(0x0c);
+			prog_lamp(1);
+			return STK_FAILED;
+		}
 	}
 	prog_lamp(1);
 	return STK_OK;
 }
 
+// Returns the instruction for value polling of an EEPROM location, or 0 if the
+// value written is one of the poll values.
+static uint8_t ee_poll_cmd(uint8_t value)
+{
+	if ( value == (avrpdata.param.eeprompoll >> 8) || value == (avrpdata.param.eeprompoll & 0xFF) )
+		return 0;
+	return 0xA0;
+}
+
 static void program_page(void)
 {
 	char result = (char) STK_FAILED;
@@ -438,42 +891,37 @@ static void program_page(void)
 	}
 	else if ( memtype == 'E' )
 	{
+		finish_commit();
 		result = (char)write_eeprom(length);
 		if ( getch() == CRC_EOP)
 		{
-			Serial.print((char) STK_INSYNC);
-			Serial.print(result);
+			uart_putc(STK_INSYNC);
+			uart_putc(result);
 		}
 		else
 		{
-			avrpdata.errorcount++;
-			avrpdata.errorcode = 0x05;
-			Serial.print((char) STK_NOSYNC);
+			nosync(0x05);
 		}
 	}
 	else
 	{
-		Serial.print((char)STK_FAILED);
+		uart_putc(STK_FAILED);
 	}
 }
 
-static uint8_t flash_read(uint8_t hilo, unsigned int addr)
-{
-	return spi_transaction(0x20 + hilo * 8, (addr >> 8) & 0xFF, addr & 0xFF, 0);
-}
-
 static char flash_read_page(int length)
 {
 	for ( int x = 0; x < length; x += 2 )
 	{
 		uint8_t low = flash_read(LOW, avrpdata.here);
-		Serial.print((char) low);
+		uart_putc(low);
 
 		uint8_t high = flash_read(HIGH, avrpdata.here);
-		Serial.print((char) high);
+		uart_putc(high);
 
 		avrpdata.here++;
 	}
+	avrpdata.stats.bytes_read += length;
 	return STK_OK;
 }
 
@@ -486,8 +934,9 @@ static char eeprom_read_page(int length)
 	{
 		int addr = start + x;
 		uint8_t ee = spi_transaction(0xA0, (addr >> 8) & 0xFF, addr & 0xFF, 0xFF);
-		Serial.print((char) ee);
+		uart_putc(ee);
 	}
+	avrpdata.stats.bytes_read += length;
 	return STK_OK;
 }
 
@@ -500,18 +949,16 @@ static void read_page(void)
 
 	if ( getch() == CRC_EOP )
 	{
-		Serial.print((char) STK_INSYNC);
+		uart_putc(STK_INSYNC);
 		if (memtype == 'F')
 			result = flash_read_page(length);
 		else if (memtype == 'E')
 			result = eeprom_read_page(length);
-		Serial.print(result);
+		uart_putc(result);
 	}
 	else
 	{
-		avrpdata.errorcount++;
-		avrpdata.errorcode = 0x06;
-		Serial.print((char) STK_NOSYNC);
+		nosync(0x06);
 		return;
 	}
 }
@@ -520,30 +967,130 @@ static void read_signature(void)
 {
 	if ( getch() == CRC_EOP )
 	{
-		Serial.print((char) STK_INSYNC);
+		uart_putc(STK_INSYNC);
 
-		uint8_t high = spi_transaction(0x30, 0x00, 0x00, 0x00);
-		Serial.print((char) high);
+		uint8_t high = read_sig_byte(0);
+		uart_putc(high);
 
-		uint8_t middle = spi_transaction(0x30, 0x00, 0x01, 0x00);
-		Serial.print((char) middle);
+		uint8_t middle = read_sig_byte(1);
+		uart_putc(middle);
 
-		uint8_t low = spi_transaction(0x30, 0x00, 0x02, 0x00);
-		Serial.print((char) low);
+		uint8_t low = read_sig_byte(2);
+		uart_putc(low);
 
-		Serial.print((char) STK_OK);
+		uart_putc(STK_OK);
 	}
 	else
 	{
-		avrpdata.errorcount++;
-		avrpdata.errorcode = 0x07;
-		Serial.print((char) STK_NOSYNC);
+		nosync(0x07);
+	}
+}
+
+/* flash_crc() - calculate the CRC of (length) bytes of the target's flash, starting at word address (addr)
+ *
+ * The CRC is CRC-16/XMODEM (polynomial 0x1021, initial value 0), the same as python's binascii.crc_hqx(data, 0).
+*/
+uint16_t flash_crc(unsigned int addr, uint16_t length)
+{
+	uint16_t crc = 0;
+
+	for ( uint16_t x = 0; x < length; x++ )
+	{
+		crc = _crc_xmodem_update(crc, flash_read(x & 1, addr));
+		if ( x & 1 )
+			addr++;
+	}
+
+	return crc;
+}
+
+/* crc_check() - compare the CRCs of (n) consecutive blocks of the target's flash with the expected CRCs
+ *
+ * The blocks start at (here) and are (blksize) bytes long. crcs[] contains the expected CRCs (big-endian).
+ * The indexes of the blocks that don't match are written to the start of crcs[], overwriting CRCs that have
+ * already been checked. Returns the number of blocks that don't match.
+ *
+ * This replaces avrdude's verify, which reads the whole image back over the serial line.
+ * Reading the target over SPI is much faster than that, so only the result needs to be sent back.
+*/
+uint8_t crc_check(uint8_t *crcs, uint16_t blksize, uint8_t n)
+{
+	uint8_t nbad = 0;
+
+	prog_lamp(0);
+
+	for ( uint8_t i = 0; i < n; i++ )
+	{
+		if ( flash_crc(avrpdata.here, blksize) != beget16(&crcs[2*i]) )
+		{
+			crcs[nbad] = i;
+			nbad++;
+		}
+		avrpdata.here += blksize / 2;
+	}
+	avrpdata.stats.bytes_read += (uint32_t)blksize * n;
+
+	prog_lamp(1);
+	return nbad;
+}
+
+/* verify_crc() - STK_CRC_CHECK command
+ *
+ * Command: '|', blksize (2 bytes, big-endian), n, n CRCs (2 bytes each, big-endian), CRC_EOP
+ * Reply: STK_INSYNC, number of bad blocks, index of each bad block, STK_OK
+ *
+ * The first block is at the address set by the 'U' command. blksize must be even; normally it's the page size.
+*/
+static void verify_crc(void)
+{
+	uint16_t blksize = 256 * getch();
+	blksize += getch();
+	uint8_t n = getch();
+	uint8_t nbad = 0;
+	uint8_t ok = ( n <= AVRP_CRC_MAX && blksize != 0 && (blksize & 1) == 0 );
+
+	if ( ok )
+	{
+		fill(n * 2);
+	}
+	else
+	{
+		for ( uint16_t x = 0; x < n * 2; x++ )
+			getch();
+	}
+
+	if ( getch() == CRC_EOP )
+	{
+		uart_putc(STK_INSYNC);
+		if ( ok )
+		{
+			nbad = crc_check(avrpdata.buff, blksize, n);
+			uart_putc(nbad);
+			uart_write(avrpdata.buff, nbad);
+			uart_putc(STK_OK);
+		}
+		else
+		{
+			uart_putc(STK_FAILED);
+		}
+	}
+	else
+	{
+		nosync(0x0e);
 	}
 }
 
 static void avrisp(void)
 {
 	uint8_t ch = getch();
+	uint8_t commit_err = 0;
+
+	trace(TR_ISP_CMD, ch);
+
+	// A flash page write might still be in progress (see write_flash()). The next block
+	// of the programming sequence takes care of it. Anything else waits for it here.
+	if ( ch != 'U' && ch != 0x64 )
+		commit_err = finish_commit();
 
 	switch (ch)
 	{
@@ -556,15 +1103,13 @@ static void avrisp(void)
 	case '1':
 		if ( getch() == CRC_EOP )
 		{
-			Serial.print((char)STK_INSYNC);
-			Serial.print("AVR ISP");
-			Serial.print((char)STK_OK);
+			uart_putc(STK_INSYNC);
+			uart_puts_P(PSTR("AVR ISP"));
+			uart_putc(STK_OK);
 		}
 		else
 		{
-			avrpdata.errorcount++;
-			avrpdata.errorcode = 0x08;
-			Serial.print((char) STK_NOSYNC);
+			nosync(0x08);
 		}
 		break;
 
@@ -578,8 +1123,9 @@ static void avrisp(void)
 		empty_reply();
 		break;
 
-	case 'E': // extended parameters - ignore for now
+	case 'E': // extended parameters
 		fill(5);
+		set_ext_parameters();
 		empty_reply();
 		break;
 
@@ -619,42 +1165,220 @@ static void avrisp(void)
 		break;
 
 	case 'Q': //0x51
-		avrpdata.errorcount = 0;
-		avrpdata.errorcode = 0x00;
+		// The write of the last page hasn't been reported yet. If it failed, the error stays on the display
 		end_pmode();
-		empty_reply();
+		if ( commit_err == 0 )
+		{
+			avrpdata.errorcount = 0;
+			avrpdata.errorcode = 0x00;
+		}
+		if ( getch() == CRC_EOP )
+		{
+			uart_putc(STK_INSYNC);
+			uart_putc(commit_err ? STK_FAILED : STK_OK);
+		}
+		else
+		{
+			nosync(0x01);
+		}
 		break;
 
 	case 0x75: //STK_READ_SIGN 'u'
 		read_signature();
 		break;
 
+	case STK_CRC_CHECK:
+		verify_crc();
+		break;
+
+	case STK_GET_STATS:
+		if ( getch() == CRC_EOP )
+		{
+			uart_putc(STK_INSYNC);
+			send_stats();
+			uart_putc(STK_OK);
+		}
+		else
+		{
+			nosync(0x0f);
+		}
+		break;
+
 	// expecting a command, not CRC_EOP
 	// this is how we can get back in sync
 	case CRC_EOP:
-		avrpdata.errorcount++;
-		avrpdata.errorcode = 0x09;
-		Serial.print((char)STK_NOSYNC);
+		nosync(0x09);
 		break;
 
 	// anything else we will return STK_UNKNOWN
 	default:
-		avrpdata.errorcount++;
-		avrpdata.errorcode = 0x0a;
+		avrp_error(0x0a);
 		if ( getch() == CRC_EOP )
-			Serial.print((char)STK_UNKNOWN);
+			uart_putc(STK_UNKNOWN);
 		else
-			Serial.print((char)STK_NOSYNC);
+			uart_putc(STK_NOSYNC);
+		break;
+	}
+}
+
+static void avrp_init(uint8_t protocol)
+{
+	avrpdata.protocol = protocol;
+	avrpdata.options = 0;
+	avrpdata.commit_wait = MILLIS_TO_TICKS(AVRP_FLASH_WAIT);
+	if ( protocol == AVRP_STK500V2 )
+		stk500v2_init();
+	uart_init(BAUDRATE);
+}
+
+/* avrp_update_stats() - calculate the length of the session so far
+*/
+void avrp_update_stats(void)
+{
+	if ( avrpdata.pmode == 1 )
+		avrpdata.stats.t_session = (uint32_t)((read_ticks() - avrpdata.session_t0) / MILLIS_TO_TICKS(1));
+}
+
+/* send_stats() - send the statistics structure to the host (little-endian, see avrp_stats_t)
+*/
+static void send_stats(void)
+{
+	avrp_update_stats();
+	uart_write((const uint8_t *)&avrpdata.stats, sizeof(avrpdata.stats));
+}
+
+/* show_stats() - show one screen of the statistics
+ *
+ * Screen 0 is the "Remove AVR" prompt. The others show, in turn:
+ *	bytes written and read
+ *	pages written and skipped
+ *	session time and the SPI clock setting
+ *	how the session time was spent: waiting for the host, SPI and processing, waiting for writes
+ *	the time that page writes overlapped with host communication (pipelining)
+ *	errors and out-of-sync commands
+*/
+static void show_stats(uint8_t screen)
+{
+	avrp_stats_t *s = &avrpdata.stats;
+	uint8_t n = 0;
+
+	lcd.setCursor(0, 1);
+
+	switch ( screen )
+	{
+	case 1:
+		n += lcd.print(F("W "));
+		n += lcd.print(s->bytes_written);
+		n += lcd.print(F(" R "));
+		n += lcd.print(s->bytes_read);
+		break;
+
+	case 2:
+		n += lcd.print(F("Pages "));
+		n += lcd.print(s->pages_written);
+		n += lcd.print(F(" sk "));
+		n += lcd.print(s->pages_skipped);
+		break;
+
+	case 3:
+		n += lcd.print(F("Time "));
+		n += lcd.print(s->t_session);
+		n += lcd.print(F("ms c"));
+		n += lcd.print(hexdigit(avrpdata.spi_level));
+		break;
+
+	case 4:
+		{
+			uint32_t busy = s->t_busy / 1000;
+			uint32_t rxwait = s->t_rxwait / 1000;
+			uint32_t commit = s->t_commit / 1000;
+			uint32_t host = s->t_session - busy + rxwait;
+
+			if ( busy > s->t_session || rxwait + commit > busy )
+			{
+				n += lcd.print(F("--"));		// Rounding errors in a very short session
+				break;
+			}
+
+			n += lcd.print('H');
+			n += lcd.print(percent(host, s->t_session));
+			n += lcd.print(F("% S"));
+			n += lcd.print(percent(busy - rxwait - commit, s->t_session));
+			n += lcd.print(F("% C"));
+			n += lcd.print(percent(commit, s->t_session));
+			n += lcd.print('%');
+		}
+		break;
+
+	case 5:
+		n += lcd.print(F("Overlap "));
+		n += lcd.print(s->t_overlap / 1000);
+		n += lcd.print(F("ms"));
+		break;
+
+	case 6:
+		n += lcd.print(F("Err "));
+		n += lcd.print(s->errors);
+		n += lcd.print(F(" NoSync "));
+		n += lcd.print(s->nosync);
+		break;
+
+	default:
+		n += lcd.print(F("Remove AVR  [OK]"));
 		break;
 	}
+
+	if ( n < 16 )
+		fill_spaces(16 - n);
 }
 
-static void avrp_init(void)
+/* percent() - part as a percentage of whole
+*/
+static uint8_t percent(uint32_t part, uint32_t whole)
+{
+	if ( whole == 0 )
+		return 0;
+	return (uint8_t)((part * 100 + whole / 2) / whole);
+}
+
+/* select_options() - select the programmer options
+ *
+ * "Skip same" selects differential flash programming (AVRP_OPT_DIFF). After a chip erase, blank pages
+ * are not written. Without a chip erase (avrdude -D), pages that match the target's flash are not written.
+ * Note that the serial programming interface can't erase a single page, so -D only works if the pages
+ * that have changed were blank; avrdude's verify reports any that weren't.
+*/
+static void select_options(void)
 {
-	Serial.begin(BAUDRATE);
+	uint8_t update = 1;
+	uint8_t b;
+
+	lcd.setCursor(0, 1);
+	fill_spaces(16 - lcd.print(F("Skip same:")));
+
+	do
+	{
+		if ( update )
+		{
+			lcd.setCursor(11, 1);
+			if ( avrpdata.options & AVRP_OPT_DIFF )
+				lcd.print(F("yes"));
+			else
+				lcd.print(F("no "));
+			update = 0;
+		}
+
+		b = button();
+
+		if ( b == btn_change )
+		{
+			avrpdata.options ^= AVRP_OPT_DIFF;
+			update = 1;
+		}
+	} while ( b != btn_ok );
 }
 
-static char hexdigit(uint8_t h)
+char hexdigit(uint8_t h)
 {
 	if ( h < 10 )	return (char)(h + 0x30);
 	if ( h < 16 )	return (char)(h - 0xa + 0x41);
@@ -30,25 +30,58 @@
 
 #include <Arduino.h>
 #include "joat.h"
+#include "iopin.h"
 
-// Configure SPI clock (in Hz).
-// E.g. for an ATtiny @ 128 kHz: the datasheet states that both the high and low
-// SPI clock pulse must be > 2 CPU cycles, so take 3 cycles i.e. divide target
-// f_cpu by 6:
-//     #define SPI_CLOCK            (128000/6)
-//
-// A clock slow enough for an ATtiny85 @ 1 MHz, is a reasonable default:
-#define SPI_CLOCK 		(1000000/6)
+// The SPI clock is negotiated when entering programming mode. The programmer starts
+// with the fastest clock (2 MHz) and slows down until the target's signature can be read.
+// The slowest clock is slow enough for an ATtiny running at 32 kHz.
+// See spi_clocks[] in avr-programmer.cpp
+#define AVRP_SPI_NCLK	7
+
+// Configure which pins to use (see iopin.h)
+typedef iopin<9> PIN_VCC;
+typedef iopin<10> PIN_RESET;
+typedef iopin<11> PIN_MOSI;
+typedef iopin<12> PIN_MISO;
+typedef iopin<13> PIN_SCK;
+
+// Port and bits of the SPI pins, for accessing several pins at once.
+#define SPI_PORT		PORTB
+#define SPI_PIN			PINB
+#define SPI_DDR			DDRB
+#define SPI_MOSI_BIT	3
+#define SPI_MISO_BIT	4
+#define SPI_SCK_BIT		5
+
+// Gang programming (standalone programmer only). Targets 2 and 3 share SCK, MOSI and Vcc with target 1
+// and have their own RESET and MISO pins. The pins are the DVM inputs. See avr-gang.cpp
+#define AVRG_NTARGETS	3
+typedef iopin<A1> PIN_RESET2;
+typedef iopin<A0> PIN_MISO2;
+typedef iopin<A3> PIN_RESET3;
+typedef iopin<A2> PIN_MISO3;
+#define GANG_PIN		PINC	// Port of PIN_MISO2 and PIN_MISO3
+#define GANG_PORT		PORTC
+#define GANG_MISO2_BIT	0
+#define GANG_MISO3_BIT	2
 
-// Configure which pins to use
-#define PIN_VCC		9
-#define PIN_RESET	10
-#define PIN_MOSI	11
-#define PIN_MISO	12
-#define PIN_SCK		13
+// SPI half clock period for gang programming (always bit-banged). 3 us is slow enough for 1 MHz targets.
+#define AVRG_HALFBIT	MICROS_TO_TICKS(3)
 
-// Configure the baud rate:
-#define BAUDRATE	19200
+// TPI (ATtiny4/5/9/10, STK500v2 only). TPICLK is PIN_SCK. TPIDATA is connected to PIN_MISO and,
+// through a 1k resistor, to PIN_MOSI, so that the target can drive the line while MOSI is idle (high).
+// See avr-tpi.cpp
+#define TPI_HALFBIT		MICROS_TO_TICKS(1)	// Half clock period (about 400 kHz with the overhead)
+#define TPI_NVM_WAIT	20					// Timeout (ms) for a word write or an erase
+
+// Protocols
+#define AVRP_STK500V1	1		// ArduinoISP; avrdude -c avrisp or -c arduino
+#define AVRP_STK500V2	2		// AVR068; avrdude -c stk500v2
+
+// Configure the baud rate. The serial port is interrupt-driven (see uart.cpp), so the
+// limit is what avrdude and the USB-serial converter can manage. 250000, 500000 and 1000000
+// are exact at 16 MHz; 115200 is 2.1% fast but works with all the usual converters.
+#define BAUDRATE	115200
 
 #define HWVER 2
 #define SWMAJ 1
@@ -62,9 +95,35 @@
 #define STK_NOSYNC  0x15
 #define CRC_EOP     0x20	//ok it is a space...
 
-#define SPI_MODE0	0x00
+// Joat extension: compare CRCs of the target's flash with CRCs sent by the host. See crc_check()
+#define STK_CRC_CHECK	0x7c	// '|'
+#define STK_GET_STATS	0x7d	// '}'; see avrp_stats_t
+#define AVRP_CRC_MAX	128		// Max. number of blocks in one command; the CRCs must fit in buff
+
 #define EECHUNK		32
 
+// Size of the data buffer. An STK500v2 message body can be up to 275 bytes
+// (10 bytes of programming parameters followed by a 256-byte page, plus a few spare)
+#define AVRP_BUFFSIZE	275
+
+// STK500v2: number of settable parameters that are stored. See stk500v2.cpp
+#define AVRP_V2_NPARAM	6
+
+// Maximum write times (in ms). When the target can be polled, these are the timeouts.
+// When it can't, these are the fixed delays (the values from the original sketch).
+#define AVRP_FLASH_WAIT		20
+#define AVRP_EEPROM_WAIT	45
+
+// Pipelined flash programming: reply to avrdude without waiting for the last page write
+// to finish. Set to 0 to wait for each write before replying (e.g. for comparison: bench/isp-bench.sh
+// measures both).
+#ifndef AVRP_PIPELINE
+#define AVRP_PIPELINE		1
+#endif
+
+// Options, selected when the programmer mode starts. See select_options() in avr-programmer.cpp
+#define AVRP_OPT_DIFF		0x01	// Differential flash programming: don't write unchanged or blank pages
+
 typedef struct avrp_param_s
 {
 	uint8_t devicecode;
@@ -76,24 +135,73 @@ typedef struct avrp_param_s
 	uint8_t lockbytes;
 	uint8_t fusebytes;
 	uint8_t flashpoll;
+	uint8_t eepagesize;			// From the extended parameters; 1 if no EEPROM page buffer
 	uint16_t eeprompoll;
 	uint16_t pagesize;
 	uint16_t eepromsize;
 	uint32_t flashsize;
 } avrp_param_t;
 
+// Statistics for a programming session. STK_GET_STATS sends this structure as it is (little-endian).
+// Times are in microseconds except t_session. The session starts when programming mode is entered.
+typedef struct avrp_stats_s
+{
+	uint32_t bytes_written;		// Bytes of flash and EEPROM written
+	uint32_t bytes_read;		// Bytes of flash and EEPROM read, including CRC checks
+	uint16_t pages_written;		// Page writes started (flash and EEPROM)
+	uint16_t pages_skipped;		// Page writes avoided by differential programming
+	uint16_t errors;			// All errors; errorcount is cleared by avrdude's sign-on and leave progmode
+	uint16_t nosync;			// Commands that were out of sync, and STK500v2 header or checksum errors
+	uint32_t t_session;			// Length of the session in ms
+	uint32_t t_busy;			// Time spent processing commands; the rest of the session is waiting for the host
+	uint32_t t_rxwait;			// Time spent waiting for the rest of a command from the host
+	uint32_t t_commit;			// Time spent waiting for writes (and chip erase) to complete
+	uint32_t t_overlap;			// Time between starting a page write and waiting for it to complete
+} avrp_stats_t;
+
 typedef struct avrp_data_s
 {
-	uint8_t buff[256];			// Data buffer
+	uint8_t buff[AVRP_BUFFSIZE];	// Data buffer
 	avrp_param_t param;			// Parameter block sent by PC
 	unsigned int here;			// Address for reading and writing, set by 'U' command
+	unsigned int poll_addr;		// Address of a flash location for value polling
+	uint8_t poll_cmd;			// Read instruction for poll_addr; 0 = no suitable location
+	uint8_t poll_value;			// Value expected at poll_addr when the write has finished
+	uint8_t commit_pending;		// A page write has been started but not waited for
+	uint32_t commit_wait;		// Timeout (or fixed delay) for a page write, in ticks
+	uint16_t spi_halfbit;		// SPI bit-bang half cycle in ticks; 0 = hardware SPI
+	uint8_t spi_level;			// Index of the negotiated SPI clock
+	uint8_t options;			// AVRP_OPT_xxx
+	uint8_t erased;				// The target has been chip-erased in this session
+	uint8_t page_dirty;			// The page being loaded differs from the target's flash
+	uint8_t ntargets;			// Standalone: number of targets; gang programming if > 1
+	uint8_t active;				// Standalone: bit mask of targets that haven't failed
+	uint8_t gang_rx[AVRG_NTARGETS];		// Gang: bytes received from each target in the last transfer
+	uint8_t target_err[AVRG_NTARGETS];	// Standalone: error code of each target
 	uint8_t errorcount;			// Error counter
 	uint8_t errorcode;			// Error code of last error
 	uint8_t pmode;				// 0 = waiting, 1 = programming, 2 = done
 	uint8_t rst_active_high;	// Depends on device
 	uint8_t prog_lamp_count;	// Counter for programming activity
+	uint8_t protocol;			// AVRP_STK500V1 or AVRP_STK500V2
+	uint8_t v2_seq;				// STK500v2: sequence number of the current message
+	uint8_t v2_cksum;			// STK500v2: checksum of the answer being sent
+	uint8_t v2_ext;				// STK500v2: extended address byte (flash > 128 KiB)
+	uint8_t v2_ext_load;		// STK500v2: extended address must be sent before the next access
+	uint8_t v2_param[AVRP_V2_NPARAM];	// STK500v2: values of settable parameters
+	uint8_t xprog_mode;			// STK500v2: mode selected by CMD_XPROG_SETMODE (only TPI is supported)
+	uint32_t commit_t0;			// Time (ticks) when the last page write was started
+	uint64_t session_t0;		// Time (ticks) when the session started
+	avrp_stats_t stats;			// Statistics for the session
 } avrp_data_t;
 
-extern void avr_programmer(void) __attribute__((noreturn));
+extern void avr_programmer(uint8_t protocol) __attribute__((noreturn));
+extern void avr_standalone(uint8_t ntargets) __attribute__((noreturn));
+
+// The stored image (avr-image.h), also used by the high-voltage programmer. See avr-standalone.cpp
+extern void image_info(uint8_t *sig, uint16_t *pagesize, uint16_t *npages);
+extern uint8_t image_byte(uint16_t offset);
+extern uint8_t image_page_blank(uint16_t offset);
+extern uint16_t image_crc(uint16_t offset, uint16_t length);
 
 #endif
@@ -0,0 +1,437 @@
+/* avr-standalone.cpp - program an AVR from an image stored in the Joat, without a PC
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <Arduino.h>
+#include <util/crc16.h>
+#include "joat.h"
+#include "timing.h"
+#include "avr-programmer.h"
+#include "avr-isp.h"
+#include "avr-image.h"
+
+/* The standalone programmer uses the same ISP layer as the avrdude-controlled programmer.
+ * Each press of OK programs one device: check the signature, erase, write the pages that aren't blank,
+ * verify every page by CRC and finally program the fuses. The result is shown on the LCD.
+ *
+ * In the "AVR gang" mode, up to AVRG_NTARGETS devices are programmed at the same time (see avr-gang.cpp).
+ * The instructions are broadcast, but every response is checked for each target separately.
+ * A target that fails is dropped (avrpdata.active) and the others carry on.
+ *
+ * The image is in the nano's flash (see avr-image.h). image_byte() is the only function that reads it,
+ * so another source (e.g. an external SPI flash) only needs a different image_byte().
+*/
+
+#define AVRI_SIZE		sizeof(avri_image)
+#define AVRI_NPAGES		((AVRI_SIZE + AVRI_PAGESIZE - 1) / AVRI_PAGESIZE)
+
+static_assert(sizeof(avri_image) <= AVRI_FLASHSIZE, "avri_image is larger than the target's flash");
+static_assert((AVRI_PAGESIZE & (AVRI_PAGESIZE - 1)) == 0, "AVRI_PAGESIZE must be a power of 2");
+
+// Maximum time for a chip erase (ms)
+#define AVRS_ERASE_WAIT		100
+
+// Error codes (displayed as FAIL Exx)
+#define AVRS_E_NOTARGET		0x20	// Target did not respond at any SPI clock
+#define AVRS_E_SIGNATURE	0x21	// Target is not the device that the image is for
+#define AVRS_E_ERASE		0x22	// Timeout during chip erase
+#define AVRS_E_WRITE		0x23	// Timeout during page write
+#define AVRS_E_VERIFY		0x24	// CRC of a page doesn't match
+#define AVRS_E_FUSE			0x25	// Timeout during fuse write
+
+static void avrs_init(uint8_t ntargets);
+static void program_targets(void);
+static void enter_targets(void);
+static void check_signature(void);
+static void erase_targets(void);
+static void program_image(void);
+static void verify_image(void);
+static void program_fuses(void);
+#if defined(AVRI_LFUSE) || defined(AVRI_HFUSE) || defined(AVRI_EFUSE)
+static void write_fuse(uint8_t cmd, uint8_t value);
+#endif
+static void check_ready(uint8_t timeout, uint8_t err);
+static void check_targets(uint8_t r, uint8_t mask, uint8_t expected, uint8_t err);
+static uint8_t target_rx(uint8_t t, uint8_t r);
+static void target_failed(uint8_t t, uint8_t err);
+static void show_progress(const __FlashStringHelper *what, uint16_t page);
+static void show_result(void);
+static void show_error(uint8_t err);
+
+void avr_standalone(uint8_t ntargets)
+{
+	avrs_init(ntargets);
+
+	for (;;)
+	{
+		lcd.setCursor(0,1);
+		lcd.print(F("Insert AVR  [OK]"));
+
+		while ( button() != btn_ok )
+		{	// Wait
+		}
+
+		// Turn on power to Vcc
+		wipe_row(1);
+		lcd.print(F("Vcc on"));
+		vcc(1);
+		tick_delay(MILLIS_TO_TICKS(500));
+
+		program_targets();
+
+		if ( avrpdata.pmode == 1 )
+		{
+			if ( avrpdata.ntargets > 1 )
+				gang_end_pmode();
+			else
+				end_pmode();
+		}
+
+		// Turn off power to Vcc
+		vcc(0);
+		tick_delay(MILLIS_TO_TICKS(500));
+
+		avrpdata.pmode = 0;
+
+		show_result();
+
+		while ( button() != btn_ok )
+		{	// Wait
+		}
+	}
+}
+
+/* avrs_init() - set up the parameters that avrdude would otherwise send
+*/
+static void avrs_init(uint8_t ntargets)
+{
+	avrpdata.ntargets = ntargets;
+	avrpdata.param.pagesize = AVRI_PAGESIZE;
+	avrpdata.param.flashsize = AVRI_FLASHSIZE;
+	avrpdata.param.polling = 1;				// All devices with paged flash support RDY/BSY polling
+	avrpdata.param.flashpoll = 0xff;
+	avrpdata.param.eepagesize = 1;
+	avrpdata.rst_active_high = 0;
+	avrpdata.commit_wait = MILLIS_TO_TICKS(AVRP_FLASH_WAIT);
+}
+
+/* program_targets() - program and verify the devices in the socket(s)
+ *
+ * The result for each target is in avrpdata.target_err[]
+*/
+static void program_targets(void)
+{
+	memset(&avrpdata.stats, 0, sizeof(avrpdata.stats));
+	avrpdata.active = (1 << avrpdata.ntargets) - 1;
+	for ( uint8_t t = 0; t < avrpdata.ntargets; t++ )
+		avrpdata.target_err[t] = 0;
+
+	enter_targets();
+
+	if ( avrpdata.active )
+		check_signature();
+
+	if ( avrpdata.active )
+		erase_targets();
+
+	if ( avrpdata.active )
+		program_image();
+
+	if ( avrpdata.active )
+		verify_image();
+
+	if ( avrpdata.active )
+		program_fuses();
+}
+
+/* enter_targets() - put the target(s) into programming mode
+*/
+static void enter_targets(void)
+{
+	if ( avrpdata.ntargets > 1 )
+	{
+		gang_start_pmode();
+		check_targets(0, 0xff, 0x53, AVRS_E_NOTARGET);
+	}
+	else if ( !start_pmode() )
+	{
+		target_failed(0, AVRS_E_NOTARGET);
+	}
+}
+
+/* check_signature() - check that the target(s) are the device that the image is for
+*/
+static void check_signature(void)
+{
+	check_targets(read_sig_byte(0), 0xff, AVRI_SIG0, AVRS_E_SIGNATURE);
+	check_targets(read_sig_byte(1), 0xff, AVRI_SIG1, AVRS_E_SIGNATURE);
+	check_targets(read_sig_byte(2), 0xff, AVRI_SIG2, AVRS_E_SIGNATURE);
+}
+
+/* erase_targets() - chip erase
+*/
+static void erase_targets(void)
+{
+	show_progress(F("Erase "), 0);
+	spi_transaction(0xAC, 0x80, 0x00, 0x00);
+	avrpdata.erased = 1;
+	check_ready(wait_ready(0, 0, 0, MILLIS_TO_TICKS(AVRS_ERASE_WAIT)), AVRS_E_ERASE);
+}
+
+/* program_image() - write the image to the target's flash
+ *
+ * The target has been erased, so blank pages are not written.
+*/
+static void program_image(void)
+{
+	for ( uint16_t page = 0; page < AVRI_NPAGES && avrpdata.active; page++ )
+	{
+		uint16_t offset = page * AVRI_PAGESIZE;
+		unsigned int addr = offset / 2;
+
+		show_progress(F("Write "), page);
+
+		if ( image_page_blank(offset) )
+		{
+			avrpdata.stats.pages_skipped++;
+			continue;
+		}
+
+		for ( uint16_t i = 0; i < AVRI_PAGESIZE; i += 2 )
+		{
+			flash(LOW, addr + i/2, image_byte(offset + i));
+			flash(HIGH, addr + i/2, image_byte(offset + i + 1));
+		}
+
+		check_ready(commit(addr), AVRS_E_WRITE);
+		avrpdata.stats.bytes_written += AVRI_PAGESIZE;
+	}
+}
+
+/* verify_image() - compare the CRC of each page of the target's flash with the image
+ *
+ * Blank pages are verified too, to check that the erase worked.
+ * The CRC is calculated for each target separately; it's the same CRC as flash_crc().
+*/
+static void verify_image(void)
+{
+	uint16_t crc[AVRG_NTARGETS];
+
+	for ( uint16_t page = 0; page < AVRI_NPAGES && avrpdata.active; page++ )
+	{
+		uint16_t offset = page * AVRI_PAGESIZE;
+		unsigned int addr = offset / 2;
+
+		show_progress(F("Verify"), page);
+
+		for ( uint8_t t = 0; t < avrpdata.ntargets; t++ )
+			crc[t] = 0;
+
+		for ( uint16_t i = 0; i < AVRI_PAGESIZE; i++ )
+		{
+			uint8_t r = flash_read(i & 1, addr + i/2);
+
+			for ( uint8_t t = 0; t < avrpdata.ntargets; t++ )
+				crc[t] = _crc_xmodem_update(crc[t], target_rx(t, r));
+		}
+
+		avrpdata.stats.bytes_read += AVRI_PAGESIZE;
+
+		uint16_t expected = image_crc(offset, AVRI_PAGESIZE);
+
+		for ( uint8_t t = 0; t < avrpdata.ntargets; t++ )
+		{
+			if ( crc[t] != expected )
+				target_failed(t, AVRS_E_VERIFY);
+		}
+	}
+}
+
+/* program_fuses() - program the fuses that are defined in avr-image.h
+*/
+static void program_fuses(void)
+{
+#ifdef AVRI_LFUSE
+	write_fuse(0xA0, AVRI_LFUSE);
+#endif
+#ifdef AVRI_HFUSE
+	write_fuse(0xA8, AVRI_HFUSE);
+#endif
+#ifdef AVRI_EFUSE
+	write_fuse(0xA4, AVRI_EFUSE);
+#endif
+}
+
+#if defined(AVRI_LFUSE) || defined(AVRI_HFUSE) || defined(AVRI_EFUSE)
+/* write_fuse() - write a fuse byte. cmd is the second byte of the instruction
+*/
+static void write_fuse(uint8_t cmd, uint8_t value)
+{
+	spi_transaction(0xAC, cmd, 0x00, value);
+	check_ready(wait_ready(0, 0, 0, MILLIS_TO_TICKS(AVRP_EEPROM_WAIT)), AVRS_E_FUSE);
+}
+#endif
+
+/* check_ready() - after a timeout, find out which targets are still busy and drop them
+*/
+static void check_ready(uint8_t timeout, uint8_t err)
+{
+	if ( timeout )
+		check_targets(spi_transaction(0xF0, 0x00, 0x00, 0x00), 0x01, 0x00, err);
+}
+
+/* check_targets() - drop the targets whose response to the last transfer is wrong
+ *
+ * r is the response from target 1; in gang mode, the responses are in avrpdata.gang_rx[]
+*/
+static void check_targets(uint8_t r, uint8_t mask, uint8_t expected, uint8_t err)
+{
+	for ( uint8_t t = 0; t < avrpdata.ntargets; t++ )
+	{
+		if ( (target_rx(t, r) & mask) != expected )
+			target_failed(t, err);
+	}
+}
+
+/* target_rx() - the byte that target t sent in the last transfer
+*/
+static uint8_t target_rx(uint8_t t, uint8_t r)
+{
+	if ( avrpdata.ntargets > 1 )
+		return avrpdata.gang_rx[t];
+	return r;
+}
+
+/* target_failed() - record the first error of a target and drop it
+*/
+static void target_failed(uint8_t t, uint8_t err)
+{
+	if ( avrpdata.active & (1 << t) )
+	{
+		avrpdata.active &= ~(1 << t);
+		avrpdata.target_err[t] = err;
+		avrp_error(err);
+	}
+}
+
+/* image_info() - describe the stored image, for the other programmers that can use it (e.g. HVSP)
+*/
+void image_info(uint8_t *sig, uint16_t *pagesize, uint16_t *npages)
+{
+	sig[0] = AVRI_SIG0;
+	sig[1] = AVRI_SIG1;
+	sig[2] = AVRI_SIG2;
+	*pagesize = AVRI_PAGESIZE;
+	*npages = AVRI_NPAGES;
+}
+
+/* image_byte() - return a byte of the image. Beyond the end of the image, the flash is blank.
+*/
+uint8_t image_byte(uint16_t offset)
+{
+	if ( offset < AVRI_SIZE )
+		return pgm_read_byte(&avri_image[offset]);
+	return 0xff;
+}
+
+/* image_page_blank() - returns 1 if the page of the image at (offset) contains only 0xff
+*/
+uint8_t image_page_blank(uint16_t offset)
+{
+	for ( uint16_t i = 0; i < AVRI_PAGESIZE; i++ )
+	{
+		if ( image_byte(offset + i) != 0xff )
+			return 0;
+	}
+	return 1;
+}
+
+/* image_crc() - calculate the CRC of part of the image. Same CRC as flash_crc()
+*/
+uint16_t image_crc(uint16_t offset, uint16_t length)
+{
+	uint16_t crc = 0;
+
+	for ( uint16_t i = 0; i < length; i++ )
+		crc = _crc_xmodem_update(crc, image_byte(offset + i));
+
+	return crc;
+}
+
+/* show_progress() - show what's happening and how far it has got
+*/
+static void show_progress(const __FlashStringHelper *what, uint16_t page)
+{
+	uint8_t percent = (uint8_t)((uint32_t)page * 100 / AVRI_NPAGES);
+
+	lcd.setCursor(0, 1);
+	lcd.print(what);
+	if ( percent < 10 )
+		lcd.print(' ');
+	lcd.print(percent);
+	lcd.print('%');
+}
+
+/* show_result() - show PASS or FAIL with the error code
+ *
+ * In gang mode, the result for each target is shown, e.g. "1 ok 2E21 3 ok"
+*/
+static void show_result(void)
+{
+	wipe_row(1);
+
+	if ( avrpdata.ntargets > 1 )
+	{
+		for ( uint8_t t = 0; t < avrpdata.ntargets; t++ )
+		{
+			lcd.print((char)('1' + t));
+			if ( avrpdata.target_err[t] == 0 )
+			{
+				lcd.print(F(" ok "));
+			}
+			else
+			{
+				show_error(avrpdata.target_err[t]);
+				lcd.print(' ');
+			}
+		}
+		return;
+	}
+
+	if ( avrpdata.target_err[0] == 0 )
+	{
+		lcd.print(F("PASS"));
+	}
+	else
+	{
+		lcd.print(F("FAIL "));
+		show_error(avrpdata.target_err[0]);
+	}
+
+	lcd.setCursor(12, 1);
+	lcd.print(F("[OK]"));
+}
+
+/* show_error() - show an error code as Exx
+*/
+static void show_error(uint8_t err)
+{
+	lcd.print('E');
+	lcd.print(hexdigit((err >> 4) & 0xf));
+	lcd.print(hexdigit(err & 0xf));
+}
@@ -0,0 +1,420 @@
+/* avr-tpi.cpp - TPI programming for the reduced-core ATtinys (ATtiny4/5/9/10)
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <Arduino.h>
+#include "joat.h"
+#include "timing.h"
+#include "avr-programmer.h"
+#include "avr-isp.h"
+
+/* The Tiny Programming Interface (TPI) is described in the ATtiny4/5/9/10 datasheet.
+ *
+ * TPI is a synchronous half-duplex serial link with a clock (TPICLK) and a bidirectional data line (TPIDATA).
+ * Each frame is a 0 start bit, 8 data bits LSB first, an even parity bit and two 1 stop bits; the line
+ * idles high. The target samples TPIDATA on the rising edge of TPICLK and changes it after the falling edge.
+ *
+ * The USART can't be used in synchronous mode because it's the link to the host, so the frames are bit-banged
+ * on the ISP pins. TPIDATA is connected directly to MISO and through a resistor to MOSI; when MOSI is high
+ * the target can pull the line low.
+ *
+ * All the memories are in one data address space and are accessed with the pointer register (SSTPR),
+ * the load/store instructions (SLD/SST) and the NVM controller's registers (SIN/SOUT).
+ * Flash is written one word at a time: the pointer is loaded once and every word is stored with SST ptr+,
+ * then NVMBSY is polled before the next word. Consecutive words therefore cost only two store frames and
+ * the poll. After a chip erase, blank words are skipped.
+*/
+
+// TPI instructions
+#define TPI_SLD_PI			0x24		// Load from *ptr++
+#define TPI_SST				0x60		// Store to *ptr
+#define TPI_SST_PI			0x64		// Store to *ptr++
+#define TPI_SSTPR(n)		(0x68 | (n))	// Store to the pointer register (0 = low, 1 = high byte)
+#define TPI_SIN(a)			(0x10 | (((a) & 0x30) << 1) | ((a) & 0x0f))
+#define TPI_SOUT(a)			(0x90 | (((a) & 0x30) << 1) | ((a) & 0x0f))
+#define TPI_SLDCS(a)		(0x80 | ((a) & 0x0f))
+#define TPI_SSTCS(a)		(0xc0 | ((a) & 0x0f))
+#define TPI_SKEY			0xe0
+
+// TPI control/status registers
+#define TPI_TPISR			0x00
+#define TPI_TPIPCR			0x02
+#define TPI_NVMEN			0x02		// TPISR: NVM programming enabled
+#define TPI_GT_2			0x07		// TPIPCR: guard time of 2 idle bits (the default is 128)
+
+// NVM controller (I/O space) and its commands
+#define TPI_NVMCSR			0x32
+#define TPI_NVMCMD			0x33
+#define TPI_NVMBSY			0x80
+#define NVM_NOP				0x00
+#define NVM_CHIP_ERASE		0x10
+#define NVM_SECTION_ERASE	0x14
+#define NVM_WORD_WRITE		0x1d
+
+#define TPI_FLASH_BASE		0x4000
+
+// Number of idle bits to wait for the start of an answer. The guard time is 2 bits, plus a margin
+#define TPI_RX_IDLE			16
+
+// The NVM programming enable key, in the order it is sent
+static const uint8_t PROGMEM tpi_key[8] = { 0xff, 0x88, 0xd8, 0xcd, 0x45, 0xab, 0x89, 0x12 };
+
+static inline void tpi_halfbit(void);
+static void tpi_idle(uint8_t n);
+static void tpi_clock(void);
+static void tpi_send(uint8_t b);
+static int16_t tpi_recv(void);
+static void tpi_set_pointer(uint16_t addr);
+static uint8_t tpi_nvm_wait(void);
+
+/* tpi_start_pmode() - reset the target and enable NVM programming
+ *
+ * Returns 1 if the target responded, 0 otherwise
+*/
+uint8_t tpi_start_pmode(void)
+{
+	int16_t sr = 0;
+
+	SPCR = 0;
+	avrpdata.spi_halfbit = TPI_HALFBIT;
+
+	// TPICLK low, TPIDATA idle (high)
+	SPI_PORT &= ~_BV(SPI_SCK_BIT);
+	SPI_PORT |= _BV(SPI_MOSI_BIT);
+	SPI_DDR |= _BV(SPI_MOSI_BIT) | _BV(SPI_SCK_BIT);
+	PIN_MISO::input();
+
+	// Holding RESET low enables the TPI; it must then see at least 16 idle bits
+	PIN_RESET::high();
+	PIN_RESET::output();
+	tick_delay(MILLIS_TO_TICKS(20));
+	PIN_RESET::low();
+	tick_delay(MILLIS_TO_TICKS(1));
+	tpi_idle(32);
+
+	tpi_send(TPI_SSTCS(TPI_TPIPCR));
+	tpi_send(TPI_GT_2);
+
+	tpi_send(TPI_SKEY);
+	for ( uint8_t i = 0; i < sizeof(tpi_key); i++ )
+		tpi_send(pgm_read_byte(&tpi_key[i]));
+
+	// NVMEN comes on within a few frames
+	for ( uint8_t i = 0; i < 10; i++ )
+	{
+		tpi_send(TPI_SLDCS(TPI_TPISR));
+		sr = tpi_recv();
+		if ( sr >= 0 && (sr & TPI_NVMEN) != 0 )
+			break;
+	}
+
+	lcd.setCursor(11, 1);
+	lcd.print(F("tp"));
+
+	avrpdata.erased = 0;
+	avrpdata.pmode = 1;
+	avrpdata.session_t0 = read_ticks();
+
+	if ( sr < 0 || (sr & TPI_NVMEN) == 0 )
+	{
+		avrp_error(0x14);
+		return 0;
+	}
+	return 1;
+}
+
+/* tpi_end_pmode() - disable NVM programming and release the target
+*/
+void tpi_end_pmode(void)
+{
+	tpi_send(TPI_SSTCS(TPI_TPISR));
+	tpi_send(0x00);
+	tpi_idle(2);
+
+	avrp_update_stats();
+	avrpdata.spi_halfbit = 0;
+	PIN_MOSI::input();
+	PIN_SCK::input();
+	PIN_RESET::high();
+	PIN_RESET::input();
+	avrpdata.pmode = 2;
+}
+
+/* tpi_read() - read n bytes starting at addr (data space address)
+ *
+ * Returns 0 if OK, TPI_ERR_FAILED if the target didn't answer correctly.
+*/
+uint8_t tpi_read(uint16_t addr, uint8_t *buf, uint16_t n)
+{
+	tpi_set_pointer(addr);
+
+	for ( uint16_t i = 0; i < n; i++ )
+	{
+		tpi_send(TPI_SLD_PI);
+		int16_t c = tpi_recv();
+		if ( c < 0 )
+		{
+			avrp_error(0x15);
+			return TPI_ERR_FAILED;
+		}
+		buf[i] = c;
+	}
+
+	avrpdata.stats.bytes_read += n;
+	return 0;
+}
+
+/* tpi_write() - write n bytes starting at addr (flash or configuration section)
+ *
+ * The NVM writes whole words, so a partial word at either end is padded with 0xff.
+ * Returns 0 if OK, otherwise TPI_ERR_xxx
+*/
+uint8_t tpi_write(uint16_t addr, const uint8_t *data, uint16_t n)
+{
+	uint16_t a = addr & ~1u;
+	uint16_t end = addr + n;
+	uint8_t reload = 1;
+	uint8_t written = 0;
+
+	if ( tpi_nvm_wait() )
+		return TPI_ERR_TIMEOUT;
+
+	tpi_send(TPI_SOUT(TPI_NVMCMD));
+	tpi_send(NVM_WORD_WRITE);
+
+	for ( ; a < end; a += 2 )
+	{
+		uint8_t lo = ( a >= addr ) ? data[a - addr] : 0xff;
+		uint8_t hi = ( a + 1 < end ) ? data[a + 1 - addr] : 0xff;
+
+		if ( avrpdata.erased && a >= TPI_FLASH_BASE && lo == 0xff && hi == 0xff )
+		{
+			// Already blank. The pointer must be reloaded before the next word that is written.
+			reload = 1;
+			continue;
+		}
+
+		if ( reload )
+		{
+			tpi_set_pointer(a);
+			reload = 0;
+		}
+
+		tpi_send(TPI_SST_PI);
+		tpi_send(lo);
+		tpi_send(TPI_SST_PI);
+		tpi_send(hi);
+
+		if ( tpi_nvm_wait() )
+			return TPI_ERR_TIMEOUT;
+
+		avrpdata.stats.bytes_written += 2;
+		written = 1;
+	}
+
+	if ( written )
+		avrpdata.stats.pages_written++;
+	else
+		avrpdata.stats.pages_skipped++;
+
+	return 0;
+}
+
+/* tpi_erase() - chip erase, or erase the section that contains addr
+ *
+ * The erase is triggered by a dummy write to the high byte of a word in the section.
+ * Returns 0 if OK, otherwise TPI_ERR_xxx
+*/
+uint8_t tpi_erase(uint8_t chip, uint16_t addr)
+{
+	if ( tpi_nvm_wait() )
+		return TPI_ERR_TIMEOUT;
+
+	tpi_send(TPI_SOUT(TPI_NVMCMD));
+	tpi_send(chip ? NVM_CHIP_ERASE : NVM_SECTION_ERASE);
+
+	tpi_set_pointer(chip ? (TPI_FLASH_BASE | 1) : (addr | 1));
+	tpi_send(TPI_SST);
+	tpi_send(0xff);
+
+	if ( tpi_nvm_wait() )
+		return TPI_ERR_TIMEOUT;
+
+	if ( chip )
+		avrpdata.erased = 1;
+
+	return 0;
+}
+
+/* tpi_set_pointer() - load the pointer register
+*/
+static void tpi_set_pointer(uint16_t addr)
+{
+	tpi_send(TPI_SSTPR(0));
+	tpi_send(addr & 0xff);
+	tpi_send(TPI_SSTPR(1));
+	tpi_send(addr >> 8);
+}
+
+/* tpi_nvm_wait() - wait until the NVM controller isn't busy
+ *
+ * Returns 0 if OK, nonzero if the controller was still busy after TPI_NVM_WAIT ms
+*/
+static uint8_t tpi_nvm_wait(void)
+{
+	uint32_t t0 = (uint32_t)read_ticks();
+	uint32_t t;
+	int16_t csr;
+
+	for (;;)
+	{
+		tpi_send(TPI_SIN(TPI_NVMCSR));
+		csr = tpi_recv();
+		t = (uint32_t)read_ticks() - t0;
+
+		if ( csr >= 0 && (csr & TPI_NVMBSY) == 0 )
+			break;
+
+		if ( t >= (uint32_t)MILLIS_TO_TICKS(TPI_NVM_WAIT) )
+		{
+			avrp_error(0x16);
+			return 1;
+		}
+	}
+
+	avrpdata.stats.t_commit += AVRP_TICKS_TO_US(t);
+	return 0;
+}
+
+/* tpi_send() - send a frame
+*/
+static void tpi_send(uint8_t b)
+{
+	uint8_t parity = 0;
+
+	// Start bit
+	SPI_PORT &= ~_BV(SPI_MOSI_BIT);
+	tpi_clock();
+
+	for ( uint8_t i = 0; i < 8; i++ )
+	{
+		if ( b & 0x01 )
+		{
+			SPI_PORT |= _BV(SPI_MOSI_BIT);
+			parity ^= 1;
+		}
+		else
+			SPI_PORT &= ~_BV(SPI_MOSI_BIT);
+		b >>= 1;
+		tpi_clock();
+	}
+
+	// Parity
+	if ( parity )
+		SPI_PORT |= _BV(SPI_MOSI_BIT);
+	else
+		SPI_PORT &= ~_BV(SPI_MOSI_BIT);
+	tpi_clock();
+
+	// Two stop bits. TPIDATA is left high (idle)
+	tpi_idle(2);
+}
+
+/* tpi_recv() - receive a frame
+ *
+ * Returns the byte, or -1 if there was no start bit or the parity or stop bits were wrong
+*/
+static int16_t tpi_recv(void)
+{
+	uint8_t b = 0;
+	uint8_t parity = 0;
+	uint8_t bit;
+	uint8_t i;
+
+	// TPIDATA is high, so the target can drive it. Wait for the start bit.
+	SPI_PORT |= _BV(SPI_MOSI_BIT);
+	for ( i = 0; i < TPI_RX_IDLE; i++ )
+	{
+		tpi_halfbit();
+		SPI_PORT |= _BV(SPI_SCK_BIT);
+		bit = SPI_PIN & _BV(SPI_MISO_BIT);
+		tpi_halfbit();
+		SPI_PORT &= ~_BV(SPI_SCK_BIT);
+
+		if ( bit == 0 )
+			break;
+	}
+
+	if ( i >= TPI_RX_IDLE )
+		return -1;
+
+	// 8 data bits, parity and 2 stop bits
+	for ( i = 0; i < 11; i++ )
+	{
+		tpi_halfbit();
+		SPI_PORT |= _BV(SPI_SCK_BIT);
+		bit = (SPI_PIN >> SPI_MISO_BIT) & 0x01;
+		tpi_halfbit();
+		SPI_PORT &= ~_BV(SPI_SCK_BIT);
+
+		if ( i < 8 )
+			b |= bit << i;
+
+		if ( i < 9 )
+			parity ^= bit;
+		else if ( bit == 0 )
+			return -1;		// Bad stop bit
+	}
+
+	if ( parity != 0 )
+		return -1;
+
+	return b;
+}
+
+/* tpi_idle() - send n idle bits
+*/
+static void tpi_idle(uint8_t n)
+{
+	SPI_PORT |= _BV(SPI_MOSI_BIT);
+	while ( n-- > 0 )
+		tpi_clock();
+}
+
+/* tpi_clock() - one TPICLK cycle. The target samples TPIDATA on the rising edge
+*/
+static void tpi_clock(void)
+{
+	tpi_halfbit();
+	SPI_PORT |= _BV(SPI_SCK_BIT);
+	tpi_halfbit();
+	SPI_PORT &= ~_BV(SPI_SCK_BIT);
+}
+
+/* tpi_halfbit() - wait for half a TPI clock cycle
+ *
+ * The delay is too short for tick_delay(), which has a lot of overhead, so timer1 is read directly.
+*/
+static inline void tpi_halfbit(void)
+{
+	uint16_t t0 = TCNT1;
+
+	while ( (uint16_t)(TCNT1 - t0) < (uint16_t)TPI_HALFBIT )
+	{	// Wait
+	}
+}
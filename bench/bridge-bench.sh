@@ -0,0 +1,112 @@
+#!/bin/sh
+# bridge-bench.sh - sustained throughput of the UART bridge, full duplex
+#
+# Usage: bridge-bench.sh [-b baud] [-t secs] [-i ticks]
+#
+# Runs the host build of the firmware (host/joat-host) in the "UART bridge" mode with a simulated device
+# on the bridge's pins (host/bridge-target.cpp) that echoes everything, and sends numbered lines to the
+# bridge without a pause for the given simulated time (30 s by default). The host and the device both run
+# at exactly the nominal baud rate, so both directions are busy all the time. -i is passed to joat-host:
+# the time each interrupt handler takes, to find how much the bit timing can stand.
+#
+# Prints the bridge's own figures for the last second and the loss over the run in the format of simbench, e.g.
+#	bridge.57600.to-target.Bps 5760
+#	bridge.57600.from-target.Bps 5760
+#	bridge.57600.lost.Bps 0
+#	bridge.57600.damaged-lines 0
+# so that compare.sh can compare the results with a baseline. lost is what the bridge counts (E on the
+# display) over the second half of the run, when the buffers have filled up. A line that comes back with a byte
+# missing is expected when bytes are lost; a line with a character that isn't in the lines sent is damaged,
+# and so is a byte that the device receives with a bad stop bit. Fails if anything is damaged.
+
+baud=57600
+secs=30
+isr=0
+
+while getopts b:t:i: opt
+do
+	case $opt in
+	b)	baud=$OPTARG ;;
+	t)	secs=$OPTARG ;;
+	i)	isr=$OPTARG ;;
+	*)	sed -n 4p "$0" >&2; exit 1 ;;
+	esac
+done
+
+# Menu keys: select "UART bridge" (see joat.h), then CHANGE from 57600 to the baud rate and OK
+case $baud in
+57600)	b= ;;
+9600)	b=c ;;
+19200)	b=cc ;;
+38400)	b=ccc ;;
+*)		echo "bridge-bench: unsupported baud rate $baud" >&2; exit 1 ;;
+esac
+keys=.cccccccccco${b}o
+
+here=$(cd "$(dirname "$0")" && pwd)
+. "$here/host-pty.sh"
+
+tmp=$(mktemp -d)
+trap 'kill $sim $rd $wr 2>/dev/null; rm -rf "$tmp"' EXIT
+
+make -s -C "$here/../host" > /dev/null 2>&1 || exit 1
+
+# 40 characters per line, more than can be sent in the time
+awk -v n=$((baud * secs / 400 + 100)) 'BEGIN {
+	for ( i = 0; i < n; i++ )
+		printf "%06d abcdefghijklmnopqrstuvwxyz01234\n", i
+}' > "$tmp/in"
+
+host_start "$here/../host/joat-host" -k $keys -B $baud -i $isr -t $secs
+
+cat "$pty" > "$tmp/out" 2> /dev/null &
+rd=$!
+
+# Start sending when the bridge is running
+while ! grep -q ' baud' "$tmp/sim.log"
+do
+	sleep 0.05
+done
+cat "$tmp/in" > "$pty" 2> /dev/null &
+wr=$!
+
+wait $sim
+sleep 0.2
+
+# The display shows "<from >to Elost" once a second (without the spaces from 1000 lost):
+#	     9.223 |UART bridge     |
+#	           |<5760 >5760 E0  |
+# The device reports at the end:
+#	bridge: 10.000299 s, received 49450 sent 49342, 0 framing errors, 0 lost
+awk -v key="bridge.$baud" '
+	FNR == 1 { file++ }
+	file == 1 && /^ *[0-9.]+ \|/ { t = $1 }
+	file == 1 && /\|<[0-9]+ ?>[0-9]+ ?E[0-9]+ *\|/ {
+		s = $0
+		sub(/^[^<]*</, "", s)
+		split(s, f, /[ >E|]+/)
+		n++
+		tt[n] = t
+		ee[n] = f[3]
+		from = f[1]; to = f[2]
+	}
+	file == 1 && /^bridge: / { framing = $(NF-4) }
+	file == 2 {
+		if ( $0 ~ /[^0-9a-z ]/ )
+			damaged++
+	}
+	END {
+		t0 = tt[int(n / 2) + 1]; e0 = ee[int(n / 2) + 1]
+		t1 = tt[n]; e1 = ee[n]
+		if ( n < 2 || t1 == t0 ) {
+			print "bridge-bench: no figures from the bridge" > "/dev/stderr"
+			exit 1
+		}
+		printf "%s.to-target.Bps %d\n", key, to
+		printf "%s.from-target.Bps %d\n", key, from
+		printf "%s.lost.Bps %d\n", key, (e1 - e0) / (t1 - t0) + 0.5
+		printf "%s.damaged-lines %d\n", key, damaged + framing
+		if ( damaged + framing > 0 )
+			exit 1
+	}
+' "$tmp/sim.log" "$tmp/out"
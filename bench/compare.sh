@@ -0,0 +1,55 @@
+#!/bin/sh
+# compare.sh - compare benchmark results with a baseline
+#
+# Usage: compare.sh baseline.txt results.txt [limit-percent]
+#
+# Cycle counts (avg and max for the min/avg/max lines) are worse when they go up; frequencies (*.hz)
+# are worse when they go down. Exits with 1 if anything got worse by more than the limit (default 2%).
+
+limit=${3:-2}
+
+if [ ! -f "$1" ]
+then
+	echo "compare.sh: there is no baseline $1 yet. Make one with the matching baseline target (e.g. make baseline)" >&2
+	echo "on a machine that has what the benchmark needs, check that the results are sane, and commit it." >&2
+	exit 1
+fi
+
+awk -v limit="$limit" '
+	# value(line, field): the number after the word "field", or the first number if field is ""
+	function value(s, field,    a, n, i) {
+		n = split(s, a, " ")
+		if ( field == "" )
+			return a[1]
+		for ( i = 1; i < n; i++ )
+			if ( a[i] == field )
+				return a[i+1]
+		return ""
+	}
+
+	function compare(key, field, old, new,    d, worse) {
+		if ( old == "" || new == "" || old !~ /^[0-9.]+$/ || new !~ /^[0-9.]+$/ || old == 0 )
+			return
+		d = (new - old) * 100.0 / old
+		worse = (key ~ /\.hz$/) ? -d : d
+		status = "ok"
+		if ( worse > limit ) { status = "WORSE"; bad = 1 }
+		else if ( worse < -limit ) status = "better"
+		printf "%-40s %-4s %12s %12s %+7.1f%%  %s\n", key, field, old, new, d, status
+	}
+
+	NR == FNR { k = $1; $1 = ""; base[k] = $0; next }
+
+	{
+		k = $1; $1 = ""
+		if ( !(k in base) ) { printf "%-40s new\n", k; next }
+		if ( base[k] ~ / avg / ) {
+			compare(k, "avg", value(base[k], "avg"), value($0, "avg"))
+			compare(k, "max", value(base[k], "max"), value($0, "max"))
+		}
+		else
+			compare(k, "", value(base[k], ""), value($0, ""))
+	}
+
+	END { exit bad }
+' "$1" "$2"
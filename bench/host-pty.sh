@@ -0,0 +1,29 @@
+# host-pty.sh - start the host build of the firmware with its serial port on a pseudo-terminal
+#
+# Sourced by the bench scripts, which set tmp to their temporary directory first:
+#	. "$here/host-pty.sh"
+#	host_start "$here/../host/joat-host" -q -k $keys ...
+#	avrdude ... -P "$pty"
+#
+# host_start program options...
+#	Runs the program with the options and -p in the background, with stdout (the name of the pseudo-terminal)
+#	in $tmp/pty and stderr in $tmp/sim.log. Waits for the name and sets pty to it and sim to the process id.
+#	Exits the script if the program ends first.
+
+host_start()
+{
+	rm -f "$tmp/pty"
+	"$@" -p > "$tmp/pty" 2> "$tmp/sim.log" &
+	sim=$!
+	while [ ! -s "$tmp/pty" ]
+	do
+		if ! kill -0 $sim 2> /dev/null
+		then
+			cat "$tmp/sim.log" >&2
+			echo "$(basename "$0"): $1 didn't start" >&2
+			exit 1
+		fi
+		sleep 0.05
+	done
+	pty=$(head -1 "$tmp/pty")
+}
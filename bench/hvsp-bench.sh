@@ -0,0 +1,88 @@
+#!/bin/sh
+# hvsp-bench.sh - time taken by the high-voltage serial programmer to recover an ATtiny
+#
+# Usage: hvsp-bench.sh [-p part]
+#
+# Runs the host build of the firmware (host/joat-host) in the "AVR HVSP" mode with a simulated ATtiny on
+# the HVSP pins (host/hvsp-target.cpp) whose RSTDISBL fuse is programmed, and carries out each action:
+#	fuse-reset		write the factory default fuses
+#	erase-fuses		chip erase, then the fuses
+#	image-full		chip erase, write and verify an image that fills the flash, then the fuses
+# The image is random, built into the firmware in place of avr-image.h. Each action is a separate run.
+# The time is the simulated time from entering HVSP mode to removing Vcc, as reported by the target.
+# It includes the target's programming times and about 6 cycles for each port write of the frames.
+#
+# Prints one line per action in the format of simbench, e.g.
+#	hvsp.t85.fuse-reset.s 0.0156
+# so that compare.sh can compare the results with a baseline. Fails if the target isn't recovered.
+
+part=t85
+
+while getopts p: opt
+do
+	case $opt in
+	p)	part=$OPTARG ;;
+	*)	sed -n 4p "$0" >&2; exit 1 ;;
+	esac
+done
+
+# Flash size and page size of the part, and the keys to select the mode (see joat.h)
+case $part in
+t13)		sig="0x90 0x07"; flash=1024; page=32 ;;
+t24|t25)	sig="0x91 0x0b"; [ $part = t25 ] && sig="0x91 0x08"; flash=2048; page=32 ;;
+t44|t45)	sig="0x92 0x07"; [ $part = t45 ] && sig="0x92 0x06"; flash=4096; page=64 ;;
+t84|t85)	sig="0x93 0x0c"; [ $part = t85 ] && sig="0x93 0x0b"; flash=8192; page=64 ;;
+*)			echo "hvsp-bench: unknown part $part" >&2; exit 1 ;;
+esac
+mode=.ccccccccco
+
+here=$(cd "$(dirname "$0")" && pwd)
+host="$here/../host"
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# The image: the same definitions as avr-image.h
+head -c $flash /dev/urandom > "$tmp/image.bin"
+{
+	echo "#ifndef AVR_IMAGE_H"
+	echo "#define AVR_IMAGE_H 1"
+	echo "#include <Arduino.h>"
+	set -- $sig
+	echo "#define AVRI_SIG0 0x1e"
+	echo "#define AVRI_SIG1 $1"
+	echo "#define AVRI_SIG2 $2"
+	echo "#define AVRI_PAGESIZE $page"
+	echo "#define AVRI_FLASHSIZE $flash"
+	echo "static const uint8_t PROGMEM avri_image[] = {"
+	od -An -v -tx1 "$tmp/image.bin" | sed 's/ \([0-9a-f][0-9a-f]\)/0x\1,/g'
+	echo "};"
+	echo "#endif"
+} > "$tmp/image.h"
+
+# Build with the image in the temporary directory, so that the normal build in host/ isn't touched
+make -s -C "$host" BUILD="$tmp/build" IMAGE="$tmp/image.h" > /dev/null 2>&1 || exit 1
+
+# run op action
+#	Selects the action (the number of CHANGE presses), presses OK at "Insert AVR" and prints the result line
+run()
+{
+	op=$1
+	keys=$mode$(printf '%*s' $2 '' | tr ' ' c)oo
+
+	"$tmp/build/joat-host" -q -k $keys -H $part -t 5 < /dev/null 2> "$tmp/sim.log" > /dev/null
+
+	if grep -q 'FAIL\|not in HVSP mode' "$tmp/sim.log" || ! grep -q '^hvsp: .* session' "$tmp/sim.log"
+	then
+		cat "$tmp/sim.log" >&2
+		echo "hvsp-bench: $op failed" >&2
+		exit 1
+	fi
+
+	# hvsp: t85 session 0.015571 s, fuses 62 df ff, ...
+	awk -v key="hvsp.$part.$op" '/^hvsp: .* session/ { printf "%s.s %.4f\n", key, $4 }' "$tmp/sim.log"
+}
+
+run fuse-reset	0
+run erase-fuses	1
+run image-full	2
@@ -0,0 +1,115 @@
+#!/bin/sh
+# isp-bench.sh - programming throughput of the AVR programmer, driven by avrdude
+#
+# Usage: isp-bench.sh [-c stk500v2|arduino] [-p part] [-s kbytes]
+#
+# Runs the host build of the firmware (host/joat-host) with a simulated AVR on the ISP pins
+# (host/isp-target.cpp), and lets avrdude write, read and verify a random image of the given size
+# through the pseudo-terminal. verify-crc is the verify done by isp-crc (isp-crc.cpp) instead, with the
+# programmer's CRC command. Each operation is a separate run, because the firmware waits for OK
+# after a session. The times are simulated: they are what the Nano would take with a host that
+# answers at once, including the time on the wire at 115200 baud and the target's programming times.
+#
+# The write is measured with the firmware built both ways (AVRP_PIPELINE, see avr-programmer.h): with
+# the flash page writes pipelined, and waiting for each one before answering.
+#
+# Prints one line per operation in the format of simbench, e.g.
+#	isp.stk500v2.m328p.write.s_per_kb 0.2399
+#	isp.stk500v2.m328p.write-nopipe.s_per_kb 0.3012
+#	isp.stk500v2.m328p.verify-crc.s_per_kb 0.1352
+# so that compare.sh can compare the results with a baseline.
+
+prog=stk500v2
+part=m328p
+kbytes=16
+
+while getopts c:p:s: opt
+do
+	case $opt in
+	c)	prog=$OPTARG ;;
+	p)	part=$OPTARG ;;
+	s)	kbytes=$OPTARG ;;
+	*)	sed -n 4p "$0" >&2; exit 1 ;;
+	esac
+done
+
+here=$(cd "$(dirname "$0")" && pwd)
+. "$here/host-pty.sh"
+
+# Menu keys: select the mode (see joat.h), accept the options, then OK at "Insert AVR"
+case $prog in
+stk500v2)	keys=.ccccccooo ;;
+arduino)	keys=.cccccooo ;;
+*)			echo "isp-bench: unknown programmer $prog" >&2; exit 1 ;;
+esac
+
+command -v avrdude > /dev/null || { echo "isp-bench: avrdude not found" >&2; exit 1; }
+
+tmp=$(mktemp -d)
+trap 'kill $sim 2>/dev/null; rm -rf "$tmp"' EXIT
+
+# Build with the flash pipeline off and on, each in its own directory (host/build-pipe0, host/build-pipe1),
+# so that the normal build in host/ isn't touched
+for pipe in 0 1
+do
+	make -s -C "$here/../host" BUILD=build-pipe$pipe AVRP_PIPELINE=$pipe > /dev/null || exit 1
+done
+
+make -s -C "$here" isp-crc > /dev/null || exit 1
+
+head -c $((kbytes * 1024)) /dev/urandom > "$tmp/image.bin"
+
+# run op pipe image avrdude-options...
+#	Runs one avrdude session (isp-crc for verify-crc) against a fresh simulation of the firmware built with AVRP_PIPELINE=pipe
+#	(with the image in the target's flash if image isn't empty) and prints the result line.
+run()
+{
+	op=$1
+	pipe=$2
+	load=$3
+	shift 3
+
+	host_start "$here/../host/build-pipe$pipe/joat-host" -q -k $keys -T $part ${load:+-I "$load"}
+
+	if [ $op = verify-crc ]
+	then
+		set -- "$here/isp-crc" -c $prog -P "$pty" -b 115200 "$tmp/image.bin"
+	else
+		set -- avrdude -q -q -c $prog -p $part -P "$pty" -b 115200 "$@"
+	fi
+
+	if ! "$@" > "$tmp/avrdude.log" 2>&1
+	then
+		cat "$tmp/avrdude.log" >&2
+		echo "isp-bench: $op failed" >&2
+		exit 1
+	fi
+
+	# The target reports the session when RESET is released
+	n=0
+	while ! grep -q '^isp: .* session' "$tmp/sim.log" && [ $n -lt 50 ]
+	do
+		sleep 0.1
+		n=$((n + 1))
+	done
+	kill $sim 2>/dev/null
+	wait $sim 2>/dev/null
+
+	# isp: m328p session 1.965436 s, flash 8192 written 0 read, eeprom ...
+	grep '^uart: receive overrun' "$tmp/sim.log" >&2
+
+	awk -v key="isp.$prog.$part.$op" -v op=$op '
+		/^isp: .* session/ {
+			t = $4
+			bytes = (op ~ /^write/) ? $7 : $9
+			if ( bytes > 0 )
+				printf "%s.s_per_kb %.4f\n", key, t * 1024 / bytes
+		}
+	' "$tmp/sim.log"
+}
+
+run write			1	""					-e -V -U flash:w:"$tmp/image.bin":r
+run write-nopipe	0	""					-e -V -U flash:w:"$tmp/image.bin":r
+run read			1	"$tmp/image.bin"	-U flash:r:"$tmp/read.bin":r
+run verify			1	"$tmp/image.bin"	-U flash:v:"$tmp/image.bin":r
+run verify-crc		1	"$tmp/image.bin"
@@ -0,0 +1,375 @@
+/* isp-crc.cpp - verify a target's flash against an image with the programmer's CRC command
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+#include "serial-port.h"
+
+/* Usage: isp-crc [-c arduino|stk500v2] [-b baud] [-s blksize] -P port image.bin
+ *
+ * avrdude doesn't know the Joat programmer's CRC command (STK500v1 '|', STK500v2 0x70; see crc_check()
+ * in avr-programmer.cpp), so this is the verify step for programming with avrdude -V:
+ *	avrdude -c stk500v2 -P /dev/ttyUSB0 -b 115200 -p m328p -V -U flash:w:image.bin:r
+ *	isp-crc -c stk500v2 -P /dev/ttyUSB0 image.bin
+ * It enters programming mode, sends the CRC-16/XMODEM of each block of the image (up to 128 blocks per
+ * command) and leaves programming mode. Only the indexes of the blocks that don't match come back, so
+ * it takes a fraction of the time that reading the flash back over the serial line does.
+ * The image is a raw binary that starts at address 0. The last block is padded with 0xff, like erased flash.
+ *
+ * Prints the blocks that don't match and exits with 1 if there are any, 2 if the programmer didn't answer.
+*/
+
+#define CRC_MAX			128			// AVRP_CRC_MAX in avr-programmer.h
+#define TIMEOUT_MS		5000		// Longest time to wait for an answer
+#define SYNC_MS			500			// Time to wait for an answer to a sync attempt
+#define SYNC_TRIES		20			// The firmware doesn't listen until the mode is selected
+
+// STK500v1 (avr-programmer.h)
+#define STK_OK			0x10
+#define STK_INSYNC		0x14
+#define CRC_EOP			0x20
+#define STK_CRC_CHECK	0x7c
+
+// STK500v2 (stk500v2.cpp)
+#define MESSAGE_START			0x1b
+#define TOKEN					0x0e
+#define CMD_SIGN_ON				0x01
+#define CMD_LOAD_ADDRESS		0x06
+#define CMD_ENTER_PROGMODE_ISP	0x10
+#define CMD_LEAVE_PROGMODE_ISP	0x11
+#define CMD_CRC_CHECK			0x70
+#define STATUS_CMD_OK			0x00
+
+static int fd;
+static int v2;
+static int timeout_ms = SYNC_MS;
+static uint8_t v2_seq;
+
+static int get(uint8_t *buf, int n);
+static void put(const uint8_t *buf, int n);
+static int v1_command(const uint8_t *cmd, int n, uint8_t *answer, int nanswer);
+static int v2_command(const uint8_t *body, int n, uint8_t *answer, int max);
+static int enter_progmode(void);
+static void leave_progmode(void);
+static int check(uint32_t addr, const uint8_t *crcs, int blksize, int n, uint8_t *bad);
+static uint16_t crc_xmodem(const uint8_t *p, int n);
+static void usage(const char *prog);
+
+int main(int argc, char **argv)
+{
+	const char *port = NULL;
+	long baud = 115200;
+	int blksize = 128;
+	int opt;
+
+	while ( (opt = getopt(argc, argv, "c:b:s:P:")) != -1 )
+	{
+		switch ( opt )
+		{
+		case 'c':	v2 = (strcmp(optarg, "stk500v2") == 0);		break;
+		case 'b':	baud = atol(optarg);		break;
+		case 's':	blksize = atoi(optarg);		break;
+		case 'P':	port = optarg;				break;
+		default:	usage(argv[0]);
+		}
+	}
+
+	if ( port == NULL || optind != argc - 1 || blksize <= 0 || (blksize & 1) != 0 )
+		usage(argv[0]);
+
+	FILE *f = fopen(argv[optind], "rb");
+	if ( f == NULL )
+	{
+		perror(argv[optind]);
+		return 2;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	rewind(f);
+
+	int nblocks = (int)((size + blksize - 1) / blksize);
+	uint8_t *image = (uint8_t *)malloc((size_t)nblocks * blksize + 1);
+	memset(image, 0xff, (size_t)nblocks * blksize);
+	if ( fread(image, 1, size, f) != (size_t)size )
+	{
+		perror(argv[optind]);
+		return 2;
+	}
+	fclose(f);
+
+	fd = open_port(port, baud, O_RDWR);
+	if ( fd < 0 )
+	{
+		perror(port);
+		return 2;
+	}
+
+	if ( !enter_progmode() )
+	{
+		fprintf(stderr, "isp-crc: the programmer doesn't answer\n");
+		return 2;
+	}
+
+	int nbad = 0;
+
+	for ( int first = 0; first < nblocks; first += CRC_MAX )
+	{
+		int n = (nblocks - first < CRC_MAX) ? nblocks - first : CRC_MAX;
+		uint8_t crcs[2 * CRC_MAX];
+		uint8_t bad[CRC_MAX];
+
+		for ( int i = 0; i < n; i++ )
+		{
+			uint16_t crc = crc_xmodem(&image[(first + i) * blksize], blksize);
+			crcs[2*i] = crc >> 8;
+			crcs[2*i+1] = crc & 0xff;
+		}
+
+		int nb = check((uint32_t)first * blksize, crcs, blksize, n, bad);
+		if ( nb < 0 )
+		{
+			fprintf(stderr, "isp-crc: the CRC command failed at 0x%05x\n", first * blksize);
+			leave_progmode();
+			return 2;
+		}
+
+		for ( int i = 0; i < nb; i++ )
+			printf("0x%05x: block differs\n", (first + bad[i]) * blksize);
+		nbad += nb;
+	}
+
+	leave_progmode();
+
+	fprintf(stderr, "isp-crc: %ld bytes, %d blocks of %d, %d differ\n", size, nblocks, blksize, nbad);
+	return nbad != 0;
+}
+
+/* enter_progmode() - get in sync with the programmer and enter programming mode. Returns 1 if OK.
+*/
+static int enter_progmode(void)
+{
+	uint8_t a[64];
+
+	if ( v2 )
+	{
+		static const uint8_t sign_on[] = { CMD_SIGN_ON };
+		// Timeouts and instructions as avrdude sends them; the firmware negotiates the SPI clock itself
+		static const uint8_t enter[] = { CMD_ENTER_PROGMODE_ISP, 200, 100, 25, 32, 0, 0x53, 3, 0xac, 0x53, 0, 0 };
+
+		for ( int i = 0; i < SYNC_TRIES; i++ )
+		{
+			if ( v2_command(sign_on, sizeof(sign_on), a, sizeof(a)) >= 2 && a[1] == STATUS_CMD_OK )
+			{
+				timeout_ms = TIMEOUT_MS;
+				return v2_command(enter, sizeof(enter), a, sizeof(a)) >= 2 && a[1] == STATUS_CMD_OK;
+			}
+			tcflush(fd, TCIOFLUSH);
+		}
+		return 0;
+	}
+
+	static const uint8_t sync[] = { '0', CRC_EOP };
+	static const uint8_t enter[] = { 'P', CRC_EOP };
+
+	for ( int i = 0; i < SYNC_TRIES; i++ )
+	{
+		if ( v1_command(sync, sizeof(sync), a, 0) )
+		{
+			timeout_ms = TIMEOUT_MS;
+			return v1_command(enter, sizeof(enter), a, 0);
+		}
+		tcflush(fd, TCIOFLUSH);
+	}
+	return 0;
+}
+
+static void leave_progmode(void)
+{
+	uint8_t a[8];
+
+	if ( v2 )
+	{
+		static const uint8_t leave[] = { CMD_LEAVE_PROGMODE_ISP, 1, 1 };
+		v2_command(leave, sizeof(leave), a, sizeof(a));
+	}
+	else
+	{
+		static const uint8_t leave[] = { 'Q', CRC_EOP };
+		v1_command(leave, sizeof(leave), a, 0);
+	}
+}
+
+/* check() - compare the CRCs of n blocks starting at byte address addr
+ *
+ * Returns the number of blocks that don't match (their indexes are in bad[]), or -1 if the command failed.
+*/
+static int check(uint32_t addr, const uint8_t *crcs, int blksize, int n, uint8_t *bad)
+{
+	uint8_t cmd[2 * CRC_MAX + 8];
+	uint8_t a[CRC_MAX + 8];
+	uint32_t word = addr / 2;
+
+	if ( v2 )
+	{
+		uint8_t load[5] = { CMD_LOAD_ADDRESS, (uint8_t)(word >> 24), (uint8_t)(word >> 16), (uint8_t)(word >> 8), (uint8_t)word };
+		if ( word > 0xffff )
+			load[1] |= 0x80;		// Extended address
+		if ( v2_command(load, sizeof(load), a, sizeof(a)) < 2 || a[1] != STATUS_CMD_OK )
+			return -1;
+
+		cmd[0] = CMD_CRC_CHECK;
+		cmd[1] = blksize >> 8;
+		cmd[2] = blksize & 0xff;
+		cmd[3] = n;
+		memcpy(&cmd[4], crcs, 2 * n);
+
+		// Answer: cmd, status, nbad, indexes, status
+		int len = v2_command(cmd, 4 + 2 * n, a, sizeof(a));
+		if ( len < 4 || a[1] != STATUS_CMD_OK || len != a[2] + 4 )
+			return -1;
+		memcpy(bad, &a[3], a[2]);
+		return a[2];
+	}
+
+	uint8_t load[4] = { 'U', (uint8_t)(word & 0xff), (uint8_t)(word >> 8), CRC_EOP };
+	if ( !v1_command(load, sizeof(load), a, 0) )
+		return -1;
+
+	cmd[0] = STK_CRC_CHECK;
+	cmd[1] = blksize >> 8;
+	cmd[2] = blksize & 0xff;
+	cmd[3] = n;
+	memcpy(&cmd[4], crcs, 2 * n);
+	cmd[4 + 2 * n] = CRC_EOP;
+	put(cmd, 5 + 2 * n);
+
+	// Answer: STK_INSYNC, nbad, indexes, STK_OK
+	if ( !get(a, 2) || a[0] != STK_INSYNC || a[1] > n )
+		return -1;
+	int nb = a[1];
+	if ( !get(bad, nb) || !get(a, 1) || a[0] != STK_OK )
+		return -1;
+	return nb;
+}
+
+/* v1_command() - send an STK500v1 command and receive STK_INSYNC, nanswer bytes and STK_OK. Returns 1 if OK.
+*/
+static int v1_command(const uint8_t *cmd, int n, uint8_t *answer, int nanswer)
+{
+	uint8_t c;
+
+	put(cmd, n);
+	if ( !get(&c, 1) || c != STK_INSYNC )
+		return 0;
+	if ( nanswer > 0 && !get(answer, nanswer) )
+		return 0;
+	return get(&c, 1) && c == STK_OK;
+}
+
+/* v2_command() - send an STK500v2 message and receive the answer's body
+ *
+ * Returns the size of the body, or -1 if there was no good answer.
+*/
+static int v2_command(const uint8_t *body, int n, uint8_t *answer, int max)
+{
+	uint8_t hdr[5] = { MESSAGE_START, ++v2_seq, (uint8_t)(n >> 8), (uint8_t)(n & 0xff), TOKEN };
+	uint8_t cksum = 0;
+
+	for ( int i = 0; i < 5; i++ )
+		cksum ^= hdr[i];
+	for ( int i = 0; i < n; i++ )
+		cksum ^= body[i];
+
+	put(hdr, 5);
+	put(body, n);
+	put(&cksum, 1);
+
+	if ( !get(hdr, 5) || hdr[0] != MESSAGE_START || hdr[1] != v2_seq || hdr[4] != TOKEN )
+		return -1;
+
+	int len = hdr[2] * 256 + hdr[3];
+	if ( len > max || !get(answer, len) || !get(&cksum, 1) )
+		return -1;
+
+	for ( int i = 0; i < 5; i++ )
+		cksum ^= hdr[i];
+	for ( int i = 0; i < len; i++ )
+		cksum ^= answer[i];
+
+	return ( cksum == 0 && answer[0] == body[0] ) ? len : -1;
+}
+
+/* get() - read n bytes from the port. Returns 0 on timeout.
+*/
+static int get(uint8_t *buf, int n)
+{
+	while ( n > 0 )
+	{
+		struct pollfd p = { fd, POLLIN, 0 };
+
+		if ( poll(&p, 1, timeout_ms) <= 0 )
+			return 0;
+
+		ssize_t r = read(fd, buf, n);
+		if ( r <= 0 )
+			return 0;
+		buf += r;
+		n -= (int)r;
+	}
+	return 1;
+}
+
+static void put(const uint8_t *buf, int n)
+{
+	while ( n > 0 )
+	{
+		ssize_t w = write(fd, buf, n);
+		if ( w <= 0 )
+			return;
+		buf += w;
+		n -= (int)w;
+	}
+}
+
+/* crc_xmodem() - CRC-16/XMODEM, the same as _crc_xmodem_update() in avr-libc
+*/
+static uint16_t crc_xmodem(const uint8_t *p, int n)
+{
+	uint16_t crc = 0;
+
+	while ( n-- > 0 )
+	{
+		crc ^= (uint16_t)*p++ << 8;
+		for ( int i = 0; i < 8; i++ )
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+	}
+
+	return crc;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-c arduino|stk500v2] [-b baud] [-s blksize] -P port image.bin\n", prog);
+	exit(2);
+}
@@ -0,0 +1,55 @@
+#!/bin/sh
+# selftest.sh - run the loopback self-test of the frequency meter (selftest.h) and print the results
+#
+# Usage: selftest.sh [-p port] [-i ticks]
+#
+# With -p, the Joat on the serial port runs the test; D11 must be connected to D8. Otherwise the host
+# build runs it with the loopback (joat-host -l), each interrupt handler taking the given number of
+# ticks (default 50, about what TIMER1_CAPT_vect takes on the Nano; see simbench).
+#
+# Prints the results in the format of simbench, e.g.
+#	test.1000hz.error.ppm 0.00
+#	test.capture.lossless.hz 262295
+# so that compare.sh can compare them with a baseline. The test takes about 20 seconds.
+
+port=
+isr=50
+
+while getopts p:i: opt
+do
+	case $opt in
+	p)	port=$OPTARG ;;
+	i)	isr=$OPTARG ;;
+	*)	sed -n 4p "$0" >&2; exit 1 ;;
+	esac
+done
+
+here=$(cd "$(dirname "$0")" && pwd)
+. "$here/host-pty.sh"
+tmp=$(mktemp -d)
+trap 'kill $sim 2>/dev/null; rm -rf "$tmp"' EXIT
+
+if [ -z "$port" ]
+then
+	make -s -C "$here/../host" || exit 1
+	host_start "$here/../host/joat-host" -q -l -i "$isr"
+	port=$pty
+fi
+
+stty -F "$port" 115200 raw -echo || exit 1
+exec 3<"$port"
+
+# Selecting the mode resets the Joat. The query is answered when the test has finished.
+printf 'INST TEST\n' > "$port"
+sleep 1
+printf 'TEST:REP?\n' > "$port"
+timeout 90 sed -n '/^# selftest/,/^# end/{p;/^# end/q}' <&3 | tr -d '\r' > "$tmp/report"
+exec 3<&-
+
+if ! grep -q '^# end' "$tmp/report"
+then
+	echo "selftest: the test didn't finish" >&2
+	exit 1
+fi
+
+sed '1d;$d' "$tmp/report"
@@ -0,0 +1,67 @@
+/* serial-port.h - open a serial port for the tools in bench/
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SERIAL_PORT_H
+#define SERIAL_PORT_H	1
+
+#include <fcntl.h>
+#include <termios.h>
+
+/* Each tool is a single source file, so the function is defined here rather than in a library.
+*/
+
+/* open_port() - open a serial port, raw, at the given baud rate
+ *
+ * flags is O_RDONLY or O_RDWR. A baud rate that isn't in the table leaves the port's speed as it is.
+ * Returns the file descriptor, or -1.
+*/
+static int open_port(const char *port, long baud, int flags)
+{
+	static const struct { long baud; speed_t speed; } speeds[] =
+	{
+		{ 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+		{ 115200, B115200 }, { 230400, B230400 }, { 500000, B500000 }, { 1000000, B1000000 },
+	};
+	struct termios tio;
+	int f = open(port, flags | O_NOCTTY);
+
+	if ( f < 0 )
+		return f;
+
+	if ( tcgetattr(f, &tio) == 0 )
+	{
+		cfmakeraw(&tio);
+		tio.c_cflag |= CLOCAL | CREAD;
+		tio.c_cc[VMIN] = 1;
+		tio.c_cc[VTIME] = 0;
+		for ( unsigned i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++ )
+		{
+			if ( speeds[i].baud == baud )
+			{
+				cfsetispeed(&tio, speeds[i].speed);
+				cfsetospeed(&tio, speeds[i].speed);
+			}
+		}
+		tcsetattr(f, TCSANOW, &tio);
+	}
+
+	return f;
+}
+
+#endif
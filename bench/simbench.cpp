@@ -0,0 +1,461 @@
+/* simbench.cpp - cycle-accurate benchmarks of the Joat firmware under simavr
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_io.h>
+#include <simavr/sim_cycle_timers.h>
+#include <simavr/avr_adc.h>
+#include <simavr/avr_timer.h>
+
+/* The host build (host/) runs the firmware's logic at desktop speed, but its timing is only a model.
+ * This program runs the real firmware image (the .elf from the Arduino.make build) instruction by
+ * instruction under simavr, so the numbers are what the Nano does:
+ *
+ *	isr		cycles per interrupt handler, from the vector to the end of the RETI (min/avg/max)
+ *	capture	the highest ICP1 frequency at which every edge reaches TIMER1_CAPT_vect
+ *	latency	cycles from selecting a mode (OK released) to the first call of the mode's display function
+ *	gap		cycles between calls of read_ticks() in the main line (max must stay below 65536; see timing.cpp)
+ *	dds		cycles per sample of the signal generator's DDS, and the highest sample rate that allows
+ *
+ * Each result is one line, "<name> <value>", so that a run can be compared with a baseline (see the
+ * Makefile). The buttons are driven on A6 and the modes are selected from the menu, as a user would.
+ *
+ * Symbols are read with avr-nm, so the image must not be stripped.
+*/
+
+#define F_CPU			16000000ul
+#define MS(m)			((avr_cycle_count_t)(m) * (F_CPU / 1000))
+
+#define NVECTORS		26			// ATmega328P
+#define VECTOR_SIZE		4			// jmp
+#define OP_RETI			0x9518
+#define ISR_RESPONSE	4			// Cycles of the interrupt response, before the vector's jmp
+#define V_TIMER2_COMPA	7			// The DDS
+
+// The DDS handler's cycle count is known exactly (dds.cpp), so it checks the measurement of the others.
+// The Makefile takes the value from generator.h.
+#ifndef GEN_DDS_CYCLES
+#error "GEN_DDS_CYCLES must be defined (see generator.h)"
+#endif
+
+#define BTN_NONE_MV		5000
+#define BTN_CHANGE_MV	2500
+#define BTN_OK_MV		0
+
+// Vector numbers of the handlers that Joat uses (ATmega328P datasheet, "Interrupts")
+static const struct { uint8_t vector; const char *name; } vector_names[] =
+{
+	{	3,	"PCINT0"		},
+	{	7,	"TIMER2_COMPA"	},
+	{	10,	"TIMER1_CAPT"	},
+	{	11,	"TIMER1_COMPA"	},
+	{	12,	"TIMER1_COMPB"	},
+	{	13,	"TIMER1_OVF"	},
+	{	18,	"USART_RX"		},
+	{	19,	"USART_UDRE"	},
+};
+
+// Menu position and display function of each measurement mode (see joat.h)
+static const struct { uint8_t mode; const char *name; const char *display; } modes[] =
+{
+	{	0,	"freq",	"display_freq("			},
+	{	1,	"cap",	"display_capacitance("	},
+	{	2,	"ind",	"calculate_inductance("	},
+	{	3,	"dvm",	"display_voltage("		},
+};
+
+typedef struct
+{
+	uint64_t n;
+	uint64_t total;
+	uint32_t min;
+	uint32_t max;
+} stat_t;
+
+typedef struct
+{
+	avr_t *avr;
+
+	// Interrupt handler in progress
+	int isr_vector;
+	avr_cycle_count_t isr_start;
+	stat_t isr[NVECTORS];
+
+	// Main line
+	uint32_t addr_read_ticks;
+	uint32_t addr_display;
+	avr_cycle_count_t last_read_ticks;
+	avr_cycle_count_t mode_entered;
+	avr_cycle_count_t first_display;
+	stat_t gap;
+
+	// Stimulus
+	avr_irq_t *btn_irq;
+	avr_irq_t *icp_irq;
+	uint32_t icp_half;				// Cycles per half period of the ICP1 signal (0 = none)
+	uint8_t icp_level;
+	uint64_t icp_edges;
+	const char *keys;
+	uint8_t key_index;
+	avr_irq_t *ramp_irq;
+	uint32_t ramp_mv;
+} bench_t;
+
+static const char *elf_name;
+static elf_firmware_t firmware;
+static char nm_command[512];
+
+static void stat_add(stat_t *s, uint32_t v);
+static uint32_t find_symbol(const char *prefix);
+static void bench_init(bench_t *b, const char *keys);
+static void bench_run(bench_t *b, avr_cycle_count_t cycles);
+static void bench_mode(uint8_t mode, const char *name, const char *display);
+static void bench_capture(void);
+static void bench_dds(void);
+static void report_isrs(bench_t *b, const char *prefix);
+
+int main(int argc, char **argv)
+{
+	if ( argc != 2 )
+	{
+		fprintf(stderr, "Usage: %s joat.elf\n", argv[0]);
+		return 1;
+	}
+
+	elf_name = argv[1];
+	snprintf(nm_command, sizeof(nm_command), "avr-nm -C %s", elf_name);
+
+	memset(&firmware, 0, sizeof(firmware));
+	if ( elf_read_firmware(elf_name, &firmware) != 0 )
+	{
+		fprintf(stderr, "%s: can't read %s\n", argv[0], elf_name);
+		return 1;
+	}
+	strcpy(firmware.mmcu, "atmega328p");
+	firmware.frequency = F_CPU;
+
+	bench_dds();			// First: it checks the interrupt measurement
+
+	for ( unsigned i = 0; i < sizeof(modes)/sizeof(modes[0]); i++ )
+		bench_mode(modes[i].mode, modes[i].name, modes[i].display);
+
+	bench_capture();
+	return 0;
+}
+
+static void stat_add(stat_t *s, uint32_t v)
+{
+	if ( s->n == 0 || v < s->min )
+		s->min = v;
+	if ( v > s->max )
+		s->max = v;
+	s->total += v;
+	s->n++;
+}
+
+/* find_symbol() - address (bytes) of the first function whose demangled name starts with prefix
+ *
+ * Returns 0 if there's no such function, e.g. because the compiler inlined it.
+*/
+static uint32_t find_symbol(const char *prefix)
+{
+	FILE *f = popen(nm_command, "r");
+	char line[512];
+	uint32_t addr = 0;
+
+	if ( f == NULL )
+		return 0;
+
+	while ( addr == 0 && fgets(line, sizeof(line), f) != NULL )
+	{
+		unsigned long a;
+		char type;
+		int n;
+
+		if ( sscanf(line, "%lx %c %n", &a, &type, &n) == 2 && (type == 'T' || type == 't') &&
+			 strncmp(&line[n], prefix, strlen(prefix)) == 0 )
+			addr = (uint32_t)a;
+	}
+
+	pclose(f);
+	return addr;
+}
+
+/* Button script on A6, as in host/joat-host: c = CHANGE, o = OK, . = pause; 100 ms per key,
+ * pressed for the first half.
+*/
+static avr_cycle_count_t key_timer(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	bench_t *b = (bench_t *)param;
+	char k = b->keys[b->key_index / 2];
+
+	if ( k == '\0' )
+		return 0;
+
+	if ( (b->key_index & 1) == 0 )
+		avr_raise_irq(b->btn_irq, (k == 'c') ? BTN_CHANGE_MV : (k == 'o') ? BTN_OK_MV : BTN_NONE_MV);
+	else
+	{
+		avr_raise_irq(b->btn_irq, BTN_NONE_MV);
+		if ( k == 'o' && b->keys[b->key_index / 2 + 1] == '\0' )
+			b->mode_entered = avr->cycle;			// The last key selects the mode
+	}
+
+	b->key_index++;
+	return when + MS(50);
+}
+
+/* A0: a ramp from 0 to 5 V in 1 s, so that the DVM shows changing values
+*/
+static avr_cycle_count_t ramp_timer(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	bench_t *b = (bench_t *)param;
+
+	(void)avr;
+	b->ramp_mv = (b->ramp_mv + 5) % 5000;
+	avr_raise_irq(b->ramp_irq, b->ramp_mv);
+	return when + MS(1);
+}
+
+/* ICP1 square wave
+*/
+static avr_cycle_count_t icp_timer(avr_t *avr, avr_cycle_count_t when, void *param)
+{
+	bench_t *b = (bench_t *)param;
+
+	(void)avr;
+	b->icp_level = !b->icp_level;
+	avr_raise_irq(b->icp_irq, b->icp_level);
+	if ( b->icp_level )
+		b->icp_edges++;
+	return when + b->icp_half;
+}
+
+static void bench_init(bench_t *b, const char *keys)
+{
+	memset(b, 0, sizeof(*b));
+
+	b->avr = avr_make_mcu_by_name("atmega328p");
+	avr_init(b->avr);
+	avr_load_firmware(b->avr, &firmware);
+	b->avr->frequency = F_CPU;
+	b->avr->log = 0;
+
+	b->isr_vector = -1;
+	b->addr_read_ticks = find_symbol("read_ticks(");
+
+	// A0 ramps, A1..A5 at mid-scale; buttons released
+	for ( int ch = 1; ch < 6; ch++ )
+		avr_raise_irq(avr_io_getirq(b->avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC0 + ch), 2500);
+	b->ramp_irq = avr_io_getirq(b->avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC0);
+	avr_cycle_timer_register(b->avr, MS(1), ramp_timer, b);
+	b->btn_irq = avr_io_getirq(b->avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC6);
+	avr_raise_irq(b->btn_irq, BTN_NONE_MV);
+
+	b->icp_irq = avr_io_getirq(b->avr, AVR_IOCTL_TIMER_GETIRQ('1'), TIMER_IRQ_IN_ICP);
+
+	b->keys = keys;
+	avr_cycle_timer_register(b->avr, MS(200), key_timer, b);
+}
+
+/* bench_run() - run the image for a number of cycles, one instruction at a time
+*/
+static void bench_run(bench_t *b, avr_cycle_count_t cycles)
+{
+	avr_t *avr = b->avr;
+	avr_cycle_count_t end = avr->cycle + cycles;
+
+	while ( avr->cycle < end )
+	{
+		uint32_t pc = avr->pc;
+		uint16_t op = avr->flash[pc] | (avr->flash[pc + 1] << 8);
+
+		if ( b->isr_vector < 0 )
+		{
+			if ( pc > 0 && pc < NVECTORS * VECTOR_SIZE && (pc % VECTOR_SIZE) == 0 )
+			{
+				// Includes the interrupt response, which has already gone by
+				b->isr_vector = pc / VECTOR_SIZE;
+				b->isr_start = avr->cycle - ISR_RESPONSE;
+			}
+			else if ( pc == b->addr_read_ticks && b->mode_entered != 0 )
+			{
+				if ( b->last_read_ticks != 0 )
+					stat_add(&b->gap, (uint32_t)(avr->cycle - b->last_read_ticks));
+				b->last_read_ticks = avr->cycle;
+			}
+			else if ( pc == b->addr_display && b->mode_entered != 0 && b->first_display == 0 )
+			{
+				b->first_display = avr->cycle;
+			}
+		}
+
+		int state = avr_run(avr);
+
+		if ( op == OP_RETI && b->isr_vector >= 0 )
+		{
+			stat_add(&b->isr[b->isr_vector], (uint32_t)(avr->cycle - b->isr_start));
+			b->isr_vector = -1;
+		}
+
+		if ( state == cpu_Done || state == cpu_Crashed )
+		{
+			fprintf(stderr, "simulation stopped at pc 0x%04x\n", avr->pc);
+			exit(1);
+		}
+	}
+}
+
+static void report_isrs(bench_t *b, const char *prefix)
+{
+	for ( unsigned i = 0; i < sizeof(vector_names)/sizeof(vector_names[0]); i++ )
+	{
+		stat_t *s = &b->isr[vector_names[i].vector];
+
+		if ( s->n > 0 )
+			printf("%s.isr.%s.cycles min %u avg %.1f max %u n %llu\n", prefix, vector_names[i].name,
+					s->min, (double)s->total / s->n, s->max, (unsigned long long)s->n);
+	}
+}
+
+/* bench_mode() - select a mode, run it for a few seconds and report
+*/
+static void bench_mode(uint8_t mode, const char *name, const char *display)
+{
+	static bench_t b;
+	char keys[32];
+	unsigned i = 0;
+
+	keys[i++] = '.';
+	for ( unsigned m = 0; m <= mode; m++ )
+		keys[i++] = 'c';
+	keys[i++] = 'o';
+	keys[i] = '\0';
+
+	bench_init(&b, keys);
+	b.addr_display = find_symbol(display);
+	if ( mode == 0 )
+	{
+		b.icp_half = F_CPU / 2 / 1000;		// 1 kHz for the frequency meter
+		avr_cycle_timer_register(b.avr, b.icp_half, icp_timer, &b);
+	}
+
+	bench_run(&b, MS(200 + 100 * (i + 1)) + MS(3000));
+
+	report_isrs(&b, name);
+
+	if ( b.addr_display == 0 )
+		printf("%s.latency.cycles n/a\n", name);
+	else if ( b.first_display == 0 )
+		printf("%s.latency.cycles none\n", name);
+	else
+		printf("%s.latency.cycles %llu\n", name, (unsigned long long)(b.first_display - b.mode_entered));
+
+	if ( b.gap.n > 0 )
+		printf("%s.gap.cycles min %u avg %.1f max %u n %llu\n", name,
+				b.gap.min, (double)b.gap.total / b.gap.n, b.gap.max, (unsigned long long)b.gap.n);
+
+	avr_terminate(b.avr);
+}
+
+/* bench_capture() - the highest ICP1 frequency at which no capture is lost
+ *
+ * Each trial runs the frequency meter for 100 ms at one frequency and compares the number of
+ * TIMER1_CAPT_vect calls with the number of rising edges. Binary search between 1 kHz and 1 MHz.
+*/
+static void bench_capture(void)
+{
+	static bench_t b;
+	uint32_t lo = 1000;
+	uint32_t hi = 1000000;
+
+	while ( hi - lo > lo / 100 )
+	{
+		uint32_t f = (lo + hi) / 2;
+
+		bench_init(&b, ".co");
+		bench_run(&b, MS(600));							// Select the mode and let it settle
+
+		b.icp_half = F_CPU / 2 / f;
+		b.icp_edges = 0;
+		b.isr[10].n = 0;
+		avr_cycle_timer_register(b.avr, b.icp_half, icp_timer, &b);
+		bench_run(&b, MS(100));
+
+		// The last edge might not have been handled yet
+		if ( b.isr[10].n + 1 >= b.icp_edges )
+			lo = f;
+		else
+			hi = f;
+
+		avr_terminate(b.avr);
+	}
+
+	printf("capture.lossless.hz %u\n", lo);
+}
+
+/* bench_dds() - the signal generator's DDS interrupt handler
+ *
+ * Selects the generator (mode 11), presses OK to switch to the DDS and runs it for a second.
+ * The highest sample rate is the one at which the handler would take all of the processor.
+ *
+ * The handler takes GEN_DDS_CYCLES at every sample (dds.cpp counts them), so it is also the check of
+ * the interrupt measurement in bench_run(): the vector detection and the ISR_RESPONSE cycles that
+ * simavr has counted before the vector's first instruction. If this simavr counts them differently,
+ * every isr result is off by the same amount, so simbench stops before printing anything: a baseline
+ * made from those results would be wrong.
+*/
+static void bench_dds(void)
+{
+	static bench_t b;
+	char keys[32];
+	unsigned i = 0;
+
+	keys[i++] = '.';
+	for ( unsigned m = 0; m <= 11; m++ )
+		keys[i++] = 'c';
+	keys[i++] = 'o';
+	keys[i++] = '.';
+	keys[i++] = 'o';
+	keys[i] = '\0';
+
+	bench_init(&b, keys);
+	bench_run(&b, MS(200 + 100 * (i + 1)) + MS(1000));
+
+	stat_t *s = &b.isr[V_TIMER2_COMPA];
+	if ( s->n == 0 || s->min != GEN_DDS_CYCLES || s->max != GEN_DDS_CYCLES )
+	{
+		fprintf(stderr, "simbench: the DDS handler measured %u..%u cycles in %llu samples, but it takes %u.\n"
+						"The interrupt response (ISR_RESPONSE) should be %d cycles for this simavr,\n"
+						"or the vector detection in bench_run() is wrong.\n",
+				s->min, s->max, (unsigned long long)s->n, (unsigned)GEN_DDS_CYCLES,
+				(s->n == 0) ? ISR_RESPONSE : ISR_RESPONSE + (int)GEN_DDS_CYCLES - (int)s->min);
+		exit(1);
+	}
+
+	report_isrs(&b, "gen");
+	printf("gen.dds.rate.max.hz %llu\n", (unsigned long long)(F_CPU / s->max));
+
+	avr_terminate(b.avr);
+}
@@ -0,0 +1,240 @@
+/* telem-csv.cpp - convert the telemetry stream of the measurement modes to CSV
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include "serial-port.h"
+
+/* Usage: telem-csv [-p port] [-b baud] [file]
+ *
+ * Reads the frames that the firmware sends (see telemetry.h) from the serial port, a file or stdin,
+ * and writes one CSV line per record on stdout:
+ *	time_s,instrument,channel,raw,value
+ * The time is from the firmware's tick counter, with the 32-bit wrap-around (every 268 s) undone.
+ * Frames with a bad CRC, gaps in the sequence numbers and records that the firmware had to drop are
+ * counted and reported on stderr at the end (or on ^C).
+*/
+
+#define HZ				16000000.0
+
+// From telemetry.h
+#define TELEM_REC_SIZE	14
+#define TELEM_HDR_SIZE	2
+#define TELEM_CRC_SIZE	2
+#define TELEM_BATCH_MAX	16			// More than the firmware sends; larger frames are rejected
+
+#define FRAME_MAX		(TELEM_HDR_SIZE + TELEM_BATCH_MAX * TELEM_REC_SIZE + TELEM_CRC_SIZE)
+
+// Instrument ids are the mode numbers (joat.h)
+static const char *instruments[] = { "freq", "cap", "ind", "dvm" };
+
+static struct
+{
+	unsigned long frames, records, bad, gaps, lost;
+} stats;
+
+static volatile sig_atomic_t stop;
+
+static int cobs_decode(const uint8_t *in, int n, uint8_t *out);
+static uint16_t crc_xmodem(const uint8_t *p, int n);
+static int frame(const uint8_t *f, int n);
+static void usage(const char *prog);
+static void on_signal(int sig);
+
+int main(int argc, char **argv)
+{
+	const char *port = NULL;
+	long baud = 115200;
+	int opt;
+	int fd = 0;
+
+	while ( (opt = getopt(argc, argv, "p:b:")) != -1 )
+	{
+		switch ( opt )
+		{
+		case 'p':	port = optarg;				break;
+		case 'b':	baud = atol(optarg);		break;
+		default:	usage(argv[0]);
+		}
+	}
+
+	if ( port != NULL )
+		fd = open_port(port, baud, O_RDONLY);
+	else if ( optind < argc )
+		fd = open(argv[optind], O_RDONLY);
+
+	if ( fd < 0 )
+	{
+		perror(port != NULL ? port : argv[optind]);
+		return 1;
+	}
+
+	// No SA_RESTART, so that ^C interrupts a read from the port
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("time_s,instrument,channel,raw,value\n");
+
+	// Collect the bytes up to each zero, then decode. The bytes before the first zero may be the end of
+	// a frame that started before we did, so they don't count as a bad frame.
+	uint8_t raw[FRAME_MAX + FRAME_MAX / 254 + 2];
+	uint8_t dec[sizeof(raw)];
+	int nraw = 0;
+	int synced = 0;
+	uint8_t buf[512];
+	ssize_t n;
+
+	while ( !stop && (n = read(fd, buf, sizeof(buf))) != 0 )
+	{
+		if ( n < 0 )
+			continue;		// EINTR
+
+		for ( ssize_t i = 0; i < n; i++ )
+		{
+			if ( buf[i] != 0 )
+			{
+				if ( nraw < (int)sizeof(raw) )
+					raw[nraw] = buf[i];
+				nraw++;
+				continue;
+			}
+
+			if ( nraw > 0 )
+			{
+				int len = (nraw <= (int)sizeof(raw)) ? cobs_decode(raw, nraw, dec) : -1;
+				if ( !frame(dec, len) && synced )
+					stats.bad++;
+			}
+			synced = 1;
+			nraw = 0;
+		}
+		fflush(stdout);
+	}
+
+	fprintf(stderr, "telem-csv: %lu frames, %lu records, %lu bad frames, %lu sequence gaps, %lu records dropped by the firmware\n",
+			stats.frames, stats.records, stats.bad, stats.gaps, stats.lost);
+	return 0;
+}
+
+/* frame() - check a decoded frame and print its records
+ *
+ * Returns 0 if the frame is broken (n < 0 if it couldn't be decoded).
+*/
+static int frame(const uint8_t *f, int n)
+{
+	static int have_seq;
+	static uint8_t last_seq;
+	static uint32_t last_ticks;
+	static uint64_t ticks_hi;
+
+	if ( n < TELEM_HDR_SIZE + TELEM_REC_SIZE + TELEM_CRC_SIZE ||
+		 (n - TELEM_HDR_SIZE - TELEM_CRC_SIZE) % TELEM_REC_SIZE != 0 ||
+		 crc_xmodem(f, n - TELEM_CRC_SIZE) != (f[n-2] | (f[n-1] << 8)) )
+	{
+		return 0;
+	}
+
+	if ( have_seq && f[0] != (uint8_t)(last_seq + 1) )
+		stats.gaps++;
+	have_seq = 1;
+	last_seq = f[0];
+	stats.lost += f[1];
+	stats.frames++;
+
+	for ( const uint8_t *r = &f[TELEM_HDR_SIZE]; r < &f[n - TELEM_CRC_SIZE]; r += TELEM_REC_SIZE )
+	{
+		uint32_t ticks = r[0] | (r[1] << 8) | (r[2] << 16) | ((uint32_t)r[3] << 24);
+		int32_t rawval = (int32_t)(r[6] | (r[7] << 8) | (r[8] << 16) | ((uint32_t)r[9] << 24));
+		uint32_t vbits = r[10] | (r[11] << 8) | (r[12] << 16) | ((uint32_t)r[13] << 24);
+		float value;
+		memcpy(&value, &vbits, sizeof(value));
+
+		if ( ticks < last_ticks )
+			ticks_hi += 0x100000000ull;
+		last_ticks = ticks;
+
+		if ( r[4] < sizeof(instruments) / sizeof(instruments[0]) )
+			printf("%.6f,%s,%u,%ld,%.6g\n", (double)(ticks_hi + ticks) / HZ, instruments[r[4]], r[5], (long)rawval, value);
+		else
+			printf("%.6f,%u,%u,%ld,%.6g\n", (double)(ticks_hi + ticks) / HZ, r[4], r[5], (long)rawval, value);
+		stats.records++;
+	}
+
+	return 1;
+}
+
+/* cobs_decode() - undo the COBS encoding of a frame (without its delimiter)
+ *
+ * Returns the length of the decoded frame, or -1 if the encoding is broken.
+*/
+static int cobs_decode(const uint8_t *in, int n, uint8_t *out)
+{
+	int i = 0;
+	int o = 0;
+
+	while ( i < n )
+	{
+		int code = in[i++];
+
+		if ( i + code - 1 > n )
+			return -1;
+		for ( int k = 1; k < code; k++ )
+			out[o++] = in[i++];
+		if ( code < 0xff && i < n )
+			out[o++] = 0;
+	}
+
+	return o;
+}
+
+/* crc_xmodem() - CRC-16/XMODEM, the same as _crc_xmodem_update() in avr-libc
+*/
+static uint16_t crc_xmodem(const uint8_t *p, int n)
+{
+	uint16_t crc = 0;
+
+	while ( n-- > 0 )
+	{
+		crc ^= (uint16_t)*p++ << 8;
+		for ( int i = 0; i < 8; i++ )
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+	}
+
+	return crc;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-p port] [-b baud] [file]\n", prog);
+	exit(1);
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
@@ -0,0 +1,431 @@
+/* tpi-session.cpp - program an ATtiny4/5/9/10 through the programmer's XPROG commands, as avrdude does
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+#include "serial-port.h"
+
+/* Usage: tpi-session [-b baud] [-p part] [-f config] -P port image.bin
+ *
+ * The session that avrdude -c stk500v2 -p t10 -v -U flash:w:image.bin:r -U fuse:w:config:m has with the
+ * STK500v2 engine (stk500v2.cpp), for the test of the TPI programming without avrdude (tpi-test.sh):
+ *	- sign on. avrdude only uses XPROG if the answer is "STK600" or "AVRISP_MK2".
+ *	- read the parameters that avrdude -v shows for an AVRISP mkII
+ *	- select the TPI mode, enter programming mode and set the NVM register addresses
+ *	- read and check the signature
+ *	- chip erase, then write the image a flash page (16 bytes) at a time
+ *	- read the flash back and compare it with the image. The rest of the flash must be blank.
+ *	- erase the configuration section, write the configuration byte and read it back
+ *	- leave programming mode
+ * The image is a raw binary that starts at address 0.
+ *
+ * Prints what went wrong and exits with 1 if anything did, 2 if the programmer didn't answer.
+*/
+
+#define TIMEOUT_MS		5000		// Longest time to wait for an answer
+#define SYNC_MS			500			// Time to wait for an answer to a sync attempt
+#define SYNC_TRIES		20			// The firmware doesn't listen until the mode is selected
+#define PAGE			16			// Flash page size of the ATtiny4/5/9/10
+#define READ_BLOCK		256			// Bytes per READ_MEM when reading the flash back
+
+// STK500v2 (stk500v2.cpp)
+#define MESSAGE_START			0x1b
+#define TOKEN					0x0e
+#define CMD_SIGN_ON				0x01
+#define CMD_GET_PARAMETER		0x03
+#define CMD_XPROG				0x50
+#define CMD_XPROG_SETMODE		0x51
+#define STATUS_CMD_OK			0x00
+#define PARAM_HW_VER			0x90
+#define PARAM_SW_MAJOR			0x91
+#define PARAM_SW_MINOR			0x92
+#define PARAM_VTARGET			0x94
+#define PARAM_SCK_DURATION		0x98
+
+// XPROG, as avrdude sends it
+#define XPRG_MODE_TPI			0x02
+#define XPRG_CMD_ENTER_PROGMODE	0x01
+#define XPRG_CMD_LEAVE_PROGMODE	0x02
+#define XPRG_CMD_ERASE			0x03
+#define XPRG_CMD_WRITE_MEM		0x04
+#define XPRG_CMD_READ_MEM		0x05
+#define XPRG_CMD_SET_PARAM		0x07
+#define XPRG_MEM_TYPE_APPL		0x01
+#define XPRG_MEM_TYPE_FUSE		0x04
+#define XPRG_MEM_WRITE_WRITE	0x02
+#define XPRG_ERASE_CHIP			0x01
+#define XPRG_ERASE_CONFIG		0x09
+#define XPRG_PARAM_NVMCMD_ADDR	0x03
+#define XPRG_PARAM_NVMCSR_ADDR	0x04
+#define XPRG_ERR_OK				0x00
+
+// The TPI data space
+#define A_CONFIG				0x3f40
+#define A_SIG					0x3fc0
+#define A_FLASH					0x4000
+
+static const struct { const char *name; uint8_t sig[3]; int flash; } parts[] =
+{
+	{ "t4",		{ 0x1e, 0x8f, 0x0a },  512 },
+	{ "t5",		{ 0x1e, 0x8f, 0x09 },  512 },
+	{ "t9",		{ 0x1e, 0x90, 0x08 }, 1024 },
+	{ "t10",	{ 0x1e, 0x90, 0x03 }, 1024 },
+};
+
+static int fd;
+static int timeout_ms = SYNC_MS;
+static uint8_t v2_seq;
+
+static int get(uint8_t *buf, int n);
+static void put(const uint8_t *buf, int n);
+static int v2_command(const uint8_t *body, int n, uint8_t *answer, int max);
+static int sign_on(void);
+static int get_parameter(uint8_t id);
+static int xprog(const uint8_t *body, int n, uint8_t *answer, int max);
+static int xprog_erase(uint8_t type, uint32_t addr);
+static int xprog_write(uint8_t memtype, uint32_t addr, const uint8_t *data, int n);
+static int xprog_read(uint8_t memtype, uint32_t addr, uint8_t *data, int n);
+static void usage(const char *prog);
+
+int main(int argc, char **argv)
+{
+	const char *port = NULL;
+	const char *name = "t10";
+	long baud = 115200;
+	int cfg = 0xfe;
+	int part = -1;
+	int opt;
+	uint8_t a[READ_BLOCK + 8];
+
+	while ( (opt = getopt(argc, argv, "b:p:f:P:")) != -1 )
+	{
+		switch ( opt )
+		{
+		case 'b':	baud = atol(optarg);				break;
+		case 'p':	name = optarg;						break;
+		case 'f':	cfg = (int)strtol(optarg, NULL, 0);	break;
+		case 'P':	port = optarg;						break;
+		default:	usage(argv[0]);
+		}
+	}
+
+	for ( unsigned i = 0; i < sizeof(parts) / sizeof(parts[0]); i++ )
+	{
+		if ( strcmp(name, parts[i].name) == 0 )
+			part = (int)i;
+	}
+
+	if ( port == NULL || optind != argc - 1 || part < 0 )
+		usage(argv[0]);
+
+	int flash = parts[part].flash;
+	uint8_t *image = (uint8_t *)malloc(flash);
+	memset(image, 0xff, flash);
+
+	FILE *f = fopen(argv[optind], "rb");
+	if ( f == NULL )
+	{
+		perror(argv[optind]);
+		return 2;
+	}
+	int size = (int)fread(image, 1, flash, f);
+	fclose(f);
+
+	fd = open_port(port, baud, O_RDWR);
+	if ( fd < 0 )
+	{
+		perror(port);
+		return 2;
+	}
+
+	if ( !sign_on() )
+	{
+		fprintf(stderr, "tpi-session: the programmer doesn't answer\n");
+		return 2;
+	}
+	timeout_ms = TIMEOUT_MS;
+
+	static const uint8_t params[] = { PARAM_HW_VER, PARAM_SW_MAJOR, PARAM_SW_MINOR, PARAM_VTARGET, PARAM_SCK_DURATION };
+	for ( unsigned i = 0; i < sizeof(params); i++ )
+	{
+		if ( get_parameter(params[i]) < 0 )
+		{
+			fprintf(stderr, "tpi-session: parameter 0x%02x can't be read\n", params[i]);
+			return 1;
+		}
+	}
+
+	static const uint8_t setmode[] = { CMD_XPROG_SETMODE, XPRG_MODE_TPI };
+	static const uint8_t enter[] = { CMD_XPROG, XPRG_CMD_ENTER_PROGMODE };
+	static const uint8_t nvmcmd[] = { CMD_XPROG, XPRG_CMD_SET_PARAM, XPRG_PARAM_NVMCMD_ADDR, 0x33 };
+	static const uint8_t nvmcsr[] = { CMD_XPROG, XPRG_CMD_SET_PARAM, XPRG_PARAM_NVMCSR_ADDR, 0x32 };
+	static const uint8_t leave[] = { CMD_XPROG, XPRG_CMD_LEAVE_PROGMODE };
+
+	if ( v2_command(setmode, sizeof(setmode), a, sizeof(a)) != 2 || a[1] != STATUS_CMD_OK )
+	{
+		fprintf(stderr, "tpi-session: TPI mode not selected\n");
+		return 1;
+	}
+
+	if ( xprog(enter, sizeof(enter), a, sizeof(a)) < 0 )
+	{
+		fprintf(stderr, "tpi-session: can't enter programming mode\n");
+		return 1;
+	}
+
+	int errors = 0;
+
+	if ( xprog(nvmcmd, sizeof(nvmcmd), a, sizeof(a)) < 0 || xprog(nvmcsr, sizeof(nvmcsr), a, sizeof(a)) < 0 )
+	{
+		fprintf(stderr, "tpi-session: SET_PARAM failed\n");
+		errors++;
+	}
+
+	// avrdude reads the signature a byte at a time
+	for ( int i = 0; i < 3; i++ )
+	{
+		if ( xprog_read(XPRG_MEM_TYPE_APPL, A_SIG + i, &a[i], 1) < 0 )
+			a[i] = 0;
+	}
+	if ( memcmp(a, parts[part].sig, 3) != 0 )
+	{
+		fprintf(stderr, "tpi-session: signature %02x %02x %02x, expected %02x %02x %02x\n", a[0], a[1], a[2],
+				parts[part].sig[0], parts[part].sig[1], parts[part].sig[2]);
+		errors++;
+	}
+
+	if ( xprog_erase(XPRG_ERASE_CHIP, A_FLASH) < 0 )
+	{
+		fprintf(stderr, "tpi-session: chip erase failed\n");
+		errors++;
+	}
+
+	for ( int addr = 0; addr < size; addr += PAGE )
+	{
+		if ( xprog_write(XPRG_MEM_TYPE_APPL, A_FLASH + addr, &image[addr], PAGE) < 0 )
+		{
+			fprintf(stderr, "tpi-session: write failed at 0x%04x\n", addr);
+			errors++;
+			break;
+		}
+	}
+
+	int ndiff = 0;
+
+	for ( int addr = 0; addr < flash; addr += READ_BLOCK )
+	{
+		int n = (flash - addr < READ_BLOCK) ? flash - addr : READ_BLOCK;
+
+		if ( xprog_read(XPRG_MEM_TYPE_APPL, A_FLASH + addr, a, n) < 0 )
+		{
+			fprintf(stderr, "tpi-session: read failed at 0x%04x\n", addr);
+			errors++;
+			break;
+		}
+
+		for ( int i = 0; i < n; i++ )
+		{
+			if ( a[i] != image[addr + i] && ndiff++ < 10 )
+				printf("0x%04x: 0x%02x, expected 0x%02x\n", addr + i, a[i], image[addr + i]);
+		}
+	}
+
+	// avrdude erases the configuration section before it writes the byte, padded to a word
+	uint8_t word[2] = { (uint8_t)cfg, 0xff };
+
+	if ( xprog_erase(XPRG_ERASE_CONFIG, A_CONFIG) < 0
+		|| xprog_write(XPRG_MEM_TYPE_FUSE, A_CONFIG, word, 2) < 0
+		|| xprog_read(XPRG_MEM_TYPE_FUSE, A_CONFIG, a, 1) < 0 )
+	{
+		fprintf(stderr, "tpi-session: configuration byte not written\n");
+		errors++;
+	}
+	else if ( a[0] != (uint8_t)cfg )
+	{
+		printf("config: 0x%02x, expected 0x%02x\n", a[0], cfg);
+		ndiff++;
+	}
+
+	if ( xprog(leave, sizeof(leave), a, sizeof(a)) < 0 )
+	{
+		fprintf(stderr, "tpi-session: LEAVE_PROGMODE failed\n");
+		errors++;
+	}
+
+	fprintf(stderr, "tpi-session: %s, %d bytes written, %d differ\n", name, size, ndiff);
+	return (errors != 0 || ndiff != 0);
+}
+
+/* sign_on() - get in sync with the programmer. Returns 1 if it signs on as a programmer that avrdude
+ * uses the XPROG commands with.
+*/
+static int sign_on(void)
+{
+	static const uint8_t cmd[] = { CMD_SIGN_ON };
+	uint8_t a[64];
+
+	for ( int i = 0; i < SYNC_TRIES; i++ )
+	{
+		int len = v2_command(cmd, sizeof(cmd), a, sizeof(a) - 1);
+
+		if ( len >= 3 && a[1] == STATUS_CMD_OK && a[2] == len - 3 )
+		{
+			a[len] = '\0';
+			if ( strcmp((char *)&a[3], "AVRISP_MK2") == 0 || strcmp((char *)&a[3], "STK600") == 0 )
+				return 1;
+			fprintf(stderr, "tpi-session: the programmer signs on as %s; avrdude wouldn't use XPROG\n", &a[3]);
+			exit(1);
+		}
+		tcflush(fd, TCIOFLUSH);
+	}
+	return 0;
+}
+
+/* get_parameter() - returns the value, or -1 if the command failed
+*/
+static int get_parameter(uint8_t id)
+{
+	uint8_t cmd[2] = { CMD_GET_PARAMETER, id };
+	uint8_t a[8];
+
+	if ( v2_command(cmd, sizeof(cmd), a, sizeof(a)) != 3 || a[1] != STATUS_CMD_OK )
+		return -1;
+	return a[2];
+}
+
+/* xprog() - send an XPROG command. Returns the size of the answer (cmd, xcmd, status, data), or -1 if
+ * there was no answer or the status wasn't XPRG_ERR_OK.
+*/
+static int xprog(const uint8_t *body, int n, uint8_t *answer, int max)
+{
+	int len = v2_command(body, n, answer, max);
+
+	if ( len < 3 || answer[1] != body[1] || answer[2] != XPRG_ERR_OK )
+		return -1;
+	return len;
+}
+
+static int xprog_erase(uint8_t type, uint32_t addr)
+{
+	uint8_t cmd[7] = { CMD_XPROG, XPRG_CMD_ERASE, type,
+						(uint8_t)(addr >> 24), (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr };
+	uint8_t a[8];
+
+	return xprog(cmd, sizeof(cmd), a, sizeof(a));
+}
+
+static int xprog_write(uint8_t memtype, uint32_t addr, const uint8_t *data, int n)
+{
+	uint8_t cmd[10 + PAGE] = { CMD_XPROG, XPRG_CMD_WRITE_MEM, memtype, XPRG_MEM_WRITE_WRITE,
+						(uint8_t)(addr >> 24), (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr,
+						(uint8_t)(n >> 8), (uint8_t)n };
+	uint8_t a[8];
+
+	memcpy(&cmd[10], data, n);
+	return xprog(cmd, 10 + n, a, sizeof(a));
+}
+
+static int xprog_read(uint8_t memtype, uint32_t addr, uint8_t *data, int n)
+{
+	uint8_t cmd[9] = { CMD_XPROG, XPRG_CMD_READ_MEM, memtype,
+						(uint8_t)(addr >> 24), (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr,
+						(uint8_t)(n >> 8), (uint8_t)n };
+	uint8_t a[READ_BLOCK + 8];
+
+	if ( xprog(cmd, sizeof(cmd), a, sizeof(a)) != n + 3 )
+		return -1;
+	memcpy(data, &a[3], n);
+	return 0;
+}
+
+/* v2_command() - send an STK500v2 message and receive the answer's body
+ *
+ * Returns the size of the body, or -1 if there was no good answer.
+*/
+static int v2_command(const uint8_t *body, int n, uint8_t *answer, int max)
+{
+	uint8_t hdr[5] = { MESSAGE_START, ++v2_seq, (uint8_t)(n >> 8), (uint8_t)(n & 0xff), TOKEN };
+	uint8_t cksum = 0;
+
+	for ( int i = 0; i < 5; i++ )
+		cksum ^= hdr[i];
+	for ( int i = 0; i < n; i++ )
+		cksum ^= body[i];
+
+	put(hdr, 5);
+	put(body, n);
+	put(&cksum, 1);
+
+	if ( !get(hdr, 5) || hdr[0] != MESSAGE_START || hdr[1] != v2_seq || hdr[4] != TOKEN )
+		return -1;
+
+	int len = hdr[2] * 256 + hdr[3];
+	if ( len > max || !get(answer, len) || !get(&cksum, 1) )
+		return -1;
+
+	for ( int i = 0; i < 5; i++ )
+		cksum ^= hdr[i];
+	for ( int i = 0; i < len; i++ )
+		cksum ^= answer[i];
+
+	return ( cksum == 0 && answer[0] == body[0] ) ? len : -1;
+}
+
+/* get() - read n bytes from the port. Returns 0 on timeout.
+*/
+static int get(uint8_t *buf, int n)
+{
+	while ( n > 0 )
+	{
+		struct pollfd p = { fd, POLLIN, 0 };
+
+		if ( poll(&p, 1, timeout_ms) <= 0 )
+			return 0;
+
+		ssize_t r = read(fd, buf, n);
+		if ( r <= 0 )
+			return 0;
+		buf += r;
+		n -= (int)r;
+	}
+	return 1;
+}
+
+static void put(const uint8_t *buf, int n)
+{
+	while ( n > 0 )
+	{
+		ssize_t w = write(fd, buf, n);
+		if ( w <= 0 )
+			return;
+		buf += w;
+		n -= (int)w;
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-b baud] [-p t4|t5|t9|t10] [-f config] -P port image.bin\n", prog);
+	exit(2);
+}
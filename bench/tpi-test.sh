@@ -0,0 +1,88 @@
+#!/bin/sh
+# tpi-test.sh - a TPI programming session through the STK500v2 engine's XPROG commands
+#
+# Usage: tpi-test.sh [-p part] [-s bytes]
+#
+# Runs the host build of the firmware (host/joat-host) in the "AVR prog (v2)" mode with a simulated
+# ATtiny4/5/9/10 on the TPI pins (host/tpi-target.cpp), and lets tpi-session (tpi-session.cpp) carry out
+# the session that avrdude has with an AVRISP mkII for a TPI part: sign on, read the signature, chip erase,
+# write a random image of the given size (the whole flash by default), read the flash back and write the
+# configuration byte. avrdude itself isn't needed.
+#
+# Fails if the programmer doesn't sign on as a programmer that avrdude uses XPROG with, if anything that
+# was read back is wrong, or if the target saw a bad frame or a store while it was busy. Otherwise prints
+# the length of the session in simulated time in the format of simbench, e.g.
+#	tpi.t10.write-verify.s 1.6123
+# so that compare.sh can compare the result with a baseline.
+
+part=t10
+bytes=
+
+while getopts p:s: opt
+do
+	case $opt in
+	p)	part=$OPTARG ;;
+	s)	bytes=$OPTARG ;;
+	*)	sed -n 4p "$0" >&2; exit 1 ;;
+	esac
+done
+
+case $part in
+t4|t5)		flash=512 ;;
+t9|t10)		flash=1024 ;;
+*)			echo "tpi-test: unknown part $part" >&2; exit 1 ;;
+esac
+
+here=$(cd "$(dirname "$0")" && pwd)
+. "$here/host-pty.sh"
+
+# Menu keys: select "AVR prog (v2)" (see joat.h), accept the options, then OK at "Insert AVR"
+keys=.ccccccooo
+config=0xfe
+
+tmp=$(mktemp -d)
+trap 'kill $sim 2>/dev/null; rm -rf "$tmp"' EXIT
+
+make -s -C "$here/../host" > /dev/null 2>&1 || exit 1
+make -s -C "$here" tpi-session > /dev/null || exit 1
+
+head -c ${bytes:-$flash} /dev/urandom > "$tmp/image.bin"
+
+host_start "$here/../host/joat-host" -q -k $keys -X $part
+
+if ! "$here/tpi-session" -p $part -f $config -P "$pty" "$tmp/image.bin"
+then
+	cat "$tmp/sim.log" >&2
+	echo "tpi-test: the session failed" >&2
+	exit 1
+fi
+
+# The target reports the session when RESET is released
+n=0
+while ! grep -q '^tpi: .* session' "$tmp/sim.log" && [ $n -lt 50 ]
+do
+	sleep 0.1
+	n=$((n + 1))
+done
+kill $sim 2>/dev/null
+wait $sim 2>/dev/null
+
+# tpi: t10 session 1.612345 s, config fe, lock ff, flash 1024 written 1024 read, 512 word writes, 2 erases,
+#	7012 frames, 0 errors, 0 lost
+awk -v key="tpi.$part.write-verify" -v config=$config '
+	/^tpi: .* session/ {
+		found = 1
+		if ( "0x" $7 != config "," )
+			bad = bad " config " $7
+		if ( $(NF-3) != 0 || $(NF-1) != 0 )
+			bad = bad " " $(NF-3) " errors " $(NF-1) " lost"
+		t = $4
+	}
+	END {
+		if ( !found || bad != "" ) {
+			print "tpi-test: the target" (found ? bad : " reported no session") > "/dev/stderr"
+			exit 1
+		}
+		printf "%s.s %.4f\n", key, t
+	}
+' "$tmp/sim.log"
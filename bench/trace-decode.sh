@@ -0,0 +1,103 @@
+#!/bin/sh
+# trace-decode.sh - show an event trace dump (see trace.h) as a timeline
+#
+# Usage: trace-decode.sh [file]         decode a dump that was captured earlier
+#        trace-decode.sh -p port        ask the Joat on the serial port for a dump and decode it
+#
+# The event names come from the TR_* definitions in trace.h. For each event the timeline shows the
+# time since the first event and since the previous one (in microseconds), the name and the argument.
+# An event FOO_DONE also shows the time since the last FOO. At the end there is a summary per event:
+# how often it happened, the interval between occurrences and, for the _DONE events, the duration.
+
+here=$(cd "$(dirname "$0")" && pwd)
+names="$here/../trace.h"
+
+if [ "$1" = "-p" ]
+then
+	port=$2
+	stty -F "$port" 115200 raw -echo || exit 1
+	exec 3<"$port"
+	printf 'SYST:TRAC?\n' > "$port"
+	input=$(timeout 5 sed -n '/^# trace/,/^# end/p' <&3 | tr -d '\r')
+	exec 3<&-
+else
+	input=$(tr -d '\r' < "${1:-/dev/stdin}")
+fi
+
+echo "$input" | awk -v names="$names" '
+	function hex(s,    i, c, v) {
+		v = 0
+		s = tolower(s)
+		for ( i = 1; i <= length(s); i++ ) {
+			c = index("0123456789abcdef", substr(s, i, 1))
+			if ( c == 0 ) return -1
+			v = v * 16 + c - 1
+		}
+		return v
+	}
+
+	# Difference of two 32-bit tick counts in microseconds (16 ticks per us)
+	function us(t1, t0,    d) {
+		d = t1 - t0
+		if ( d < 0 ) d += 4294967296
+		return d / 16.0
+	}
+
+	function note(k, v) {
+		if ( !(k in n) ) { min[k] = v; max[k] = v }
+		if ( v < min[k] ) min[k] = v
+		if ( v > max[k] ) max[k] = v
+		sum[k] += v
+		n[k]++
+	}
+
+	BEGIN {
+		while ( (getline line < names) > 0 ) {
+			if ( split(line, f, /[ \t]+/) >= 3 && f[1] == "#define" && f[2] ~ /^TR_/ ) {
+				id = hex(substr(f[3], 3))
+				name[id] = substr(f[2], 4)
+				byname[name[id]] = id
+			}
+		}
+	}
+
+	/^# trace/ { print; next }
+	/^#/ { next }
+
+	NF == 3 {
+		id = hex($1); t = hex($2); arg = hex($3)
+		ev = (id in name) ? name[id] : sprintf("0x%02x", id)
+
+		if ( nev == 0 ) {
+			printf "%12s %10s  %-12s %s\n", "time/us", "delta/us", "event", "arg"
+			t0 = t
+		}
+		extra = ""
+
+		if ( id in last )
+			note("every " ev, us(t, last[id]))
+
+		if ( ev ~ /_DONE$/ ) {
+			base = substr(ev, 1, length(ev) - 5)
+			if ( (base in byname) && (byname[base] in last) ) {
+				d = us(t, last[byname[base]])
+				note("length " base, d)
+				extra = sprintf("  (%.1f us)", d)
+			}
+		}
+
+		printf "%12.1f %10.1f  %-12s %04x %6d%s\n", us(t, t0), (nev ? us(t, prev) : 0), ev, arg, arg, extra
+
+		last[id] = t
+		prev = t
+		nev++
+		next
+	}
+
+	END {
+		if ( nev == 0 ) { print "no events"; exit 1 }
+		printf "\n%-24s %6s %10s %10s %10s\n", "", "n", "min/us", "avg/us", "max/us"
+		for ( k in n )
+			printf "%-24s %6d %10.1f %10.1f %10.1f\n", k, n[k], min[k], sum[k] / n[k], max[k] | "sort"
+	}
+'
@@ -0,0 +1,301 @@
+/* bridge.cpp - USB to target UART bridge
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <Arduino.h>
+#include "joat.h"
+#include "timing.h"
+#include "uart.h"
+#include "bridge.h"
+#include "avr-programmer.h"
+#include "avr-isp.h"
+#include "trace.h"
+
+/* The bridge passes everything that arrives from the host to the target's UART and vice versa.
+ *
+ * The host side is USART0 (uart.cpp). The target side is a software UART that uses timer1, which runs
+ * freely as the timebase, so the bit timing is exact and doesn't depend on how long the handlers take:
+ *	- receive: the start bit's falling edge causes a pin change interrupt. The handler disables itself and
+ *	  sets compare A to the middle of the first data bit. The compare A handler samples each bit and
+ *	  moves the compare point on by one bit; after the stop bit it stores the byte and re-enables the
+ *	  pin change interrupt.
+ *	- transmit: the compare B handler outputs the next bit of the frame and moves the compare point on by one bit.
+ *	  At the end of a frame it takes the next byte from the buffer, so back-to-back bytes have no gaps.
+ * Receive and transmit are independent, so the target side is full duplex. Both sides are buffered;
+ * the main loop only moves bytes between the buffers and updates the display.
+ *
+ * Each side has to pass on what arrives at the nominal rate from the other side, so neither may be slower
+ * than the nominal rate. Rounding the bit time down makes the target side at most 0.3% fast (57762 baud
+ * for 57600). The host side uses uart_init_fast(), which rounds USART0's baud rate register the same way
+ * (58824 baud for 57600, 2.1% fast). So with both ends sending at exactly the nominal rate without a pause,
+ * nothing is lost in either direction; rx_overrun would count bytes from the target that found the buffer
+ * full. Measured on the host build with bench/bridge-bench.sh: see the README.
+*/
+
+#define brdata	joat_data.bridge_data
+
+// Baud rates for the target side, selected with the CHANGE button
+static const uint16_t PROGMEM br_bauds[] = { 9600, 19200, 38400, 57600 };
+#define BR_NBAUDS	(sizeof(br_bauds)/sizeof(br_bauds[0]))
+
+static uint16_t select_baud(void);
+static void br_init(uint16_t baud);
+static void br_tx_start(void);
+static void show_rates(uint16_t rx, uint16_t tx, uint16_t errors);
+
+/* ISR(PCINT0_vect) - start bit from the target
+ *
+ * Only PIN_BR_RX is enabled in PCMSK0, so a low level here is the falling edge of a start bit.
+*/
+ISR(PCINT0_vect)
+{
+	uint16_t t = TCNT1;
+
+	if ( !PIN_BR_RX::read() )
+	{
+		PCMSK0 &= ~PIN_BR_RX::mask;
+		OCR1A = t + brdata.bit_ticks + brdata.bit_ticks / 2 - BR_RX_LATENCY;
+		TIFR1 = _BV(OCF1A);
+		TIMSK1 |= _BV(OCIE1A);
+		brdata.rx_nbits = 0;
+		brdata.rx_byte = 0;
+		trace(TR_BR_START, t);
+	}
+}
+
+/* ISR(TIMER1_COMPA_vect) - sample a bit from the target
+*/
+ISR(TIMER1_COMPA_vect)
+{
+	uint8_t bit = PIN_BR_RX::read();
+
+	if ( brdata.rx_nbits < 8 )
+	{
+		brdata.rx_byte = (brdata.rx_byte >> 1) | (bit ? 0x80 : 0x00);
+		brdata.rx_nbits++;
+		OCR1A += brdata.bit_ticks;
+		return;
+	}
+
+	// Stop bit
+	trace(TR_BR_RXBYTE, brdata.rx_byte | (bit ? 0 : 0x100));
+	if ( bit )
+	{
+		uint8_t h = (brdata.rx_head + 1) & BR_RXBUF_MASK;
+
+		if ( h != brdata.rx_tail )
+		{
+			brdata.rxbuf[brdata.rx_head] = brdata.rx_byte;
+			brdata.rx_head = h;
+			brdata.rx_count++;
+		}
+		else
+		{
+			brdata.rx_overrun++;
+		}
+	}
+	else
+	{
+		brdata.rx_framing++;
+	}
+
+	// Wait for the next start bit
+	TIMSK1 &= ~_BV(OCIE1A);
+	PCIFR = _BV(PCIF0);
+	PCMSK0 |= PIN_BR_RX::mask;
+}
+
+/* ISR(TIMER1_COMPB_vect) - send the next bit to the target
+*/
+ISR(TIMER1_COMPB_vect)
+{
+	uint16_t s = brdata.tx_shift;
+
+	if ( s == 0 )
+	{
+		// End of the frame (the stop bit has been sent). Start the next one, if any.
+		uint8_t t = brdata.tx_tail;
+
+		if ( t == brdata.tx_head )
+		{
+			TIMSK1 &= ~_BV(OCIE1B);
+			brdata.tx_busy = 0;
+			return;
+		}
+
+		s = ((uint16_t)brdata.txbuf[t] << 1) | 0x200;		// Start bit (0), data, stop bit (1)
+		brdata.tx_tail = (t + 1) & BR_TXBUF_MASK;
+		brdata.tx_count++;
+	}
+
+	PIN_BR_TX::set(s & 0x01);
+
+	brdata.tx_shift = s >> 1;
+	OCR1B += brdata.bit_ticks;
+}
+
+/* uart_bridge() - the UART bridge mode
+*/
+void uart_bridge(void)
+{
+	uint16_t baud = select_baud();
+	uint16_t last_rx = 0;
+	uint16_t last_tx = 0;
+	uint64_t t0;
+
+	br_init(baud);
+	uart_init_fast(baud);
+
+	t0 = read_ticks();
+
+	for (;;)
+	{
+		// Host to target
+		while ( uart_available() > 0 && ((brdata.tx_head + 1) & BR_TXBUF_MASK) != brdata.tx_tail )
+		{
+			brdata.txbuf[brdata.tx_head] = uart_getc();
+			brdata.tx_head = (brdata.tx_head + 1) & BR_TXBUF_MASK;
+		}
+
+		if ( !brdata.tx_busy && brdata.tx_head != brdata.tx_tail )
+			br_tx_start();
+
+		// Target to host, without waiting for the USART: if the target sends faster than the host side
+		// can pass on, the receive buffer overruns, but the loop keeps going round
+		while ( brdata.rx_tail != brdata.rx_head && uart_tx_space() > 0 )
+		{
+			uart_putc(brdata.rxbuf[brdata.rx_tail]);
+			brdata.rx_tail = (brdata.rx_tail + 1) & BR_RXBUF_MASK;
+		}
+
+		// Once per second, show the number of bytes passed in each direction and the number of lost bytes
+		if ( (read_ticks() - t0) >= MILLIS_TO_TICKS(1000) )
+		{
+			uint16_t rx, tx, errors;
+
+			t0 += MILLIS_TO_TICKS(1000);
+
+			cli();
+			rx = brdata.rx_count;
+			tx = brdata.tx_count;
+			errors = brdata.rx_overrun + brdata.rx_framing + uart_rx_overrun;
+			sei();
+
+			show_rates(rx - last_rx, tx - last_tx, errors);
+			last_rx = rx;
+			last_tx = tx;
+		}
+	}
+}
+
+/* select_baud() - select the baud rate
+*/
+static uint16_t select_baud(void)
+{
+	uint8_t i = BR_NBAUDS - 1;
+	uint8_t update = 1;
+	uint8_t b;
+
+	do
+	{
+		if ( update )
+		{
+			lcd.setCursor(0, 1);
+			fill_spaces(16 - lcd.print(pgm_read_word(&br_bauds[i])));
+			update = 0;
+		}
+
+		b = button();
+
+		if ( b == btn_change )
+		{
+			i++;
+			if ( i >= BR_NBAUDS )
+				i = 0;
+			update = 1;
+		}
+	} while ( b != btn_ok );
+
+	lcd.setCursor(0, 1);
+	lcd.print(pgm_read_word(&br_bauds[i]));
+	lcd.print(F(" baud"));
+	return pgm_read_word(&br_bauds[i]);
+}
+
+/* br_init() - set up the pins and interrupts for the target side
+*/
+static void br_init(uint16_t baud)
+{
+	memset(&brdata, 0, sizeof(brdata));
+	brdata.bit_ticks = (uint16_t)(HZ / baud);		// Rounded down, so never slower than the host
+
+	// Power the target and let it run
+	PIN_RESET::input();
+	PIN_SCK::input();
+	PIN_VCC::output();
+	vcc(1);
+
+	// Transmit line idles high
+	PIN_BR_TX::high();
+	PIN_BR_TX::output();
+	PIN_BR_RX::input_pullup();
+
+	// Start bit detection
+	PCMSK0 = PIN_BR_RX::mask;
+	PCIFR = _BV(PCIF0);
+	PCICR |= _BV(PCIE0);
+}
+
+/* br_tx_start() - start the transmitter
+ *
+ * The first compare comes soon after; the handler loads the first byte from the buffer.
+*/
+static void br_tx_start(void)
+{
+	cli();
+	brdata.tx_busy = 1;
+	brdata.tx_shift = 0;
+	OCR1B = TCNT1 + 100;
+	TIFR1 = _BV(OCF1B);
+	TIMSK1 |= _BV(OCIE1B);
+	sei();
+}
+
+/* show_rates() - show the bytes per second in each direction and the total number of lost bytes
+ *
+ * Example: "<5760 >5760 E0" (from the target, to the target, errors)
+ * The spaces are left out when there are 1000 errors or more, so that the line fits: "<5760>5760E1169"
+*/
+static void show_rates(uint16_t rx, uint16_t tx, uint16_t errors)
+{
+	uint8_t gap = (errors < 1000);
+	uint8_t np;
+
+	lcd.setCursor(0, 1);
+	np = lcd.print('<');
+	np += lcd.print(rx);
+	if ( gap )
+		np += lcd.print(' ');
+	np += lcd.print('>');
+	np += lcd.print(tx);
+	if ( gap )
+		np += lcd.print(' ');
+	np += lcd.print('E');
+	np += lcd.print(errors);
+	fill_spaces(16 - np);
+}
@@ -0,0 +1,69 @@
+/* bridge.h - USB to target UART bridge
+ *
+ * (c) David Haworth
+ *
+ * This file is part of Joat
+ *
+ * Joat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Joat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Joat is written for an Arduino Nano
+*/
+#ifndef BRIDGE_H
+#define BRIDGE_H	1
+
+#include <Arduino.h>
+#include "joat.h"
+#include "iopin.h"
+
+// Pin selection. The target's UART is connected to the ISP pins, so a target that has just been
+// programmed can be left in the socket. Vcc is PIN_VCC (avr-programmer.h); RESET is released.
+typedef iopin<12> PIN_BR_RX;		// MISO - from the target's TXD
+typedef iopin<11> PIN_BR_TX;		// MOSI - to the target's RXD
+
+// PIN_BR_RX is PCINT4, so it's bit 4 in pin change group 0 (PCMSK0), the same as its bit in PORTB
+static_assert(PIN_BR_RX::number >= 8 && PIN_BR_RX::number <= 13, "PIN_BR_RX must be on PORTB (PCINT0..5)");
+
+// Ring buffer sizes for the target side. Must be powers of 2, no larger than 256.
+// The host side uses the buffers in uart.cpp.
+#define BR_RXBUF_SIZE	64
+#define BR_TXBUF_SIZE	64
+#define BR_RXBUF_MASK	(BR_RXBUF_SIZE-1)
+#define BR_TXBUF_MASK	(BR_TXBUF_SIZE-1)
+
+// Ticks from the start bit edge to the first sample point is 1.5 bits less this amount,
+// to allow for the time between the edge and reading TCNT1 in the pin change handler.
+#define BR_RX_LATENCY	40
+
+typedef struct bridge_data_s
+{
+	uint8_t rxbuf[BR_RXBUF_SIZE];		// Received from the target
+	uint8_t txbuf[BR_TXBUF_SIZE];		// Waiting to be sent to the target
+	volatile uint8_t rx_head;
+	volatile uint8_t rx_tail;
+	volatile uint8_t tx_head;
+	volatile uint8_t tx_tail;
+	volatile uint8_t rx_byte;			// Receive shift register
+	volatile uint8_t rx_nbits;			// Data bits received so far
+	volatile uint16_t tx_shift;			// Transmit shift register: start, 8 data, stop (LSB first)
+	volatile uint8_t tx_busy;			// The transmitter is running
+	volatile uint16_t rx_count;			// Bytes received from the target
+	volatile uint16_t tx_count;			// Bytes sent to the target
+	volatile uint16_t rx_overrun;		// Bytes from the target dropped because the buffer was full
+	volatile uint16_t rx_framing;		// Bytes from the target with a bad stop bit
+	uint16_t bit_ticks;					// Length of a bit in timer1 ticks
+} bridge_data_t;
+
+extern void uart_bridge(void) __attribute__((noreturn));
+
+#endif
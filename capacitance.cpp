@@ -36,54 +36,70 @@
 #include "joat.h"
 #include "timing.h"
 #include "capacitance.h"
+#include "trace.h"
+#include "telemetry.h"
+#include "scpi.h"
 
 #define cdata	joat_data.cap_data
 
 static void cap_init(void);
 static void display_capacitance(void);
 
+// Units to farads, for the telemetry
+static const float cap_scale[3] = { 1.0e-12, 1.0e-9, 1.0e-6 };
+
 void capacitance_meter(void)
 {
 	cap_init();
+	telem_init();
 
 	for (;;)
 	{
-		pinMode(cap_in, INPUT);
-		digitalWrite(cap_out, HIGH);
-		int val = analogRead(cap_in);
-		digitalWrite(cap_out, LOW);
+		uint8_t method;
+		int32_t raw;
+
+		cap_in::input();
+		cap_out::high();
+		trace(TR_ADC, cap_in::number);
+		int val = analogRead(cap_in::number);
+		cap_out::low();
+		trace(TR_ADC_DONE, val);
 
 		if (val < 750)
 		{
-			pinMode(cap_in, OUTPUT);
+			cap_in::output();
 
 			cdata.ms = val;
 			cdata.unit = cap_pF;
 			cdata.capacitance = (double)val * cap_in_to_gnd / (double)(cap_max_adc - val);
+			method = 0;
+			raw = val;
 		}
 		else
 		{
-			pinMode(cap_in, OUTPUT);
+			cap_in::output();
 			tick_delay(MICROS_TO_TICKS(1000));
-			pinMode(cap_out, INPUT_PULLUP);
+			cap_out::input_pullup();
 			uint32_t u1 = (uint32_t)read_ticks();
 			uint32_t t;
 			int digVal;
 
 			do {
-				digVal = digitalRead(cap_out);
+				digVal = cap_out::read();
 				t = (uint32_t)read_ticks() - u1;
 			} while ( (digVal < 1) && (t < 400000L) );
 
-			pinMode(cap_out, INPUT);
-			val = analogRead(cap_out);
-			digitalWrite(cap_in, HIGH);
+			cap_out::input();
+			trace(TR_ADC, cap_out::number);
+			val = analogRead(cap_out::number);
+			trace(TR_ADC_DONE, val);
+			cap_in::high();
 
 			uint32_t dischargeTime = (t / 1000) * 5;
 			tick_delay(dischargeTime);
-			pinMode(cap_out, OUTPUT);
-			digitalWrite(cap_out, LOW);
-			digitalWrite(cap_in, LOW);
+			cap_out::output();
+			cap_out::low();
+			cap_in::low();
 
 			cdata.ms = val;
 			cdata.capacitance = -(double)(ticks_to_micros(t))/cap_R_pullup/log(1.0 - (double)val/(double)cap_max_adc);
@@ -102,40 +118,48 @@ void capacitance_meter(void)
 			{
 				cdata.unit = cap_nF;
 			}
+			method = 1;
+			raw = t;
 		}
 
+		float c = cdata.capacitance * cap_scale[cdata.unit];
+		telem_record(m_cap, method, raw, c);
 		display_capacitance();
+		scpi_result(c);
+		scpi_done();
 
-		tick_delay(MILLIS_TO_TICKS(500));
+		scpi_wait(MILLIS_TO_TICKS(500));
 	}
 }
 
 static void cap_init(void)
 {
-	pinMode(cap_out, OUTPUT);
-	pinMode(cap_in, OUTPUT);
+	cap_out::output();
+	cap_in::output();
 }
 
 static void display_capacitance(void)
 {
 	uint8_t np = 0;
 
-	lcd->setCursor(0,1);
+	trace(TR_LCD, m_cap);
+	lcd.setCursor(0,1);
 
 	if ( cdata.capacitance < 10.0 )
-		np += lcd->print(cdata.capacitance, 3);
+		np += lcd.print(cdata.capacitance, 3);
 	else
-		np += lcd->print(cdata.capacitance, 2);
+		np += lcd.print(cdata.capacitance, 2);
 
 	if ( cdata.unit == cap_pF )
-		np += lcd->print(F("pF "));
+		np += lcd.print(F("pF "));
 	else if ( cdata.unit == cap_nF )
-		np += lcd->print(F("nF "));
+		np += lcd.print(F("nF "));
 	else
-		np += lcd->print(F("uF "));
+		np += lcd.print(F("uF "));
 
-	np += lcd->print(cdata.ms);
-	np += lcd->print(F("ms"));
+	np += lcd.print(cdata.ms);
+	np += lcd.print(F("ms"));
 
 	fill_spaces(16-np);
+	trace(TR_LCD_DONE, 0);
 }
@@ -24,11 +24,12 @@
 
 #include <Arduino.h>
 #include "joat.h"
+#include "iopin.h"
 
 // Pin selection for capacitance measurement.
 // For polarised capacitors, the + terminal goes to cap_out
-#define cap_out		A2
-#define cap_in		A0
+typedef iopin<A2> cap_out;
+typedef iopin<A0> cap_in;
 
 // Maximum ADC value. Might be different on some boards.
 #define cap_max_adc				1023
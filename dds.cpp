@@ -0,0 +1,82 @@
+/* dds.cpp - the signal generator's DDS interrupt handler
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * The host build uses host/dds-host.cpp instead of this file.
+*/
+#include <Arduino.h>
+#include "joat.h"
+#include "generator.h"
+
+/* ISR(TIMER2_COMPA_vect) - one DDS sample: dds_phase += dds_incr, then bit 31 of dds_phase to the pin
+ *
+ * Written in assembler so that it takes the same time at every sample and uses only two registers.
+ * The compiler's version saves eight registers and takes about 90 cycles. Cycles:
+ *	interrupt response and the jmp in the vector		 7
+ *	save r24, SREG, r25									 7
+ *	4 x (lds, lds, add/adc, sts)						28
+ *	bit 31 to the pin: sbrc/sbi/sbrs/cbi				 5 (either way)
+ *	restore												 7
+ *	reti												 4
+ *	total												58 = GEN_DDS_CYCLES
+ * The pin rises 45 cycles and falls 47 cycles after the compare match, plus up to 3 cycles for the
+ * instruction that the main line was executing, or longer if interrupts are disabled.
+ * bench/simbench measures the handler on the real image.
+*/
+ISR(TIMER2_COMPA_vect, ISR_NAKED)
+{
+	asm volatile(
+		"push	r24"				"\n\t"
+		"in		r24, __SREG__"		"\n\t"
+		"push	r24"				"\n\t"
+		"push	r25"				"\n\t"
+
+		"lds	r24, %[ph]"			"\n\t"
+		"lds	r25, %[inc]"		"\n\t"
+		"add	r24, r25"			"\n\t"
+		"sts	%[ph], r24"			"\n\t"
+		"lds	r24, %[ph]+1"		"\n\t"
+		"lds	r25, %[inc]+1"		"\n\t"
+		"adc	r24, r25"			"\n\t"
+		"sts	%[ph]+1, r24"		"\n\t"
+		"lds	r24, %[ph]+2"		"\n\t"
+		"lds	r25, %[inc]+2"		"\n\t"
+		"adc	r24, r25"			"\n\t"
+		"sts	%[ph]+2, r24"		"\n\t"
+		"lds	r24, %[ph]+3"		"\n\t"
+		"lds	r25, %[inc]+3"		"\n\t"
+		"adc	r24, r25"			"\n\t"
+		"sts	%[ph]+3, r24"		"\n\t"
+
+		"sbrc	r24, 7"				"\n\t"
+		"sbi	%[port], %[bit]"	"\n\t"
+		"sbrs	r24, 7"				"\n\t"
+		"cbi	%[port], %[bit]"	"\n\t"
+
+		"pop	r25"				"\n\t"
+		"pop	r24"				"\n\t"
+		"out	__SREG__, r24"		"\n\t"
+		"pop	r24"				"\n\t"
+		"reti"						"\n\t"
+		:
+		:	[ph] "i" (&dds_phase),
+			[inc] "i" (&dds_incr),
+			[port] "I" (_SFR_IO_ADDR(PORTB)),
+			[bit] "I" (PIN_GEN::bit)
+	);
+}
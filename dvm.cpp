@@ -23,58 +23,85 @@
 #include "joat.h"
 #include "timing.h"
 #include "dvm.h"
+#include "trace.h"
+#include "telemetry.h"
+#include "scpi.h"
 
 static void dvm_init(void);
+static void dvm_input(uint8_t pin, uint8_t x, uint8_t y);
 static void display_voltage(uint8_t pin, uint8_t x, uint8_t y);
 
 void dvm(void)
 {
 	dvm_init();
+	telem_init();
 
 	for (;;)
 	{
-		(void)analogRead(dvm_1);	//	Allow input multiplexer to settle
-		tick_delay(MILLIS_TO_TICKS(10));
-		display_voltage(dvm_1, 0, 0);
+		dvm_input(dvm_1::number, 0, 0);
+		dvm_input(dvm_2::number, 11, 0);
+		dvm_input(dvm_3::number, 0, 1);
+		dvm_input(dvm_4::number, 11, 1);
+		scpi_done();
 
-		(void)analogRead(dvm_2);	//	Allow input multiplexer to settle
-		tick_delay(MILLIS_TO_TICKS(10));
-		display_voltage(dvm_2, 11, 0);
-
-		(void)analogRead(dvm_3);	//	Allow input multiplexer to settle
-		tick_delay(MILLIS_TO_TICKS(10));
-		display_voltage(dvm_3, 0, 1);
-
-		(void)analogRead(dvm_4);	//	Allow input multiplexer to settle
-		tick_delay(MILLIS_TO_TICKS(10));
-		display_voltage(dvm_4, 11, 1);
-
-		tick_delay(MILLIS_TO_TICKS(450));
+		scpi_wait(MILLIS_TO_TICKS(450));
 	}
 }
 
 static void dvm_init(void)
 {
 	analogReference(DEFAULT);
-	pinMode(dvm_1, INPUT);
-	pinMode(dvm_2, INPUT);
-	pinMode(dvm_3, INPUT);
-	pinMode(dvm_4, INPUT);
-	lcd->setCursor(0, 1);
+	dvm_1::input();
+	dvm_2::input();
+	dvm_3::input();
+	dvm_4::input();
+	lcd.setCursor(0, 1);
 	fill_spaces(16);
 	tick_delay(MILLIS_TO_TICKS(1000));
-	lcd->setCursor(0, 0);
+	lcd.setCursor(0, 0);
 	fill_spaces(16);
 }
 
+/* dvm_input() - measure and display an input, if it is selected (SENSe:DVM:CHANnels)
+*/
+static void dvm_input(uint8_t pin, uint8_t x, uint8_t y)
+{
+	if ( (scpi_config.dvm_channels & (1 << (pin - dvm_1::number))) == 0 )
+	{
+		lcd.setCursor(x, y);
+		fill_spaces(5);
+		return;
+	}
+
+	(void)analogRead(pin);	//	Allow input multiplexer to settle
+	tick_delay(MILLIS_TO_TICKS(10));
+	display_voltage(pin, x, y);
+}
+
+/* display_voltage() - measure an input and display the voltage
+ *
+ * The result is the average of scpi_config.average readings (SENSe:AVERage:COUNt). Each takes about 110 us.
+*/
 static void display_voltage(uint8_t pin, uint8_t x, uint8_t y)
 {
 	double scale = 5.0/1024.0;
+	uint8_t n = scpi_config.average;
+	uint16_t sum = 0;
+
+	trace(TR_ADC, pin);
+	for ( uint8_t i = 0; i < n; i++ )
+		sum += analogRead(pin);
+	int val = (sum + n/2) / n;
+	trace(TR_ADC_DONE, val);
+
+	double v = ((double)sum) * scale / n;
 
-	double v = ((double)analogRead(pin)) * scale;
-	
+	telem_record(m_dvm, pin - dvm_1::number + 1, val, v);
+	scpi_result(v);
 
-	lcd->setCursor(x, y);
-	lcd->print(v, 2);
-	lcd->print(F("v"));
+	trace(TR_LCD, m_dvm);
+	lcd.setCursor(x, y);
+	lcd.print(v, 2);
+	lcd.print(F("v"));
+	trace(TR_LCD_DONE, 0);
 }
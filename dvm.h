@@ -24,12 +24,13 @@
 
 #include <Arduino.h>
 #include "joat.h"
+#include "iopin.h"
 
 // Pin selection for inductance measurement.
-#define dvm_1		A0
-#define dvm_2		A1
-#define dvm_3		A2
-#define dvm_4		A3
+typedef iopin<A0> dvm_1;
+typedef iopin<A1> dvm_2;
+typedef iopin<A2> dvm_3;
+typedef iopin<A3> dvm_4;
 
 // Note: there's no dvm_data_t; voltage measurement uses no global data
 
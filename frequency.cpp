@@ -21,13 +21,15 @@
 #include "joat.h"
 #include "timing.h"
 #include "frequency.h"
+#include "iopin.h"
+#include "trace.h"
+#include "telemetry.h"
+#include "scpi.h"
 
-#define ICP1	8	// Input capture 1 is on pin 8/PB0
+typedef iopin<8> ICP1;	// Input capture 1 is on pin 8/PB0
 
 #define fdata	joat_data.freq_data
 
-static void display_freq(double f);
-
 /* ISR(TIMER1_OVF_vect) - interrupt handler for the timer overflow
  *
  * Increment a counter
@@ -35,6 +37,7 @@ static void display_freq(double f);
 ISR(TIMER1_OVF_vect)
 {
 	fdata.n_oflo++;
+	trace(TR_FREQ_OVF, fdata.n_oflo);
 }
 
 /* ISR(TIMER1_CAPT_vect) - interrupt handler for the capture interrupt
@@ -46,9 +49,10 @@ ISR(TIMER1_CAPT_vect)
 	fdata.cap = ICR1;					// Read the time of the capture
 	fdata.n_oflo_cap = fdata.n_oflo;	// Upper part of the capture time
 	fdata.n_cap++;						// Count the captures
+	trace(TR_FREQ_CAPT, fdata.cap);
 }
 
-/* freq() - calculate the signal frequency
+/* frequency_meter() - calculate the signal frequency
  *
  * Using the difference between the capture time (from the ISR) and the last known capture time,
  * along with the number of overflows, the interval can be calculated.
@@ -56,74 +60,116 @@ ISR(TIMER1_CAPT_vect)
 */
 void frequency_meter(void)
 {
-	uint64_t t;
-	uint64_t t0;
-	uint32_t elapsed;
-	uint8_t nc, no;
-	uint16_t v;
+	uint8_t r;
 
 	freq_init();
-	t0 = read_ticks();
+	telem_init();
+	fdata.armed = 0;
 
 	for (;;)
 	{
-		t = read_ticks();
-		elapsed = t - t0;
-		t0 = t;
-
-		fdata.update_interval += elapsed;
-
-		cli();
-		nc = fdata.n_cap;
-		if ( nc > 0 )		// If there's been at least one capture, read and reset the interrupt handlers' data
+		// Start a new gate time when the last one has finished and a measurement is due
+		if ( scpi_ready(0, 0) && !fdata.armed )
 		{
-			v = fdata.cap;
-			no = fdata.n_oflo;
-			fdata.n_cap = 0;
-			fdata.n_oflo = 0;
+			fdata.armed = 1;
+			freq_restart();
 		}
-		sei();
 
-		if ( nc > 0 )		// If there's been at least one capture, accumulate the time and no of captures.
-		{
-			fdata.total_time += (uint32_t)v  - (uint32_t)fdata.last_cap + (uint32_t)no * 65536ul;
-			fdata.total_cap += nc;
-			fdata.last_cap = v;
+		r = freq_gate(scpi_config.gate_ticks);
 
-			// Once per second, calculate and display the frequency
-			if ( fdata.update_interval > MILLIS_TO_TICKS(1000) )
+		if ( r != FREQ_BUSY )
+		{
+			if ( fdata.armed )
 			{
-				double f = ((double)fdata.total_cap * 16000000.0) / (double)fdata.total_time;
+				// No pulse for a second longer than the gate time: assume 0.0 Hz
+				double f = (r == FREQ_DONE) ? freq_hz() : 0.0;
+				telem_record(m_freq, 0, (r == FREQ_DONE) ? fdata.total_time : 0, f);
 				display_freq(f);
-
-				fdata.total_cap = 0;
-				fdata.total_time = 0;
-				fdata.update_interval = 0;
+				scpi_result(f);
+				scpi_done();
+				fdata.armed = 0;
 			}
-		}
-		else if ( fdata.update_interval > MILLIS_TO_TICKS(2000) )
-		{
-			// More than 2 seconds without a pulse; assume 0.0 Hz
-			display_freq(0.0);
-			fdata.total_cap = 0;
-			fdata.total_time = 0;
-			fdata.update_interval = 0;
+			freq_restart();
 		}
 	}
 }
 
-static void display_freq(double f)
+/* freq_gate() - accumulate the captures since the last call; call it often
+ *
+ * Returns FREQ_DONE at the end of the gate time, when fdata.total_cap captures took fdata.total_time ticks,
+ * or FREQ_NONE when there hasn't been a capture for a second longer than the gate time. Otherwise FREQ_BUSY.
+ * After FREQ_DONE or FREQ_NONE the caller starts the next gate time with freq_restart().
+*/
+uint8_t freq_gate(uint32_t gate)
+{
+	uint32_t t;
+	uint8_t nc, no;
+	uint16_t v;
+
+	t = (uint32_t)read_ticks();
+	fdata.update_interval += t - fdata.last_ticks;
+	fdata.last_ticks = t;
+
+	cli();
+	nc = fdata.n_cap;
+	if ( nc > 0 )		// If there's been at least one capture, read and reset the interrupt handlers' data
+	{
+		v = fdata.cap;
+		no = fdata.n_oflo;
+		fdata.n_cap = 0;
+		fdata.n_oflo = 0;
+	}
+	sei();
+
+	if ( nc > 0 )		// If there's been at least one capture, accumulate the time and no of captures.
+	{
+		fdata.total_time += (uint32_t)v  - (uint32_t)fdata.last_cap + (uint32_t)no * 65536ul;
+		fdata.total_cap += nc;
+		fdata.last_cap = v;
+
+		// At the end of the gate time (1 second by default) the frequency can be calculated
+		if ( fdata.update_interval > gate )
+			return FREQ_DONE;
+	}
+	else if ( fdata.update_interval > gate + MILLIS_TO_TICKS(1000) )
+		return FREQ_NONE;
+
+	return FREQ_BUSY;
+}
+
+/* freq_restart() - start a new gate time
+*/
+void freq_restart(void)
+{
+	fdata.total_cap = 0;
+	fdata.total_time = 0;
+	fdata.update_interval = 0;
+}
+
+/* freq_hz() - the frequency at the end of a gate time
+*/
+double freq_hz(void)
+{
+	return ((double)fdata.total_cap * 16000000.0) / (double)fdata.total_time;
+}
+
+/* display_freq() - show the frequency on the bottom line
+*/
+void display_freq(double f)
 {
 	uint8_t np;
-	lcd->setCursor(0, 1);
-	np = lcd->print(f, ((f < 100.0) ? 3 : 2));
-	np += lcd->print(F("Hz"));
+	trace(TR_LCD, m_freq);
+	lcd.setCursor(0, 1);
+	np = lcd.print(f, ((f < 100.0) ? 3 : 2));
+	np += lcd.print(F("Hz"));
 	fill_spaces(16 - np);
+	trace(TR_LCD_DONE, 0);
 }
 
 void freq_init(void)
 {
-	pinMode(ICP1, INPUT);		// Set up the T1 input capture pin for frequency measurement
+	ICP1::input();				// Set up the T1 input capture pin for frequency measurement
 	TCCR1B |= 0x40;				// Input capture on leading edge
 	TIMSK1 |= 0x21;				// Enable input capture and overflow interrupts
+	fdata.last_ticks = (uint32_t)read_ticks();
 }
@@ -32,7 +32,8 @@ typedef struct frequency_data_s
 {
 	uint32_t update_interval;
 	uint32_t total_time;
-	uint16_t total_cap;
+	uint32_t total_cap;
+	uint32_t last_ticks;		// Time of the last freq_gate()
 	uint16_t last_cap;
 	uint16_t cap;
 	uint8_t n_oflo;
@@ -40,9 +41,19 @@ typedef struct frequency_data_s
 	uint8_t n_cap;
 	uint8_t n_discard;
 	uint8_t capacitor_no;
+	uint8_t armed;				// Frequency meter: a measurement is in progress (see scpi.h)
 } frequency_data_t;
 
+// freq_gate() return values
+#define FREQ_BUSY	0			// The gate time hasn't finished
+#define FREQ_DONE	1			// The gate time has finished; see freq_hz()
+#define FREQ_NONE	2			// No signal
+
 extern void frequency_meter(void) __attribute__((noreturn));
 extern void freq_init(void);
+extern uint8_t freq_gate(uint32_t gate);
+extern void freq_restart(void);
+extern double freq_hz(void);
+extern void display_freq(double f);
 
 #endif
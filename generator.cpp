@@ -0,0 +1,201 @@
+/* generator.cpp - signal generator on timer2
+ *
+ * (c) David Haworth
+ *
+ * This file is part of Joat
+ *
+ * Joat free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Joat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Joat is an Arduino sketch, written for an Arduino Nano
+*/
+#include <Arduino.h>
+#include "joat.h"
+#include "timing.h"
+#include "generator.h"
+#include "scpi.h"
+
+#define gdata	joat_data.gen_data
+
+#define GEN_NPRESCALE	7
+#define GEN_DEFAULT		5			// 1 kHz
+
+// The DDS state. The interrupt handler is in dds.cpp.
+volatile uint32_t dds_phase;
+volatile uint32_t dds_incr;
+
+// Frequencies that CHANGE steps through
+static const float PROGMEM gen_presets[] =
+{
+	1.0, 10.0, 50.0, 100.0, 440.0, 1000.0, 10000.0, 100000.0, 1000000.0, 4000000.0
+};
+
+#define GEN_NPRESETS	(sizeof(gen_presets) / sizeof(gen_presets[0]))
+
+// Timer2 prescaler for each clock select value (CS22..CS20) from 1 to 7
+static const uint16_t PROGMEM gen_prescale[GEN_NPRESCALE] = { 1, 8, 32, 64, 128, 256, 1024 };
+
+static void display_gen(void);
+
+/* generator() - the signal generator mode
+ *
+ * CHANGE steps through the preset frequencies and OK switches between the square wave and the DDS.
+ * The remote commands SOURce:FREQuency and SOURce:FUNCtion set any frequency. The display shows
+ * the frequency, the error of the frequency that timer2 actually produces and the edge jitter.
+*/
+void generator(void)
+{
+	uint8_t b;
+
+	gdata.preset = GEN_DEFAULT;
+	gdata.freq = -1.0;				// Start the generator in the first pass
+
+	for (;;)
+	{
+		if ( scpi_config.gen_freq != gdata.freq || scpi_config.gen_method != gdata.method )
+		{
+			gdata.freq = scpi_config.gen_freq;
+			gdata.method = scpi_config.gen_method;
+			gdata.actual = gen_start(gdata.freq, gdata.method);
+			display_gen();
+		}
+
+		scpi_poll();
+		b = button();
+
+		if ( b == btn_change )
+		{
+			gdata.preset++;
+			if ( gdata.preset >= GEN_NPRESETS )
+				gdata.preset = 0;
+			scpi_config.gen_freq = pgm_read_float(&gen_presets[gdata.preset]);
+		}
+		else if ( b == btn_ok )
+		{
+			scpi_config.gen_method = ( scpi_config.gen_method == GEN_DDS ) ? GEN_SQUARE : GEN_DDS;
+		}
+	}
+}
+
+/* gen_start() - start the output at the given frequency; returns the frequency that timer2 produces
+ *
+ * For the square wave, the prescaler and compare value that come closest are chosen. Below 30.5 Hz the
+ * square wave is as slow as timer2 can go; above GEN_DDS_RATE/2 the DDS is as fast as it can go.
+*/
+float gen_start(float f, uint8_t method)
+{
+	gen_stop();
+
+	if ( f < GEN_FREQ_MIN )
+		f = GEN_FREQ_MIN;
+	PIN_GEN::low();
+	PIN_GEN::output();
+
+	if ( method == GEN_DDS )
+	{
+		if ( f > GEN_DDS_RATE / 2 )
+			f = GEN_DDS_RATE / 2;
+
+		uint32_t incr = (uint32_t)(f * (4294967296.0 / GEN_DDS_RATE) + 0.5);
+
+		cli();
+		dds_phase = 0;
+		dds_incr = incr;
+		sei();
+
+		OCR2A = GEN_DDS_OCR;
+		TCNT2 = 0;
+		TIFR2 = _BV(OCF2A);
+		TIMSK2 = _BV(OCIE2A);
+		TCCR2B = _BV(CS21);			// Prescaler 8
+		return (float)incr * (float)(GEN_DDS_RATE / 4294967296.0);
+	}
+
+	uint8_t cs = GEN_NPRESCALE;
+	uint16_t top = 256;
+	float best = -1.0;
+
+	for ( uint8_t i = 0; i < GEN_NPRESCALE; i++ )
+	{
+		float n2 = 2.0 * (float)pgm_read_word(&gen_prescale[i]);
+		uint32_t t = (uint32_t)((float)HZ / (n2 * f) + 0.5);
+
+		if ( t < 1 )
+			t = 1;
+		if ( t > 256 )
+			continue;
+
+		float err = fabs((float)HZ / (n2 * (float)t) - f);
+		if ( best < 0.0 || err < best )
+		{
+			best = err;
+			cs = i + 1;
+			top = t;
+		}
+	}
+
+	OCR2A = top - 1;
+	TCNT2 = 0;
+	TCCR2A = _BV(COM2A0) | _BV(WGM21);		// Toggle OC2A on compare match, CTC
+	TCCR2B = cs;
+	return (float)HZ / (2.0 * (float)pgm_read_word(&gen_prescale[cs - 1]) * (float)top);
+}
+
+/* gen_stop() - stop timer2 and its interrupt, and leave the output low
+*/
+void gen_stop(void)
+{
+	TCCR2B = 0;
+	TIMSK2 = 0;
+	TCCR2A = _BV(WGM21);			// CTC, OC2A disconnected
+	PIN_GEN::low();
+}
+
+/* display_gen() - show the frequency, the method, the error and the jitter
+ *
+ *	1000.00Hz     SQ
+ *	e+0.0ppm j0us
+*/
+static void display_gen(void)
+{
+	uint8_t np;
+	float e = (gdata.actual - gdata.freq) / gdata.freq * 1.0e6;
+
+	lcd.setCursor(0, 0);
+	np = lcd.print(gdata.freq, (gdata.freq < 100.0) ? 3 : (gdata.freq < 1.0e6) ? 2 : 0);
+	np += lcd.print(F("Hz"));
+	fill_spaces(13 - np);
+	if ( gdata.method == GEN_DDS )
+		lcd.print(F("DDS"));
+	else
+		lcd.print(F(" SQ"));
+
+	lcd.setCursor(0, 1);
+	np = lcd.print('e');
+	if ( e >= 0.0 )
+		np += lcd.print('+');
+	if ( fabs(e) < 1000.0 )
+	{
+		np += lcd.print(e, 1);
+		np += lcd.print(F("ppm"));
+	}
+	else
+	{
+		np += lcd.print(e / 1.0e4, 2);
+		np += lcd.print('%');
+	}
+	np += lcd.print(F(" j"));
+	np += lcd.print((gdata.method == GEN_DDS) ? (uint16_t)(1000000ul / GEN_DDS_RATE) : 0);
+	np += lcd.print(F("us"));
+	fill_spaces(16 - np);
+}
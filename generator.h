@@ -0,0 +1,75 @@
+/* generator.h - signal generator on timer2
+ *
+ * (c) David Haworth
+ *
+ * This file is part of Joat
+ *
+ * Joat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Joat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Joat is written for an Arduino Nano
+*/
+#ifndef GENERATOR_H
+#define GENERATOR_H	1
+
+#include <Arduino.h>
+#include "joat.h"
+#include "timing.h"
+#include "iopin.h"
+
+/* Timer1 is the timebase, so the generator uses timer2. The output is OC2A (D11), which is also MOSI
+ * (J1.10). There are two methods:
+ *
+ *	GEN_SQUARE	timer2 in CTC mode toggles OC2A in hardware, so f = HZ / (2 * N * (OCR2A + 1)) for a prescaler
+ *				N of 1, 8, 32, 64, 128, 256 or 1024. 30.5 Hz to 8 MHz, in steps that get coarse at high
+ *				frequencies. No jitter beyond that of the crystal.
+ *	GEN_DDS		timer2 interrupts at GEN_DDS_RATE. The handler (dds.cpp) adds dds_incr to the 32-bit
+ *				phase accumulator dds_phase and copies its top bit to the pin, so f = dds_incr * GEN_DDS_RATE / 2^32:
+ *				any frequency up to GEN_DDS_RATE/2 in steps of 29 uHz. An edge can only happen at a sample,
+ *				so the edges jitter by up to one sample period, plus the interrupt latency.
+ *
+ * The handler takes GEN_DDS_CYCLES at every sample, so the highest possible rate is HZ / GEN_DDS_CYCLES
+ * (275 kHz), with nothing left for the main line. GEN_DDS_RATE leaves about half the processor for the
+ * display, the buttons and the timebase.
+*/
+typedef iopin<11> PIN_GEN;			// OC2A (PB3)
+
+#define GEN_SQUARE			0
+#define GEN_DDS				1
+
+#define GEN_DDS_PRESCALE	8
+#define GEN_DDS_OCR			15
+#define GEN_DDS_RATE		(HZ / GEN_DDS_PRESCALE / (GEN_DDS_OCR + 1))		// 125 kHz
+#define GEN_DDS_CYCLES		58		// TIMER2_COMPA_vect, from the interrupt to the end of the reti
+
+#define GEN_FREQ_MIN		0.01
+#define GEN_FREQ_MAX		8000000.0
+
+static_assert(GEN_DDS_CYCLES * 3 / 2 < GEN_DDS_PRESCALE * (GEN_DDS_OCR + 1), "the DDS interrupt would leave too little time for the main line");
+
+typedef struct generator_data_s
+{
+	float freq;						// Requested frequency
+	float actual;					// Frequency that timer2 produces
+	uint8_t method;
+	uint8_t preset;
+} generator_data_t;
+
+extern volatile uint32_t dds_phase;
+extern volatile uint32_t dds_incr;
+
+extern void generator(void) __attribute__((noreturn));
+extern float gen_start(float f, uint8_t method);
+extern void gen_stop(void);
+
+#endif
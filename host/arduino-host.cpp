@@ -0,0 +1,190 @@
+/* arduino-host.cpp - the parts of the arduino core that Joat uses, for the host build
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <Arduino.h>
+#include "timing.h"
+#include "hal.h"
+
+static volatile uint8_t *pin_reg(uint8_t pin, volatile uint8_t *d, volatile uint8_t *b, volatile uint8_t *c);
+static uint8_t pin_mask(uint8_t pin);
+
+/* Digital pins - the same numbering as iopin.h
+*/
+static volatile uint8_t *pin_reg(uint8_t pin, volatile uint8_t *d, volatile uint8_t *b, volatile uint8_t *c)
+{
+	return (pin < 8) ? d : (pin < 14) ? b : c;
+}
+
+static uint8_t pin_mask(uint8_t pin)
+{
+	return 1 << ((pin < 8) ? pin : (pin < 14) ? (pin - 8) : (pin - 14));
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+	volatile uint8_t *ddr = pin_reg(pin, &DDRD, &DDRB, &DDRC);
+	volatile uint8_t *port = pin_reg(pin, &PORTD, &PORTB.v, &PORTC);
+	uint8_t m = pin_mask(pin);
+
+	if ( mode == OUTPUT )
+		*ddr |= m;
+	else
+	{
+		*ddr &= ~m;
+		if ( mode == INPUT_PULLUP )
+			*port |= m;
+		else
+			*port &= ~m;
+	}
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+	volatile uint8_t *port = pin_reg(pin, &PORTD, &PORTB.v, &PORTC);
+
+	if ( val )
+		*port |= pin_mask(pin);
+	else
+		*port &= ~pin_mask(pin);
+}
+
+int digitalRead(uint8_t pin)
+{
+	return (*pin_reg(pin, &PIND, &PINB, &PINC) & pin_mask(pin)) != 0;
+}
+
+/* Print - number formatting as in the arduino Print class
+*/
+size_t Print::print(const __FlashStringHelper *s)
+{
+	return print(reinterpret_cast<const char *>(s));
+}
+
+size_t Print::print(const char *s)
+{
+	size_t n = 0;
+
+	while ( *s != '\0' )
+		n += write((uint8_t)*s++);
+
+	return n;
+}
+
+size_t Print::print(char c)
+{
+	return write((uint8_t)c);
+}
+
+size_t Print::print(unsigned char n, int base)
+{
+	return print((unsigned long)n, base);
+}
+
+size_t Print::print(int n, int base)
+{
+	return print((long)n, base);
+}
+
+size_t Print::print(unsigned int n, int base)
+{
+	return print((unsigned long)n, base);
+}
+
+size_t Print::print(long n, int base)
+{
+	if ( base == 0 )
+		return write((uint8_t)n);
+
+	if ( base == 10 && n < 0 )
+		return write('-') + print_number(-(unsigned long)n, 10);
+
+	return print_number((unsigned long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base)
+{
+	if ( base == 0 )
+		return write((uint8_t)n);
+
+	return print_number(n, base);
+}
+
+size_t Print::print(double n, int digits)
+{
+	return print_float(n, digits);
+}
+
+size_t Print::print_number(unsigned long n, uint8_t base)
+{
+	char buf[8 * sizeof(long) + 1];
+	char *s = &buf[sizeof(buf) - 1];
+
+	if ( base < 2 )
+		base = 10;
+
+	*s = '\0';
+	do {
+		uint8_t d = n % base;
+		n /= base;
+		*--s = (d < 10) ? ('0' + d) : ('A' + d - 10);
+	} while ( n != 0 );
+
+	return print(s);
+}
+
+size_t Print::print_float(double n, uint8_t digits)
+{
+	size_t len = 0;
+
+	if ( isnan(n) )
+		return print("nan");
+	if ( isinf(n) )
+		return print("inf");
+	if ( n > 4294967040.0 || n < -4294967040.0 )
+		return print("ovf");
+
+	if ( n < 0.0 )
+	{
+		len += write('-');
+		n = -n;
+	}
+
+	// Round as the arduino core does, then print the integer part and the digits one at a time
+	double rounding = 0.5;
+	for ( uint8_t i = 0; i < digits; i++ )
+		rounding /= 10.0;
+	n += rounding;
+
+	unsigned long ipart = (unsigned long)n;
+	double rem = n - (double)ipart;
+	len += print(ipart);
+
+	if ( digits > 0 )
+		len += write('.');
+
+	while ( digits-- > 0 )
+	{
+		rem *= 10.0;
+		unsigned int d = (unsigned int)rem;
+		len += print(d);
+		rem -= d;
+	}
+
+	return len;
+}
@@ -0,0 +1,158 @@
+/* bridge-target.cpp - a simulated device on the UART bridge's pins that echoes what it receives
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <Arduino.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "joat.h"
+#include "timing.h"
+#include "avr-programmer.h"
+#include "bridge.h"
+#include "hal.h"
+
+/* The device has a UART whose clock is exact: a bit is HZ / baud ticks, not a whole number of them.
+ * It follows the pins (hal_pin_hook): its RXD is PIN_BR_TX and its TXD drives PIN_BR_RX.
+ *	- receive: a falling edge on RXD starts a frame. Each bit is sampled in its middle, at the first
+ *	  step of the clock after that time. A byte with a bad stop bit is counted and dropped.
+ *	- transmit: each byte received is sent back as soon as the transmitter is free, so when bytes are waiting
+ *	  the frames follow each other without a gap.
+ * With a host that sends all the time, both directions of the bridge are busy all the time (full duplex),
+ * at the rate of the slower of the two sides. The device only listens while it is powered (PIN_VCC).
+ * At the end of the simulation it prints what it received and sent on stderr, for bench/bridge-bench.sh.
+*/
+
+#define BT_QUEUE		4096			// Bytes waiting to be echoed. A power of 2
+
+#define RXD				_BV(PIN_BR_TX::bit)
+#define TXD				_BV(PIN_BR_RX::bit)
+#define VCC				_BV(PIN_VCC::bit)
+
+static double bit_ticks;
+static uint8_t rxd_last = 1;
+static uint8_t rx_busy;
+static double rx_start;					// Time of the falling edge of the start bit
+static uint8_t rx_nbits;				// Bits sampled, including the start bit
+static uint16_t rx_shift;
+static uint8_t queue[BT_QUEUE];
+static double queue_t[BT_QUEUE];		// Time at which each byte was received (the middle of its stop bit)
+static uint32_t q_in, q_out;
+static uint8_t tx_busy;
+static double tx_start;					// Start of the frame being sent, or the end of the last one
+static uint16_t tx_frame;				// Start bit, data and stop bit, LSB first
+static uint32_t n_rx, n_tx, n_framing, n_full;
+
+static void bt_pins(void);
+static void bt_report(void);
+
+/* bridge_target_attach() - connect a device with a UART at the given baud rate to the bridge's pins
+*/
+int bridge_target_attach(const char *baud)
+{
+	long b = atol(baud);
+
+	if ( b <= 0 )
+	{
+		fprintf(stderr, "bridge: bad baud rate %s\n", baud);
+		return -1;
+	}
+
+	bit_ticks = (double)HZ / b;
+	hal_pin_hook = bt_pins;
+	atexit(bt_report);
+	return 0;
+}
+
+/* bt_pins() - follow the pins
+*/
+static void bt_pins(void)
+{
+	double now = (double)hal_ticks;
+	uint8_t rxd = ((PORTB & DDRB) | ~DDRB) & RXD ? 1 : 0;	// Inputs float high
+
+	if ( (PORTB & VCC) == 0 )
+	{
+		rx_busy = 0;
+		rxd_last = rxd;
+		hal_ext[0] |= TXD;
+		return;
+	}
+
+	// Receive
+	if ( !rx_busy && rxd_last && !rxd )
+	{
+		rx_busy = 1;
+		rx_start = now;
+		rx_nbits = 0;
+		rx_shift = 0;
+	}
+	rxd_last = rxd;
+
+	while ( rx_busy && now >= rx_start + (rx_nbits + 0.5) * bit_ticks )
+	{
+		rx_shift |= (uint16_t)rxd << rx_nbits;
+		rx_nbits++;
+		if ( rx_nbits >= 10 )
+		{
+			rx_busy = 0;
+			if ( (rx_shift & 0x200) == 0 )
+				n_framing++;
+			else if ( q_in - q_out >= BT_QUEUE )
+				n_full++;
+			else
+			{
+				queue[q_in & (BT_QUEUE - 1)] = (uint8_t)(rx_shift >> 1);
+				queue_t[q_in & (BT_QUEUE - 1)] = rx_start + 9.5 * bit_ticks;
+				q_in++;
+				n_rx++;
+			}
+		}
+	}
+
+	// Transmit
+	if ( tx_busy && now >= tx_start + 10 * bit_ticks )
+	{
+		tx_busy = 0;
+		tx_start += 10 * bit_ticks;
+		n_tx++;
+	}
+
+	if ( !tx_busy && q_out != q_in )
+	{
+		tx_busy = 1;
+		if ( tx_start < queue_t[q_out & (BT_QUEUE - 1)] )
+			tx_start = queue_t[q_out & (BT_QUEUE - 1)];		// Not before the byte has been received
+		tx_frame = ((uint16_t)queue[q_out++ & (BT_QUEUE - 1)] << 1) | 0x200;
+	}
+
+	uint8_t level = 1;
+	if ( tx_busy )
+		level = (tx_frame >> (int)((now - tx_start) / bit_ticks)) & 0x01;
+
+	if ( level )
+		hal_ext[0] |= TXD;
+	else
+		hal_ext[0] &= (uint8_t)~TXD;
+}
+
+static void bt_report(void)
+{
+	fprintf(stderr, "bridge: %.6f s, received %u sent %u, %u framing errors, %u lost\n",
+			(double)hal_ticks / HZ, n_rx, n_tx, n_framing, n_full);
+}
@@ -0,0 +1,30 @@
+/* dds-host.cpp - the signal generator's DDS interrupt handler for the host build
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Replaces dds.cpp, whose handler is in AVR assembler. This one does the same in C.
+*/
+#include <Arduino.h>
+#include "joat.h"
+#include "generator.h"
+
+ISR(TIMER2_COMPA_vect)
+{
+	dds_phase += dds_incr;
+	PIN_GEN::set((dds_phase & 0x80000000ul) != 0);
+}
@@ -0,0 +1,519 @@
+/* hal.cpp - simulated hardware for the host (Linux) build of Joat
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <Arduino.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "timing.h"
+#include "scpi.h"
+#include "hal.h"
+
+// The interrupt handlers that the firmware might define. Weak, so that a mode can be left out of the build.
+extern "C" void PCINT0_vect(void) __attribute__((weak));
+extern "C" void TIMER2_COMPA_vect(void) __attribute__((weak));
+extern "C" void TIMER1_CAPT_vect(void) __attribute__((weak));
+extern "C" void TIMER1_COMPA_vect(void) __attribute__((weak));
+extern "C" void TIMER1_COMPB_vect(void) __attribute__((weak));
+extern "C" void TIMER1_OVF_vect(void) __attribute__((weak));
+
+#define HAL_MAXSTEP			0x8000						// Largest clock step (ticks) between timer1 checks
+#define HAL_ISRSTEP			32							// Largest step when an interrupt source is enabled
+#define HAL_POLL_INTERVAL	MICROS_TO_TICKS(1000)		// Interval between hal_poll() calls
+#define HAL_LCD_SETTLE		MILLIS_TO_TICKS(20)			// The LCD is shown when it hasn't changed for this long
+#define HAL_BTN_SLOT		MILLIS_TO_TICKS(100)		// Each button in the script is pressed for half a slot
+#define HAL_ADC_TIME		MICROS_TO_TICKS(104)		// 13 a/d clocks at 125 kHz
+#define HAL_IO_IDLE			MICROS_TO_TICKS(200)		// The firmware is idle when it hasn't done any I/O for this long
+#define HAL_RESET_TIME		MILLIS_TO_TICKS(15)			// Watchdog timeout before a reset
+#define HAL_RESET_ENV		"JOAT_HOST_RESET"
+
+// The registers
+volatile uint8_t PINB, DDRB;
+hal_port_t PORTB;
+volatile uint8_t PINC, DDRC, PORTC;
+volatile uint8_t PIND, DDRD, PORTD;
+volatile uint8_t TCCR1A, TCCR1B, TCCR1C, TIMSK1;
+volatile uint16_t ICR1, OCR1A, OCR1B;
+volatile uint8_t SPCR, SPSR;
+volatile uint8_t ADCSRA, ADMUX;
+volatile uint8_t UCSR0A, UCSR0B, UCSR0C, UDR0;
+volatile uint16_t UBRR0;
+volatile uint8_t PCICR, PCMSK0, PCMSK1, PCMSK2;
+volatile uint8_t MCUSR;
+hal_flags_t TIFR1;
+volatile uint8_t TCCR2A, TCCR2B, TCNT2, OCR2A, OCR2B, TIMSK2;
+hal_flags_t TIFR2;
+hal_flags_t PCIFR;
+hal_tcnt1_t TCNT1;
+hal_spdr_t SPDR;
+hal_sreg_t SREG;
+
+// The simulation
+volatile uint8_t hal_ie;
+uint64_t hal_ticks;
+uint16_t hal_tcnt1_step = 16;
+uint16_t hal_portb_step = 6;
+uint16_t hal_isr_ticks;
+uint8_t (*hal_spi_target)(uint8_t mosi);
+uint8_t hal_ext[3] = { 0xff, 0xff, 0xff };
+void (*hal_pin_hook)(void);
+double hal_icp_period;
+uint8_t hal_loopback;
+uint16_t hal_adc[8] = { 0, 0, 0, 0, 0, 0, 1023, 0 };	// A6: no button pressed
+uint64_t hal_limit;
+uint8_t hal_show_lcd = 1;
+uint64_t hal_io_ticks;
+
+static uint64_t t1_zero;			// hal_ticks when TCNT1 was last 0
+static uint8_t spi_rx;				// Byte received by the last SPI transfer
+static double icp_next;				// Time of the next rising edge on ICP1
+static uint64_t t2_next;			// Time of timer2's next compare match; 0 when it is stopped
+static uint8_t oc2a;				// Level of the OC2A output
+static uint8_t pb3_last;			// PB3 at the last sync_pins(), for the loopback
+static uint64_t poll_next;
+static const char *btn_script;
+static uint64_t btn_t0;
+static uint8_t pinb_last;
+static uint8_t out_last[3];			// PORTx & DDRx at the last sync_pins()
+static char **hal_argv;
+
+static void timer2(uint64_t until);
+static void icp_capture(uint64_t when);
+static void sync_pins(void);
+static uint16_t button_level(void);
+
+/* TCNT1 - the counter runs whenever a clock is selected (only prescaler 1 is simulated)
+*/
+hal_tcnt1_t::operator uint16_t()
+{
+	hal_advance(hal_tcnt1_step);
+	return (uint16_t)(hal_ticks - t1_zero);
+}
+
+hal_tcnt1_t &hal_tcnt1_t::operator=(uint16_t v)
+{
+	t1_zero = hal_ticks - v;
+	return *this;
+}
+
+/* PORTB - the write is seen by the pin model at the end of the step
+*/
+hal_port_t &hal_port_t::operator=(int b)
+{
+	v = (uint8_t)b;
+	hal_advance(hal_portb_step);
+	return *this;
+}
+
+/* SREG - the I bit
+*/
+hal_sreg_t::operator uint8_t()
+{
+	return hal_ie ? 0x80 : 0x00;
+}
+
+hal_sreg_t &hal_sreg_t::operator=(uint8_t v)
+{
+	if ( v & 0x80 )
+		sei();
+	else
+		cli();
+	return *this;
+}
+
+/* SPDR - a transfer takes 8 SPI clocks. The target model sees the byte at the end of the transfer.
+*/
+hal_spdr_t::operator uint8_t()
+{
+	SPSR &= (uint8_t)~_BV(SPIF);
+	return spi_rx;
+}
+
+hal_spdr_t &hal_spdr_t::operator=(uint8_t b)
+{
+	if ( SPCR & _BV(SPE) )
+	{
+		static const uint8_t div[4] = { 4, 16, 64, 128 };
+		uint32_t d = div[SPCR & 0x03];
+		if ( SPSR & _BV(SPI2X) )
+			d /= 2;
+		hal_advance(8 * d);
+		hal_io_ticks = hal_ticks;
+		spi_rx = (hal_spi_target == 0) ? 0xff : hal_spi_target(b);
+		SPSR |= _BV(SPIF);
+	}
+	return *this;
+}
+
+/* hal_advance() - advance the simulated clock
+ *
+ * Timer1 sets its flags for any event that happens during the step. Like the real timer, a flag
+ * that is already set stays set, so an interrupt handler that is too slow loses events.
+*/
+void hal_advance(uint32_t ticks)
+{
+	// Small steps when interrupts can happen, so that a long operation like an LCD write
+	// is interrupted about where it would be on the target
+	uint32_t maxstep = ( TIMSK1 != 0 || TIMSK2 != 0 || (PCICR & _BV(PCIE0)) ) ? HAL_ISRSTEP : HAL_MAXSTEP;
+
+	while ( ticks > 0 )
+	{
+		if ( hal_ticks - hal_io_ticks > HAL_IO_IDLE )
+			ticks += hal_uart_wait();
+
+		uint32_t step = (ticks > maxstep) ? maxstep : ticks;
+		uint16_t c0 = (uint16_t)(hal_ticks - t1_zero);
+
+		ticks -= step;
+
+		if ( (TCCR1B & 0x07) == 0 )
+		{
+			// Timer stopped: the counter keeps its value
+			t1_zero += step;
+		}
+		else
+		{
+			if ( (uint16_t)(OCR1A - c0 - 1) < step )
+				TIFR1.v |= _BV(OCF1A);
+			if ( (uint16_t)(OCR1B - c0 - 1) < step )
+				TIFR1.v |= _BV(OCF1B);
+			if ( (uint32_t)c0 + step > 0xffff )
+				TIFR1.v |= _BV(TOV1);
+		}
+
+		timer2(hal_ticks + step);
+		hal_ticks += step;
+		hal_uart_rx();
+
+		if ( hal_icp_period > 0.0 )
+		{
+			while ( icp_next <= (double)hal_ticks )
+			{
+				icp_capture((uint64_t)icp_next);
+				icp_next += hal_icp_period;
+			}
+		}
+
+		sync_pins();
+
+		if ( hal_ticks >= poll_next )
+		{
+			poll_next = hal_ticks + HAL_POLL_INTERVAL;
+			hal_poll();
+		}
+
+		if ( hal_ie )
+			hal_pending();
+	}
+}
+
+/* hal_pending() - call the handlers of pending interrupts, in the target's priority order
+ *
+ * If the handlers take time (hal_isr_ticks), only one is called: the next one waits until the main line
+ * has had a step of the clock.
+*/
+void hal_pending(void)
+{
+	for (;;)
+	{
+		void (*handler)(void) = 0;
+
+		if ( (PCICR & _BV(PCIE0)) && (PCIFR.v & _BV(PCIF0)) )
+		{
+			PCIFR.v &= ~_BV(PCIF0);
+			handler = PCINT0_vect;
+		}
+		else if ( (TIMSK2 & _BV(OCIE2A)) && (TIFR2.v & _BV(OCF2A)) )
+		{
+			TIFR2.v &= ~_BV(OCF2A);
+			handler = TIMER2_COMPA_vect;
+		}
+		else if ( (TIMSK1 & _BV(ICIE1)) && (TIFR1.v & _BV(ICF1)) )
+		{
+			TIFR1.v &= ~_BV(ICF1);
+			handler = TIMER1_CAPT_vect;
+		}
+		else if ( (TIMSK1 & _BV(OCIE1A)) && (TIFR1.v & _BV(OCF1A)) )
+		{
+			TIFR1.v &= ~_BV(OCF1A);
+			handler = TIMER1_COMPA_vect;
+		}
+		else if ( (TIMSK1 & _BV(OCIE1B)) && (TIFR1.v & _BV(OCF1B)) )
+		{
+			TIFR1.v &= ~_BV(OCF1B);
+			handler = TIMER1_COMPB_vect;
+		}
+		else if ( (TIMSK1 & _BV(TOIE1)) && (TIFR1.v & _BV(TOV1)) )
+		{
+			TIFR1.v &= ~_BV(TOV1);
+			handler = TIMER1_OVF_vect;
+		}
+		else
+			return;
+
+		if ( handler != 0 )
+		{
+			hal_ie = 0;
+			handler();
+			if ( hal_isr_ticks != 0 )
+			{
+				hal_advance(hal_isr_ticks);
+				hal_ie = 1;
+				return;
+			}
+			hal_ie = 1;
+		}
+	}
+}
+
+/* timer2() - run timer2 up to the given time
+ *
+ * Only CTC mode (the signal generator) is simulated: a compare match every N * (OCR2A + 1) ticks
+ * sets OCF2A and, if COM2A0 is set, toggles OC2A. With the loopback, each rising edge of OC2A is
+ * captured by timer1 at the exact time, so the self-test sees what the target would.
+*/
+static void timer2(uint64_t until)
+{
+	static const uint16_t prescale[8] = { 0, 1, 8, 32, 64, 128, 256, 1024 };
+	uint8_t cs = TCCR2B & 0x07;
+
+	if ( cs == 0 )
+	{
+		t2_next = 0;
+		oc2a = 0;
+		return;
+	}
+
+	uint32_t period = (uint32_t)prescale[cs] * ((uint32_t)OCR2A + 1);
+
+	if ( t2_next == 0 )
+		t2_next = hal_ticks + period;
+
+	while ( t2_next <= until )
+	{
+		TIFR2.v |= _BV(OCF2A);
+		if ( TCCR2A & _BV(COM2A0) )
+		{
+			oc2a = !oc2a;
+			if ( oc2a && hal_loopback && (DDRB & 0x08) )
+				icp_capture(t2_next);
+		}
+		t2_next += period;
+	}
+}
+
+/* icp_capture() - a rising edge on ICP1 at the given time
+*/
+static void icp_capture(uint64_t when)
+{
+	ICR1 = (uint16_t)(when - t1_zero);
+	TIFR1.v |= _BV(ICF1);
+}
+
+/* sync_pins() - compute the PINx registers
+ *
+ * An output reads back its PORTx bit; an input reads the external level. A change of an output
+ * counts as I/O (hal_io_ticks). PB3 is OC2A when timer2 drives it; with the loopback, PB0 (ICP1)
+ * follows PB3 and a rising edge that the software makes (the DDS) is captured at the end of the step.
+*/
+static void sync_pins(void)
+{
+	if ( hal_pin_hook != 0 )
+		hal_pin_hook();
+
+	if ( TCCR2A & _BV(COM2A0) )
+		PORTB.v = (PORTB.v & ~0x08) | (oc2a ? 0x08 : 0x00);
+
+	if ( hal_loopback )
+	{
+		uint8_t pb3 = PORTB & DDRB & 0x08;
+		if ( pb3 && !pb3_last && !(TCCR2A & _BV(COM2A0)) )
+			icp_capture(hal_ticks);
+		pb3_last = pb3;
+		hal_ext[0] = (hal_ext[0] & ~0x01) | (pb3 ? 0x01 : 0x00);
+	}
+
+	uint8_t ob = PORTB & DDRB, oc = PORTC & DDRC, od = PORTD & DDRD;
+	if ( ob != out_last[0] || oc != out_last[1] || od != out_last[2] )
+	{
+		out_last[0] = ob;
+		out_last[1] = oc;
+		out_last[2] = od;
+		hal_io_ticks = hal_ticks;
+	}
+
+	uint8_t b = (PORTB & DDRB) | (hal_ext[0] & ~DDRB);
+
+	if ( (b ^ pinb_last) & PCMSK0 )
+		PCIFR.v |= _BV(PCIF0);
+	pinb_last = b;
+
+	PINB = b;
+	PINC = (PORTC & DDRC) | (hal_ext[1] & ~DDRC);
+	PIND = (PORTD & DDRD) | (hal_ext[2] & ~DDRD);
+}
+
+/* analogRead() - the a/d converter
+ *
+ * A6 reads the button script, if there is one. The other inputs read hal_adc[].
+*/
+int analogRead(uint8_t pin)
+{
+	uint8_t ch = (pin >= A0) ? (pin - A0) : pin;
+
+	hal_advance(HAL_ADC_TIME);
+
+	if ( ch == (A6 - A0) && btn_script != 0 )
+		return button_level();
+
+	return hal_adc[ch & 0x07];
+}
+
+void analogReference(uint8_t mode)
+{
+	(void)mode;
+}
+
+/* hal_buttons() - set the button script
+ *
+ * Each character of the script is a slot: 'c' presses CHANGE and 'o' presses OK for the first half
+ * of the slot. Anything else (e.g. '.') is a pause. After the end of the script no button is pressed.
+*/
+void hal_buttons(const char *script)
+{
+	btn_script = script;
+	btn_t0 = hal_ticks;
+}
+
+static uint16_t button_level(void)
+{
+	uint64_t el = hal_ticks - btn_t0;
+	uint64_t slot = el / HAL_BTN_SLOT;
+
+	if ( slot >= strlen(btn_script) || (el % HAL_BTN_SLOT) >= HAL_BTN_SLOT / 2 )
+		return 1023;
+
+	switch ( btn_script[slot] )
+	{
+	case 'o':	return 100;
+	case 'c':	return 512;
+	default:	return 1023;
+	}
+}
+
+/* hal_poll() - called about once per simulated millisecond
+*/
+void hal_poll(void)
+{
+	hal_uart_poll();
+
+	if ( hal_show_lcd && hal_lcd.changed && (hal_ticks - hal_lcd.when) >= HAL_LCD_SETTLE )
+	{
+		hal_lcd.changed = 0;
+		hal_lcd_dump(stderr);
+	}
+
+	if ( hal_limit != 0 && hal_ticks >= hal_limit )
+		hal_exit(0);
+}
+
+/* hal_lcd_dump() - print the display and the simulated time
+*/
+void hal_lcd_dump(FILE *f)
+{
+	for ( uint8_t r = 0; r < hal_lcd.rows; r++ )
+	{
+		if ( r == 0 )
+			fprintf(f, "%10.3f |", (double)hal_ticks / HZ);
+		else
+			fprintf(f, "%10s |", "");
+		fprintf(f, "%.*s|\n", hal_lcd.cols, hal_lcd.text[r]);
+	}
+}
+
+/* hal_exit() - end the simulation
+*/
+void hal_exit(int status)
+{
+	hal_uart_flush();
+	hal_lcd_dump(stderr);
+	exit(status);
+}
+
+/* hal_reset() - reset the processor: run the program again with the same options
+ *
+ * What survives a reset on the target is passed to the new program in the environment: the
+ * simulated time, the pseudo-terminal (so the host stays connected) and the .noinit variables,
+ * i.e. scpi_config. Everything else starts again from nothing, including a simulated ISP target.
+ * Characters that have been received but not yet read are lost, as they are on the target.
+*/
+void hal_reset(void)
+{
+	char env[64 + 2 * sizeof(scpi_config)];
+	const uint8_t *cfg = (const uint8_t *)&scpi_config;
+	int fd, slave;
+
+	hal_uart_flush();
+	fflush(0);
+	hal_uart_get_pty(&fd, &slave);
+
+	int n = snprintf(env, sizeof(env), "%llu,%d,%d,", (unsigned long long)(hal_ticks + HAL_RESET_TIME), fd, slave);
+	for ( size_t i = 0; i < sizeof(scpi_config); i++ )
+		n += snprintf(&env[n], sizeof(env) - n, "%02x", cfg[i]);
+
+	setenv(HAL_RESET_ENV, env, 1);
+	execv("/proc/self/exe", hal_argv);
+	perror("reset");
+	exit(1);
+}
+
+/* hal_restarted() - called first by the program; returns 1 if it was started by hal_reset()
+ *
+ * argv is kept for hal_reset(). After a reset the command-line options that select a mode with the
+ * buttons or open a new pseudo-terminal must be ignored.
+*/
+int hal_restarted(char **argv)
+{
+	const char *env = getenv(HAL_RESET_ENV);
+	unsigned long long t;
+	int fd, slave, n;
+
+	hal_argv = argv;
+
+	if ( env == 0 || sscanf(env, "%llu,%d,%d,%n", &t, &fd, &slave, &n) != 3 )
+		return 0;
+
+	hal_ticks = t;
+	t1_zero = t;
+	icp_next = t;
+	poll_next = t;
+	if ( fd >= 0 )
+		hal_uart_use_pty(fd, slave);
+
+	uint8_t *cfg = (uint8_t *)&scpi_config;
+	for ( size_t i = 0; i < sizeof(scpi_config); i++ )
+	{
+		unsigned b;
+		if ( sscanf(&env[n + 2 * i], "%2x", &b) != 1 )
+			break;
+		cfg[i] = (uint8_t)b;
+	}
+
+	unsetenv(HAL_RESET_ENV);
+	return 1;
+}
@@ -0,0 +1,133 @@
+/* hal.h - simulated hardware for the host (Linux) build of Joat
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef HAL_H
+#define HAL_H	1
+
+#include <stdint.h>
+#include <stdio.h>
+#include "lcd.h"
+
+/* The host build compiles the firmware sources unchanged. The headers in host/include take the place of
+ * the arduino core and avr-libc: the I/O registers are ordinary variables, except for the few whose
+ * access has side effects on the real hardware:
+ *	TCNT1	each read advances the simulated clock, so timer1 counts and all the timing code works
+ *	PORTB	each write advances the clock a little, so that the pin models see bit-banged pulses
+ *	SPDR	a write transfers a byte to the simulated SPI target (hal_spi_target) and sets SPIF
+ *	TIFR1, TIFR2, PCIFR	writing a 1 clears a flag
+ * When the clock advances, timer1 sets its overflow, compare and capture flags, timer2 (CTC mode only)
+ * sets its compare flag and toggles OC2A, and the pin change flag is set; the interrupt handlers are
+ * called from hal_pending() as on the target.
+ * uart.cpp is replaced by host/uart-host.cpp, which connects the uart.h API to stdin/stdout or to a
+ * pseudo-terminal. lcd.cpp is replaced by host/lcd-host.cpp, which writes to a character buffer.
+ *
+ * Time is simulated, not real: the clock only advances when the firmware reads TCNT1, converts an
+ * analogue input or transfers a byte over SPI. A 500 ms delay takes a few milliseconds of host time,
+ * and waiting for the host link takes no simulated time at all.
+*/
+
+// The simulated clock, in timer1 ticks (16 MHz)
+extern uint64_t hal_ticks;
+
+// Number of ticks that each read of TCNT1 advances the clock. Roughly the time that the
+// firmware takes between reads in a polling loop.
+extern uint16_t hal_tcnt1_step;
+
+// Number of ticks that each write of PORTB advances the clock: an sbi or cbi and the code around it in
+// a bit-banging loop.
+extern uint16_t hal_portb_step;
+
+// Time, in ticks, that each interrupt handler takes. 0 (the default): no time at all.
+extern uint16_t hal_isr_ticks;
+
+// SPI target model: called for each byte written to SPDR; returns the byte on MISO.
+// The default has no target, so MISO is high.
+extern uint8_t (*hal_spi_target)(uint8_t mosi);
+
+// Levels driven onto the pins from outside, for pins that are inputs: [0] = port B, [1] = C, [2] = D.
+// All high by default.
+extern uint8_t hal_ext[3];
+
+// Pin model: called each time the clock advances, before the PINx registers are computed, so that
+// a model can follow the outputs (PORTx and DDRx) and drive its inputs through hal_ext[].
+extern void (*hal_pin_hook)(void);
+
+// Period, in ticks, of a square wave on ICP1 (D8), for the frequency meter (0 = no signal)
+extern double hal_icp_period;
+
+// Loopback: the signal generator's output (D11, OC2A) is connected to ICP1 (D8), as for the self-test
+extern uint8_t hal_loopback;
+
+// Analogue inputs (0..1023) for analogRead(). A6 is the button input; see hal_buttons().
+extern uint16_t hal_adc[8];
+
+// Stop the simulation after this many ticks (0 = never)
+extern uint64_t hal_limit;
+
+// Show the LCD on stderr whenever it changes
+extern uint8_t hal_show_lcd;
+
+// The display: a buffer of characters. rows is 0 until lcd.begin() has been called.
+// Characters written beyond the end of a row are lost, as they are on a real display in the rows
+// that Joat uses.
+typedef struct hal_lcd_s
+{
+	uint8_t cols, rows;
+	uint8_t col, row;
+	uint8_t changed;
+	uint64_t when;				// Time of the last change
+	char text[LCD_ROWS][LCD_COLS+1];
+} hal_lcd_t;
+
+extern hal_lcd_t hal_lcd;
+
+// Time of the firmware's last I/O: a serial character, an SPI transfer or a change of an output pin
+extern uint64_t hal_io_ticks;
+
+extern void hal_advance(uint32_t ticks);
+extern void hal_buttons(const char *script);
+extern void hal_poll(void);
+extern void hal_lcd_dump(FILE *f);
+extern void hal_exit(int status) __attribute__((noreturn));
+extern void hal_reset(void) __attribute__((noreturn));
+extern int hal_restarted(char **argv);
+
+// Serial link. See uart-host.cpp
+extern int hal_uart_open_pty(void);
+extern void hal_uart_poll(void);
+extern void hal_uart_flush(void);
+extern uint32_t hal_uart_wait(void);
+extern void hal_uart_rx(void);
+extern void hal_uart_get_pty(int *fd, int *slave);
+extern void hal_uart_use_pty(int fd, int slave);
+
+// Simulated AVR on the ISP pins. See isp-target.cpp
+extern int isp_target_attach(const char *part);
+extern int isp_target_load(const char *file);
+
+// Simulated ATtiny on the HVSP pins. See hvsp-target.cpp
+extern int hvsp_target_attach(const char *part);
+
+// Simulated ATtiny4/5/9/10 on the TPI pins. See tpi-target.cpp
+extern int tpi_target_attach(const char *part);
+
+// Simulated device with a UART on the bridge's pins, that echoes what it receives. See bridge-target.cpp
+extern int bridge_target_attach(const char *baud);
+
+#endif
@@ -0,0 +1,392 @@
+/* hvsp-target.cpp - a simulated ATtiny on the HVSP pins, for the host build
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <Arduino.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "joat.h"
+#include "timing.h"
+#include "avr-programmer.h"
+#include "hvsp.h"
+#include "hal.h"
+
+/* The target implements the high-voltage serial programming instructions of the ATtiny datasheets
+ * ("High-voltage Serial Programming Instruction Set"): chip erase, flash page loading and writing,
+ * signature, fuse, lock and flash reads, and fuse and lock writes.
+ *
+ * It follows the pins (hal_pin_hook): Vcc on PIN_VCC, 12 V on RESET from PIN_HV, SCI, SDI, SII and SDO on
+ * PB2..PB5 (hvsp.h). The bit-banged frames are seen because each write of PORTB advances the clock.
+ * Like a real ATtiny, the target:
+ *	- is only powered when PIN_VCC is driven high
+ *	- only enters HVSP mode if 12 V is applied 20..60 us after Vcc, while SDI, SII and SDO are low.
+ *	  Otherwise it runs its program and ignores the pins.
+ *	- samples SDI and SII on the rising edge of SCI. A frame is a 0 start bit, 8 bits MSB first and two
+ *	  stop bits. The result of a read comes out on SDO, MSB first, during the frame after the one that
+ *	  starts the read; the programmer samples each bit before the next rising edge.
+ *	- holds SDO low for the programming time after a write or erase, and ignores SCI until it's finished.
+ *	  The times are those of isp-target.cpp, which are longer than the datasheets' HVSP times.
+ *	- ignores fuse writes while the lock bits are programmed (modes 2 and 3), and returns 0xff for flash
+ *	  reads in mode 3. A chip erase clears them.
+ * The session ends when Vcc is removed. The target then prints the length of the session in simulated
+ * time, the fuses and what was done on stderr, for bench/hvsp-bench.sh.
+ *
+ * The part starts "bricked": RSTDISBL is programmed, so only HVSP can get at it. The flash has a program in it.
+*/
+
+typedef struct hvsp_part_s
+{
+	const char *name;
+	uint8_t sig[3];
+	uint16_t flash;				// Size of flash in bytes
+	uint8_t flash_page;			// Size of a flash page in bytes
+	uint8_t fuse[3];			// Factory settings: low, high, extended
+} hvsp_part_t;
+
+static const hvsp_part_t hvsp_parts[] =
+{
+	{ "t13",	{ 0x1e, 0x90, 0x07 },  1024, 32, { 0x6a, 0xff, 0xff } },
+	{ "t24",	{ 0x1e, 0x91, 0x0b },  2048, 32, { 0x62, 0xdf, 0xff } },
+	{ "t44",	{ 0x1e, 0x92, 0x07 },  4096, 64, { 0x62, 0xdf, 0xff } },
+	{ "t84",	{ 0x1e, 0x93, 0x0c },  8192, 64, { 0x62, 0xdf, 0xff } },
+	{ "t25",	{ 0x1e, 0x91, 0x08 },  2048, 32, { 0x62, 0xdf, 0xff } },
+	{ "t45",	{ 0x1e, 0x92, 0x06 },  4096, 64, { 0x62, 0xdf, 0xff } },
+	{ "t85",	{ 0x1e, 0x93, 0x0b },  8192, 64, { 0x62, 0xdf, 0xff } },
+};
+
+#define HVSP_NPARTS		(sizeof(hvsp_parts) / sizeof(hvsp_parts[0]))
+
+#define T_WRITE			4500		// Flash page, fuse and lock writes (us)
+#define T_ERASE			9000		// Chip erase (us)
+
+// Bits of port B
+#define VCC_BIT			PIN_VCC::bit
+#define SCI				_BV(HVSP_SCI_BIT)
+#define SDI				_BV(HVSP_SDI_BIT)
+#define SII				_BV(HVSP_SII_BIT)
+#define SDO				_BV(HVSP_SDO_BIT)
+
+typedef struct hvsp_stats_s
+{
+	uint64_t t_start;			// Time of entry to HVSP mode
+	uint32_t flash_written;		// Bytes in the flash pages that were written
+	uint32_t flash_read;
+	uint32_t pages;
+	uint32_t erases;
+	uint32_t frames;
+} hvsp_stats_t;
+
+static const hvsp_part_t *part;
+static uint8_t *flash;
+static uint8_t *flash_buf;				// The page buffer
+static uint8_t fuse[3];
+static uint8_t lock;
+
+static uint8_t powered;
+static uint64_t t_vcc;					// Time when Vcc was applied
+static uint8_t hv_failed;				// 12 V was applied at the wrong time
+static uint8_t hvsp_mode;
+static uint8_t pins_last;
+static uint8_t nbits;					// Bits of the current frame received
+static uint8_t sdi, sii;				// The frame being received
+static uint8_t sdo;						// The byte being shifted out
+static uint8_t cmd;						// Last command (SII 0x4c)
+static uint8_t addr_lo, addr_hi;
+static uint8_t data_lo, data_hi;
+static uint8_t last_sii;				// SII of the previous frame
+static uint64_t busy_until;
+static uint8_t was_busy;
+static hvsp_stats_t stats;
+
+static void hvsp_pins(void);
+static void hvsp_power(uint8_t on, uint8_t hv, uint8_t b);
+static void hvsp_frame(void);
+static uint8_t hvsp_read(uint8_t s);
+static void hvsp_write(uint8_t s);
+static uint8_t hv_level(void);
+
+/* hvsp_target_attach() - connect a simulated ATtiny to the HVSP pins
+ *
+ * The part is one of the names in hvsp_parts[] (avrdude's names). The 12 V supply is connected, so
+ * the monitor (PIN_HVMON) reads about 12 V.
+*/
+int hvsp_target_attach(const char *name)
+{
+	for ( unsigned i = 0; i < HVSP_NPARTS; i++ )
+	{
+		if ( strcmp(name, hvsp_parts[i].name) == 0 )
+			part = &hvsp_parts[i];
+	}
+
+	if ( part == 0 )
+	{
+		fprintf(stderr, "hvsp: unknown part %s. Known parts:", name);
+		for ( unsigned i = 0; i < HVSP_NPARTS; i++ )
+			fprintf(stderr, " %s", hvsp_parts[i].name);
+		fprintf(stderr, "\n");
+		return -1;
+	}
+
+	flash = (uint8_t *)malloc(part->flash);
+	flash_buf = (uint8_t *)malloc(part->flash_page);
+	for ( uint16_t i = 0; i < part->flash; i++ )
+		flash[i] = (uint8_t)(i * 7 + 3);
+	memset(flash_buf, 0xff, part->flash_page);
+	memcpy(fuse, part->fuse, sizeof(fuse));
+	fuse[1] &= 0x7f;						// RSTDISBL
+	lock = 0xff;
+
+	hal_adc[PIN_HVMON - A0] = 820;
+	hal_pin_hook = hvsp_pins;
+	return 0;
+}
+
+/* hvsp_pins() - follow the pins
+ *
+ * Called whenever the clock advances. A write of PORTB advances it, so each edge of SCI is seen.
+*/
+static void hvsp_pins(void)
+{
+	uint8_t b = (PORTB & DDRB) | ~DDRB;			// Inputs float high
+	uint8_t rise = b & ~pins_last;
+
+	pins_last = b;
+	hvsp_power((PORTB & DDRB & _BV(VCC_BIT)) != 0, hv_level(), b);
+
+	if ( !hvsp_mode )
+		return;
+
+	if ( hal_ticks < busy_until )
+	{
+		was_busy = 1;
+		nbits = 0;
+		hal_ext[0] &= (uint8_t)~SDO;
+		return;
+	}
+
+	if ( was_busy )
+	{
+		// An SCI pulse that the programmer started before it saw SDO go high isn't part of a frame
+		was_busy = 0;
+		rise = 0;
+	}
+
+	if ( rise & SCI )
+	{
+		// Bit 0 is the start bit, 1..8 the data, 9 and 10 the stop bits
+		if ( nbits >= 1 && nbits <= 8 )
+		{
+			sdi = (sdi << 1) | ((b & SDI) ? 1 : 0);
+			sii = (sii << 1) | ((b & SII) ? 1 : 0);
+		}
+		nbits++;
+		if ( nbits >= 11 )
+		{
+			nbits = 0;
+			hvsp_frame();
+		}
+	}
+
+	// SDO: after the edge of the start bit, the MSB of the result; after each data bit's edge, the next bit
+	uint8_t bit = (nbits >= 1 && nbits <= 8) ? (sdo & (0x80 >> (nbits - 1))) : 1;
+	if ( bit )
+		hal_ext[0] |= SDO;
+	else
+		hal_ext[0] &= (uint8_t)~SDO;
+}
+
+/* hvsp_power() - follow Vcc and the 12 V on RESET
+*/
+static void hvsp_power(uint8_t on, uint8_t hv, uint8_t b)
+{
+	if ( !on )
+	{
+		if ( powered && hvsp_mode )
+		{
+			fprintf(stderr, "hvsp: %s session %.6f s, fuses %02x %02x %02x, lock %02x, flash %u written %u read, "
+					"%u page writes, %u erases, %u frames\n",
+					part->name, (double)(hal_ticks - stats.t_start) / HZ, fuse[0], fuse[1], fuse[2], lock,
+					stats.flash_written, stats.flash_read, stats.pages, stats.erases, stats.frames);
+		}
+		powered = 0;
+		hvsp_mode = 0;
+		hal_ext[0] |= SDO;
+		return;
+	}
+
+	if ( !powered )
+	{
+		powered = 1;
+		hv_failed = 0;
+		t_vcc = hal_ticks;
+	}
+
+	if ( hv && !hvsp_mode && !hv_failed )
+	{
+		uint64_t dt = hal_ticks - t_vcc;
+
+		if ( dt < MICROS_TO_TICKS(20) || dt > MICROS_TO_TICKS(60) || (b & (SDI | SII | SDO)) != 0 )
+		{
+			fprintf(stderr, "hvsp: 12 V after %.1f us with SDI/SII/SDO %s: not in HVSP mode\n",
+					(double)dt * 1.0e6 / HZ, (b & (SDI | SII | SDO)) ? "high" : "low");
+			hv_failed = 1;
+			return;
+		}
+
+		hvsp_mode = 1;
+		nbits = 0;
+		sdo = 0xff;
+		last_sii = 0;
+		busy_until = 0;
+		memset(&stats, 0, sizeof(stats));
+		stats.t_start = hal_ticks;
+	}
+}
+
+/* hvsp_frame() - carry out an instruction frame
+ *
+ * The SII byte says what to do with the SDI byte. A write or a read is a pair of frames: the first
+ * (e.g. 0x64 or 0x68) sets it up and the second (0x6c) carries it out or shifts out the result.
+*/
+static void hvsp_frame(void)
+{
+	uint8_t s = sii;
+
+	stats.frames++;
+	sdo = 0xff;
+
+	switch ( s )
+	{
+	case 0x4c:		// Load command
+		cmd = sdi;
+		break;
+	case 0x0c:		// Load address low byte
+		addr_lo = sdi;
+		break;
+	case 0x1c:		// Load address high byte
+		addr_hi = sdi;
+		break;
+	case 0x2c:		// Load data low byte
+		data_lo = sdi;
+		break;
+	case 0x3c:		// Load data high byte
+		data_hi = sdi;
+		break;
+
+	case 0x68:		// Read low byte, signature, low fuse
+	case 0x78:		// Read high byte, calibration, lock
+	case 0x7a:		// Read high fuse
+	case 0x6a:		// Read extended fuse
+		sdo = hvsp_read(s);
+		break;
+
+	case 0x7c:		// Latch data (after 0x7d), or the end of a write (after 0x74)
+	case 0x6c:
+	case 0x6e:
+		hvsp_write(s);
+		break;
+	}
+
+	last_sii = s;
+}
+
+/* hvsp_read() - the result of a read, shifted out during the next frame
+*/
+static uint8_t hvsp_read(uint8_t s)
+{
+	uint32_t waddr = ((uint32_t)addr_hi << 8) | addr_lo;
+
+	switch ( cmd )
+	{
+	case 0x08:		// Signature (0x68) or calibration (0x78)
+		return (s == 0x68) ? ((addr_lo < 3) ? part->sig[addr_lo] : 0xff) : 0x80;
+
+	case 0x04:		// Fuses and lock
+		return (s == 0x68) ? fuse[0] : (s == 0x7a) ? fuse[1] : (s == 0x6a) ? fuse[2] : lock;
+
+	case 0x02:		// Flash: nothing comes out in lock mode 3
+		stats.flash_read++;
+		if ( (lock & 0x03) == 0 )
+			return 0xff;
+		return flash[(waddr * 2 + (s == 0x78)) % part->flash];
+	}
+
+	return 0xff;
+}
+
+/* hvsp_write() - the second frame of a write
+*/
+static void hvsp_write(uint8_t s)
+{
+	uint32_t waddr = ((uint32_t)addr_hi << 8) | addr_lo;
+
+	if ( s == 0x7c && last_sii == 0x7d )
+	{
+		// Latch the data into the page buffer at the word address in the page
+		uint16_t i = (waddr * 2) % part->flash_page;
+		flash_buf[i] = data_lo;
+		flash_buf[i + 1] = data_hi;
+		return;
+	}
+
+	if ( !((s == 0x6c && last_sii == 0x64) || (s == 0x7c && last_sii == 0x74) || (s == 0x6e && last_sii == 0x66)) )
+		return;
+
+	switch ( cmd )
+	{
+	case 0x80:		// Chip erase
+		memset(flash, 0xff, part->flash);
+		lock = 0xff;
+		stats.erases++;
+		busy_until = hal_ticks + MICROS_TO_TICKS(T_ERASE);
+		break;
+
+	case 0x40:		// Write fuse: low (0x64), high (0x74), extended (0x66)
+		if ( (lock & 0x03) == 0x03 )
+			fuse[(last_sii == 0x74) ? 1 : (last_sii == 0x66) ? 2 : 0] = data_lo;
+		busy_until = hal_ticks + MICROS_TO_TICKS(T_WRITE);
+		break;
+
+	case 0x20:		// Write lock bits
+		lock &= data_lo | 0xfc;
+		busy_until = hal_ticks + MICROS_TO_TICKS(T_WRITE);
+		break;
+
+	case 0x10:		// Write flash page
+	{
+		uint32_t addr = (waddr * 2) % part->flash;
+		addr -= addr % part->flash_page;
+		for ( uint16_t i = 0; i < part->flash_page; i++ )
+			flash[addr + i] &= flash_buf[i];
+		memset(flash_buf, 0xff, part->flash_page);
+		stats.flash_written += part->flash_page;
+		stats.pages++;
+		busy_until = hal_ticks + MICROS_TO_TICKS(T_WRITE);
+		break;
+	}
+	}
+}
+
+/* hv_level() - 1 if PIN_HV switches 12 V onto RESET
+*/
+static uint8_t hv_level(void)
+{
+	uint8_t on = (PORTC & DDRC & _BV(PIN_HV::bit)) != 0;
+	return on == (HVSP_HV_ON == HIGH);
+}
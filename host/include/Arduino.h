@@ -0,0 +1,90 @@
+/* Arduino.h - the parts of the arduino core that Joat uses, for the host build. See host/hal.h
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H	1
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#define HIGH			1
+#define LOW				0
+#define INPUT			0
+#define OUTPUT			1
+#define INPUT_PULLUP	2
+#define DEFAULT			1
+
+#define DEC		10
+#define HEX		16
+
+#define _BV(b)	(1 << (b))
+
+static const uint8_t A0 = 14;
+static const uint8_t A1 = 15;
+static const uint8_t A2 = 16;
+static const uint8_t A3 = 17;
+static const uint8_t A4 = 18;
+static const uint8_t A5 = 19;
+static const uint8_t A6 = 20;
+static const uint8_t A7 = 21;
+
+extern void pinMode(uint8_t pin, uint8_t mode);
+extern void digitalWrite(uint8_t pin, uint8_t val);
+extern int digitalRead(uint8_t pin);
+extern int analogRead(uint8_t pin);
+extern void analogReference(uint8_t mode);
+
+// Provided by timing.cpp, as on the target
+extern void delay(unsigned long ms);
+extern void delayMicroseconds(unsigned int us);
+
+// F() strings are ordinary strings on the host
+class __FlashStringHelper;
+#define F(s)	(reinterpret_cast<const __FlashStringHelper *>(s))
+
+/* Print - the arduino Print class, with the same number formatting
+*/
+class Print
+{
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t c) = 0;
+
+	size_t print(const __FlashStringHelper *s);
+	size_t print(const char *s);
+	size_t print(char c);
+	size_t print(unsigned char n, int base = DEC);
+	size_t print(int n, int base = DEC);
+	size_t print(unsigned int n, int base = DEC);
+	size_t print(long n, int base = DEC);
+	size_t print(unsigned long n, int base = DEC);
+	size_t print(double n, int digits = 2);
+
+private:
+	size_t print_number(unsigned long n, uint8_t base);
+	size_t print_float(double n, uint8_t digits);
+};
+
+#endif
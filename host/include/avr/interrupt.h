@@ -0,0 +1,47 @@
+/* avr/interrupt.h - interrupts for the host build. See host/hal.h
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H	1
+
+#include <stdint.h>
+
+/* The simulation is single-threaded, so an interrupt can only happen when the simulated clock
+ * advances (see hal_advance()). An interrupt handler becomes an ordinary function with the vector's
+ * name, which hal_pending() calls when the interrupt's flag and enable bits are set and interrupts
+ * are enabled. As on the target, the handler runs with interrupts disabled, and an interrupt that
+ * becomes pending between cli() and sei() runs at the sei().
+*/
+#define ISR(vector, ...)	extern "C" void vector(void); void vector(void)
+
+extern volatile uint8_t hal_ie;
+extern void hal_pending(void);
+
+static inline void cli(void)
+{
+	hal_ie = 0;
+}
+
+static inline void sei(void)
+{
+	hal_ie = 1;
+	hal_pending();
+}
+
+#endif
@@ -0,0 +1,170 @@
+/* avr/io.h - simulated ATmega328P registers for the host build. See host/hal.h
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H	1
+
+#include <stdint.h>
+
+/* Only the registers and bits that Joat uses are here. Add more as needed.
+*/
+
+// Registers whose access has side effects
+class hal_tcnt1_t
+{
+public:
+	operator uint16_t();					// Advances the simulated clock
+	hal_tcnt1_t &operator=(uint16_t v);
+};
+
+class hal_spdr_t
+{
+public:
+	operator uint8_t();						// Byte received by the last transfer; clears SPIF
+	hal_spdr_t &operator=(uint8_t b);		// Starts (and completes) a transfer
+};
+
+// Status register: only the I bit is simulated (hal_ie). Writing it with the I bit set enables interrupts.
+class hal_sreg_t
+{
+public:
+	operator uint8_t();
+	hal_sreg_t &operator=(uint8_t v);
+};
+
+// Interrupt flag registers: writing a 1 clears the flag
+class hal_flags_t
+{
+public:
+	uint8_t v;
+	operator uint8_t() const				{ return v; }
+	hal_flags_t &operator=(uint8_t b)		{ v &= (uint8_t)~b; return *this; }
+};
+
+// PORTB: a write advances the clock (hal_portb_step), so that a model on the pins (hal_pin_hook) sees
+// every change, even the short pulses of the protocols that are bit-banged with direct port I/O.
+// Writes through a reference (iopin.h) are ordinary writes, seen when the clock next advances.
+class hal_port_t
+{
+public:
+	volatile uint8_t v;
+	operator volatile uint8_t &()			{ return v; }
+	hal_port_t &operator=(int b);
+	hal_port_t &operator|=(int b)			{ return *this = v | b; }
+	hal_port_t &operator&=(int b)			{ return *this = v & b; }
+};
+
+extern hal_tcnt1_t TCNT1;
+extern hal_spdr_t SPDR;
+extern hal_sreg_t SREG;
+
+// Ports. The PINx registers are updated from PORTx, DDRx and the simulated inputs (hal_ext)
+// whenever the clock advances.
+extern volatile uint8_t PINB, DDRB;
+extern hal_port_t PORTB;
+extern volatile uint8_t PINC, DDRC, PORTC;
+extern volatile uint8_t PIND, DDRD, PORTD;
+
+// Timer 1
+extern volatile uint8_t TCCR1A, TCCR1B, TCCR1C, TIMSK1;
+extern hal_flags_t TIFR1;
+extern volatile uint16_t ICR1, OCR1A, OCR1B;
+
+#define TOIE1	0
+#define OCIE1A	1
+#define OCIE1B	2
+#define ICIE1	5
+#define TOV1	0
+#define OCF1A	1
+#define OCF1B	2
+#define ICF1	5
+#define ICES1	6
+#define CS10	0
+
+// SPI
+extern volatile uint8_t SPCR, SPSR;
+
+#define SPR0	0
+#define SPR1	1
+#define CPHA	2
+#define CPOL	3
+#define MSTR	4
+#define DORD	5
+#define SPE		6
+#define SPIE	7
+#define SPI2X	0
+#define WCOL	6
+#define SPIF	7
+
+// ADC
+extern volatile uint8_t ADCSRA, ADMUX;
+
+#define ADPS0	0
+#define ADPS1	1
+#define ADPS2	2
+#define ADIE	3
+#define ADIF	4
+#define ADATE	5
+#define ADSC	6
+#define ADEN	7
+
+// USART0
+extern volatile uint8_t UCSR0A, UCSR0B, UCSR0C, UDR0;
+extern volatile uint16_t UBRR0;
+
+#define U2X0	1
+#define UDRE0	5
+#define RXC0	7
+#define UCSZ00	1
+#define UCSZ01	2
+#define TXEN0	3
+#define RXEN0	4
+#define UDRIE0	5
+#define TXCIE0	6
+#define RXCIE0	7
+
+// Pin change interrupts
+extern volatile uint8_t PCICR, PCMSK0, PCMSK1, PCMSK2;
+extern hal_flags_t PCIFR;
+
+#define PCIE0	0
+#define PCIE1	1
+#define PCIE2	2
+#define PCIF0	0
+#define PCIF1	1
+#define PCIF2	2
+
+// Timer 2. Only CTC mode is simulated (see hal.cpp)
+extern volatile uint8_t TCCR2A, TCCR2B, TCNT2, OCR2A, OCR2B, TIMSK2;
+extern hal_flags_t TIFR2;
+
+#define WGM20	0
+#define WGM21	1
+#define COM2A0	6
+#define COM2A1	7
+#define CS20	0
+#define CS21	1
+#define CS22	2
+#define OCIE2A	1
+#define OCF2A	1
+
+// Reset cause
+extern volatile uint8_t MCUSR;
+
+#endif
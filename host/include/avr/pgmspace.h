@@ -0,0 +1,40 @@
+/* avr/pgmspace.h - program memory access for the host build. See host/hal.h
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H	1
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+// There's only one address space on the host
+#define PROGMEM
+#define PSTR(s)				(s)
+#define pgm_read_byte(a)	(*(const uint8_t *)(a))
+#define pgm_read_word(a)	(*(const uint16_t *)(a))
+#define pgm_read_dword(a)	(*(const uint32_t *)(a))
+#define pgm_read_ptr(a)		(*(void * const *)(a))
+#define pgm_read_float(a)	(*(const float *)(a))
+#define memcpy_P			memcpy
+#define strlen_P			strlen
+#define strcmp_P			strcmp
+#define strcasecmp_P		strcasecmp
+
+#endif
@@ -0,0 +1,44 @@
+/* util/crc16.h - CRC functions for the host build
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef HOST_UTIL_CRC16_H
+#define HOST_UTIL_CRC16_H	1
+
+#include <stdint.h>
+
+/* _crc_xmodem_update() - the C equivalent given in the avr-libc documentation
+ *
+ * CRC-16/XMODEM: polynomial 0x1021, MSB first
+*/
+static inline uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data)
+{
+	crc ^= (uint16_t)data << 8;
+
+	for ( uint8_t i = 0; i < 8; i++ )
+	{
+		if ( crc & 0x8000 )
+			crc = (crc << 1) ^ 0x1021;
+		else
+			crc <<= 1;
+	}
+
+	return crc;
+}
+
+#endif
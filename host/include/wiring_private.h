@@ -0,0 +1,28 @@
+/* wiring_private.h - register bit macros for the host build. See host/hal.h
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef HOST_WIRING_PRIVATE_H
+#define HOST_WIRING_PRIVATE_H	1
+
+#include <Arduino.h>
+
+#define sbi(reg, bit)	((reg) |= _BV(bit))
+#define cbi(reg, bit)	((reg) &= ~_BV(bit))
+
+#endif
@@ -0,0 +1,498 @@
+/* isp-target.cpp - a simulated AVR on the ISP pins, for the host build
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <Arduino.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "joat.h"
+#include "timing.h"
+#include "avr-programmer.h"
+#include "hal.h"
+
+/* The target implements the serial programming instruction set of the AVR datasheets ("Serial
+ * Programming Instruction Set"): programming enable, chip erase, RDY/BSY polling, signature, fuse and
+ * lock bytes, flash page loading and writing, and EEPROM byte and page writes.
+ *
+ * It is connected to PIN_RESET, PIN_MOSI, PIN_MISO and PIN_SCK (and powered by PIN_VCC) in two ways:
+ *	- when the SPI hardware is enabled, each byte written to SPDR is a transfer (hal_spi_target)
+ *	- otherwise the pins are followed (hal_pin_hook): MOSI is sampled on the rising edge of SCK and
+ *	  MISO changes on the falling edge, as the bit-banged transfers of the slow SPI clocks expect
+ *
+ * Like a real AVR, the target:
+ *	- only listens while RESET is low; releasing RESET ends programming mode
+ *	- needs each half of the SCK period to be at least 2 of its own clock cycles. When SCK is faster
+ *	  it misses a bit, so the echo of the programming enable instruction and the signature are wrong.
+ *	  The clock is that of the factory fuse settings (1 MHz for the ATmegas) unless another is given,
+ *	  so the programmer has to negotiate a slower SPI clock.
+ *	- is busy for the datasheet's programming time (tWD_FLASH etc.) after a write or an erase. While it
+ *	  is busy, RDY/BSY returns 1, reads return 0xff and writes are ignored.
+ *	- can only clear bits when it writes a flash page, so a page that isn't erased first is corrupted
+ *
+ * A programming session ends when RESET is released. The target then prints the length of the session
+ * in simulated time and what was done on stderr, for bench/isp-bench.sh.
+*/
+
+typedef struct isp_part_s
+{
+	const char *name;
+	uint8_t sig[3];
+	uint32_t flash;				// Size of flash in bytes
+	uint16_t flash_page;		// Size of a flash page in bytes
+	uint16_t eeprom;			// Size of EEPROM in bytes
+	uint8_t eeprom_page;		// Size of an EEPROM page in bytes
+	uint8_t fuse[3];			// Factory settings: low, high, extended
+	uint32_t fck;				// Clock frequency (Hz) with the factory fuses
+	uint16_t t_flash;			// tWD_FLASH (us)
+	uint16_t t_eeprom;			// tWD_EEPROM (us)
+	uint16_t t_erase;			// tWD_ERASE (us)
+	uint16_t t_fuse;			// tWD_FUSE (us)
+} isp_part_t;
+
+static const isp_part_t isp_parts[] =
+{
+	{ "m1284p",	{ 0x1e, 0x97, 0x05 }, 131072, 256, 4096, 8, { 0x62, 0x99, 0xff }, 1000000, 4500, 3600, 9000, 4500 },
+	{ "m328p",	{ 0x1e, 0x95, 0x0f }, 32768, 128, 1024, 4, { 0x62, 0xd9, 0xff }, 1000000, 4500, 3600, 9000, 4500 },
+	{ "m168p",	{ 0x1e, 0x94, 0x0b }, 16384, 128,  512, 4, { 0x62, 0xdf, 0xf9 }, 1000000, 4500, 3600, 9000, 4500 },
+	{ "m88p",	{ 0x1e, 0x93, 0x0f },  8192,  64,  512, 4, { 0x62, 0xdf, 0xf9 }, 1000000, 4500, 3600, 9000, 4500 },
+	{ "t85",	{ 0x1e, 0x93, 0x0b },  8192,  64,  512, 4, { 0x62, 0xdf, 0xff }, 1000000, 4500, 4000, 9000, 4500 },
+	{ "t45",	{ 0x1e, 0x92, 0x06 },  4096,  64,  256, 4, { 0x62, 0xdf, 0xff }, 1000000, 4500, 4000, 9000, 4500 },
+	{ "t13",	{ 0x1e, 0x90, 0x07 },  1024,  32,   64, 4, { 0x6a, 0xff, 0xff }, 1200000, 4500, 4000, 9000, 4500 },
+};
+
+#define ISP_NPARTS		(sizeof(isp_parts) / sizeof(isp_parts[0]))
+
+// Bits of port B
+#define ISP_VCC_BIT		PIN_VCC::bit
+#define ISP_RESET_BIT	PIN_RESET::bit
+
+typedef struct isp_stats_s
+{
+	uint64_t t_start;			// Time of the programming enable instruction
+	uint32_t flash_written;		// Bytes in the flash pages that were written
+	uint32_t flash_read;
+	uint32_t eeprom_written;
+	uint32_t eeprom_read;
+	uint32_t pages;				// Flash and EEPROM page writes
+	uint32_t erases;
+	uint32_t instructions;
+} isp_stats_t;
+
+static const isp_part_t *part;
+static uint8_t *flash;
+static uint8_t *eeprom;
+static uint8_t *flash_buf;				// The page buffer
+static uint8_t eeprom_buf[8];
+static uint8_t eeprom_buf_used;			// Bit n: eeprom_buf[n] has been loaded
+static uint8_t fuse[3];
+static uint8_t lock;
+static uint8_t ext_addr;				// Extended address byte (4D instruction)
+static uint32_t fck;					// The target's clock frequency
+
+static uint8_t in_reset;
+static uint8_t enabled;					// Programming enabled
+static uint8_t instr[4];				// The instruction being received
+static uint8_t nbytes;					// Number of bytes of instr[] received
+static uint8_t reply;					// Byte on MISO during the last byte of an instruction
+static uint64_t busy_until;
+static isp_stats_t stats;
+
+// Pin-level transfers
+static uint8_t pins_last;
+static uint8_t pin_bits;				// Number of bits of the current byte
+static uint8_t pin_in;					// Bits received
+static uint8_t pin_out;					// Byte being sent
+static uint64_t pin_edge;				// Time of the last SCK edge
+static uint8_t pin_fast;				// An SCK half period in the current byte was too short
+
+static uint8_t isp_spi(uint8_t mosi);
+static void isp_pins(void);
+static uint8_t isp_out(void);
+static void isp_in(uint8_t b);
+static void isp_execute(void);
+static void isp_reset(uint8_t level);
+static uint8_t isp_busy(void);
+static void isp_wait(uint16_t us);
+
+/* isp_target_attach() - connect a simulated part to the ISP pins
+ *
+ * The part is one of the names in isp_parts[] (avrdude's names), optionally followed by the target's
+ * clock frequency in Hz, e.g. "t85:128000". The memories are erased.
+*/
+int isp_target_attach(const char *name)
+{
+	size_t len = strcspn(name, ":");
+
+	for ( unsigned i = 0; i < ISP_NPARTS; i++ )
+	{
+		if ( strlen(isp_parts[i].name) == len && strncmp(name, isp_parts[i].name, len) == 0 )
+			part = &isp_parts[i];
+	}
+
+	if ( part == 0 )
+	{
+		fprintf(stderr, "isp: unknown part %s. Known parts:", name);
+		for ( unsigned i = 0; i < ISP_NPARTS; i++ )
+			fprintf(stderr, " %s", isp_parts[i].name);
+		fprintf(stderr, "\n");
+		return -1;
+	}
+
+	flash = (uint8_t *)malloc(part->flash);
+	flash_buf = (uint8_t *)malloc(part->flash_page);
+	eeprom = (uint8_t *)malloc(part->eeprom);
+	memset(flash, 0xff, part->flash);
+	memset(flash_buf, 0xff, part->flash_page);
+	memset(eeprom, 0xff, part->eeprom);
+	memcpy(fuse, part->fuse, sizeof(fuse));
+	lock = 0xff;
+	fck = (name[len] == ':') ? strtoul(&name[len+1], 0, 0) : part->fck;
+	in_reset = 0;
+
+	hal_spi_target = isp_spi;
+	hal_pin_hook = isp_pins;
+	return 0;
+}
+
+/* isp_target_load() - fill the flash from a binary file, as if the part had been programmed
+*/
+int isp_target_load(const char *file)
+{
+	FILE *f = fopen(file, "rb");
+
+	if ( f == 0 || part == 0 )
+		return -1;
+
+	size_t n = fread(flash, 1, part->flash, f);
+	fclose(f);
+	return (n > 0) ? 0 : -1;
+}
+
+/* isp_spi() - a byte transfer by the SPI hardware
+ *
+ * The SPI clock is the 16 MHz clock divided by 2, 4, ... 128 (SPR1, SPR0 and SPI2X). A clock that is too
+ * fast for the target shifts the bytes by one bit in both directions.
+*/
+static uint8_t isp_spi(uint8_t mosi)
+{
+	static const uint8_t div[4] = { 4, 16, 64, 128 };
+	uint32_t d = div[SPCR & 0x03];
+
+	if ( SPSR & _BV(SPI2X) )
+		d /= 2;
+
+	if ( (PORTB & _BV(ISP_VCC_BIT)) == 0 )
+		return 0xff;
+
+	isp_reset((((PORTB & DDRB) | ~DDRB) & _BV(ISP_RESET_BIT)) != 0);
+	if ( !in_reset )
+		return 0xff;
+
+	uint8_t out = isp_out();
+
+	if ( (uint64_t)d * fck < (uint64_t)4 * HZ )
+	{
+		out = (out >> 1) | 0x80;
+		mosi = (mosi << 1) | 0x01;
+	}
+
+	isp_in(mosi);
+	return out;
+}
+
+/* isp_pins() - follow the pins when they are driven by port I/O
+ *
+ * Called whenever the clock advances, so a pin that changes twice between two calls isn't seen. The
+ * bit-banged transfers wait half an SCK period after each change.
+*/
+static void isp_pins(void)
+{
+	uint8_t b = (PORTB & DDRB) | ~DDRB;			// Inputs float high
+	uint8_t rise = b & ~pins_last;
+	uint8_t fall = ~b & pins_last;
+
+	pins_last = b;
+
+	if ( (PORTB & _BV(ISP_VCC_BIT)) == 0 )
+	{
+		isp_reset(1);			// Unpowered: not in reset, not listening
+		hal_ext[0] |= _BV(SPI_MISO_BIT);
+		return;
+	}
+
+	isp_reset((b & _BV(ISP_RESET_BIT)) != 0);
+
+	if ( !in_reset || (SPCR & _BV(SPE)) != 0 )
+	{
+		pin_bits = 0;
+		hal_ext[0] |= _BV(SPI_MISO_BIT);
+		return;
+	}
+
+	if ( (rise | fall) & _BV(SPI_SCK_BIT) )
+	{
+		if ( (hal_ticks - pin_edge) * fck < (uint64_t)2 * HZ )
+			pin_fast = 1;
+		pin_edge = hal_ticks;
+	}
+
+	if ( rise & _BV(SPI_SCK_BIT) )
+	{
+		if ( pin_bits == 0 )
+		{
+			pin_out = isp_out();
+			pin_fast = 0;
+		}
+		pin_in = (pin_in << 1) | ((b & _BV(SPI_MOSI_BIT)) ? 1 : 0);
+		pin_bits++;
+	}
+	else if ( fall & _BV(SPI_SCK_BIT) )
+	{
+		if ( pin_bits >= 8 )
+		{
+			pin_bits = 0;
+			isp_in(pin_fast ? (uint8_t)((pin_in << 1) | 0x01) : pin_in);
+		}
+	}
+
+	// MISO: the bit that the next rising edge samples
+	uint8_t next = (pin_bits == 0) ? isp_out() : pin_out;
+	if ( next & (0x80 >> (pin_bits & 0x07)) )
+		hal_ext[0] |= _BV(SPI_MISO_BIT);
+	else
+		hal_ext[0] &= (uint8_t)~_BV(SPI_MISO_BIT);
+}
+
+/* isp_reset() - follow the level of the RESET pin, which is active low
+*/
+static void isp_reset(uint8_t level)
+{
+	uint8_t reset = !level;
+
+	if ( reset == in_reset )
+		return;
+
+	in_reset = reset;
+	nbytes = 0;
+	pin_bits = 0;
+
+	if ( !reset && enabled )
+	{
+		enabled = 0;
+		fprintf(stderr, "isp: %s session %.6f s, flash %u written %u read, eeprom %u written %u read, "
+				"%u page writes, %u erases, %u instructions\n",
+				part->name, (double)(hal_ticks - stats.t_start) / HZ,
+				stats.flash_written, stats.flash_read, stats.eeprom_written, stats.eeprom_read,
+				stats.pages, stats.erases, stats.instructions);
+	}
+}
+
+/* isp_out() - the byte that the target sends during the next byte of the instruction
+ *
+ * In sync, the target echoes the previous byte, except in the last byte of an instruction, which
+ * has the result of a read.
+*/
+static uint8_t isp_out(void)
+{
+	if ( nbytes == 0 )
+		return 0xff;
+	if ( nbytes < 3 )
+		return instr[nbytes - 1];
+	return reply;
+}
+
+/* isp_in() - a byte received from the programmer
+*/
+static void isp_in(uint8_t b)
+{
+	instr[nbytes++] = b;
+
+	if ( nbytes == 3 )
+	{
+		// The reply is sent during the fourth byte, so work it out now
+		reply = instr[2];
+		isp_execute();
+	}
+	else if ( nbytes == 4 )
+	{
+		nbytes = 0;
+		if ( enabled )
+		{
+			stats.instructions++;
+			isp_execute();
+		}
+
+		// The programming enable instruction is only recognised when the target is in sync
+		else if ( instr[0] == 0xac && instr[1] == 0x53 )
+		{
+			enabled = 1;
+			memset(&stats, 0, sizeof(stats));
+			stats.t_start = hal_ticks;
+		}
+	}
+}
+
+/* isp_execute() - carry out an instruction
+ *
+ * Called twice per instruction: after the third byte (nbytes == 3) to work out the reply for a read, and
+ * after the fourth byte (nbytes == 0) to carry out a write.
+*/
+static void isp_execute(void)
+{
+	uint8_t rd = (nbytes == 3);
+	uint16_t a16 = (uint16_t)((instr[1] << 8) | instr[2]);
+	uint8_t v = instr[3];
+
+	if ( rd )
+	{
+		if ( !enabled )
+			return;
+		if ( instr[0] == 0xf0 )
+		{
+			reply = isp_busy();
+			return;
+		}
+		if ( isp_busy() )
+		{
+			reply = 0xff;
+			return;
+		}
+
+		switch ( instr[0] )
+		{
+		case 0x20:		// Read flash, low byte
+		case 0x28:		// Read flash, high byte
+		{
+			uint32_t addr = ((((uint32_t)ext_addr << 16) | a16) * 2 + (instr[0] == 0x28)) % part->flash;
+			reply = flash[addr];
+			stats.flash_read++;
+			break;
+		}
+		case 0xa0:		// Read EEPROM
+			reply = eeprom[a16 % part->eeprom];
+			stats.eeprom_read++;
+			break;
+		case 0x30:		// Read signature byte
+			reply = (instr[2] < 3) ? part->sig[instr[2] & 0x03] : 0xff;
+			break;
+		case 0x50:		// Read low fuse (0x00) or extended fuse (0x08)
+			reply = (instr[1] == 0x08) ? fuse[2] : fuse[0];
+			break;
+		case 0x58:		// Read high fuse (0x08) or lock bits (0x00)
+			reply = (instr[1] == 0x08) ? fuse[1] : lock;
+			break;
+		case 0x38:		// Read calibration byte
+			reply = 0x80;
+			break;
+		}
+		return;
+	}
+
+	if ( isp_busy() )
+		return;
+
+	switch ( instr[0] )
+	{
+	case 0xac:
+		switch ( instr[1] & 0xe0 )
+		{
+		case 0x80:		// Chip erase
+			memset(flash, 0xff, part->flash);
+			if ( fuse[1] & 0x08 )		// EESAVE unprogrammed
+				memset(eeprom, 0xff, part->eeprom);
+			lock = 0xff;
+			stats.erases++;
+			isp_wait(part->t_erase);
+			break;
+		case 0xa0:		// Write low (0xa0), high (0xa8) or extended (0xa4) fuse
+			fuse[(instr[1] == 0xa8) ? 1 : (instr[1] == 0xa4) ? 2 : 0] = v;
+			isp_wait(part->t_fuse);
+			break;
+		case 0xe0:		// Write lock bits
+			lock &= v | 0xc0;
+			isp_wait(part->t_fuse);
+			break;
+		}
+		break;
+
+	case 0x40:		// Load flash page buffer, low byte
+	case 0x48:		// Load flash page buffer, high byte
+		flash_buf[((a16 * 2) + (instr[0] == 0x48)) % part->flash_page] = v;
+		break;
+
+	case 0x4c:		// Write flash page
+	{
+		uint32_t addr = ((((uint32_t)ext_addr << 16) | a16) * 2) % part->flash;
+		addr -= addr % part->flash_page;
+		for ( uint16_t i = 0; i < part->flash_page; i++ )
+			flash[addr + i] &= flash_buf[i];
+		memset(flash_buf, 0xff, part->flash_page);
+		stats.flash_written += part->flash_page;
+		stats.pages++;
+		isp_wait(part->t_flash);
+		break;
+	}
+
+	case 0x4d:		// Load extended address byte
+		ext_addr = instr[2];
+		break;
+
+	case 0xc0:		// Write EEPROM byte
+		eeprom[a16 % part->eeprom] = v;
+		stats.eeprom_written++;
+		isp_wait(part->t_eeprom);
+		break;
+
+	case 0xc1:		// Load EEPROM page buffer
+	{
+		uint8_t i = instr[2] % part->eeprom_page;
+		eeprom_buf[i] = v;
+		eeprom_buf_used |= (uint8_t)(1 << i);
+		break;
+	}
+
+	case 0xc2:		// Write EEPROM page; only the loaded bytes are written
+	{
+		uint16_t addr = a16 % part->eeprom;
+		addr -= addr % part->eeprom_page;
+		for ( uint8_t i = 0; i < part->eeprom_page; i++ )
+		{
+			if ( eeprom_buf_used & (1 << i) )
+			{
+				eeprom[addr + i] = eeprom_buf[i];
+				stats.eeprom_written++;
+			}
+		}
+		eeprom_buf_used = 0;
+		stats.pages++;
+		isp_wait(part->t_eeprom);
+		break;
+	}
+	}
+}
+
+static uint8_t isp_busy(void)
+{
+	return hal_ticks < busy_until;
+}
+
+static void isp_wait(uint16_t us)
+{
+	busy_until = hal_ticks + MICROS_TO_TICKS(us);
+}
@@ -0,0 +1,161 @@
+/* joat-host.cpp - run the Joat firmware on Linux against the simulated hardware
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <Arduino.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "timing.h"
+#include "hal.h"
+
+// joat.cpp's main(), renamed by the Makefile
+extern int joat_main(void);
+
+static char mode_script[64];
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -m mode     select a mode from the menu (0 = frequency, 1 = capacitance, ...; see joat.h)\n"
+		"  -k keys     button script: c = change, o = ok, . = pause (100 ms per key)\n"
+		"  -p          use a pseudo-terminal for the serial port; its name is printed on stdout\n"
+		"  -t secs     stop after this many seconds of simulated time\n"
+		"  -a pin=val  a/d reading (0..1023) for analogue input A0..A7, e.g. -a 7=512\n"
+		"  -f hz       square wave on ICP1 (D8) for the frequency meter\n"
+		"  -i ticks    time that each interrupt handler takes (default 0)\n"
+		"  -l          loopback: the generator output (D11) drives ICP1 (D8), for the self-test\n"
+		"  -q          only show the display when the simulation ends\n"
+		"  -T part     simulated AVR on the ISP pins, e.g. m328p, or t85:128000 for a 128 kHz clock\n"
+		"  -I file     binary image to put in the simulated AVR's flash (after -T)\n"
+		"  -H part     simulated ATtiny on the HVSP pins, e.g. t85, with RSTDISBL programmed\n"
+		"  -X part     simulated ATtiny4/5/9/10 on the TPI pins, e.g. t10\n"
+		"  -B baud     simulated device on the UART bridge's pins, that echoes what it receives\n"
+		"Without -p the serial port is stdin/stdout. After a reset by a remote command the\n"
+		"program runs again with the same options, but without -m and -k.\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *keys = 0;
+	int opt;
+	int restarted = hal_restarted(argv);
+
+	while ( (opt = getopt(argc, argv, "m:k:pt:a:f:i:lqT:I:H:X:B:")) != -1 )
+	{
+		switch ( opt )
+		{
+		case 'm':
+		{
+			// CHANGE once for each mode up to the one wanted (the menu starts before the first mode), then OK
+			int m = atoi(optarg);
+			int i = 0;
+			mode_script[i++] = '.';
+			while ( m-- >= 0 && i < (int)sizeof(mode_script) - 2 )
+				mode_script[i++] = 'c';
+			mode_script[i++] = 'o';
+			mode_script[i] = '\0';
+			keys = mode_script;
+			break;
+		}
+
+		case 'k':
+			keys = optarg;
+			break;
+
+		case 'p':
+			if ( restarted )
+				break;
+			if ( hal_uart_open_pty() != 0 )
+			{
+				perror("pty");
+				return 1;
+			}
+			break;
+
+		case 't':
+			hal_limit = (uint64_t)(atof(optarg) * HZ);
+			break;
+
+		case 'a':
+		{
+			int pin, val;
+			if ( sscanf(optarg, "%d=%d", &pin, &val) != 2 || pin < 0 || pin > 7 )
+				usage(argv[0]);
+			hal_adc[pin] = (uint16_t)val;
+			break;
+		}
+
+		case 'f':
+			hal_icp_period = (double)HZ / atof(optarg);
+			break;
+
+		case 'i':
+			hal_isr_ticks = (uint16_t)atoi(optarg);
+			break;
+
+		case 'l':
+			hal_loopback = 1;
+			break;
+
+		case 'q':
+			hal_show_lcd = 0;
+			break;
+
+		case 'T':
+			if ( isp_target_attach(optarg) != 0 )
+				return 1;
+			break;
+
+		case 'H':
+			if ( hvsp_target_attach(optarg) != 0 )
+				return 1;
+			break;
+
+		case 'X':
+			if ( tpi_target_attach(optarg) != 0 )
+				return 1;
+			break;
+
+		case 'B':
+			if ( bridge_target_attach(optarg) != 0 )
+				return 1;
+			break;
+
+		case 'I':
+			if ( isp_target_load(optarg) != 0 )
+			{
+				fprintf(stderr, "%s: can't load %s into the target\n", argv[0], optarg);
+				return 1;
+			}
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if ( keys != 0 && !restarted )
+		hal_buttons(keys);
+
+	joat_main();
+	return 0;
+}
@@ -0,0 +1,72 @@
+/* lcd-host.cpp - the display for the host build
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Replaces lcd.cpp. The characters go to hal_lcd, which the simulation shows on stderr when it
+ * changes; see hal_lcd_dump().
+*/
+#include <Arduino.h>
+#include <string.h>
+#include "timing.h"
+#include "lcd.h"
+#include "hal.h"
+
+lcd_t lcd;
+hal_lcd_t hal_lcd;
+
+void lcd_t::begin(void)
+{
+	hal_lcd.cols = LCD_COLS;
+	hal_lcd.rows = LCD_ROWS;
+	hal_advance(MICROS_TO_TICKS(50000));		// lcd.cpp waits 50 ms for the display to power up
+	clear();
+}
+
+void lcd_t::clear(void)
+{
+	for ( uint8_t r = 0; r < LCD_ROWS; r++ )
+	{
+		memset(hal_lcd.text[r], ' ', LCD_COLS);
+		hal_lcd.text[r][LCD_COLS] = '\0';
+	}
+	hal_lcd.col = hal_lcd.row = 0;
+	hal_lcd.changed = 1;
+	hal_lcd.when = hal_ticks;
+}
+
+void lcd_t::setCursor(uint8_t c, uint8_t r)
+{
+	hal_lcd.col = c;
+	hal_lcd.row = (r >= LCD_ROWS) ? LCD_ROWS - 1 : r;
+}
+
+size_t lcd_t::write(uint8_t c)
+{
+	if ( hal_lcd.col < hal_lcd.cols )
+	{
+		if ( hal_lcd.text[hal_lcd.row][hal_lcd.col] != (char)c )
+		{
+			hal_lcd.text[hal_lcd.row][hal_lcd.col] = (char)c;
+			hal_lcd.changed = 1;
+			hal_lcd.when = hal_ticks;
+		}
+		hal_lcd.col++;
+	}
+	hal_advance(MICROS_TO_TICKS(100));			// lcd.cpp waits 100 us after each character
+	return 1;
+}
@@ -0,0 +1,51 @@
+/* mem-host.cpp - stack and RAM usage for the host build
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Replaces mem-paint.cpp. The host's RAM says nothing about the Nano's, so all the sizes are 0
+ * and no stack depth is ever recorded.
+*/
+#include <Arduino.h>
+#include "memory.h"
+
+mem_record_t mem_record;
+
+void mem_mode_start(uint8_t mode)
+{
+	mem_record.mode = mode;
+}
+
+uint16_t mem_data_size(void)
+{
+	return 0;
+}
+
+uint16_t mem_stack_now(void)
+{
+	return 0;
+}
+
+uint16_t mem_free_now(void)
+{
+	return 0;
+}
+
+uint16_t mem_free_min(void)
+{
+	return 0;
+}
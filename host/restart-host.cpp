@@ -0,0 +1,30 @@
+/* restart-host.cpp - start the firmware again, for the host build
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Replaces restart.cpp. hal_reset() runs the program again, which puts the simulated peripherals back
+ * to their reset state and keeps what the jump to address 0 keeps on the Nano.
+*/
+#include <Arduino.h>
+#include "joat.h"
+#include "hal.h"
+
+void restart(void)
+{
+	hal_reset();
+}
@@ -0,0 +1,500 @@
+/* tpi-target.cpp - a simulated ATtiny4/5/9/10 on the TPI pins, for the host build
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <Arduino.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "joat.h"
+#include "timing.h"
+#include "avr-programmer.h"
+#include "hal.h"
+
+/* The target implements the Tiny Programming Interface of the ATtiny4/5/9/10 datasheet ("Programming
+ * interface"): the SLD, SST, SSTPR, SIN, SOUT, SLDCS, SSTCS and SKEY instructions, and the NVM controller's
+ * chip erase, section erase and word write commands.
+ *
+ * It follows the pins (hal_pin_hook), wired as avr-tpi.cpp describes: RESET on PIN_RESET, TPICLK on
+ * PIN_SCK, and TPIDATA on PIN_MISO and, through a resistor, on PIN_MOSI. The bit-banged frames are seen
+ * because each write of PORTB advances the clock. Like a real ATtiny10, the target:
+ *	- is only powered when PIN_VCC is high, and only listens while RESET is low
+ *	- needs at least 16 idle bits after RESET goes low before the first frame
+ *	- samples TPIDATA on the rising edge of TPICLK. A frame is a 0 start bit, 8 bits LSB first, an even
+ *	  parity bit and two 1 stop bits. A frame with a bad parity or stop bit is ignored, and so are the
+ *	  frames that belong to the same instruction.
+ *	- answers SLD, SIN and SLDCS after the guard time (TPIPCR), by pulling TPIDATA low for the 0 bits
+ *	- only gives access to the NVM after the key has been sent with SKEY (TPISR.NVMEN)
+ *	- is busy (NVMCSR.NVMBSY) for the programming time after an erase or a word write, and ignores
+ *	  stores to the NVM until it has finished
+ *	- can only clear bits when it writes a word, so a word that isn't erased first is corrupted
+ * The session ends when RESET is released. The target then prints the length of the session in simulated
+ * time, the configuration byte and what was done on stderr, for bench/tpi-test.sh.
+ *
+ * The flash has a program in it at the start.
+*/
+
+typedef struct tpi_part_s
+{
+	const char *name;
+	uint8_t sig[3];
+	uint16_t flash;				// Size of flash in bytes
+} tpi_part_t;
+
+static const tpi_part_t tpi_parts[] =
+{
+	{ "t4",		{ 0x1e, 0x8f, 0x0a },  512 },
+	{ "t5",		{ 0x1e, 0x8f, 0x09 },  512 },
+	{ "t9",		{ 0x1e, 0x90, 0x08 }, 1024 },
+	{ "t10",	{ 0x1e, 0x90, 0x03 }, 1024 },
+};
+
+#define TPI_NPARTS		(sizeof(tpi_parts) / sizeof(tpi_parts[0]))
+
+#define T_WORD			2500		// Word write (us)
+#define T_ERASE			9000		// Chip or section erase (us)
+
+// The data space
+#define A_LOCK			0x3f00		// NVM lock bits
+#define A_CONFIG		0x3f40		// Configuration byte
+#define A_CALIB			0x3f80		// Calibration byte
+#define A_SIG			0x3fc0		// Signature
+#define A_FLASH			0x4000
+
+// I/O and control/status registers
+#define NVMCSR			0x32
+#define NVMCMD			0x33
+#define NVMBSY			0x80
+#define TPISR			0x00
+#define TPIPCR			0x02
+#define TPIIR			0x0f
+#define NVMEN			0x02
+
+// Bits of port B
+#define VCC_BIT			PIN_VCC::bit
+#define RESET			_BV(PIN_RESET::bit)
+#define TPICLK			_BV(SPI_SCK_BIT)
+#define MOSI			_BV(SPI_MOSI_BIT)
+#define MISO			_BV(SPI_MISO_BIT)
+
+// Operands that the next frame carries
+enum { op_none, op_sst, op_sstpr, op_sout, op_sstcs, op_skey };
+
+typedef struct tpi_stats_s
+{
+	uint64_t t_start;			// Time when NVMEN was set
+	uint32_t flash_written;
+	uint32_t flash_read;
+	uint32_t words;
+	uint32_t erases;
+	uint32_t frames;
+	uint32_t errors;			// Frames with a bad parity or stop bit
+	uint32_t lost;				// Stores to the NVM while it was busy
+} tpi_stats_t;
+
+static const tpi_part_t *part;
+static uint8_t *flash;
+static uint8_t config;
+static uint8_t lock;
+
+static uint8_t listening;				// Powered and RESET low
+static uint8_t session;					// NVMEN has been set since RESET went low
+static uint8_t pins_last;
+static uint8_t idle;					// Idle bits since RESET went low, up to 16
+static uint8_t nbits;					// Bits of the current frame received
+static uint8_t rx, parity, frame_bad;
+static uint8_t tx_guard;				// Idle bits before the answer's start bit
+static uint16_t tx;						// The answer's bits, LSB first
+static uint8_t tx_bits;					// Number of bits of tx still to send
+static uint8_t tx_drive;				// Level that the target drives onto TPIDATA (1 = released)
+static uint8_t operand;					// op_xxx
+static uint8_t operand_arg;				// The register or pointer byte of the instruction
+static uint8_t key_n;
+static uint8_t key_ok;
+static uint8_t tpisr, tpipcr;
+static uint8_t nvmcmd;
+static uint16_t ptr;
+static uint8_t word_lo;					// Low byte of a word write
+static uint64_t busy_until;
+static tpi_stats_t stats;
+
+// The NVM key, in the order it is sent
+static const uint8_t tpi_key[8] = { 0xff, 0x88, 0xd8, 0xcd, 0x45, 0xab, 0x89, 0x12 };
+
+// Idle bits of guard time for TPIPCR.GT
+static const uint8_t guard_bits[8] = { 128, 64, 32, 16, 8, 4, 2, 2 };
+
+static void tpi_pins(void);
+static void tpi_listen(uint8_t on);
+static void tpi_bit(uint8_t bit);
+static void tpi_frame(uint8_t b);
+static void tpi_answer(uint8_t b);
+static uint8_t tpi_load(uint16_t a);
+static void tpi_store(uint16_t a, uint8_t v);
+static uint8_t *tpi_nvm(uint16_t a);
+
+/* tpi_target_attach() - connect a simulated ATtiny4/5/9/10 to the TPI pins
+ *
+ * The part is one of the names in tpi_parts[] (avrdude's names).
+*/
+int tpi_target_attach(const char *name)
+{
+	for ( unsigned i = 0; i < TPI_NPARTS; i++ )
+	{
+		if ( strcmp(name, tpi_parts[i].name) == 0 )
+			part = &tpi_parts[i];
+	}
+
+	if ( part == 0 )
+	{
+		fprintf(stderr, "tpi: unknown part %s. Known parts:", name);
+		for ( unsigned i = 0; i < TPI_NPARTS; i++ )
+			fprintf(stderr, " %s", tpi_parts[i].name);
+		fprintf(stderr, "\n");
+		return -1;
+	}
+
+	flash = (uint8_t *)malloc(part->flash);
+	for ( uint16_t i = 0; i < part->flash; i++ )
+		flash[i] = (uint8_t)(i * 7 + 3);
+	config = 0xff;
+	lock = 0xff;
+
+	hal_pin_hook = tpi_pins;
+	return 0;
+}
+
+/* tpi_pins() - follow the pins
+ *
+ * Called whenever the clock advances. A write of PORTB advances it, so each edge of TPICLK is seen.
+ * The answer's bit is put on TPIDATA at the rising edge that the programmer samples it after.
+*/
+static void tpi_pins(void)
+{
+	uint8_t b = (PORTB & DDRB) | ~DDRB;			// Inputs float high
+	uint8_t rise = b & ~pins_last;
+
+	pins_last = b;
+	tpi_listen((PORTB & _BV(VCC_BIT)) != 0 && (b & RESET) == 0);
+
+	if ( listening && (rise & TPICLK) )
+	{
+		if ( tx_guard > 0 )
+		{
+			tx_guard--;
+			tx_drive = 1;
+		}
+		else if ( tx_bits > 0 )
+		{
+			tx_drive = tx & 0x01;
+			tx >>= 1;
+			tx_bits--;
+		}
+		else
+		{
+			tx_drive = 1;
+			tpi_bit((b & MOSI) != 0);
+		}
+	}
+
+	// TPIDATA is MISO. MOSI drives it through a resistor, so the target can pull it low; the programmer
+	// keeps MOSI high while it receives.
+	if ( tx_drive && (b & MOSI) )
+		hal_ext[0] |= MISO;
+	else
+		hal_ext[0] &= (uint8_t)~MISO;
+}
+
+/* tpi_listen() - follow power and RESET. Releasing RESET ends the session.
+*/
+static void tpi_listen(uint8_t on)
+{
+	if ( on == listening )
+		return;
+
+	listening = on;
+	idle = 0;
+	nbits = 0;
+	tx_guard = 0;
+	tx_bits = 0;
+	tx_drive = 1;
+	operand = op_none;
+	tpipcr = 0;
+
+	if ( !on && session )
+	{
+		fprintf(stderr, "tpi: %s session %.6f s, config %02x, lock %02x, flash %u written %u read, "
+				"%u word writes, %u erases, %u frames, %u errors, %u lost\n",
+				part->name, (double)(hal_ticks - stats.t_start) / HZ, config, lock,
+				stats.flash_written, stats.flash_read, stats.words, stats.erases, stats.frames,
+				stats.errors, stats.lost);
+	}
+	tpisr = 0;
+	session = 0;
+}
+
+/* tpi_bit() - a bit received from the programmer
+*/
+static void tpi_bit(uint8_t bit)
+{
+	if ( nbits == 0 )
+	{
+		// A start bit only counts after 16 idle bits since RESET went low
+		if ( bit )
+		{
+			if ( idle < 16 )
+				idle++;
+		}
+		else if ( idle >= 16 )
+		{
+			nbits = 1;
+			rx = 0;
+			parity = 0;
+			frame_bad = 0;
+		}
+		return;
+	}
+
+	if ( nbits <= 8 )
+	{
+		rx |= bit << (nbits - 1);
+		parity ^= bit;
+	}
+	else if ( nbits == 9 )
+		frame_bad |= (parity ^ bit);
+	else
+		frame_bad |= !bit;
+
+	nbits++;
+	if ( nbits > 11 )
+	{
+		nbits = 0;
+		if ( frame_bad )
+		{
+			stats.errors++;
+			operand = op_none;
+		}
+		else
+			tpi_frame(rx);
+	}
+}
+
+/* tpi_frame() - carry out an instruction, or take its operand
+*/
+static void tpi_frame(uint8_t b)
+{
+	stats.frames++;
+
+	switch ( operand )
+	{
+	case op_sst:
+		tpi_store(ptr, b);
+		if ( operand_arg & 0x04 )
+			ptr++;
+		operand = op_none;
+		return;
+
+	case op_sstpr:
+		if ( operand_arg & 0x01 )
+			ptr = (ptr & 0x00ff) | ((uint16_t)b << 8);
+		else
+			ptr = (ptr & 0xff00) | b;
+		operand = op_none;
+		return;
+
+	case op_sout:
+		if ( operand_arg == NVMCMD )
+			nvmcmd = b;
+		operand = op_none;
+		return;
+
+	case op_sstcs:
+		if ( operand_arg == TPISR )
+			tpisr = b & NVMEN;
+		else if ( operand_arg == TPIPCR )
+			tpipcr = b & 0x07;
+		operand = op_none;
+		return;
+
+	case op_skey:
+		if ( b != tpi_key[key_n] )
+			key_ok = 0;
+		if ( ++key_n < sizeof(tpi_key) )
+			return;
+		if ( key_ok && !(tpisr & NVMEN) )
+		{
+			tpisr |= NVMEN;
+			session = 1;
+			memset(&stats, 0, sizeof(stats));
+			stats.t_start = hal_ticks;
+		}
+		operand = op_none;
+		return;
+	}
+
+	if ( (b & 0xfb) == 0x20 )					// SLD, SLD ptr+
+	{
+		tpi_answer(tpi_load(ptr));
+		if ( b & 0x04 )
+			ptr++;
+	}
+	else if ( (b & 0xfb) == 0x60 )				// SST, SST ptr+
+	{
+		operand = op_sst;
+		operand_arg = b;
+	}
+	else if ( (b & 0xfe) == 0x68 )				// SSTPR
+	{
+		operand = op_sstpr;
+		operand_arg = b;
+	}
+	else if ( (b & 0x80) == 0x00 && (b & 0x10) )	// SIN
+	{
+		uint8_t a = ((b >> 1) & 0x30) | (b & 0x0f);
+		tpi_answer((a == NVMCSR) ? ((hal_ticks < busy_until) ? NVMBSY : 0) : (a == NVMCMD) ? nvmcmd : 0);
+	}
+	else if ( (b & 0x90) == 0x90 )				// SOUT
+	{
+		operand = op_sout;
+		operand_arg = ((b >> 1) & 0x30) | (b & 0x0f);
+	}
+	else if ( (b & 0xf0) == 0x80 )				// SLDCS
+	{
+		uint8_t a = b & 0x0f;
+		tpi_answer((a == TPISR) ? tpisr : (a == TPIPCR) ? tpipcr : (a == TPIIR) ? 0x80 : 0);
+	}
+	else if ( (b & 0xf0) == 0xc0 )				// SSTCS
+	{
+		operand = op_sstcs;
+		operand_arg = b & 0x0f;
+	}
+	else if ( b == 0xe0 )						// SKEY
+	{
+		operand = op_skey;
+		key_n = 0;
+		key_ok = 1;
+	}
+}
+
+/* tpi_answer() - send a frame after the guard time
+*/
+static void tpi_answer(uint8_t b)
+{
+	uint8_t p = 0;
+
+	for ( uint8_t i = 0; i < 8; i++ )
+		p ^= (b >> i) & 0x01;
+
+	// Start bit, data, parity, two stop bits
+	tx = ((uint16_t)b << 1) | ((uint16_t)p << 9) | (0x03 << 10);
+	tx_bits = 12;
+	tx_guard = guard_bits[tpipcr];
+}
+
+/* tpi_load() - SLD. The NVM can only be read with NVMEN set.
+*/
+static uint8_t tpi_load(uint16_t a)
+{
+	if ( !(tpisr & NVMEN) )
+		return 0x00;
+
+	if ( a >= A_SIG && a < A_SIG + 3 )
+		return part->sig[a - A_SIG];
+	if ( a == A_CALIB )
+		return 0x5a;
+	if ( a >= A_FLASH && a < A_FLASH + part->flash )
+		stats.flash_read++;
+
+	uint8_t *p = tpi_nvm(a);
+	return (p == 0) ? 0x00 : *p;
+}
+
+/* tpi_store() - SST. The NVM command says what a store to the NVM does.
+ *
+ * A word write latches the low byte (even address) and writes the word when the high byte is stored.
+ * An erase is triggered by a store to the high byte of a word in the section.
+*/
+static void tpi_store(uint16_t a, uint8_t v)
+{
+	uint8_t *p = tpi_nvm(a & ~1u);
+
+	if ( !(tpisr & NVMEN) || p == 0 )
+		return;
+
+	if ( hal_ticks < busy_until )
+	{
+		stats.lost++;
+		return;
+	}
+
+	switch ( nvmcmd )
+	{
+	case 0x1d:		// Word write
+		if ( (a & 1) == 0 )
+		{
+			word_lo = v;
+			return;
+		}
+		p[0] &= word_lo;
+		if ( a >= A_FLASH )
+		{
+			p[1] &= v;
+			stats.flash_written += 2;
+		}
+		stats.words++;
+		busy_until = hal_ticks + MICROS_TO_TICKS(T_WORD);
+		break;
+
+	case 0x10:		// Chip erase: flash and lock bits
+		if ( (a & 1) == 0 || a < A_FLASH )
+			return;
+		memset(flash, 0xff, part->flash);
+		lock = 0xff;
+		stats.erases++;
+		busy_until = hal_ticks + MICROS_TO_TICKS(T_ERASE);
+		break;
+
+	case 0x14:		// Section erase: the code section or the configuration section
+		if ( (a & 1) == 0 )
+			return;
+		if ( a >= A_FLASH )
+			memset(flash, 0xff, part->flash);
+		else if ( a == (A_CONFIG | 1) )
+			config = 0xff;
+		else
+			return;
+		stats.erases++;
+		busy_until = hal_ticks + MICROS_TO_TICKS(T_ERASE);
+		break;
+	}
+}
+
+/* tpi_nvm() - the location of an NVM byte in the data space, or 0 if it isn't writable NVM
+ *
+ * The lock and configuration sections are one word each, of which only the low byte is used.
+*/
+static uint8_t *tpi_nvm(uint16_t a)
+{
+	if ( a >= A_FLASH && a < A_FLASH + part->flash )
+		return &flash[a - A_FLASH];
+	if ( a == A_LOCK )
+		return &lock;
+	if ( a == A_CONFIG )
+		return &config;
+	return 0;
+}
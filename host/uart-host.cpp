@@ -0,0 +1,458 @@
+/* uart-host.cpp - the serial port for the host build; replaces uart.cpp
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <Arduino.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <termios.h>
+#include <pthread.h>
+#include <time.h>
+#include "uart.h"
+#include "timing.h"
+#include "hal.h"
+
+/* The serial link is stdin/stdout, or the master side of a pseudo-terminal (hal_uart_open_pty()).
+ *
+ * The firmware waits for received characters by polling uart_rx_head, which the USART_RX interrupt
+ * updates. That doesn't advance the simulated clock, so the receiver runs in its own thread, just as
+ * the interrupt runs independently of the firmware. The thread also writes the transmitted characters
+ * to the host, so that a reply gets sent while the firmware is waiting for the next command.
+ *
+ * The link has the speed that the firmware selects with uart_init(). Each received character is
+ * stamped with the simulated time at which its stop bit would have arrived at exactly that speed, and
+ * uart_getc() doesn't return it before that time. The transmitter runs at the speed that the USART's baud
+ * rate register gives (uart.cpp), e.g. 57143 baud for 57600, or 58824 with uart_init_fast(), and uart_putc()
+ * waits (in simulated time) when the transmit buffer is full.
+ * So the simulated time of a programming session includes the time on the wire. Time that the
+ * firmware spends waiting for the host costs nothing: uart_getc() doesn't advance the clock while the
+ * buffer is empty, and when the firmware goes back to its idle loop after replying to a command,
+ * hal_uart_wait() stops the clock until the host sends the next one. So the simulated time is that of
+ * a host that answers at once.
+ *
+ * The host can send more than the firmware's receive buffer holds. The characters wait in rxq, and
+ * hal_uart_rx() moves uart_rx_head on, like the USART_RX interrupt, as they arrive in simulated time and
+ * as long as the buffer has room. A character that arrives while the buffer is full would be lost on the
+ * Nano: see rx_check().
+ *
+ * A pty stays open when there's no host, so when the link has been idle for a while the simulation is
+ * slowed down to about real time. Otherwise it would use a whole CPU, and simulated years would go by
+ * before avrdude was started.
+*/
+
+#define UART_IDLE		MILLIS_TO_TICKS(500)
+#define UART_FLUSH_MS	1				// Interval at which the receiver thread sends pending output
+#define UART_HOST_WAIT	50				// Time (ms, real) that hal_uart_wait() waits for the host
+#define UART_HOST_PAUSE	2				// Time (ms, real) after which the host is pausing on purpose
+
+#define UART_RXQ_SIZE	4096			// Characters that the host can send ahead of the firmware. A power of 2
+#define UART_RXQ_MASK	(UART_RXQ_SIZE-1)
+
+static uint8_t rxq[UART_RXQ_SIZE];
+static uint64_t rxq_due[UART_RXQ_SIZE];	// Arrival time of each character in rxq
+static volatile uint32_t rxq_in;		// Characters put into rxq by the receiver thread
+static uint32_t rxq_arrived;			// Characters that have arrived (rxq_due <= hal_ticks)
+static volatile uint32_t rxq_out;		// Characters taken by the firmware
+
+volatile uint8_t uart_rx_head;
+volatile uint8_t uart_rx_tail;
+volatile uint8_t uart_rx_overrun;
+
+static int fd_in = 0;
+static int fd_out = 1;
+static int fd_slave = -1;				// Held open so that the pty doesn't hang up when the host closes it
+
+static pthread_t rx_thread;
+static pthread_mutex_t tx_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile uint8_t rx_open;		// The firmware has initialised the uart
+static volatile uint8_t rx_eof;			// The host has closed the link
+static volatile uint64_t rx_last;		// Time at which the last character arrived
+static volatile uint8_t host_active;	// A character has arrived since the last hal_uart_wait() timeout
+
+static uint8_t outbuf[1024];			// Characters sent but not yet written to the host
+static uint16_t out_n;
+
+static volatile uint32_t byte_ticks = (HZ * 10) / 115200;
+static uint32_t tx_ticks = 10 * 8 * 17;	// A character sent by the USART: 10 bits of 8 * (UBRR0 + 1) ticks
+static uint64_t tx_free;				// Time at which the transmitter has sent everything in its buffer
+
+static void *rx_main(void *arg);
+static void rx_put(uint8_t c);
+static void rx_window(void);
+static void rx_check(uint64_t now);
+static void tx_write(void);
+static void uart_start(uint32_t baud, uint32_t div);
+
+/* hal_uart_open_pty() - use a pseudo-terminal for the serial link
+ *
+ * Prints the name of the slave side (the "serial port" for avrdude) on stdout.
+*/
+int hal_uart_open_pty(void)
+{
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if ( fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0 )
+		return -1;
+
+	const char *name = ptsname(fd);
+	fd_slave = open(name, O_RDWR | O_NOCTTY);
+	if ( fd_slave < 0 )
+		return -1;
+
+	struct termios t;
+	tcgetattr(fd_slave, &t);
+	cfmakeraw(&t);
+	tcsetattr(fd_slave, TCSANOW, &t);
+
+	fd_in = fd_out = fd;
+	printf("%s\n", name);
+	fflush(stdout);
+	return 0;
+}
+
+/* hal_uart_get_pty() - the file descriptors of the pseudo-terminal (-1 if there isn't one)
+ *
+ * hal_uart_use_pty() takes them over in the program that hal_reset() starts, so that the host
+ * stays connected over a reset.
+*/
+void hal_uart_get_pty(int *fd, int *slave)
+{
+	*fd = ( fd_slave >= 0 ) ? fd_in : -1;
+	*slave = fd_slave;
+}
+
+void hal_uart_use_pty(int fd, int slave)
+{
+	fd_in = fd_out = fd;
+	fd_slave = slave;
+}
+
+/* rx_main() - the receiver thread
+*/
+static void *rx_main(void *arg)
+{
+	(void)arg;
+
+	for (;;)
+	{
+		struct pollfd p;
+		uint8_t buf[256];
+
+		p.fd = fd_in;
+		p.events = POLLIN;
+
+		if ( poll(&p, 1, UART_FLUSH_MS) <= 0 )
+		{
+			hal_uart_flush();
+			continue;
+		}
+
+		ssize_t n = read(fd_in, buf, sizeof(buf));
+
+		if ( n > 0 )
+		{
+			for ( ssize_t i = 0; i < n; i++ )
+				rx_put(buf[i]);
+		}
+		else if ( n == 0 )
+		{
+			// End of input. When the firmware has taken everything, end the simulation. The firmware
+			// might be waiting in uart_getc() or polling uart_available(), so do it from here if need be.
+			while ( rxq_out != rxq_in )
+				usleep(1000);
+			usleep(100000);
+			rx_eof = 1;
+			usleep(100000);
+			hal_exit(0);
+		}
+		else if ( errno == EIO )
+		{
+			// The pty has no slave at the moment
+			usleep(10000);
+		}
+	}
+}
+
+/* rx_put() - put a character into rxq
+ *
+ * The characters of a burst follow each other on the wire; the first one after a pause arrives one
+ * character time after the host sent it. Nothing is lost here: if rxq is full, wait for the firmware.
+*/
+static void rx_put(uint8_t c)
+{
+	while ( rxq_in - rxq_out >= UART_RXQ_SIZE )
+		usleep(100);
+
+	uint64_t now = __atomic_load_n(&hal_ticks, __ATOMIC_RELAXED);
+	uint64_t due = rxq_due[(rxq_in - 1) & UART_RXQ_MASK] + byte_ticks;
+
+	if ( due < now + byte_ticks )
+		due = now + byte_ticks;
+
+	rxq[rxq_in & UART_RXQ_MASK] = c;
+	rxq_due[rxq_in & UART_RXQ_MASK] = due;
+	rx_last = now;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	rxq_in++;
+	host_active = 1;
+}
+
+/* hal_uart_rx() - called whenever the clock advances: make the characters that have arrived visible
+*/
+void hal_uart_rx(void)
+{
+	if ( rxq_arrived != rxq_in && rxq_due[rxq_arrived & UART_RXQ_MASK] <= hal_ticks )
+	{
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		while ( rxq_arrived != rxq_in && rxq_due[rxq_arrived & UART_RXQ_MASK] <= hal_ticks )
+			rxq_arrived++;
+		rx_window();
+	}
+}
+
+/* rx_window() - show the firmware the characters that have arrived, as many as fit in its buffer
+*/
+static void rx_window(void)
+{
+	uint32_t n = rxq_arrived - rxq_out;
+
+	if ( n > UART_RXBUF_MASK )
+		n = UART_RXBUF_MASK;
+
+	uart_rx_tail = rxq_out & UART_RXBUF_MASK;
+	uart_rx_head = (rxq_out + n) & UART_RXBUF_MASK;
+}
+
+/* rx_check() - look for an overrun when the firmware takes a character at time now
+ *
+ * The character UART_RXBUF_MASK places further on would have found the buffer full if it arrived
+ * before now, and the Nano would have lost it. That is counted in uart_rx_overrun (the characters
+ * aren't dropped, so the simulation carries on) and reported on stderr the first time.
+*/
+static void rx_check(uint64_t now)
+{
+	uint32_t i = rxq_out + UART_RXBUF_MASK;
+
+	if ( i - rxq_out < rxq_in - rxq_out && rxq_due[i & UART_RXQ_MASK] < now )
+	{
+		if ( uart_rx_overrun == 0 )
+			fprintf(stderr, "uart: receive overrun at %.6f s\n", (double)rxq_due[i & UART_RXQ_MASK] / HZ);
+		if ( uart_rx_overrun < 255 )
+			uart_rx_overrun++;
+	}
+}
+
+/* hal_uart_wait() - called when the firmware hasn't done any I/O for a while (see hal_advance())
+ *
+ * If the firmware has taken everything that the host sent and the reply is on its way, the host is
+ * working out what to send next; avrdude takes a fraction of a millisecond for that, but it is enough
+ * for thousands of turns round the firmware's idle loop. So wait for the host, in real time, without
+ * advancing the clock. A host that doesn't answer within UART_HOST_WAIT has finished (or is a person),
+ * and the clock runs again until the next character arrives.
+ *
+ * A pause longer than UART_HOST_PAUSE is deliberate, e.g. avrdude's wait after a chip erase with
+ * the STK500v1 protocol, so the target has to see it: the return value is the number of ticks to
+ * add to the clock.
+*/
+uint32_t hal_uart_wait(void)
+{
+	if ( !host_active || rx_eof || rxq_out != rxq_in || tx_free > hal_ticks )
+		return 0;
+
+	hal_uart_flush();
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	for ( int i = 0; i < UART_HOST_WAIT * 10 && rxq_out == rxq_in; i++ )
+		usleep(100);
+
+	if ( rxq_out == rxq_in )
+	{
+		host_active = 0;
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	uint64_t us = (uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_nsec / 1000 - t0.tv_nsec / 1000;
+
+	return ( us > UART_HOST_PAUSE * 1000 ) ? (uint32_t)MICROS_TO_TICKS(us) : 0;
+}
+
+/* hal_uart_poll() - called once per simulated millisecond
+*/
+void hal_uart_poll(void)
+{
+	if ( fd_slave >= 0 && (hal_ticks - rx_last) > UART_IDLE )
+		usleep(1000);
+}
+
+/* hal_uart_flush() - write everything that has been sent to the host
+*/
+void hal_uart_flush(void)
+{
+	pthread_mutex_lock(&tx_lock);
+	tx_write();
+	pthread_mutex_unlock(&tx_lock);
+}
+
+static void tx_write(void)
+{
+	uint16_t i = 0;
+
+	while ( i < out_n )
+	{
+		ssize_t n = write(fd_out, &outbuf[i], out_n - i);
+		if ( n <= 0 )
+		{
+			if ( errno != EINTR && errno != EAGAIN )
+				break;
+			continue;
+		}
+		i += (uint16_t)n;
+	}
+	out_n = 0;
+}
+
+/* The uart.h API
+*/
+void uart_init(uint32_t baud)
+{
+	uart_start(baud, ((F_CPU / 8) + (baud / 2)) / baud);
+}
+
+void uart_init_fast(uint32_t baud)
+{
+	uart_start(baud, (F_CPU / 8) / baud);
+}
+
+/* uart_start() - the host sends at exactly baud; the USART's clock divides by 8 * div (UBRR0 + 1)
+*/
+static void uart_start(uint32_t baud, uint32_t div)
+{
+	rxq_out = rxq_arrived = rxq_in;
+	rx_window();
+	uart_rx_overrun = 0;
+	byte_ticks = (uint32_t)((HZ * 10 + baud / 2) / baud);
+	tx_ticks = 10 * 8 * div;
+
+	// Nothing is read until the uart is initialised, so that a command stream on stdin
+	// isn't lost while the mode is being selected.
+	if ( !rx_open )
+	{
+		rx_open = 1;
+		pthread_create(&rx_thread, 0, rx_main, 0);
+	}
+}
+
+uint8_t uart_getc(void)
+{
+	uint32_t t = rxq_out;
+
+	if ( t == rxq_in )
+	{
+		hal_uart_flush();
+		while ( t == rxq_in )
+		{
+			if ( rx_eof )
+				hal_exit(0);		// Nothing more will arrive
+			usleep(50);
+		}
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	if ( rxq_due[t & UART_RXQ_MASK] > hal_ticks )
+		hal_advance((uint32_t)(rxq_due[t & UART_RXQ_MASK] - hal_ticks));		// Still on the wire
+
+	rx_check(hal_ticks);
+
+	uint8_t c = rxq[t & UART_RXQ_MASK];
+	rxq_out = t + 1;
+	if ( (int32_t)(rxq_out - rxq_arrived) > 0 )
+		rxq_arrived = rxq_out;
+	rx_window();
+	hal_io_ticks = hal_ticks;
+	return c;
+}
+
+uint8_t uart_peek(uint8_t i)
+{
+	return rxq[(rxq_out + i) & UART_RXQ_MASK];
+}
+
+void uart_read(uint8_t *buf, uint16_t n)
+{
+	while ( n > 0 )
+	{
+		*buf++ = uart_getc();
+		n--;
+	}
+}
+
+void uart_putc(uint8_t c)
+{
+	const uint64_t bufticks = (uint64_t)UART_TXBUF_SIZE * tx_ticks;
+
+	if ( tx_free < hal_ticks )
+		tx_free = hal_ticks;
+	if ( tx_free - hal_ticks > bufticks )
+		hal_advance((uint32_t)(tx_free - hal_ticks - bufticks));		// Wait for space in the buffer
+	tx_free += tx_ticks;
+	hal_io_ticks = hal_ticks;
+
+	pthread_mutex_lock(&tx_lock);
+	if ( out_n >= sizeof(outbuf) )
+		tx_write();
+	outbuf[out_n++] = c;
+	pthread_mutex_unlock(&tx_lock);
+}
+
+void uart_write(const uint8_t *buf, uint16_t n)
+{
+	while ( n > 0 )
+	{
+		uart_putc(*buf++);
+		n--;
+	}
+}
+
+void uart_puts_P(const char *s)
+{
+	while ( *s != '\0' )
+		uart_putc((uint8_t)*s++);
+}
+
+void uart_flush(void)
+{
+	if ( tx_free > hal_ticks )
+		hal_advance((uint32_t)(tx_free - hal_ticks));
+	hal_uart_flush();
+}
+
+uint8_t uart_tx_space(void)
+{
+	uint64_t queued = 0;
+
+	if ( tx_free > hal_ticks )
+		queued = (tx_free - hal_ticks + tx_ticks - 1) / tx_ticks;
+	return ( queued >= UART_TXBUF_SIZE - 1 ) ? 0 : (uint8_t)(UART_TXBUF_SIZE - 1 - queued);
+}
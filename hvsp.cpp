@@ -0,0 +1,530 @@
+/* hvsp.cpp - high-voltage serial programmer for 8- and 14-pin ATtinys
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <Arduino.h>
+#include <util/crc16.h>
+#include "joat.h"
+#include "timing.h"
+#include "hvsp.h"
+#include "avr-programmer.h"
+#include "avr-isp.h"
+
+/* High-voltage serial programming (HVSP) is the way to recover an ATtiny whose fuses disable
+ * serial programming (RSTDISBL, SPIEN or a clock source that isn't there).
+ *
+ * Every instruction is an 11-bit frame that is clocked into the target on SDI (data) and SII (instruction)
+ * at the same time: a 0 start bit, 8 bits MSB first and two 0 stop bits. The target samples SDI and SII
+ * on the rising edge of SCI and shifts out a byte on SDO during the data bits. SCI is also the target's
+ * clock, so there's no minimum speed; the datasheets only require SCI to be high and low for at least 110 ns
+ * each, which is less than two CPU cycles of the nano. The frames are generated with direct port I/O.
+ *
+ * After a write or erase the target holds SDO low until it's finished, so SDO is polled instead of waiting
+ * for the worst-case time.
+ *
+ * The instructions are the same for all the HVSP devices (ATtiny13, 24/44/84 and 25/45/85).
+*/
+
+// Error codes (displayed as FAIL Exx)
+#define HVSP_E_NO12V		0x30	// No 12 V supply
+#define HVSP_E_DEVICE		0x31	// Signature not in the device table
+#define HVSP_E_TIMEOUT		0x32	// SDO didn't go high after a write or erase
+#define HVSP_E_FUSE			0x33	// Fuses don't read back correctly
+#define HVSP_E_IMAGE		0x34	// The stored image is for a different device
+#define HVSP_E_VERIFY		0x35	// CRC of a flash page doesn't match
+
+// Actions
+#define HVSP_FUSERESET		0		// Write the factory default fuses
+#define HVSP_ERASE			1		// Chip erase (clears the lock bits), then write the default fuses
+#define HVSP_IMAGE			2		// Chip erase, write and verify the stored image, then write the default fuses
+#define HVSP_NACTIONS		3
+
+// Devices and their factory default fuses
+typedef struct hvsp_device_s
+{
+	char name[4];
+	uint8_t sig1;
+	uint8_t sig2;
+	uint8_t lfuse;
+	uint8_t hfuse;
+	uint8_t efuse;
+	uint8_t nfuses;			// 2 = no extended fuse
+	uint8_t pagewords;		// Flash page size in words
+} hvsp_device_t;
+
+static const hvsp_device_t PROGMEM hvsp_devices[] =
+{
+	{	"t13",	0x90, 0x07,		0x6a, 0xff, 0xff,	2,	16	},
+	{	"t24",	0x91, 0x0b,		0x62, 0xdf, 0xff,	3,	16	},
+	{	"t44",	0x92, 0x07,		0x62, 0xdf, 0xff,	3,	32	},
+	{	"t84",	0x93, 0x0c,		0x62, 0xdf, 0xff,	3,	32	},
+	{	"t25",	0x91, 0x08,		0x62, 0xdf, 0xff,	3,	16	},
+	{	"t45",	0x92, 0x06,		0x62, 0xdf, 0xff,	3,	32	},
+	{	"t85",	0x93, 0x0b,		0x62, 0xdf, 0xff,	3,	32	}
+};
+
+#define HVSP_NDEVICES	(sizeof(hvsp_devices)/sizeof(hvsp_devices[0]))
+
+static uint8_t hvsp_fuses[3];		// Fuses read back by hvsp_check_fuses()
+
+static uint8_t select_action(void);
+static uint8_t hvsp_run(uint8_t action);
+static uint8_t hv_present(void);
+static void hvsp_enter(void);
+static void hvsp_exit(void);
+static uint8_t hvsp_xfer(uint8_t sdi, uint8_t sii);
+static uint8_t hvsp_wait(void);
+static uint8_t hvsp_read_sig(uint8_t n);
+static const hvsp_device_t *hvsp_find(uint8_t sig1, uint8_t sig2);
+static uint8_t hvsp_erase(void);
+static uint8_t hvsp_write_fuses(const hvsp_device_t *dev);
+static uint8_t hvsp_write_fuse(uint8_t sii_a, uint8_t sii_b, uint8_t value);
+static uint8_t hvsp_check_fuses(const hvsp_device_t *dev);
+static uint8_t hvsp_write_image(const hvsp_device_t *dev);
+static uint8_t hvsp_verify_image(void);
+static void show_fuses(void);
+static void show_hex(uint8_t v);
+
+void avr_hvsp(void)
+{
+	uint8_t action = select_action();
+
+	PIN_HV::set(!HVSP_HV_ON);
+	PIN_HV::output();
+	vcc(0);
+	PIN_VCC::output();
+
+	for (;;)
+	{
+		uint8_t err;
+
+		lcd.setCursor(0,1);
+		lcd.print(F("Insert AVR  [OK]"));
+
+		while ( button() != btn_ok )
+		{	// Wait
+		}
+
+		wipe_row(1);
+
+		if ( hv_present() )
+		{
+			hvsp_enter();
+			err = hvsp_run(action);
+			if ( err == 0 )
+				show_fuses();
+			hvsp_exit();
+		}
+		else
+		{
+			err = HVSP_E_NO12V;
+		}
+
+		if ( err != 0 )
+		{
+			wipe_row(1);
+			lcd.print(F("FAIL E"));
+			show_hex(err);
+		}
+
+		lcd.setCursor(12, 1);
+		lcd.print(F("[OK]"));
+
+		while ( button() != btn_ok )
+		{	// Wait
+		}
+	}
+}
+
+/* select_action() - select what to do to each device
+*/
+static uint8_t select_action(void)
+{
+	uint8_t action = 0;
+	uint8_t update = 1;
+	uint8_t b;
+
+	do
+	{
+		if ( update )
+		{
+			lcd.setCursor(0, 1);
+			switch ( action )
+			{
+			case HVSP_ERASE:	fill_spaces(16 - lcd.print(F("Erase+fuses")));	break;
+			case HVSP_IMAGE:	fill_spaces(16 - lcd.print(F("Write image")));	break;
+			default:			fill_spaces(16 - lcd.print(F("Fuse reset")));	break;
+			}
+			update = 0;
+		}
+
+		b = button();
+
+		if ( b == btn_change )
+		{
+			action++;
+			if ( action >= HVSP_NACTIONS )
+				action = 0;
+			update = 1;
+		}
+	} while ( b != btn_ok );
+
+	return action;
+}
+
+/* hvsp_run() - identify the device and carry out the action
+ *
+ * Returns 0 if OK, otherwise an error code
+*/
+static uint8_t hvsp_run(uint8_t action)
+{
+	const hvsp_device_t *dev;
+	char name[4];
+
+	dev = hvsp_find(hvsp_read_sig(1), hvsp_read_sig(2));
+	if ( dev == NULL )
+		return HVSP_E_DEVICE;
+
+	memcpy_P(name, dev->name, sizeof(name));
+	lcd.setCursor(0, 1);
+	lcd.print(name);
+
+	if ( action != HVSP_FUSERESET )
+	{
+		if ( hvsp_erase() )
+			return HVSP_E_TIMEOUT;
+	}
+
+	if ( action == HVSP_IMAGE )
+	{
+		uint8_t err = hvsp_write_image(dev);
+		if ( err == 0 )
+			err = hvsp_verify_image();
+		if ( err != 0 )
+			return err;
+	}
+
+	if ( hvsp_write_fuses(dev) )
+		return HVSP_E_TIMEOUT;
+
+	return hvsp_check_fuses(dev);
+}
+
+/* hv_present() - returns 1 if the 12 V supply is there
+*/
+static uint8_t hv_present(void)
+{
+	return analogRead(PIN_HVMON) >= HVSP_HV_MIN;
+}
+
+/* hvsp_enter() - power up the target in HVSP mode
+ *
+ * See the datasheets, "High-voltage Serial Programming Algorithm": with Vcc and all the lines at 0, apply Vcc,
+ * then 12 V to RESET within 20..60 us. SDI, SII and SDO must stay low for at least 10 us after that to select
+ * HVSP mode. Then SDO is released and the target is ready for instructions 300 us later.
+*/
+static void hvsp_enter(void)
+{
+	vcc(0);
+	PIN_HV::set(!HVSP_HV_ON);
+	HVSP_PORT &= ~(_BV(HVSP_SCI_BIT) | _BV(HVSP_SDI_BIT) | _BV(HVSP_SII_BIT) | _BV(HVSP_SDO_BIT));
+	HVSP_DDR |= _BV(HVSP_SCI_BIT) | _BV(HVSP_SDI_BIT) | _BV(HVSP_SII_BIT) | _BV(HVSP_SDO_BIT);
+	tick_delay(MILLIS_TO_TICKS(50));		// Let Vcc fall
+
+	vcc(1);
+	tick_delay(MICROS_TO_TICKS(40));
+	PIN_HV::set(HVSP_HV_ON);
+	tick_delay(MICROS_TO_TICKS(20));
+
+	HVSP_DDR &= ~_BV(HVSP_SDO_BIT);
+	tick_delay(MICROS_TO_TICKS(300));
+}
+
+/* hvsp_exit() - power down the target and release the lines
+*/
+static void hvsp_exit(void)
+{
+	PIN_HV::set(!HVSP_HV_ON);
+	HVSP_PORT &= ~(_BV(HVSP_SCI_BIT) | _BV(HVSP_SDI_BIT) | _BV(HVSP_SII_BIT));
+	vcc(0);
+	HVSP_DDR &= ~(_BV(HVSP_SCI_BIT) | _BV(HVSP_SDI_BIT) | _BV(HVSP_SII_BIT) | _BV(HVSP_SDO_BIT));
+	tick_delay(MILLIS_TO_TICKS(100));
+}
+
+/* hvsp_xfer() - send one instruction frame and return the byte received on SDO
+ *
+ * The SCI pulse is an sbi followed by a cbi, so it's high for 2 CPU cycles (125 ns). The data and the
+ * SDO sample are handled while SCI is low, which takes much longer than the minimum low time.
+ * SDO changes shortly after a rising edge of SCI, so it's read just before the next one.
+*/
+static uint8_t hvsp_xfer(uint8_t sdi, uint8_t sii)
+{
+	uint8_t sdo = 0;
+	uint8_t p;
+
+	// Start bit
+	HVSP_PORT &= ~(_BV(HVSP_SDI_BIT) | _BV(HVSP_SII_BIT));
+	HVSP_PORT |= _BV(HVSP_SCI_BIT);
+	HVSP_PORT &= ~_BV(HVSP_SCI_BIT);
+
+	for ( uint8_t i = 0; i < 8; i++ )
+	{
+		p = HVSP_PORT & ~(_BV(HVSP_SDI_BIT) | _BV(HVSP_SII_BIT));
+		if ( sdi & 0x80 )
+			p |= _BV(HVSP_SDI_BIT);
+		if ( sii & 0x80 )
+			p |= _BV(HVSP_SII_BIT);
+		HVSP_PORT = p;
+		sdi <<= 1;
+		sii <<= 1;
+
+		sdo <<= 1;
+		if ( HVSP_PIN & _BV(HVSP_SDO_BIT) )
+			sdo |= 0x01;
+
+		HVSP_PORT |= _BV(HVSP_SCI_BIT);
+		HVSP_PORT &= ~_BV(HVSP_SCI_BIT);
+	}
+
+	// Two stop bits
+	HVSP_PORT &= ~(_BV(HVSP_SDI_BIT) | _BV(HVSP_SII_BIT));
+	HVSP_PORT |= _BV(HVSP_SCI_BIT);
+	HVSP_PORT &= ~_BV(HVSP_SCI_BIT);
+	HVSP_PORT |= _BV(HVSP_SCI_BIT);
+	HVSP_PORT &= ~_BV(HVSP_SCI_BIT);
+
+	return sdo;
+}
+
+/* hvsp_wait() - wait for SDO to go high at the end of a write or erase
+ *
+ * The target needs its clock to complete the operation, so SCI keeps running while waiting.
+ * Returns 0 if OK, nonzero if the target is still busy after HVSP_WAIT ms.
+*/
+static uint8_t hvsp_wait(void)
+{
+	uint32_t t0 = (uint32_t)read_ticks();
+
+	while ( (HVSP_PIN & _BV(HVSP_SDO_BIT)) == 0 )
+	{
+		HVSP_PORT |= _BV(HVSP_SCI_BIT);
+		HVSP_PORT &= ~_BV(HVSP_SCI_BIT);
+
+		if ( ((uint32_t)read_ticks() - t0) >= (uint32_t)MILLIS_TO_TICKS(HVSP_WAIT) )
+			return 1;
+	}
+
+	return 0;
+}
+
+/* hvsp_read_sig() - read a signature byte
+*/
+static uint8_t hvsp_read_sig(uint8_t n)
+{
+	hvsp_xfer(0x08, 0x4c);
+	hvsp_xfer(n, 0x0c);
+	hvsp_xfer(0x00, 0x68);
+	return hvsp_xfer(0x00, 0x6c);
+}
+
+/* hvsp_find() - look up a device by its signature. All the devices are Atmel (0x1e)
+*/
+static const hvsp_device_t *hvsp_find(uint8_t sig1, uint8_t sig2)
+{
+	for ( uint8_t i = 0; i < HVSP_NDEVICES; i++ )
+	{
+		if ( pgm_read_byte(&hvsp_devices[i].sig1) == sig1 && pgm_read_byte(&hvsp_devices[i].sig2) == sig2 )
+			return &hvsp_devices[i];
+	}
+	return NULL;
+}
+
+/* hvsp_erase() - chip erase. Returns 0 if OK, nonzero on timeout
+*/
+static uint8_t hvsp_erase(void)
+{
+	hvsp_xfer(0x80, 0x4c);
+	hvsp_xfer(0x00, 0x64);
+	hvsp_xfer(0x00, 0x6c);
+	return hvsp_wait();
+}
+
+/* hvsp_write_fuses() - write the default fuses. Returns 0 if OK, nonzero on timeout
+*/
+static uint8_t hvsp_write_fuses(const hvsp_device_t *dev)
+{
+	uint8_t err = 0;
+
+	err |= hvsp_write_fuse(0x64, 0x6c, pgm_read_byte(&dev->lfuse));
+	err |= hvsp_write_fuse(0x74, 0x7c, pgm_read_byte(&dev->hfuse));
+	if ( pgm_read_byte(&dev->nfuses) > 2 )
+		err |= hvsp_write_fuse(0x66, 0x6e, pgm_read_byte(&dev->efuse));
+
+	return err;
+}
+
+/* hvsp_write_fuse() - write a fuse. sii_a and sii_b select the fuse
+*/
+static uint8_t hvsp_write_fuse(uint8_t sii_a, uint8_t sii_b, uint8_t value)
+{
+	hvsp_xfer(0x40, 0x4c);
+	hvsp_xfer(value, 0x2c);
+	hvsp_xfer(0x00, sii_a);
+	hvsp_xfer(0x00, sii_b);
+	return hvsp_wait();
+}
+
+/* hvsp_check_fuses() - read the fuses back and compare them with the defaults
+ *
+ * The values that were read are left in hvsp_fuses[] for show_fuses() to display.
+*/
+static uint8_t hvsp_check_fuses(const hvsp_device_t *dev)
+{
+	uint8_t nf = pgm_read_byte(&dev->nfuses);
+
+	hvsp_xfer(0x04, 0x4c);
+	hvsp_xfer(0x00, 0x68);
+	hvsp_fuses[0] = hvsp_xfer(0x00, 0x6c);
+	hvsp_xfer(0x04, 0x4c);
+	hvsp_xfer(0x00, 0x7a);
+	hvsp_fuses[1] = hvsp_xfer(0x00, 0x7e);
+	hvsp_fuses[2] = 0xff;
+	if ( nf > 2 )
+	{
+		hvsp_xfer(0x04, 0x4c);
+		hvsp_xfer(0x00, 0x6a);
+		hvsp_fuses[2] = hvsp_xfer(0x00, 0x6e);
+	}
+
+	if ( hvsp_fuses[0] != pgm_read_byte(&dev->lfuse) ||
+		 hvsp_fuses[1] != pgm_read_byte(&dev->hfuse) ||
+		 ( nf > 2 && hvsp_fuses[2] != pgm_read_byte(&dev->efuse) ) )
+		return HVSP_E_FUSE;
+
+	return 0;
+}
+
+/* hvsp_write_image() - write the stored image to the flash
+ *
+ * The flash has been erased, so blank pages are skipped.
+ * Returns 0 if OK, otherwise an error code
+*/
+static uint8_t hvsp_write_image(const hvsp_device_t *dev)
+{
+	uint8_t sig[3];
+	uint16_t pagesize;
+	uint16_t npages;
+
+	image_info(sig, &pagesize, &npages);
+
+	if ( sig[1] != pgm_read_byte(&dev->sig1) || sig[2] != pgm_read_byte(&dev->sig2) ||
+		 pagesize != pgm_read_byte(&dev->pagewords) * 2 )
+		return HVSP_E_IMAGE;
+
+	hvsp_xfer(0x10, 0x4c);		// Write flash
+
+	for ( uint16_t page = 0; page < npages; page++ )
+	{
+		uint16_t offset = page * pagesize;
+		uint16_t waddr = offset / 2;
+
+		if ( image_page_blank(offset) )
+			continue;
+
+		for ( uint16_t i = 0; i < pagesize; i += 2 )
+		{
+			hvsp_xfer((waddr + i/2) & 0xff, 0x0c);		// Address low byte
+			hvsp_xfer(image_byte(offset + i), 0x2c);		// Data low byte
+			hvsp_xfer(image_byte(offset + i + 1), 0x3c);	// Data high byte
+			hvsp_xfer(0x00, 0x7d);							// Latch data
+			hvsp_xfer(0x00, 0x7c);
+		}
+
+		hvsp_xfer(waddr >> 8, 0x1c);					// Address high byte
+		hvsp_xfer(0x00, 0x64);							// Write page
+		hvsp_xfer(0x00, 0x6c);
+		if ( hvsp_wait() )
+			return HVSP_E_TIMEOUT;
+	}
+
+	hvsp_xfer(0x00, 0x4c);		// End of page programming
+	return 0;
+}
+
+/* hvsp_verify_image() - compare the CRC of each page with the image
+ *
+ * The flash is read a word at a time: the address high byte is only loaded when it changes, so a word
+ * takes 5 frames instead of 8 for two separate byte reads.
+ * Returns 0 if OK, otherwise an error code
+*/
+static uint8_t hvsp_verify_image(void)
+{
+	uint8_t sig[3];
+	uint16_t pagesize;
+	uint16_t npages;
+
+	image_info(sig, &pagesize, &npages);
+
+	hvsp_xfer(0x02, 0x4c);		// Read flash
+
+	for ( uint16_t page = 0; page < npages; page++ )
+	{
+		uint16_t offset = page * pagesize;
+		uint16_t crc = 0;
+
+		for ( uint16_t i = 0; i < pagesize; i += 2 )
+		{
+			uint16_t waddr = (offset + i) / 2;
+
+			if ( (page == 0 && i == 0) || (waddr & 0xff) == 0 )
+				hvsp_xfer(waddr >> 8, 0x1c);		// Address high byte
+			hvsp_xfer(waddr & 0xff, 0x0c);			// Address low byte
+			hvsp_xfer(0x00, 0x68);					// Read low byte
+			crc = _crc_xmodem_update(crc, hvsp_xfer(0x00, 0x6c));
+			hvsp_xfer(0x00, 0x78);					// Read high byte
+			crc = _crc_xmodem_update(crc, hvsp_xfer(0x00, 0x7c));
+		}
+
+		if ( crc != image_crc(offset, pagesize) )
+			return HVSP_E_VERIFY;
+	}
+
+	hvsp_xfer(0x00, 0x4c);
+	return 0;
+}
+
+/* show_fuses() - show the fuses that were read back, e.g. "t85 62 df ff ok"
+*/
+static void show_fuses(void)
+{
+	lcd.setCursor(4, 1);
+	for ( uint8_t i = 0; i < 3; i++ )
+	{
+		show_hex(hvsp_fuses[i]);
+		lcd.print(' ');
+	}
+	lcd.print(F("ok"));
+}
+
+/* show_hex() - show a byte as 2 hex digits
+*/
+static void show_hex(uint8_t v)
+{
+	lcd.print(hexdigit((v >> 4) & 0xf));
+	lcd.print(hexdigit(v & 0xf));
+}
@@ -0,0 +1,59 @@
+/* hvsp.h - high-voltage serial programmer for 8- and 14-pin ATtinys
+ *
+ * (c) David Haworth
+ *
+ * This file is part of Joat
+ *
+ * Joat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Joat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Joat is written for an Arduino Nano
+*/
+#ifndef HVSP_H
+#define HVSP_H	1
+
+#include <Arduino.h>
+#include "joat.h"
+#include "iopin.h"
+
+// Pin selection. See joat-nano-pin-spec.csv
+// The serial lines are D10..D13, the AVR programmer's pins, but the target isn't wired as for ISP:
+// D10 goes to pin 2 (SCI) instead of pin 1 (RESET), which goes to the 12 V supply, and D11..D13 go to
+// pins 5..7 as SDI, SII and SDO. Vcc is PIN_VCC (avr-programmer.h).
+typedef iopin<A5> PIN_HV;		// Switches 12 V onto the target's RESET pin
+#define PIN_HVMON		A7		// 12 V monitor (analogue)
+
+// Port and bits of the serial lines, for direct register access
+#define HVSP_PORT		PORTB
+#define HVSP_PIN		PINB
+#define HVSP_DDR		DDRB
+#define HVSP_SCI_BIT	2		// D10 - target pin 2 (clock)
+#define HVSP_SDI_BIT	3		// D11 - target pin 5 (data in)
+#define HVSP_SII_BIT	4		// D12 - target pin 6 (instruction in)
+#define HVSP_SDO_BIT	5		// D13 - target pin 7 (data out)
+
+// Level of PIN_HV that turns the 12 V supply on
+#define HVSP_HV_ON		HIGH
+
+// Minimum reading of PIN_HVMON when the 12 V supply is present.
+// The monitor has a 1:3 divider, so 12 V reads as about 820. 600 is about 8.8 V.
+#define HVSP_HV_MIN		600
+
+// Maximum time (ms) for a write or erase operation. SDO goes high when the target is ready.
+#define HVSP_WAIT		20
+
+// Note: there's no hvsp_data_t; the programmer only uses local variables
+
+extern void avr_hvsp(void) __attribute__((noreturn));
+
+#endif
@@ -43,6 +43,9 @@
 #include "timing.h"
 #include "inductance.h"
 #include "frequency.h"
+#include "trace.h"
+#include "telemetry.h"
+#include "scpi.h"
 
 #define idata	joat_data.freq_data
 
@@ -64,7 +67,7 @@ static void ind_init(void);
 static void trigger_LC(void);
 static void discharge_LC(void);
 static uint8_t measure_oscillation(void);
-static double select_capacitor(void);
+static double select_capacitor(uint8_t wait);
 
 static void calculate_inductance(double cc);
 static void display_error(uint8_t err);
@@ -73,13 +76,35 @@ void inductance_meter(void)
 {
 	uint8_t err;
 	double calc_constant;	// Constant for calculation that depends on chosen capacitor
+	uint64_t t0 = 0;
 
 	ind_init();
+	telem_init();
 
-	calc_constant = select_capacitor();
+	// When the meter was selected by a remote command, the capacitor is the one that was set by command too
+	idata.capacitor_no = scpi_config.capacitor;
+	calc_constant = select_capacitor(!scpi_config.remote);
 
 	for (;;)
 	{
+		// Wait for the next measurement. CHANGE selects another capacitor and measures at once.
+		while ( !scpi_ready(t0, MILLIS_TO_TICKS(1000)) )
+		{
+			if ( button() == btn_change )
+			{
+				calc_constant = select_capacitor(1);
+				break;
+			}
+		}
+		t0 = read_ticks();
+
+		// SENSe:INDuctance:CAPacitor
+		if ( scpi_config.capacitor != idata.capacitor_no )
+		{
+			idata.capacitor_no = scpi_config.capacitor;
+			calc_constant = select_capacitor(0);
+		}
+
 		// Trigger the LC circuit
 		trigger_LC();
 
@@ -98,49 +123,48 @@ void inductance_meter(void)
 		{
 			// Display an error code
 			display_error(err);
+			scpi_result(NAN);
 		}
-
-		for ( int i = 0; i < 100; i++ )
-		{
-			if ( button() == btn_change )
-			{
-				calc_constant = select_capacitor();
-				break;
-			}
-
-			tick_delay(MILLIS_TO_TICKS(10));
-		}
+		scpi_done();
 	}
 }
 
 /* select_capacitor() - select the capacitor and return the calculation constant
+ *
+ * If wait is zero, the capacitor is the one in idata.capacitor_no. Otherwise CHANGE selects one and OK confirms.
 */
-double select_capacitor(void)
+double select_capacitor(uint8_t wait)
 {
 	double c;
 	uint8_t update = 1;
 	uint8_t b;
 
-	lcd->setCursor(0, 1);
-	fill_spaces(16 - lcd->print(F("Capacitor:")));
+	lcd.setCursor(0, 1);
+	fill_spaces(16 - lcd.print(F("Capacitor:")));
 	
 	do
 	{
 		if ( update )
 		{
-			lcd->setCursor(11, 1);
+			lcd.setCursor(11, 1);
 			switch (idata.capacitor_no)
 			{
-			case 2:		c = C2;		lcd->print(F("1.0 "));	break;
-			case 3:		c = C3;		lcd->print(F("0.47"));	break;
-			case 4:		c = C4;		lcd->print(F("0.22"));	break;
-			case 5:		c = C5;		lcd->print(F("0.15"));	break;
-			default:	c = C1;		lcd->print(F("2.2 "));	idata.capacitor_no = 1;	break;
+			case 2:		c = C2;		lcd.print(F("1.0 "));	break;
+			case 3:		c = C3;		lcd.print(F("0.47"));	break;
+			case 4:		c = C4;		lcd.print(F("0.22"));	break;
+			case 5:		c = C5;		lcd.print(F("0.15"));	break;
+			default:	c = C1;		lcd.print(F("2.2 "));	idata.capacitor_no = 1;	break;
 			}
 			update = 0;
 		}
 
-		b = button();
+		if ( wait )
+		{
+			b = button();
+			scpi_poll();
+		}
+		else
+			b = btn_ok;
 
 		if ( b == btn_change )
 		{
@@ -149,6 +173,8 @@ double select_capacitor(void)
 		}
 	} while ( b != btn_ok );
 
+	scpi_config.capacitor = idata.capacitor_no;
+
 	return 1.0 / (4.0 * Pi * Pi * c);
 }
 
@@ -171,7 +197,6 @@ static uint8_t measure_oscillation(void)
 	uint8_t last_ncap;
 	uint8_t last_oflo;
 	uint8_t nc, no;
-	uint16_t v;
 
 	t0 = read_ticks();
 
@@ -242,63 +267,68 @@ static void calculate_inductance(double cc)
 	double L = cc / f / f;
 	int np;
 
-	lcd->setCursor(0, 0);
-	np = lcd->print(F("f="));
-	np += lcd->print(f, 1);
+	telem_record(m_ind, idata.capacitor_no, idata.total_time, L);
+	scpi_result(L);
+
+	trace(TR_LCD, m_ind);
+	lcd.setCursor(0, 0);
+	np = lcd.print(F("f="));
+	np += lcd.print(f, 1);
 	fill_spaces(13-np);
-	lcd->print(F("d="));
-	lcd->print(idata.n_discard);
+	lcd.print(F("d="));
+	lcd.print(idata.n_discard);
 	
-	lcd->setCursor(0, 1);
+	lcd.setCursor(0, 1);
 	if ( L >= 1.0 )
 	{
-		np = lcd->print(L, 3);
-		np += lcd->print(F("H"));
+		np = lcd.print(L, 3);
+		np += lcd.print(F("H"));
 	}
 	else if ( L >= 1.0e-3 )
 	{
-		np = lcd->print(L*1.0e3, 3);
-		np += lcd->print(F("mH"));
+		np = lcd.print(L*1.0e3, 3);
+		np += lcd.print(F("mH"));
 	}
 	else if ( L >= 1.0e-6 )
 	{
-		np = lcd->print(L*1.0e6, 3);
-		np += lcd->print(F("uH"));
+		np = lcd.print(L*1.0e6, 3);
+		np += lcd.print(F("uH"));
 	}
 	else
 	{
-		np = lcd->print(L*1.0e9, 3);
-		np += lcd->print(F("nH"));
+		np = lcd.print(L*1.0e9, 3);
+		np += lcd.print(F("nH"));
 	}
 	fill_spaces(13 - np);
-	lcd->print(F("n="));
+	lcd.print(F("n="));
 	if ( idata.total_cap < 10 )
-		lcd->print(idata.total_cap);
+		lcd.print(idata.total_cap);
 	else
-		lcd->print('#');
+		lcd.print('#');
+	trace(TR_LCD_DONE, 0);
 }
 
 /* display_error() - display the error code
 */
 void display_error(uint8_t err)
 {
-	lcd->setCursor(11,1);
-	lcd->print(F("Err:"));
+	lcd.setCursor(11,1);
+	lcd.print(F("Err:"));
 	if ( err < 10 )
-		lcd->print((char)(err + 0x30));
+		lcd.print((char)(err + 0x30));
 	else
-		lcd->print('?');
+		lcd.print('?');
 }
 
 /* trigger_LC() - hit the LC with a short pulse to start the ringing.
 */
 static void trigger_LC(void)
 {
-	pinMode(ind_out, OUTPUT);
-	digitalWrite(ind_out, HIGH);
+	ind_out::output();
+	ind_out::high();
 	tick_delay(MILLIS_TO_TICKS(5));
 	idata.n_cap = 0;
-	pinMode(ind_out, INPUT);
+	ind_out::input();
 }
 
 /* discharge_LC() - allow remaining charge to dissipate.
@@ -308,8 +338,8 @@ static void trigger_LC(void)
 */
 static void discharge_LC(void)
 {
-	pinMode(ind_out, OUTPUT);
-	digitalWrite(ind_out, LOW);
+	ind_out::output();
+	ind_out::low();
 }
 
 /* ind_init() - initialise for inductance measurement
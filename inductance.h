@@ -24,10 +24,11 @@
 
 #include <Arduino.h>
 #include "joat.h"
+#include "iopin.h"
 
 // Pin selection for inductance measurement.
-#define ind_out		A4		// Pulse
-#define ind_in		8		// ICP1 to measure frequency of ringing.
+typedef iopin<A4> ind_out;		// Pulse
+typedef iopin<8> ind_in;		// ICP1 to measure frequency of ringing.
 
 // Units. The measurement is automatically scaled to these units.
 #define ind_uH  0
@@ -0,0 +1,62 @@
+/* iopin.h - digital I/O pins resolved at compile time; replaces digitalWrite/digitalRead/pinMode
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef IOPIN_H
+#define IOPIN_H	1
+
+#include <Arduino.h>
+
+/* digitalWrite() and friends look up the port and bit of the pin in tables in flash, check for PWM
+ * and disable interrupts, which takes several microseconds. A pin that is declared as
+ *	typedef iopin<A2> cap_out;
+ * is a type whose port and bit are known to the compiler, so
+ *	cap_out::high();
+ * compiles to a single sbi instruction (cbi for low(), sbic/sbis for read()).
+ * sbi and cbi can't be interrupted, so the interrupts don't need to be disabled.
+ *
+ * The pin numbers are the arduino numbers for the nano: D0..D7 are PORTD, D8..D13 are PORTB
+ * and A0..A5 (14..19) are PORTC. A6 and A7 are analogue inputs only, so they can't be iopins.
+ *
+ * Unlike digitalWrite(), the functions don't turn off the PWM of a timer that uses the pin.
+*/
+template<uint8_t pin>
+struct iopin
+{
+	static_assert(pin < 20, "iopin: not a digital pin on the nano");
+
+	static constexpr uint8_t number = pin;		// The arduino pin number, e.g. for analogRead()
+	static constexpr uint8_t bit = (pin < 8) ? pin : (pin < 14) ? (pin - 8) : (pin - 14);
+	static constexpr uint8_t mask = 1 << bit;
+
+	static inline volatile uint8_t &port(void)	{ return (pin < 8) ? PORTD : (pin < 14) ? PORTB : PORTC; }
+	static inline volatile uint8_t &ddr(void)	{ return (pin < 8) ? DDRD : (pin < 14) ? DDRB : DDRC; }
+	static inline volatile uint8_t &pinr(void)	{ return (pin < 8) ? PIND : (pin < 14) ? PINB : PINC; }
+
+	static inline void high(void)				{ port() |= mask; }
+	static inline void low(void)				{ port() &= (uint8_t)~mask; }
+	static inline void set(uint8_t v)			{ if ( v ) high(); else low(); }
+	static inline void toggle(void)				{ pinr() = mask; }		// Writing 1 to PINx toggles PORTx
+	static inline uint8_t read(void)			{ return (pinr() & mask) != 0; }
+
+	static inline void output(void)				{ ddr() |= mask; }
+	static inline void input(void)				{ ddr() &= (uint8_t)~mask; low(); }
+	static inline void input_pullup(void)		{ ddr() &= (uint8_t)~mask; high(); }
+};
+
+#endif
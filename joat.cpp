@@ -18,14 +18,9 @@
  * Joat is written for an Arduino Nano
 */
 #include <Arduino.h>
-#include <LiquidCrystal.h>
 #include "joat.h"
 #include "timing.h"
 
-// We cannot use a static constructor because the LiquidCrystal library uses the Arduino delay functions
-// and the local replacement hasn't been initialised yet.
-LiquidCrystal *lcd;
-
 // This is where the individual functions store global variables.
 joat_data_t joat_data;
 
@@ -35,23 +30,18 @@ static uint32_t btn_lasttime;
 static uint8_t btn_last;
 
 static void joat_setup(void);
-static void display_mode(uint8_t row, uint8_t m);
-
-// TEMPORARY: dummy functions for initial testing
-extern void avr_hvp(void) __attribute__((noreturn));
 
 int main(void)
 {
 	init();
 	joat_setup();
 
-	// Initial mode
-	uint8_t mode = m_start;
+	// Initial mode: the menu, or the instrument that a remote command selected before the reset
+	uint8_t mode = scpi_boot_mode();
+	uint8_t b = ( mode <= m_max ) ? btn_ok : btn_none;
 
 	for (;;)
 	{
-		uint8_t b = button();
-
 		if ( b == btn_change )
 		{
 			mode++;
@@ -63,7 +53,9 @@ int main(void)
 		{
 			display_mode(0, mode);
 			wipe_row(1);
-			
+			mem_mode_start(mode);
+			scpi_mode_start(mode);
+
 			switch ( mode )
 			{
 			case m_freq:
@@ -83,11 +75,39 @@ int main(void)
 				break;
 
 			case m_prog:
-				avr_programmer();
+				avr_programmer(AVRP_STK500V1);
+				break;
+
+			case m_prog2:
+				avr_programmer(AVRP_STK500V2);
+				break;
+
+			case m_standalone:
+				avr_standalone(1);
+				break;
+
+			case m_gang:
+				avr_standalone(AVRG_NTARGETS);
 				break;
 
 			case m_hvp:
-				avr_hvp();
+				avr_hvsp();
+				break;
+
+			case m_bridge:
+				uart_bridge();
+				break;
+
+			case m_mem:
+				mem_display();
+				break;
+
+			case m_gen:
+				generator();
+				break;
+
+			case m_test:
+				selftest();
 				break;
 
 			default:
@@ -95,6 +115,9 @@ int main(void)
 				break;
 			}
 		}
+
+		scpi_poll();
+		b = button();
 	}
 }
 
@@ -103,15 +126,17 @@ static void joat_setup(void)
 	// Initialise the timing system (timer1)
 	init_timing();
 
-	// Initialise the lcd driver
-	lcd = new LiquidCrystal(lcd_rs, lcd_e, lcd_d4, lcd_d5, lcd_d6, lcd_d7);
-	lcd->begin(16, 2);
+	// Serial port for remote commands, telemetry and the event trace
+	scpi_init();
+
+	// Initialise the lcd driver. It uses the timing system.
+	lcd.begin();
 
 	// Display a friendly greeting
-	lcd->setCursor(0,0);
-	lcd->print(F("The Joat"));
-	lcd->setCursor(0,1);
-	lcd->print(F("(c) dh   GPLv3"));
+	lcd.setCursor(0,0);
+	lcd.print(F("The Joat"));
+	lcd.setCursor(0,1);
+	lcd.print(F("(c) dh   GPLv3"));
 
 	// Initialise the a/d converter
 	analogReference(DEFAULT);
@@ -121,50 +146,78 @@ void fill_spaces(uint8_t nsp)
 {
 	while ( nsp > 0 )
 	{
-		lcd->print(' ');
+		lcd.print(' ');
 		nsp--;
 	}
 }
 
 void wipe_row(uint8_t row)
 {
-	lcd->setCursor(0, row);
+	lcd.setCursor(0, row);
 	fill_spaces(16);
-	lcd->setCursor(0, row);
+	lcd.setCursor(0, row);
 }
 
-static void display_mode(uint8_t row, uint8_t m)
+void display_mode(uint8_t row, uint8_t m)
 {
 	wipe_row(row);
 	switch (m)
 	{
 	case m_freq:
-		lcd->print(F("Frequency"));
+		lcd.print(F("Frequency"));
 		break;
 
 	case m_cap:
-		lcd->print(F("Capacitance"));
+		lcd.print(F("Capacitance"));
 		break;
 
 	case m_ind:
-		lcd->print(F("Inductance"));
+		lcd.print(F("Inductance"));
 		break;
 
 	case m_dvm:
-		lcd->print(F("DVM"));
+		lcd.print(F("DVM"));
 		break;
 
 	case m_prog:
-		lcd->print(F("AVR programmer"));
+		lcd.print(F("AVR programmer"));
+		break;
+
+	case m_prog2:
+		lcd.print(F("AVR prog (v2)"));
+		break;
+
+	case m_standalone:
+		lcd.print(F("AVR standalone"));
+		break;
+
+	case m_gang:
+		lcd.print(F("AVR gang"));
 		break;
 
 	case m_hvp:
-		lcd->print(F("AVR HVP"));
+		lcd.print(F("AVR HVSP"));
+		break;
+
+	case m_bridge:
+		lcd.print(F("UART bridge"));
+		break;
+
+	case m_mem:
+		lcd.print(F("Memory"));
+		break;
+
+	case m_gen:
+		lcd.print(F("Generator"));
+		break;
+
+	case m_test:
+		lcd.print(F("Self-test"));
 		break;
 
 	default:
 		/* Not reached */
-		lcd->print(F("Help!"));
+		lcd.print(F("Help!"));
 		break;
 	}
 }
@@ -208,17 +261,3 @@ uint8_t button(void)
 	}
 	return btn_none;
 }
-
-// TEMPORARY: dummy functions for initial testing
-static void not_implemented(void) __attribute__((noreturn));
-static void not_implemented(void)
-{
-	wipe_row(1);
-	lcd->print(F("Not implemented"));
-	for (;;) {}
-}
-
-void avr_hvp(void)
-{
-	not_implemented();
-}
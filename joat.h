@@ -21,12 +21,18 @@
 #define JOAT_H	1
 
 #include <Arduino.h>
-#include <LiquidCrystal.h>
 #include "frequency.h"
 #include "capacitance.h"
 #include "inductance.h"
 #include "dvm.h"
 #include "avr-programmer.h"
+#include "hvsp.h"
+#include "bridge.h"
+#include "memory.h"
+#include "generator.h"
+#include "selftest.h"
+#include "scpi.h"
+#include "lcd.h"
 
 // Operating modes
 #define m_freq		0
@@ -34,8 +40,15 @@
 #define m_ind		2
 #define m_dvm		3
 #define m_prog		4
-#define m_hvp		5
-#define m_max		5
+#define m_prog2		5
+#define m_standalone	6
+#define m_gang		7
+#define m_hvp		8
+#define m_bridge	9
+#define m_mem		10
+#define m_gen		11
+#define m_test		12
+#define m_max		12
 #define m_start		(m_max+1)	// Deliberately out of range
 
 // LCD/VFD pins (4-bit mode)
@@ -59,14 +72,19 @@ typedef union
 	frequency_data_t freq_data;
 	capacitance_data_t cap_data;
 	avrp_data_t avrp_data;
+	bridge_data_t bridge_data;
+	generator_data_t gen_data;
+	selftest_data_t test_data;
 } joat_data_t;
 
 extern joat_data_t joat_data;
-extern LiquidCrystal *lcd;
+extern lcd_t lcd;
 
 extern void init(void);
 extern uint8_t button(void);
 extern void fill_spaces(uint8_t nsp);
 extern void wipe_row(uint8_t row);
+extern void display_mode(uint8_t row, uint8_t m);
+extern void restart(void) __attribute__((noreturn));
 
 #endif
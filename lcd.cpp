@@ -0,0 +1,149 @@
+/* lcd.cpp - driver for the HD44780-compatible display
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * The display is used in 4-bit mode with no read pin. The timing is the same as the arduino
+ * LiquidCrystal library's. The host build uses host/lcd-host.cpp instead of this file.
+*/
+#include <Arduino.h>
+#include "joat.h"
+#include "timing.h"
+#include "iopin.h"
+#include "lcd.h"
+
+typedef iopin<lcd_rs> LCD_RS;
+typedef iopin<lcd_e> LCD_E;
+typedef iopin<lcd_d4> LCD_D4;
+typedef iopin<lcd_d5> LCD_D5;
+typedef iopin<lcd_d6> LCD_D6;
+typedef iopin<lcd_d7> LCD_D7;
+
+// HD44780 commands
+#define LCD_CLEAR		0x01
+#define LCD_ENTRYMODE	0x06		// Cursor moves right, display doesn't shift
+#define LCD_DISPLAYON	0x0c		// Display on, no cursor, no blinking
+#define LCD_FUNCTION	0x28		// 4-bit, 2 lines, 5x8 dots
+#define LCD_SETDDRAM	0x80
+
+#define LCD_E_TICKS		8			// Enable pulse width: at least 450 ns
+
+static void lcd_command(uint8_t cmd);
+static void lcd_send(uint8_t val);
+static void lcd_nibble(uint8_t val);
+static void lcd_pulse(void);
+
+// The display. It has no constructor that does anything, so it can be static; see lcd.h
+lcd_t lcd;
+
+/* begin() - initialise the display
+ *
+ * The display might be in 8-bit mode or half way through a 4-bit transfer, so it is set to 8-bit
+ * mode three times before switching to 4-bit mode (HD44780 datasheet, figure 24).
+*/
+void lcd_t::begin(void)
+{
+	LCD_RS::low();
+	LCD_E::low();
+	LCD_RS::output();
+	LCD_E::output();
+	LCD_D4::output();
+	LCD_D5::output();
+	LCD_D6::output();
+	LCD_D7::output();
+
+	tick_delay(MILLIS_TO_TICKS(50));		// Power-up time
+
+	lcd_nibble(0x03);
+	tick_delay(MICROS_TO_TICKS(4500));
+	lcd_nibble(0x03);
+	tick_delay(MICROS_TO_TICKS(4500));
+	lcd_nibble(0x03);
+	tick_delay(MICROS_TO_TICKS(150));
+	lcd_nibble(0x02);
+
+	lcd_command(LCD_FUNCTION);
+	lcd_command(LCD_DISPLAYON);
+	clear();
+	lcd_command(LCD_ENTRYMODE);
+}
+
+/* clear() - clear the display and move the cursor to the top left
+*/
+void lcd_t::clear(void)
+{
+	lcd_command(LCD_CLEAR);
+	tick_delay(MICROS_TO_TICKS(2000));
+}
+
+/* setCursor() - move the cursor. The second row starts at address 0x40.
+*/
+void lcd_t::setCursor(uint8_t col, uint8_t row)
+{
+	lcd_command(LCD_SETDDRAM | (col + ((row == 0) ? 0x00 : 0x40)));
+}
+
+/* write() - display a character at the cursor
+*/
+size_t lcd_t::write(uint8_t c)
+{
+	LCD_RS::high();
+	lcd_send(c);
+	return 1;
+}
+
+static void lcd_command(uint8_t cmd)
+{
+	LCD_RS::low();
+	lcd_send(cmd);
+}
+
+/* lcd_send() - send a byte, upper nibble first, and wait for the display to execute it
+ *
+ * The wait uses tick_delay() so that a long text keeps the timing system going.
+*/
+static void lcd_send(uint8_t val)
+{
+	lcd_nibble(val >> 4);
+	lcd_nibble(val);
+	tick_delay(MICROS_TO_TICKS(100));
+}
+
+static void lcd_nibble(uint8_t val)
+{
+	LCD_D4::set(val & 0x01);
+	LCD_D5::set(val & 0x02);
+	LCD_D6::set(val & 0x04);
+	LCD_D7::set(val & 0x08);
+	lcd_pulse();
+}
+
+/* lcd_pulse() - latch the data with a pulse on E
+ *
+ * The pulse is too short for tick_delay(), so timer1 is read directly (as in gang_halfbit()).
+*/
+static void lcd_pulse(void)
+{
+	LCD_E::high();
+
+	uint16_t t0 = TCNT1;
+	while ( (uint16_t)(TCNT1 - t0) < (uint16_t)LCD_E_TICKS )
+	{	// Wait
+	}
+
+	LCD_E::low();
+}
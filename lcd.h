@@ -0,0 +1,45 @@
+/* lcd.h - driver for the HD44780-compatible display
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef LCD_H
+#define LCD_H	1
+
+#include <Arduino.h>
+
+#define LCD_COLS	16
+#define LCD_ROWS	2
+
+/* lcd_t - the display, with the same print functions as the arduino LiquidCrystal library
+ *
+ * The LiquidCrystal constructor initialises the display, which needs delay(), which needs the timing
+ * system. So the object had to be created with new after init_timing(), and that brought in malloc().
+ * lcd_t has no constructor and no data: the pins are fixed (see joat.h), so it can be a static object,
+ * and begin() is called when the timing system is running.
+*/
+class lcd_t : public Print
+{
+public:
+	void begin(void);
+	void clear(void);
+	void setCursor(uint8_t col, uint8_t row);
+	virtual size_t write(uint8_t c);
+	using Print::write;
+};
+
+#endif
@@ -0,0 +1,110 @@
+/* mem-paint.cpp - stack painting and RAM measurement
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * The host build uses host/mem-host.cpp instead of this file.
+*/
+#include <Arduino.h>
+#include "memory.h"
+
+// From the linker script: the end of the static variables. There is no heap, so the stack may use
+// everything above it.
+extern uint8_t __heap_start;
+
+// Not cleared at start-up, so it survives a reset
+mem_record_t mem_record __attribute__((section(".noinit")));
+
+static void mem_paint(void) __attribute__((naked, used, section(".init3")));
+
+/* mem_paint() - measure the stack used by the previous run, then paint the free RAM
+ *
+ * Runs in .init3: the stack pointer and r1 have been set up, but .data and .bss haven't been
+ * initialised yet. Being naked, it has no prologue or return; execution falls through to .init4.
+ * The stack is empty at this point, so everything from the end of the static variables to just
+ * below RAMEND is painted.
+*/
+static void mem_paint(void)
+{
+	uint8_t *p;
+
+	if ( mem_record.magic != MEM_MAGIC )
+	{
+		// Power-on: the RAM holds rubbish
+		for ( p = (uint8_t *)&mem_record; p < (uint8_t *)(&mem_record + 1); p++ )
+			*p = 0;
+		mem_record.magic = MEM_MAGIC;
+	}
+	else if ( mem_record.mode < MEM_NMODES )
+	{
+		p = &__heap_start;
+		while ( p <= (uint8_t *)RAMEND && *p == MEM_CANARY )
+			p++;
+
+		uint16_t used = (uint16_t)RAMEND + 1 - (uint16_t)p;
+		if ( used > mem_record.stack_used[mem_record.mode] )
+			mem_record.stack_used[mem_record.mode] = used;
+	}
+
+	mem_record.mode = MEM_NONE;
+
+	for ( p = &__heap_start; p < (uint8_t *)SP; p++ )
+		*p = MEM_CANARY;
+}
+
+/* mem_mode_start() - note the mode that is about to run
+*/
+void mem_mode_start(uint8_t mode)
+{
+	mem_record.mode = mode;
+}
+
+/* mem_data_size() - the size of the static variables (.data, .bss and .noinit)
+*/
+uint16_t mem_data_size(void)
+{
+	return (uint16_t)&__heap_start - RAMSTART;
+}
+
+/* mem_stack_now() - the size of the stack
+*/
+uint16_t mem_stack_now(void)
+{
+	return RAMEND - SP;
+}
+
+/* mem_free_now() - the space between the static variables and the stack
+*/
+uint16_t mem_free_now(void)
+{
+	return SP + 1 - (uint16_t)&__heap_start;
+}
+
+/* mem_free_min() - the smallest space there has been below the stack since start-up
+ *
+ * That's the canary bytes that the stack hasn't overwritten yet.
+*/
+uint16_t mem_free_min(void)
+{
+	uint8_t *p = &__heap_start;
+	uint8_t *sp = (uint8_t *)SP;
+
+	while ( p <= sp && *p == MEM_CANARY )
+		p++;
+
+	return (uint16_t)(p - &__heap_start);
+}
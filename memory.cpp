@@ -0,0 +1,114 @@
+/* memory.cpp - display of stack and RAM usage
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <Arduino.h>
+#include "joat.h"
+#include "timing.h"
+#include "memory.h"
+
+static_assert(m_max < MEM_NMODES, "MEM_NMODES is too small for the number of modes");
+
+// Screens: free space, static data and stack, then one for each mode
+#define MEM_SCR_FREE	0
+#define MEM_SCR_DATA	1
+#define MEM_SCR_MODE	2
+#define MEM_NSCREENS	(MEM_SCR_MODE + m_max + 1)
+
+static void mem_show(uint8_t screen);
+static void mem_show_value(uint8_t row, const __FlashStringHelper *label, uint16_t value);
+
+/* mem_display() - the "Memory" mode
+ *
+ * CHANGE steps through the screens. The free space is updated twice a second.
+*/
+void mem_display(void)
+{
+	uint8_t screen = MEM_SCR_FREE;
+	uint8_t update = 1;
+	uint64_t next = 0;
+
+	for (;;)
+	{
+		uint8_t b = button();
+
+		if ( b == btn_change )
+		{
+			screen++;
+			if ( screen >= MEM_NSCREENS )
+				screen = MEM_SCR_FREE;
+			update = 1;
+		}
+		else if ( screen == MEM_SCR_FREE && read_ticks() >= next )
+			update = 1;
+
+		if ( update )
+		{
+			mem_show(screen);
+			next = read_ticks() + MILLIS_TO_TICKS(500);
+			update = 0;
+		}
+
+		scpi_poll();
+	}
+}
+
+/* mem_show() - show a screen
+ *
+ * The stack used by a mode is only known after a reset that happened while the mode was running.
+*/
+static void mem_show(uint8_t screen)
+{
+	if ( screen == MEM_SCR_FREE )
+	{
+		mem_show_value(0, F("Free now"), mem_free_now());
+		mem_show_value(1, F("Free min"), mem_free_min());
+	}
+	else if ( screen == MEM_SCR_DATA )
+	{
+		mem_show_value(0, F("Static data"), mem_data_size());
+		mem_show_value(1, F("Stack now"), mem_stack_now());
+	}
+	else
+	{
+		uint8_t m = screen - MEM_SCR_MODE;
+		uint16_t used = mem_record.stack_used[m];
+
+		display_mode(0, m);
+		if ( used == 0 )
+		{
+			lcd.setCursor(0, 1);
+			lcd.print(F("Stack       --  "));
+		}
+		else
+			mem_show_value(1, F("Stack"), used);
+	}
+}
+
+/* mem_show_value() - show a label and a number of bytes on a row
+ *
+ * E.g. "Free min    1234"
+*/
+static void mem_show_value(uint8_t row, const __FlashStringHelper *label, uint16_t value)
+{
+	lcd.setCursor(0, row);
+	uint8_t n = lcd.print(label);
+	fill_spaces(12 - n);
+	n = lcd.print(value);
+	fill_spaces(4 - n);
+}
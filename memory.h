@@ -0,0 +1,55 @@
+/* memory.h - stack and RAM usage
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MEMORY_H
+#define MEMORY_H	1
+
+#include <Arduino.h>
+
+/* The firmware has no heap: the RAM above the static variables belongs to the stack. At start-up,
+ * all of it is filled with MEM_CANARY. The lowest address that no longer holds the canary shows how
+ * deep the stack has been.
+ *
+ * The modes never return, so the depth reached in a mode can only be measured after the next reset.
+ * The mode is kept in a .noinit variable; the start-up code finds the depth from what the previous
+ * run left in the RAM before painting it again. The largest depth seen for each mode is
+ * kept until the power is switched off.
+*/
+#define MEM_CANARY		0xc5
+#define MEM_MAGIC		0x4a6d
+#define MEM_NONE		0xff		// No mode running
+#define MEM_NMODES		16			// Must be at least m_max+1
+
+typedef struct mem_record_s
+{
+	uint16_t magic;
+	uint8_t mode;					// Mode that is running, or MEM_NONE
+	uint16_t stack_used[MEM_NMODES];	// Deepest stack seen in each mode, 0 if not known
+} mem_record_t;
+
+extern mem_record_t mem_record;
+
+extern void mem_mode_start(uint8_t mode);
+extern uint16_t mem_data_size(void);
+extern uint16_t mem_stack_now(void);
+extern uint16_t mem_free_now(void);
+extern uint16_t mem_free_min(void);
+extern void mem_display(void) __attribute__((noreturn));
+
+#endif
@@ -0,0 +1,87 @@
+/* restart.cpp - start the firmware again without a reset
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * The host build uses host/restart-host.cpp instead of this file.
+*/
+#include <Arduino.h>
+#include "joat.h"
+
+/* restart() - run the firmware again from the start, as after a reset
+ *
+ * A watchdog reset would be simpler, but the bootloader runs after it, and the old Nano bootloader
+ * doesn't turn the watchdog off, so it resets over and over. Jumping to address 0 runs the start-up
+ * code and main() without the bootloader. The start-up code sets up the stack and SREG and initialises
+ * .data and .bss; the .noinit variables (scpi_config, mem_record) are kept, as they are over a reset.
+ *
+ * The peripherals aren't reset by the jump, and init() and the modes expect them as a reset leaves them,
+ * so everything that the firmware and the Arduino core use is put back to its reset state first: the
+ * timers, the pin change and external interrupts, the a/d converter, SPI, the USART and the pins. The
+ * pins all become inputs, so the programmer's target loses its power, as it does when the Nano resets.
+*/
+void restart(void)
+{
+	cli();
+
+	TIMSK0 = 0;
+	TIMSK1 = 0;
+	TIMSK2 = 0;
+	TCCR0A = 0;
+	TCCR0B = 0;
+	TCCR1A = 0;
+	TCCR1B = 0;
+	TCCR1C = 0;
+	TCCR2A = 0;
+	TCCR2B = 0;
+	TIFR0 = 0xff;					// Writing 1 clears a flag
+	TIFR1 = 0xff;
+	TIFR2 = 0xff;
+
+	PCICR = 0;
+	PCMSK0 = 0;
+	PCMSK1 = 0;
+	PCMSK2 = 0;
+	PCIFR = 0xff;
+	EIMSK = 0;
+	EICRA = 0;
+	EIFR = 0xff;
+
+	ADCSRA = _BV(ADIF);				// Disabled; clears the flag
+	ADCSRB = 0;
+	ADMUX = 0;
+
+	SPCR = 0;
+	SPSR = 0;
+
+	UCSR0B = 0;
+	UCSR0A = 0;
+	UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+
+	DDRB = 0;
+	DDRC = 0;
+	DDRD = 0;
+	PORTB = 0;
+	PORTC = 0;
+	PORTD = 0;
+
+	asm volatile("jmp 0");
+
+	for (;;)
+	{	// Not reached
+	}
+}
@@ -0,0 +1,1036 @@
+/* scpi.cpp - remote control by SCPI-style commands on the serial port
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * The commands. Upper case is the short form: SENS:AVER:COUN and sense:average:count are the same.
+ * A line can hold several commands separated by ';', each with its full path.
+ *	*IDN?							identification
+ *	*RST							default settings, back to the menu
+ *	*CLS							clear the error
+ *	*TRG							same as INIT
+ *	INSTrument[:SELect] name		select FREQuency, CAPacitance, INDuctance, DVM, GENerator, TEST or MENU (resets)
+ *	INSTrument[:SELect]?
+ *	INITiate[:IMMediate]			start one measurement (when INIT:CONT is OFF)
+ *	INITiate:CONTinuous ON|OFF		measure continuously (the default) or once for each INIT
+ *	ABORt							forget an INIT that hasn't started, or cancel a READ? that is waiting
+ *	FETCh?							results of the last measurement, comma-separated, in Hz, F, H or V
+ *	READ?, MEASure?					start a measurement and return its results when it has finished. The commands
+ *									after it wait until then, so that the replies come in order; a line
+ *									that starts with ABORt or *RST cancels it.
+ *	SENSe:FREQuency:GATE ms			frequency meter gate time, 100..60000 ms
+ *	SENSe:INDuctance:CAPacitor n	inductance meter capacitor, 1..5
+ *	SENSe:DVM:CHANnels list			DVM inputs to measure, e.g. 1,3 or (@1,3)
+ *	SENSe:AVERage:COUNt n			DVM a/d readings per result, 1..64
+ *	SYSTem:ERRor?					the last error, e.g. -113,"Undefined header"; 0,"No error"
+ *	SYSTem:TELEMetry ON|OFF			binary telemetry (telemetry.h). Any command turns it off.
+ *	SYSTem:TRACe?					dump the event trace (trace.h)
+ *	SOURce:FREQuency f				signal generator frequency in Hz, 0.01..8000000 (generator.h)
+ *	SOURce:FUNCtion SQUare|DDS		signal generator method
+ *	TEST:REPort?					results of the loopback self-test (selftest.h), one per line
+ * The settings all have queries too. Errors don't give a reply; SYSTem:ERRor? returns them.
+*/
+#include <Arduino.h>
+#include <ctype.h>
+#include "joat.h"
+#include "timing.h"
+#include "uart.h"
+#include "trace.h"
+#include "telemetry.h"
+#include "scpi.h"
+
+#define SCPI_NAME_MAX	28
+
+// Error numbers from the SCPI standard
+#define E_NONE			0
+#define E_SYNTAX		(-102)
+#define E_HEADER		(-113)
+#define E_CONFLICT		(-221)
+#define E_RANGE			(-222)
+#define E_PARAMETER		(-224)
+#define E_STALE			(-230)
+#define E_OVERFLOW		(-363)		// Input buffer overrun: line too long
+
+typedef struct scpi_cmd_s
+{
+	char name[SCPI_NAME_MAX];
+	void (*set)(const char *arg);
+	void (*query)(void);
+} scpi_cmd_t;
+
+typedef struct scpi_inst_s
+{
+	char name[SCPI_NAME_MAX];
+	uint8_t mode;
+} scpi_inst_t;
+
+typedef struct scpi_err_s
+{
+	int16_t number;
+	char text[20];
+} scpi_err_t;
+
+// Kept over a restart; see scpi.h
+scpi_config_t scpi_config __attribute__((section(".noinit")));
+
+static char scpi_line[SCPI_LINE_MAX + 1];
+static uint8_t scpi_len;
+static uint8_t scpi_overrun;
+static int16_t scpi_error;
+static uint8_t scpi_armed;				// INIT received, measurement not started yet
+static uint8_t scpi_reading;			// READ? is waiting for the end of a measurement
+static char *scpi_pending;				// The commands after READ? in its line, or 0
+static uint8_t scpi_scanned;			// uart_rx_head when scpi_cancelled() last looked
+static uint8_t scpi_nnew;
+static uint8_t scpi_nresults;
+static float scpi_new[SCPI_NRESULTS];	// Results of the measurement in progress
+static float scpi_results[SCPI_NRESULTS];
+
+static void scpi_defaults(void);
+static void scpi_reset(uint8_t mode) __attribute__((noreturn));
+static void scpi_execute(char *cmd);
+static uint8_t scpi_match(const char *hdr, const char *pname);
+static uint8_t scpi_node(const char *in, uint8_t n, const char *p, uint8_t plen);
+static uint8_t scpi_uint(const char *arg, uint16_t min, uint16_t max, uint16_t *v);
+static uint8_t scpi_bool(const char *arg, uint8_t *v);
+static uint8_t scpi_float(const char *arg, float min, float max, float *v);
+static void scpi_put_uint(uint16_t v);
+static void scpi_put_float(float v);
+static void scpi_put_bool(uint8_t v);
+static void scpi_eol(void);
+static uint8_t scpi_measuring(void);
+static uint8_t scpi_cancelled(void);
+
+static void cmd_idn_q(void);
+static void cmd_rst(const char *arg);
+static void cmd_cls(const char *arg);
+static void cmd_inst(const char *arg);
+static void cmd_inst_q(void);
+static void cmd_init(const char *arg);
+static void cmd_cont(const char *arg);
+static void cmd_cont_q(void);
+static void cmd_abort(const char *arg);
+static void cmd_fetch_q(void);
+static void cmd_read_q(void);
+static void cmd_gate(const char *arg);
+static void cmd_gate_q(void);
+static void cmd_cap(const char *arg);
+static void cmd_cap_q(void);
+static void cmd_chan(const char *arg);
+static void cmd_chan_q(void);
+static void cmd_aver(const char *arg);
+static void cmd_aver_q(void);
+static void cmd_err_q(void);
+static void cmd_telem(const char *arg);
+static void cmd_telem_q(void);
+static void cmd_trace_q(void);
+static void cmd_sour_freq(const char *arg);
+static void cmd_sour_freq_q(void);
+static void cmd_sour_func(const char *arg);
+static void cmd_sour_func_q(void);
+static void cmd_test_q(void);
+
+static const scpi_cmd_t PROGMEM scpi_cmds[] =
+{
+	{	"*IDN",							0,			cmd_idn_q	},
+	{	"*RST",							cmd_rst,	0			},
+	{	"*CLS",							cmd_cls,	0			},
+	{	"*TRG",							cmd_init,	0			},
+	{	"INSTrument",					cmd_inst,	cmd_inst_q	},
+	{	"INSTrument:SELect",			cmd_inst,	cmd_inst_q	},
+	{	"INITiate",						cmd_init,	0			},
+	{	"INITiate:IMMediate",			cmd_init,	0			},
+	{	"INITiate:CONTinuous",			cmd_cont,	cmd_cont_q	},
+	{	"ABORt",						cmd_abort,	0			},
+	{	"FETCh",						0,			cmd_fetch_q	},
+	{	"READ",							0,			cmd_read_q	},
+	{	"MEASure",						0,			cmd_read_q	},
+	{	"SENSe:FREQuency:GATE",			cmd_gate,	cmd_gate_q	},
+	{	"SENSe:INDuctance:CAPacitor",	cmd_cap,	cmd_cap_q	},
+	{	"SENSe:DVM:CHANnels",			cmd_chan,	cmd_chan_q	},
+	{	"SENSe:AVERage:COUNt",			cmd_aver,	cmd_aver_q	},
+	{	"SYSTem:ERRor",					0,			cmd_err_q	},
+	{	"SYSTem:TELEMetry",				cmd_telem,	cmd_telem_q	},
+	{	"SYSTem:TRACe",					0,			cmd_trace_q	},
+	{	"SOURce:FREQuency",				cmd_sour_freq,	cmd_sour_freq_q	},
+	{	"SOURce:FUNCtion",				cmd_sour_func,	cmd_sour_func_q	},
+	{	"TEST:REPort",					0,			cmd_test_q	},
+};
+
+#define SCPI_NCMDS	(sizeof(scpi_cmds) / sizeof(scpi_cmds[0]))
+
+// Modes that INSTrument can select
+static const scpi_inst_t PROGMEM scpi_instruments[] =
+{
+	{	"FREQuency",	m_freq	},
+	{	"CAPacitance",	m_cap	},
+	{	"INDuctance",	m_ind	},
+	{	"DVM",			m_dvm	},
+	{	"GENerator",	m_gen	},
+	{	"TEST",			m_test	},
+	{	"MENU",			m_start	},
+};
+
+#define SCPI_NINSTS	(sizeof(scpi_instruments) / sizeof(scpi_instruments[0]))
+
+static const scpi_err_t PROGMEM scpi_errors[] =
+{
+	{	E_NONE,			"No error"				},
+	{	E_SYNTAX,		"Syntax error"			},
+	{	E_HEADER,		"Undefined header"		},
+	{	E_CONFLICT,		"Settings conflict"		},
+	{	E_RANGE,		"Data out of range"		},
+	{	E_PARAMETER,	"Illegal parameter"		},
+	{	E_STALE,		"Data stale"			},
+	{	E_OVERFLOW,		"Input overrun"			},
+};
+
+/* scpi_init() - start the serial port, and set the defaults after a power-on
+*/
+void scpi_init(void)
+{
+	if ( scpi_config.magic != SCPI_MAGIC )
+		scpi_defaults();
+
+	scpi_config.mode = m_start;
+	uart_init(SCPI_BAUD);
+	telem_enable(scpi_config.telemetry);
+}
+
+/* scpi_boot_mode() - the mode that INSTrument selected before the reset, or m_start
+ *
+ * The next reset goes back to the menu, unless there's another INSTrument command.
+*/
+uint8_t scpi_boot_mode(void)
+{
+	uint8_t m = scpi_config.boot_mode;
+
+	scpi_config.boot_mode = m_start;
+	scpi_config.remote = (m <= m_max);
+	return m;
+}
+
+/* scpi_mode_start() - note the mode that is about to run
+*/
+void scpi_mode_start(uint8_t mode)
+{
+	scpi_config.mode = mode;
+}
+
+/* scpi_poll() - collect the characters that have arrived, and run the command when a line is complete
+ *
+ * While READ? is waiting for its result, nothing is done: the rest of its line waits in scpi_line and
+ * the lines after it in the UART's buffer, so a reply to a later command can't overtake the result.
+ * Only a line that starts with ABORt or *RST cancels the READ? (without a reply); then the lines are
+ * run in order as usual, up to and including that one.
+*/
+void scpi_poll(void)
+{
+	if ( scpi_reading )
+	{
+		if ( !scpi_cancelled() )
+			return;
+		scpi_reading = 0;
+		scpi_armed = 0;
+	}
+
+	if ( scpi_pending != 0 )
+	{
+		char *cmd = scpi_pending;
+
+		scpi_pending = 0;
+		scpi_execute(cmd);
+	}
+
+	while ( !scpi_reading && uart_available() > 0 )
+	{
+		char c = (char)uart_getc();
+
+		if ( c == '\n' || c == '\r' )
+		{
+			if ( scpi_overrun )
+				scpi_error = E_OVERFLOW;
+			else if ( scpi_len > 0 )
+			{
+				scpi_line[scpi_len] = '\0';
+				scpi_execute(scpi_line);
+			}
+			scpi_len = 0;
+			scpi_overrun = 0;
+		}
+		else if ( scpi_len < SCPI_LINE_MAX )
+			scpi_line[scpi_len++] = c;
+		else
+			scpi_overrun = 1;
+	}
+}
+
+/* scpi_ready() - returns 1 when a mode should start a measurement
+ *
+ * In continuous mode that's when pace ticks have passed since "since". Otherwise it's once for each INIT
+ * (or READ?). Meanwhile the commands and the telemetry are kept going, so a mode that calls this in its
+ * main loop never holds them up.
+*/
+uint8_t scpi_ready(uint64_t since, uint32_t pace)
+{
+	// Always, so that timer1's wrap-arounds are counted while a mode waits for INIT (see timing.cpp)
+	uint64_t now = read_ticks();
+
+	scpi_poll();
+	telem_poll();
+
+	if ( scpi_config.continuous )
+		return (now - since) >= pace;
+
+	if ( scpi_armed )
+	{
+		scpi_armed = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* scpi_wait() - wait until scpi_ready() says that the next measurement is due
+*/
+void scpi_wait(uint32_t pace)
+{
+	uint64_t t0 = read_ticks();
+
+	while ( !scpi_ready(t0, pace) )
+	{	// Wait
+	}
+}
+
+/* scpi_result() - add a result of the measurement in progress
+*/
+void scpi_result(float value)
+{
+	if ( scpi_nnew < SCPI_NRESULTS )
+		scpi_new[scpi_nnew++] = value;
+}
+
+/* scpi_done() - a measurement has finished. Its results are what FETCh? returns now.
+*/
+void scpi_done(void)
+{
+	memcpy(scpi_results, scpi_new, sizeof(scpi_results));
+	scpi_nresults = scpi_nnew;
+	scpi_nnew = 0;
+
+	if ( scpi_reading )
+	{
+		scpi_reading = 0;
+		cmd_fetch_q();
+	}
+}
+
+static void scpi_defaults(void)
+{
+	scpi_config.magic = SCPI_MAGIC;
+	scpi_config.boot_mode = m_start;
+	scpi_config.remote = 0;
+	scpi_config.continuous = 1;
+	scpi_config.telemetry = 1;
+	scpi_config.capacitor = 1;
+	scpi_config.dvm_channels = 0x0f;
+	scpi_config.average = 1;
+	scpi_config.gate_ms = 1000;
+	scpi_config.gate_ticks = MILLIS_TO_TICKS(1000);
+	scpi_config.gen_freq = 1000.0;
+	scpi_config.gen_method = GEN_SQUARE;
+}
+
+/* scpi_reset() - start the given mode (or the menu) by running the firmware again (restart())
+*/
+static void scpi_reset(uint8_t mode)
+{
+	scpi_config.boot_mode = mode;
+	uart_flush();
+	tick_delay(MICROS_TO_TICKS(200));		// The last 2 characters are still in the USART (174 us)
+	restart();
+}
+
+/* scpi_cancelled() - returns 1 if a line in the UART's buffer starts with ABORt or *RST
+ *
+ * Only complete lines are looked at, and the characters stay in the buffer. The buffer is only looked
+ * through again when something new has arrived.
+*/
+static uint8_t scpi_cancelled(void)
+{
+	uint8_t n = uart_available();
+	uint8_t i = 0;
+
+	if ( uart_rx_head == scpi_scanned )
+		return 0;
+	scpi_scanned = uart_rx_head;
+
+	while ( i < n )
+	{
+		char hdr[8];
+		uint8_t len = 0;
+		char c = 0;
+
+		while ( i < n && ((c = uart_peek(i)) == ' ' || c == '\t') )
+			i++;
+
+		while ( i < n && (c = uart_peek(i)) != '\n' && c != '\r' && c != ' ' && c != '\t' && c != ';' )
+		{
+			if ( len < sizeof(hdr) - 1 )
+				hdr[len++] = c;
+			i++;
+		}
+		hdr[len] = '\0';
+
+		while ( i < n && (c = uart_peek(i)) != '\n' && c != '\r' )
+			i++;
+
+		if ( i >= n )
+			return 0;			// The line isn't complete yet
+		i++;
+
+		if ( scpi_match(hdr, PSTR("ABORt")) || scpi_match(hdr, PSTR("*RST")) )
+			return 1;
+	}
+
+	return 0;
+}
+
+/* scpi_execute() - run the commands in a line
+ *
+ * Stops after a READ? that has to wait for its result; scpi_poll() runs the rest of the line afterwards.
+*/
+static void scpi_execute(char *cmd)
+{
+	// Any command means that a program is in control, and it won't want the binary telemetry
+	if ( scpi_config.telemetry )
+	{
+		scpi_config.telemetry = 0;
+		telem_enable(0);
+	}
+
+	while ( *cmd != '\0' )
+	{
+		char *next = strchr(cmd, ';');
+		if ( next != 0 )
+			*next++ = '\0';
+		else
+			next = cmd + strlen(cmd);
+
+		while ( *cmd == ' ' || *cmd == '\t' )
+			cmd++;
+
+		char *arg = cmd;
+		while ( *arg != '\0' && *arg != ' ' && *arg != '\t' )
+			arg++;
+		if ( *arg != '\0' )
+			*arg++ = '\0';
+		while ( *arg == ' ' || *arg == '\t' )
+			arg++;
+
+		uint8_t len = strlen(cmd);
+		uint8_t query = (len > 0 && cmd[len-1] == '?');
+		if ( query )
+			cmd[len-1] = '\0';
+
+		if ( *cmd != '\0' )
+		{
+			uint8_t i;
+			for ( i = 0; i < SCPI_NCMDS; i++ )
+			{
+				if ( scpi_match(cmd, scpi_cmds[i].name) )
+					break;
+			}
+
+			void (*set)(const char *) = 0;
+			void (*qry)(void) = 0;
+			if ( i < SCPI_NCMDS )
+			{
+				set = (void (*)(const char *))pgm_read_ptr(&scpi_cmds[i].set);
+				qry = (void (*)(void))pgm_read_ptr(&scpi_cmds[i].query);
+			}
+
+			if ( query && qry != 0 )
+				qry();
+			else if ( !query && set != 0 )
+				set(arg);
+			else
+				scpi_error = E_HEADER;
+		}
+
+		cmd = next;
+
+		if ( scpi_reading )
+		{
+			if ( *cmd != '\0' )
+				scpi_pending = cmd;
+			return;
+		}
+	}
+}
+
+/* scpi_match() - compare a command header with a name from the table, node by node
+*/
+static uint8_t scpi_match(const char *hdr, const char *pname)
+{
+	if ( *hdr == ':' )
+		hdr++;
+
+	for (;;)
+	{
+		uint8_t n = 0;
+		while ( hdr[n] != '\0' && hdr[n] != ':' )
+			n++;
+		uint8_t plen = 0;
+		char pc;
+		while ( (pc = pgm_read_byte(&pname[plen])) != '\0' && pc != ':' )
+			plen++;
+
+		if ( !scpi_node(hdr, n, pname, plen) )
+			return 0;
+
+		hdr += n;
+		pname += plen;
+		pc = pgm_read_byte(pname);
+
+		if ( *hdr == '\0' || pc == '\0' )
+			return ( *hdr == '\0' && pc == '\0' );
+
+		hdr++;
+		pname++;
+	}
+}
+
+/* scpi_node() - compare a node of a header with a node of a name from the table
+ *
+ * The node matches if it is the short form (the upper-case part of the name) or the whole name.
+*/
+static uint8_t scpi_node(const char *in, uint8_t n, const char *p, uint8_t plen)
+{
+	uint8_t nshort = 0;
+
+	while ( nshort < plen && !islower(pgm_read_byte(&p[nshort])) )
+		nshort++;
+
+	if ( n != nshort && n != plen )
+		return 0;
+
+	for ( uint8_t i = 0; i < n; i++ )
+	{
+		if ( toupper(in[i]) != toupper(pgm_read_byte(&p[i])) )
+			return 0;
+	}
+
+	return 1;
+}
+
+/* scpi_uint() - read a number in the range min..max
+*/
+static uint8_t scpi_uint(const char *arg, uint16_t min, uint16_t max, uint16_t *v)
+{
+	uint32_t n = 0;
+
+	if ( !isdigit(*arg) )
+	{
+		scpi_error = E_SYNTAX;
+		return 0;
+	}
+
+	while ( isdigit(*arg) )
+	{
+		n = n * 10 + (*arg++ - '0');
+		if ( n > 65535 )
+			n = 65536;
+	}
+
+	if ( *arg != '\0' && *arg != ' ' )
+	{
+		scpi_error = E_SYNTAX;
+		return 0;
+	}
+
+	if ( n < min || n > max )
+	{
+		scpi_error = E_RANGE;
+		return 0;
+	}
+
+	*v = (uint16_t)n;
+	return 1;
+}
+
+/* scpi_bool() - read ON, OFF, 1 or 0
+*/
+static uint8_t scpi_bool(const char *arg, uint8_t *v)
+{
+	if ( strcasecmp_P(arg, PSTR("ON")) == 0 || strcmp_P(arg, PSTR("1")) == 0 )
+		*v = 1;
+	else if ( strcasecmp_P(arg, PSTR("OFF")) == 0 || strcmp_P(arg, PSTR("0")) == 0 )
+		*v = 0;
+	else
+	{
+		scpi_error = E_PARAMETER;
+		return 0;
+	}
+
+	return 1;
+}
+
+/* scpi_float() - read a number like 440, 1.5e3 or .25 in the range min..max
+ *
+ * Smaller than strtod(), which would pull in a lot of the floating-point library.
+*/
+static uint8_t scpi_float(const char *arg, float min, float max, float *v)
+{
+	float f = 0.0;
+	int8_t e = 0;
+	uint8_t ndigits = 0;
+
+	while ( isdigit(*arg) )
+	{
+		f = f * 10.0 + (*arg++ - '0');
+		ndigits++;
+	}
+
+	if ( *arg == '.' )
+	{
+		arg++;
+		while ( isdigit(*arg) )
+		{
+			f = f * 10.0 + (*arg++ - '0');
+			e--;
+			ndigits++;
+		}
+	}
+
+	if ( ndigits > 0 && (*arg == 'e' || *arg == 'E') )
+	{
+		int8_t sign = 1;
+		int8_t x = 0;
+
+		arg++;
+		if ( *arg == '-' || *arg == '+' )
+			sign = ( *arg++ == '-' ) ? -1 : 1;
+		if ( !isdigit(*arg) )
+			ndigits = 0;
+		while ( isdigit(*arg) && x < 40 )
+			x = x * 10 + (*arg++ - '0');
+		e += sign * x;
+	}
+
+	if ( ndigits == 0 || (*arg != '\0' && *arg != ' ') )
+	{
+		scpi_error = E_SYNTAX;
+		return 0;
+	}
+
+	while ( e > 0 )
+	{
+		f *= 10.0;
+		e--;
+	}
+	while ( e < 0 )
+	{
+		f /= 10.0;
+		e++;
+	}
+
+	if ( f < min || f > max )
+	{
+		scpi_error = E_RANGE;
+		return 0;
+	}
+
+	*v = f;
+	return 1;
+}
+
+static void scpi_put_uint(uint16_t v)
+{
+	char buf[6];
+	uint8_t i = 0;
+
+	do
+	{
+		buf[i++] = '0' + (v % 10);
+		v /= 10;
+	} while ( v != 0 );
+
+	while ( i > 0 )
+		uart_putc(buf[--i]);
+}
+
+/* scpi_put_float() - send a number as d.dddddE+nn
+ *
+ * A float has about 7 significant digits, so 6 are sent. 9.91E+37 is SCPI's "not a number".
+*/
+static void scpi_put_float(float v)
+{
+	int8_t e = 0;
+
+	if ( v != v || v > 1.0e37 || v < -1.0e37 )
+	{
+		uart_puts_P(PSTR("9.91E+37"));
+		return;
+	}
+
+	if ( v < 0 )
+	{
+		uart_putc('-');
+		v = -v;
+	}
+
+	if ( v != 0.0 )
+	{
+		while ( v >= 10.0 )
+		{
+			v /= 10.0;
+			e++;
+		}
+		while ( v < 1.0 )
+		{
+			v *= 10.0;
+			e--;
+		}
+	}
+
+	uint32_t m = (uint32_t)(v * 100000.0 + 0.5);
+	if ( m >= 1000000 )
+	{
+		m /= 10;
+		e++;
+	}
+
+	char buf[6];
+	for ( int8_t i = 5; i >= 0; i-- )
+	{
+		buf[i] = '0' + (m % 10);
+		m /= 10;
+	}
+
+	uart_putc(buf[0]);
+	uart_putc('.');
+	for ( uint8_t i = 1; i < 6; i++ )
+		uart_putc(buf[i]);
+	uart_putc('E');
+	uart_putc(( e < 0 ) ? '-' : '+');
+	if ( e < 0 )
+		e = -e;
+	uart_putc('0' + e / 10);
+	uart_putc('0' + e % 10);
+}
+
+static void scpi_put_bool(uint8_t v)
+{
+	uart_putc(v ? '1' : '0');
+	scpi_eol();
+}
+
+static void scpi_eol(void)
+{
+	uart_puts_P(PSTR("\r\n"));
+}
+
+/* scpi_measuring() - is a measurement mode running? Sets the error if not.
+*/
+static uint8_t scpi_measuring(void)
+{
+	if ( scpi_config.mode <= m_dvm )
+		return 1;
+
+	scpi_error = E_CONFLICT;
+	return 0;
+}
+
+static void cmd_idn_q(void)
+{
+	uart_puts_P(PSTR("Joat,Nano,0,0"));
+	scpi_eol();
+}
+
+static void cmd_rst(const char *arg)
+{
+	(void)arg;
+	scpi_defaults();
+	scpi_reset(m_start);
+}
+
+static void cmd_cls(const char *arg)
+{
+	(void)arg;
+	scpi_error = E_NONE;
+}
+
+static void cmd_inst(const char *arg)
+{
+	uint8_t i;
+
+	for ( i = 0; i < SCPI_NINSTS; i++ )
+	{
+		if ( scpi_match(arg, scpi_instruments[i].name) )
+			break;
+	}
+
+	if ( i >= SCPI_NINSTS )
+	{
+		scpi_error = E_PARAMETER;
+		return;
+	}
+
+	uint8_t m = pgm_read_byte(&scpi_instruments[i].mode);
+	if ( m != scpi_config.mode )
+		scpi_reset(m);
+}
+
+/* cmd_inst_q() - the short form of the name, as SCPI queries do. MENU for a mode that isn't an instrument.
+*/
+static void cmd_inst_q(void)
+{
+	uint8_t i;
+
+	for ( i = 0; i < SCPI_NINSTS - 1; i++ )
+	{
+		if ( pgm_read_byte(&scpi_instruments[i].mode) == scpi_config.mode )
+			break;
+	}
+
+	const char *p = scpi_instruments[i].name;
+	char c;
+
+	while ( (c = pgm_read_byte(p++)) != '\0' && !islower(c) )
+		uart_putc(c);
+	scpi_eol();
+}
+
+static void cmd_init(const char *arg)
+{
+	(void)arg;
+	if ( scpi_measuring() )
+		scpi_armed = 1;
+}
+
+static void cmd_cont(const char *arg)
+{
+	(void)scpi_bool(arg, &scpi_config.continuous);
+}
+
+static void cmd_cont_q(void)
+{
+	scpi_put_bool(scpi_config.continuous);
+}
+
+/* cmd_abort() - forget an INIT. A READ? that is waiting has already been cancelled by scpi_poll().
+*/
+static void cmd_abort(const char *arg)
+{
+	(void)arg;
+	scpi_armed = 0;
+}
+
+static void cmd_fetch_q(void)
+{
+	if ( scpi_nresults == 0 )
+	{
+		scpi_error = E_STALE;
+		scpi_put_float(NAN);
+	}
+
+	for ( uint8_t i = 0; i < scpi_nresults; i++ )
+	{
+		if ( i > 0 )
+			uart_putc(',');
+		scpi_put_float(scpi_results[i]);
+	}
+	scpi_eol();
+}
+
+static void cmd_read_q(void)
+{
+	if ( scpi_measuring() )
+	{
+		scpi_armed = 1;
+		scpi_reading = 1;
+		scpi_scanned = uart_rx_head + 1;		// Never the head, so scpi_cancelled() looks at once
+	}
+}
+
+static void cmd_gate(const char *arg)
+{
+	uint16_t v;
+
+	if ( scpi_uint(arg, 100, 60000, &v) )
+	{
+		scpi_config.gate_ms = v;
+		scpi_config.gate_ticks = MILLIS_TO_TICKS(v);
+	}
+}
+
+static void cmd_gate_q(void)
+{
+	scpi_put_uint(scpi_config.gate_ms);
+	scpi_eol();
+}
+
+static void cmd_cap(const char *arg)
+{
+	uint16_t v;
+
+	if ( scpi_uint(arg, 1, 5, &v) )
+		scpi_config.capacitor = (uint8_t)v;
+}
+
+static void cmd_cap_q(void)
+{
+	scpi_put_uint(scpi_config.capacitor);
+	scpi_eol();
+}
+
+/* cmd_chan() - a list of inputs, e.g. 1,2,4 or (@1,2,4)
+*/
+static void cmd_chan(const char *arg)
+{
+	uint8_t mask = 0;
+
+	for ( ; *arg != '\0'; arg++ )
+	{
+		if ( *arg >= '1' && *arg <= '4' )
+			mask |= 1 << (*arg - '1');
+		else if ( *arg != '(' && *arg != '@' && *arg != ',' && *arg != ')' && *arg != ' ' )
+		{
+			scpi_error = E_PARAMETER;
+			return;
+		}
+	}
+
+	if ( mask == 0 )
+		scpi_error = E_PARAMETER;
+	else
+		scpi_config.dvm_channels = mask;
+}
+
+static void cmd_chan_q(void)
+{
+	char sep = '@';
+
+	uart_putc('(');
+	for ( uint8_t i = 0; i < 4; i++ )
+	{
+		if ( scpi_config.dvm_channels & (1 << i) )
+		{
+			uart_putc(sep);
+			uart_putc('1' + i);
+			sep = ',';
+		}
+	}
+	uart_putc(')');
+	scpi_eol();
+}
+
+static void cmd_aver(const char *arg)
+{
+	uint16_t v;
+
+	if ( scpi_uint(arg, 1, 64, &v) )
+		scpi_config.average = (uint8_t)v;
+}
+
+static void cmd_aver_q(void)
+{
+	scpi_put_uint(scpi_config.average);
+	scpi_eol();
+}
+
+/* cmd_err_q() - the last error, then no error
+*/
+static void cmd_err_q(void)
+{
+	uint8_t i;
+
+	for ( i = 0; i < sizeof(scpi_errors) / sizeof(scpi_errors[0]) - 1; i++ )
+	{
+		if ( (int16_t)pgm_read_word(&scpi_errors[i].number) == scpi_error )
+			break;
+	}
+
+	if ( scpi_error < 0 )
+		uart_putc('-');
+	scpi_put_uint((scpi_error < 0) ? -scpi_error : scpi_error);
+	uart_puts_P(PSTR(",\""));
+	uart_puts_P(scpi_errors[i].text);
+	uart_putc('"');
+	scpi_eol();
+
+	scpi_error = E_NONE;
+}
+
+static void cmd_telem(const char *arg)
+{
+	if ( scpi_bool(arg, &scpi_config.telemetry) )
+		telem_enable(scpi_config.telemetry);
+}
+
+static void cmd_telem_q(void)
+{
+	scpi_put_bool(scpi_config.telemetry);
+}
+
+static void cmd_trace_q(void)
+{
+#if TRACE_ENABLE
+	trace_dump();
+#else
+	scpi_error = E_HEADER;
+#endif
+}
+
+static void cmd_sour_freq(const char *arg)
+{
+	float f;
+
+	if ( scpi_float(arg, GEN_FREQ_MIN, GEN_FREQ_MAX, &f) )
+		scpi_config.gen_freq = f;
+}
+
+static void cmd_sour_freq_q(void)
+{
+	scpi_put_float(scpi_config.gen_freq);
+	scpi_eol();
+}
+
+static void cmd_sour_func(const char *arg)
+{
+	if ( scpi_match(arg, PSTR("SQUare")) )
+		scpi_config.gen_method = GEN_SQUARE;
+	else if ( scpi_match(arg, PSTR("DDS")) )
+		scpi_config.gen_method = GEN_DDS;
+	else
+		scpi_error = E_PARAMETER;
+}
+
+static void cmd_sour_func_q(void)
+{
+	uart_puts_P(( scpi_config.gen_method == GEN_DDS ) ? PSTR("DDS") : PSTR("SQU"));
+	scpi_eol();
+}
+
+static void cmd_test_q(void)
+{
+	if ( scpi_config.mode == m_test )
+		selftest_report();
+	else
+		scpi_error = E_CONFLICT;
+}
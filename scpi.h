@@ -0,0 +1,76 @@
+/* scpi.h - remote control by SCPI-style commands on the serial port
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SCPI_H
+#define SCPI_H	1
+
+#include <Arduino.h>
+
+/* Commands are lines of text at SCPI_BAUD, e.g.
+ *	INST DVM
+ *	SENS:AVER:COUN 16
+ *	INIT:CONT OFF
+ *	READ?
+ * scpi_poll() collects the characters that have arrived and runs a command when its line is complete,
+ * so it never waits. It is called from the menu and from the main loops of the measurement modes
+ * (through scpi_ready()). The command table is in flash; see scpi.cpp for the commands. While READ? waits
+ * for its result, the lines after it stay in the UART's buffer, except that one that starts with ABORt or
+ * *RST cancels the READ?.
+ *
+ * The modes never return, so selecting an instrument starts the firmware again (restart()). The
+ * selected mode and the settings are kept in a .noinit variable, so they survive that, and a reset; after
+ * a power-on they have their defaults.
+*/
+#define SCPI_BAUD		115200
+#define SCPI_LINE_MAX	48			// Longest command line; longer ones are discarded
+#define SCPI_NRESULTS	4			// Results per measurement (the DVM has 4 inputs)
+
+// Settings that the modes use
+typedef struct scpi_config_s
+{
+	uint16_t magic;
+	uint8_t boot_mode;				// Mode to start after a reset, or m_start for the menu
+	uint8_t mode;					// Mode that is running, or m_start in the menu
+	uint8_t remote;					// The running mode was selected by a command
+	uint8_t continuous;				// Measure continuously (otherwise: once for each INIT)
+	uint8_t telemetry;				// Send telemetry (see telemetry.h)
+	uint8_t capacitor;				// Inductance meter: capacitor 1..5
+	uint8_t dvm_channels;			// DVM: inputs to measure, bit 0 = input 1
+	uint8_t average;				// DVM: a/d readings per result
+	uint16_t gate_ms;				// Frequency meter: gate time
+	uint32_t gate_ticks;			// ... in ticks
+	float gen_freq;					// Generator: frequency in Hz
+	uint8_t gen_method;				// Generator: GEN_SQUARE or GEN_DDS (generator.h)
+} scpi_config_t;
+
+// Changes when the layout changes, so that a new firmware doesn't take over an old firmware's settings
+#define SCPI_MAGIC		(0x5300 + sizeof(scpi_config_t))
+
+extern scpi_config_t scpi_config;
+
+extern void scpi_init(void);
+extern uint8_t scpi_boot_mode(void);
+extern void scpi_mode_start(uint8_t mode);
+extern void scpi_poll(void);
+extern uint8_t scpi_ready(uint64_t since, uint32_t pace);
+extern void scpi_wait(uint32_t pace);
+extern void scpi_result(float value);
+extern void scpi_done(void);
+
+#endif
@@ -0,0 +1,395 @@
+/* selftest.cpp - loopback self-test of the frequency meter
+ *
+ * (c) David Haworth
+ *
+ * This file is part of Joat
+ *
+ * Joat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Joat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Joat is an Arduino sketch, written for an Arduino Nano
+*/
+#include <Arduino.h>
+#include "joat.h"
+#include "timing.h"
+#include "frequency.h"
+#include "generator.h"
+#include "selftest.h"
+#include "uart.h"
+#include "scpi.h"
+
+#define tdata	joat_data.test_data
+#define fdata	joat_data.freq_data
+
+// The sweep. The last one is beyond what TIMER1_CAPT_vect can take.
+static const float PROGMEM test_freqs[TEST_NPOINTS] =
+{
+	1.0, 10.0, 100.0, 1000.0, 10000.0, 100000.0, 1000000.0
+};
+
+static void test_run(void);
+static uint8_t test_measure(selftest_point_t *p, float f, uint8_t method, uint32_t gate);
+static void test_latency(uint32_t *min, uint32_t *avg, uint32_t *max);
+static void display_progress(const __FlashStringHelper *what, float f);
+static void display_result(void);
+static void put_key(uint8_t i, const char *what);
+static void put_uint(uint32_t v);
+static void put_fixed(uint32_t v);
+
+/* selftest() - the "Self-test" mode
+ *
+ * Runs the test, then shows the results. CHANGE steps through them and OK runs the test again.
+ * Remote commands are only read between runs: sending a report in the middle of a gate time would hold
+ * up freq_gate() for long enough to lose captures.
+*/
+void selftest(void)
+{
+	uint8_t b;
+
+	freq_init();
+
+	for (;;)
+	{
+		test_run();
+
+		tdata.page = 0;
+		display_result();
+
+		do {
+			scpi_poll();
+			b = button();
+
+			if ( b == btn_change )
+			{
+				tdata.page++;
+				if ( tdata.page > tdata.n_points )
+					tdata.page = 0;
+				display_result();
+			}
+		} while ( b != btn_ok );
+	}
+}
+
+/* test_run() - the sweep, then the binary search for the highest frequency with no loss
+ *
+ * The search uses the square wave with prescaler 1, f = HZ / (2 * t), between the last good frequency
+ * of the sweep and the first bad one. The largest t is assumed to be good.
+*/
+static void test_run(void)
+{
+	selftest_point_t probe;
+	float good = 0.0;
+	float bad = 0.0;
+
+	tdata.n_points = 0;
+	tdata.lossless = 0.0;
+
+	for ( uint8_t i = 0; i < TEST_NPOINTS; i++ )
+	{
+		selftest_point_t *p = &tdata.point[i];
+		float f = pgm_read_float(&test_freqs[i]);
+
+		display_progress(F("Test "), f);
+		uint8_t ok = test_measure(p, f, (f < 100.0) ? GEN_DDS : GEN_SQUARE, MILLIS_TO_TICKS(TEST_GATE_MS));
+		tdata.n_points++;
+
+		if ( !ok || p->lost != 0 )
+		{
+			bad = p->expected;
+			break;
+		}
+		good = p->expected;
+	}
+
+	tdata.lossless = good;
+
+	if ( good > 0.0 && bad > 0.0 )
+	{
+		uint16_t lo = (uint16_t)((float)HZ / 2.0 / bad);
+		uint16_t hi = (uint16_t)((float)HZ / 2.0 / good + 0.999);
+
+		if ( hi > 256 )
+			hi = 256;
+
+		while ( hi - lo > 1 )
+		{
+			uint16_t mid = (lo + hi) / 2;
+			float f = (float)HZ / 2.0 / (float)mid;
+
+			display_progress(F("Max? "), f);
+			if ( test_measure(&probe, f, GEN_SQUARE, MILLIS_TO_TICKS(TEST_PROBE_MS)) && probe.lost == 0 )
+				hi = mid;
+			else
+				lo = mid;
+		}
+
+		float f = (float)HZ / 2.0 / (float)hi;
+		if ( f > tdata.lossless )
+			tdata.lossless = f;
+	}
+
+	gen_stop();
+}
+
+/* test_measure() - measure the generator's output at one frequency
+ *
+ * The first gate time only finds the first capture after the change of frequency; the second is the
+ * measurement. Returns 0 if there was no signal.
+*/
+static uint8_t test_measure(selftest_point_t *p, float f, uint8_t method, uint32_t gate)
+{
+	uint8_t r;
+
+	p->expected = gen_start(f, method);
+	p->measured = 0.0;
+	p->lost = 0;
+	p->latency = 0;
+
+	for ( uint8_t n = 0; n < 2; n++ )
+	{
+		freq_restart();
+		do {
+			r = freq_gate(gate);
+		} while ( r == FREQ_BUSY );
+
+		if ( r == FREQ_NONE )
+			return 0;
+	}
+
+	// The capture that ended the gate time was read in the last pass, so it's less than 4 ms old
+	uint64_t t = read_ticks();
+	uint16_t age = (uint16_t)t - fdata.last_cap;
+
+	p->measured = freq_hz();
+	display_freq(p->measured);
+	p->latency = age + (uint32_t)(read_ticks() - t);
+
+	float periods = p->expected * (float)fdata.total_time / (float)HZ;
+	p->lost = (int32_t)(periods + 0.5) - (int32_t)fdata.total_cap;
+	return 1;
+}
+
+/* test_latency() - minimum, average and maximum latency of the sweep points with no loss, in ticks
+*/
+static void test_latency(uint32_t *min, uint32_t *avg, uint32_t *max)
+{
+	uint32_t sum = 0;
+	uint8_t n = 0;
+
+	*min = 0xffffffff;
+	*max = 0;
+
+	for ( uint8_t i = 0; i < tdata.n_points; i++ )
+	{
+		selftest_point_t *p = &tdata.point[i];
+
+		if ( p->measured > 0.0 && p->lost == 0 )
+		{
+			if ( p->latency < *min )
+				*min = p->latency;
+			if ( p->latency > *max )
+				*max = p->latency;
+			sum += p->latency;
+			n++;
+		}
+	}
+
+	if ( n == 0 )
+		*min = 0;
+	*avg = (n == 0) ? 0 : sum / n;
+}
+
+/* display_progress() - show what the test is doing on the top line. display_freq() shows the result below.
+ *
+ *	Test 1000.00Hz
+*/
+static void display_progress(const __FlashStringHelper *what, float f)
+{
+	uint8_t np;
+
+	lcd.setCursor(0, 0);
+	np = lcd.print(what);
+	np += lcd.print(f, (f < 100.0) ? 3 : (f < 1.0e5) ? 2 : 0);
+	np += lcd.print(F("Hz"));
+	fill_spaces(16 - np);
+}
+
+/* display_result() - show a page of the results
+ *
+ * Page 0 is the summary: the highest frequency with no loss, and the average and maximum latency.
+ * The other pages are the sweep points: the error, or the number of captures lost.
+ *
+ *	Max 262295Hz				1000.00Hz
+ *	Lat 3.21/3.48ms				e+0.1ppm 3.21ms
+*/
+static void display_result(void)
+{
+	uint8_t np;
+
+	lcd.setCursor(0, 0);
+
+	if ( tdata.n_points == 0 || tdata.point[0].measured == 0.0 )
+	{
+		lcd.print(F("No signal       "));
+		lcd.setCursor(0, 1);
+		lcd.print(F("Jumper D11-D8?  "));
+		return;
+	}
+
+	if ( tdata.page == 0 )
+	{
+		uint32_t min, avg, max;
+
+		test_latency(&min, &avg, &max);
+		np = lcd.print(F("Max "));
+		np += lcd.print((uint32_t)(tdata.lossless + 0.5));
+		np += lcd.print(F("Hz"));
+		fill_spaces(16 - np);
+
+		lcd.setCursor(0, 1);
+		np = lcd.print(F("Lat "));
+		np += lcd.print((float)ticks_to_micros(avg) / 1000.0, 2);
+		np += lcd.print('/');
+		np += lcd.print((float)ticks_to_micros(max) / 1000.0, 2);
+		np += lcd.print(F("ms"));
+		fill_spaces(16 - np);
+		return;
+	}
+
+	selftest_point_t *p = &tdata.point[tdata.page - 1];
+
+	np = lcd.print(p->expected, (p->expected < 100.0) ? 3 : (p->expected < 1.0e5) ? 2 : 0);
+	np += lcd.print(F("Hz"));
+	fill_spaces(16 - np);
+
+	lcd.setCursor(0, 1);
+	if ( p->measured == 0.0 || p->lost != 0 )
+	{
+		np = lcd.print(F("Lost "));
+		np += lcd.print(p->lost);
+	}
+	else
+	{
+		float e = (p->measured - p->expected) / p->expected * 1.0e6;
+
+		np = lcd.print('e');
+		if ( e >= 0.0 )
+			np += lcd.print('+');
+		np += lcd.print(e, 1);
+		np += lcd.print(F("ppm "));
+		np += lcd.print((float)ticks_to_micros(p->latency) / 1000.0, 2);
+		np += lcd.print(F("ms"));
+	}
+	fill_spaces(16 - np);
+}
+
+/* selftest_report() - the results as text, for TEST:REPort? (scpi.cpp)
+ *
+ * One line per result in the format of the benchmarks in bench/, so that bench/compare.sh can compare
+ * a run with a baseline. The error is the size of the error. E.g.
+ *	# selftest
+ *	test.1000hz.error.ppm 0.00
+ *	test.1000hz.latency.us 3210
+ *	...
+ *	# 1000000hz lost 654321
+ *	test.capture.lossless.hz 262295
+ *	test.latency.us min 3100 avg 3210 max 3480
+ *	# end
+ * A query that arrives while the test is running is answered at the end.
+*/
+void selftest_report(void)
+{
+	uart_puts_P(PSTR("# selftest\r\n"));
+
+	for ( uint8_t i = 0; i < tdata.n_points; i++ )
+	{
+		selftest_point_t *p = &tdata.point[i];
+
+		if ( p->measured == 0.0 || p->lost != 0 )
+		{
+			uart_puts_P(PSTR("# "));
+			put_uint((uint32_t)pgm_read_float(&test_freqs[i]));
+			uart_puts_P(PSTR("hz lost "));
+			if ( p->lost < 0 )
+				uart_putc('-');
+			put_uint((p->lost < 0) ? -p->lost : p->lost);
+			uart_puts_P(PSTR("\r\n"));
+		}
+		else
+		{
+			float e = (p->measured - p->expected) / p->expected * 1.0e6;
+
+			put_key(i, PSTR(".error.ppm "));
+			put_fixed((uint32_t)(fabs(e) * 100.0 + 0.5));
+			uart_puts_P(PSTR("\r\n"));
+
+			put_key(i, PSTR(".latency.us "));
+			put_uint(ticks_to_micros(p->latency));
+			uart_puts_P(PSTR("\r\n"));
+		}
+
+		// About 30 characters at 115200 baud; keep the timing system going
+		(void)read_ticks();
+	}
+
+	uint32_t min, avg, max;
+
+	uart_puts_P(PSTR("test.capture.lossless.hz "));
+	put_uint((uint32_t)(tdata.lossless + 0.5));
+	uart_puts_P(PSTR("\r\n"));
+
+	test_latency(&min, &avg, &max);
+	uart_puts_P(PSTR("test.latency.us min "));
+	put_uint(ticks_to_micros(min));
+	uart_puts_P(PSTR(" avg "));
+	put_uint(ticks_to_micros(avg));
+	uart_puts_P(PSTR(" max "));
+	put_uint(ticks_to_micros(max));
+	uart_puts_P(PSTR("\r\n"));
+
+	uart_puts_P(PSTR("# end\r\n"));
+}
+
+/* put_key() - e.g. "test.1000hz" followed by the string in flash
+*/
+static void put_key(uint8_t i, const char *what)
+{
+	uart_puts_P(PSTR("test."));
+	put_uint((uint32_t)pgm_read_float(&test_freqs[i]));
+	uart_puts_P(PSTR("hz"));
+	uart_puts_P(what);
+}
+
+static void put_uint(uint32_t v)
+{
+	char buf[11];
+	uint8_t n = 0;
+
+	do {
+		buf[n++] = '0' + (v % 10);
+		v /= 10;
+	} while ( v != 0 );
+
+	while ( n > 0 )
+		uart_putc(buf[--n]);
+}
+
+/* put_fixed() - hundredths, e.g. 123 is 1.23
+*/
+static void put_fixed(uint32_t v)
+{
+	put_uint(v / 100);
+	uart_putc('.');
+	uart_putc('0' + (v / 10) % 10);
+	uart_putc('0' + v % 10);
+}
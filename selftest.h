@@ -0,0 +1,67 @@
+/* selftest.h - loopback self-test of the frequency meter
+ *
+ * (c) David Haworth
+ *
+ * This file is part of Joat
+ *
+ * Joat is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Joat is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Joat is written for an Arduino Nano
+*/
+#ifndef SELFTEST_H
+#define SELFTEST_H	1
+
+#include <Arduino.h>
+#include "frequency.h"
+
+/* With a jumper from D11 (the generator's output, see generator.h) to D8 (ICP1), the frequency meter
+ * can measure signals whose frequency is known exactly: the generator and timer1 run from the same
+ * crystal, so the error of the crystal doesn't count. The self-test measures a sweep of frequencies
+ * from 1 Hz up, with the frequency meter's own code (freq_gate() and display_freq()):
+ *
+ *	error		measured against the frequency that timer2 produces, in ppm
+ *	lost		captures that TIMER1_CAPT_vect missed: the number of periods in the gate time minus
+ *				the number of captures. Not 0 when the edges come faster than the handler can take them;
+ *				negative when TIMER1_OVF_vect can't get in either, so the gate time comes out too short.
+ *	latency		from the capture that ends a gate time to the end of the display update
+ *
+ * The sweep stops at the first frequency that loses captures. A binary search between that one and
+ * the last good one finds the highest frequency with no loss. The square wave is used above 100 Hz,
+ * because its frequencies are exact; the DDS is used for the lower frequencies.
+*/
+#define TEST_NPOINTS	7			// 1 Hz .. 1 MHz
+#define TEST_GATE_MS	1000		// Gate time for the sweep
+#define TEST_PROBE_MS	100			// Gate time for the binary search
+
+typedef struct selftest_point_s
+{
+	float expected;					// Frequency that timer2 produces
+	float measured;					// Frequency that the meter shows
+	int32_t lost;					// Captures lost
+	uint32_t latency;				// Capture-to-display latency in ticks
+} selftest_point_t;
+
+typedef struct selftest_data_s
+{
+	frequency_data_t freq;			// Must be first: the frequency meter's handlers use joat_data.freq_data
+	selftest_point_t point[TEST_NPOINTS];
+	float lossless;					// Highest frequency at which no capture was lost
+	uint8_t n_points;				// Sweep points measured
+	uint8_t page;					// Result shown on the display
+} selftest_data_t;
+
+extern void selftest(void) __attribute__((noreturn));
+extern void selftest_report(void);
+
+#endif
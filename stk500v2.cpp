@@ -0,0 +1,948 @@
+/* stk500v2.cpp - STK500v2 protocol engine for the AVR programmer
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <Arduino.h>
+#include "joat.h"
+#include "timing.h"
+#include "uart.h"
+#include "avr-programmer.h"
+#include "avr-isp.h"
+#include "trace.h"
+
+/* The STK500v2 protocol is described in Atmel application note AVR068.
+ *
+ * Every message is framed:
+ *	MESSAGE_START, sequence number, body size (2 bytes, big-endian), TOKEN, body, checksum
+ * The checksum is the XOR of all the other bytes. An answer has the same framing and sequence number
+ * as the command. The first byte of the body is the command; the second byte of an answer is the status.
+ *
+ * Compared with STK500v1, a whole page travels in a single message together with the instructions
+ * for loading, writing and polling, so there's only one host round-trip per page.
+ *
+ * The command body is received into avrpdata.buff. Answers are sent as they are generated, with
+ * the checksum calculated on the fly, so a block read doesn't need a second buffer.
+*/
+
+// Framing
+#define MESSAGE_START				0x1b
+#define TOKEN						0x0e
+
+// Commands
+#define CMD_SIGN_ON					0x01
+#define CMD_SET_PARAMETER			0x02
+#define CMD_GET_PARAMETER			0x03
+#define CMD_LOAD_ADDRESS			0x06
+#define CMD_ENTER_PROGMODE_ISP		0x10
+#define CMD_LEAVE_PROGMODE_ISP		0x11
+#define CMD_CHIP_ERASE_ISP			0x12
+#define CMD_PROGRAM_FLASH_ISP		0x13
+#define CMD_READ_FLASH_ISP			0x14
+#define CMD_PROGRAM_EEPROM_ISP		0x15
+#define CMD_READ_EEPROM_ISP			0x16
+#define CMD_PROGRAM_FUSE_ISP		0x17
+#define CMD_READ_FUSE_ISP			0x18
+#define CMD_PROGRAM_LOCK_ISP		0x19
+#define CMD_READ_LOCK_ISP			0x1a
+#define CMD_READ_SIGNATURE_ISP		0x1b
+#define CMD_READ_OSCCAL_ISP			0x1c
+#define CMD_SPI_MULTI				0x1d
+
+// XPROG commands (STK600, AVRISP mkII). Only the TPI mode is supported. See avr-tpi.cpp
+#define CMD_XPROG					0x50
+#define CMD_XPROG_SETMODE			0x51
+
+#define XPRG_MODE_TPI				0x02
+
+#define XPRG_CMD_ENTER_PROGMODE		0x01
+#define XPRG_CMD_LEAVE_PROGMODE		0x02
+#define XPRG_CMD_ERASE				0x03
+#define XPRG_CMD_WRITE_MEM			0x04
+#define XPRG_CMD_READ_MEM			0x05
+#define XPRG_CMD_SET_PARAM			0x07
+
+#define XPRG_ERASE_CHIP				0x01
+
+#define XPRG_ERR_OK					0x00
+#define XPRG_ERR_FAILED				0x01
+#define XPRG_ERR_TIMEOUT			0x03
+
+// Joat extensions: see v2_crc_check() and v2_get_stats()
+#define CMD_CRC_CHECK				0x70
+#define CMD_GET_STATS				0x71
+
+// Answer to a message with a bad checksum
+#define ANSWER_CKSUM_ERROR			0xb0
+
+// Status
+#define STATUS_CMD_OK				0x00
+#define STATUS_CMD_TOUT				0x80
+#define STATUS_RDY_BSY_TOUT			0x81
+#define STATUS_CMD_FAILED			0xc0
+#define STATUS_CKSUM_ERROR			0xc1
+#define STATUS_CMD_UNKNOWN			0xc9
+
+// Parameters
+#define PARAM_BUILD_NUMBER_LOW		0x80
+#define PARAM_BUILD_NUMBER_HIGH		0x81
+#define PARAM_HW_VER				0x90
+#define PARAM_SW_MAJOR				0x91
+#define PARAM_SW_MINOR				0x92
+#define PARAM_VTARGET				0x94
+#define PARAM_VADJUST				0x95
+#define PARAM_OSC_PSCALE			0x96
+#define PARAM_OSC_CMATCH			0x97
+#define PARAM_SCK_DURATION			0x98
+#define PARAM_TOPCARD_DETECT		0x9a
+#define PARAM_STATUS				0x9c
+#define PARAM_DATA					0x9d
+#define PARAM_RESET_POLARITY		0x9e
+#define PARAM_CONTROLLER_INIT		0x9f
+
+// Bits of the mode byte in CMD_PROGRAM_FLASH_ISP and CMD_PROGRAM_EEPROM_ISP
+#define MODE_PAGE					0x01	// 0 = word mode, 1 = page mode
+#define MODE_WORD_TIMED				0x02
+#define MODE_WORD_VALUE				0x04
+#define MODE_WORD_RDYBSY			0x08
+#define MODE_PAGE_TIMED				0x10
+#define MODE_PAGE_VALUE				0x20
+#define MODE_PAGE_RDYBSY			0x40
+#define MODE_PAGE_WRITE				0x80
+
+#define V2_SWMAJ					2
+#define V2_SWMIN					10
+
+// Maximum time for a chip erase when polling (ms)
+#define V2_ERASE_WAIT				100
+
+static uint16_t v2_receive(void);
+static void v2_begin(uint16_t size);
+static void v2_put(uint8_t c);
+static void v2_end(void);
+static void v2_status(uint8_t cmd, uint8_t status);
+static void v2_sign_on(void);
+static void v2_set_parameter(void);
+static void v2_get_parameter(void);
+static uint8_t *v2_param_ptr(uint8_t id);
+static void v2_load_address(void);
+static void v2_ext_address(void);
+static void v2_enter_progmode(void);
+static void v2_chip_erase(void);
+static void v2_program(uint8_t cmd, uint16_t size);
+static uint8_t v2_page_unchanged(uint16_t n);
+static void v2_read(uint8_t cmd);
+static void v2_program_fuse(uint8_t cmd);
+static void v2_read_fuse(uint8_t cmd);
+static void v2_spi_multi(uint16_t size);
+static void v2_crc_check(uint16_t size);
+static void v2_get_stats(void);
+static void v2_xprog_setmode(void);
+static void v2_xprog(uint16_t size);
+static void v2_xprog_status(uint8_t xcmd, uint8_t err);
+
+// Parameters that can be set by the host. The values are stored in avrpdata.v2_param[] in the same order.
+static const uint8_t PROGMEM v2_params[AVRP_V2_NPARAM] =
+{
+	PARAM_VADJUST,
+	PARAM_OSC_PSCALE,
+	PARAM_OSC_CMATCH,
+	PARAM_SCK_DURATION,
+	PARAM_RESET_POLARITY,
+	PARAM_CONTROLLER_INIT
+};
+
+// avrdude only uses the XPROG commands for a TPI part if the programmer signs on as an STK600 or an
+// AVRISP mkII; otherwise it programs the part with the ISP commands, which TPI parts don't have. As an
+// AVRISP mkII, the parameters that avrdude reads (avrdude -v) are all in v2_get_parameter(), and the
+// ISP commands are the same as for an STK500.
+static const char PROGMEM v2_signature[] = "AVRISP_MK2";
+
+/* stk500v2_init() - initialise the STK500v2 engine
+*/
+void stk500v2_init(void)
+{
+	*v2_param_ptr(PARAM_RESET_POLARITY) = 1;		// Active low (AVR)
+	avrpdata.rst_active_high = 0;
+	avrpdata.xprog_mode = 0xff;		// ISP until the host selects an XPROG mode
+}
+
+/* stk500v2() - receive and process one message
+*/
+void stk500v2(void)
+{
+	uint16_t size = v2_receive();
+	uint8_t cmd = avrpdata.buff[0];
+	uint8_t commit_err = 0;
+
+	if ( size == 0 )
+		return;
+
+	trace(TR_V2_CMD, cmd);
+
+	// A flash page write might still be in progress (see v2_program()). The next page
+	// takes care of it. Anything else waits for it here.
+	if ( cmd != CMD_LOAD_ADDRESS && cmd != CMD_PROGRAM_FLASH_ISP )
+		commit_err = finish_commit();
+
+	switch ( cmd )
+	{
+	case CMD_SIGN_ON:
+		v2_sign_on();
+		break;
+
+	case CMD_SET_PARAMETER:
+		v2_set_parameter();
+		break;
+
+	case CMD_GET_PARAMETER:
+		v2_get_parameter();
+		break;
+
+	case CMD_LOAD_ADDRESS:
+		v2_load_address();
+		break;
+
+	case CMD_ENTER_PROGMODE_ISP:
+		v2_enter_progmode();
+		break;
+
+	case CMD_LEAVE_PROGMODE_ISP:
+		// The write of the last page hasn't been reported yet. If it failed, the error stays on the display
+		end_pmode();
+		if ( commit_err == 0 )
+		{
+			avrpdata.errorcount = 0;
+			avrpdata.errorcode = 0x00;
+		}
+		v2_status(cmd, commit_err ? STATUS_RDY_BSY_TOUT : STATUS_CMD_OK);
+		break;
+
+	case CMD_CHIP_ERASE_ISP:
+		v2_chip_erase();
+		break;
+
+	case CMD_PROGRAM_FLASH_ISP:
+	case CMD_PROGRAM_EEPROM_ISP:
+		v2_program(cmd, size);
+		break;
+
+	case CMD_READ_FLASH_ISP:
+	case CMD_READ_EEPROM_ISP:
+		v2_read(cmd);
+		break;
+
+	case CMD_PROGRAM_FUSE_ISP:
+	case CMD_PROGRAM_LOCK_ISP:
+		v2_program_fuse(cmd);
+		break;
+
+	case CMD_READ_FUSE_ISP:
+	case CMD_READ_LOCK_ISP:
+	case CMD_READ_SIGNATURE_ISP:
+	case CMD_READ_OSCCAL_ISP:
+		v2_read_fuse(cmd);
+		break;
+
+	case CMD_SPI_MULTI:
+		v2_spi_multi(size);
+		break;
+
+	case CMD_CRC_CHECK:
+		v2_crc_check(size);
+		break;
+
+	case CMD_GET_STATS:
+		v2_get_stats();
+		break;
+
+	case CMD_XPROG_SETMODE:
+		v2_xprog_setmode();
+		break;
+
+	case CMD_XPROG:
+		v2_xprog(size);
+		break;
+
+	default:
+		avrp_error(0x13);
+		v2_status(cmd, STATUS_CMD_UNKNOWN);
+		break;
+	}
+}
+
+/* v2_receive() - receive a message body into avrpdata.buff
+ *
+ * Returns the size of the body, or 0 if the message was bad.
+ * Anything before MESSAGE_START is discarded; that's how we get back in sync after an error.
+*/
+static uint16_t v2_receive(void)
+{
+	uint8_t c;
+	uint8_t cksum;
+	uint16_t size;
+
+	while ( (c = avrp_getc()) != MESSAGE_START )
+	{
+		avrp_error(0x10);
+	}
+
+	cksum = MESSAGE_START;
+	avrpdata.v2_seq = avrp_getc();
+	cksum ^= avrpdata.v2_seq;
+	c = avrp_getc();
+	cksum ^= c;
+	size = c * 256;
+	c = avrp_getc();
+	cksum ^= c;
+	size += c;
+	c = avrp_getc();
+	cksum ^= c;
+
+	if ( c != TOKEN || size == 0 || size > AVRP_BUFFSIZE )
+	{
+		// Can't trust the header, so don't answer. Resynchronise on the next MESSAGE_START.
+		avrp_error(0x11);
+		avrpdata.stats.nosync++;
+		return 0;
+	}
+
+	avrp_read(avrpdata.buff, size);
+
+	for ( uint16_t i = 0; i < size; i++ )
+		cksum ^= avrpdata.buff[i];
+
+	if ( avrp_getc() != cksum )
+	{
+		avrp_error(0x12);
+		avrpdata.stats.nosync++;
+		v2_status(ANSWER_CKSUM_ERROR, STATUS_CKSUM_ERROR);
+		return 0;
+	}
+
+	return size;
+}
+
+/* Answer construction. v2_begin() sends the header, v2_put() sends each byte of the body
+ * and v2_end() sends the checksum.
+*/
+static void v2_begin(uint16_t size)
+{
+	avrpdata.v2_cksum = 0;
+	v2_put(MESSAGE_START);
+	v2_put(avrpdata.v2_seq);
+	v2_put(size >> 8);
+	v2_put(size & 0xff);
+	v2_put(TOKEN);
+}
+
+static void v2_put(uint8_t c)
+{
+	avrpdata.v2_cksum ^= c;
+	uart_putc(c);
+}
+
+static void v2_end(void)
+{
+	uart_putc(avrpdata.v2_cksum);
+}
+
+static void v2_status(uint8_t cmd, uint8_t status)
+{
+	v2_begin(2);
+	v2_put(cmd);
+	v2_put(status);
+	v2_end();
+}
+
+static void v2_sign_on(void)
+{
+	uint8_t i;
+
+	v2_begin(3 + sizeof(v2_signature) - 1);
+	v2_put(CMD_SIGN_ON);
+	v2_put(STATUS_CMD_OK);
+	v2_put(sizeof(v2_signature) - 1);
+	for ( i = 0; i < sizeof(v2_signature) - 1; i++ )
+		v2_put(pgm_read_byte(&v2_signature[i]));
+	v2_end();
+}
+
+/* v2_param_ptr() - returns the location of a settable parameter, or 0 if the parameter can't be set
+*/
+static uint8_t *v2_param_ptr(uint8_t id)
+{
+	for ( uint8_t i = 0; i < AVRP_V2_NPARAM; i++ )
+	{
+		if ( pgm_read_byte(&v2_params[i]) == id )
+			return &avrpdata.v2_param[i];
+	}
+	return 0;
+}
+
+static void v2_set_parameter(void)
+{
+	uint8_t id = avrpdata.buff[1];
+	uint8_t *p = v2_param_ptr(id);
+
+	if ( p == 0 )
+	{
+		v2_status(CMD_SET_PARAMETER, STATUS_CMD_FAILED);
+		return;
+	}
+
+	*p = avrpdata.buff[2];
+
+	// AVR devices have active low reset (1), AT89Sx are active high (0)
+	if ( id == PARAM_RESET_POLARITY )
+		avrpdata.rst_active_high = (*p == 0);
+
+	// The SCK duration is ignored: the SPI clock is negotiated when entering programming mode.
+
+	v2_status(CMD_SET_PARAMETER, STATUS_CMD_OK);
+}
+
+static void v2_get_parameter(void)
+{
+	uint8_t id = avrpdata.buff[1];
+	uint8_t *p = v2_param_ptr(id);
+	uint8_t v;
+
+	if ( p != 0 )
+	{
+		v = *p;
+	}
+	else
+	{
+		switch ( id )
+		{
+		case PARAM_BUILD_NUMBER_LOW:	v = 0;						break;
+		case PARAM_BUILD_NUMBER_HIGH:	v = 0;						break;
+		case PARAM_HW_VER:				v = HWVER;					break;
+		case PARAM_SW_MAJOR:			v = V2_SWMAJ;				break;
+		case PARAM_SW_MINOR:			v = V2_SWMIN;				break;
+		case PARAM_VTARGET:				v = 50;						break;	// 5.0 V
+		case PARAM_TOPCARD_DETECT:		v = 0xff;					break;	// No top card
+		case PARAM_STATUS:				v = avrpdata.errorcode;		break;
+		default:
+			v2_status(CMD_GET_PARAMETER, STATUS_CMD_FAILED);
+			return;
+		}
+	}
+
+	v2_begin(3);
+	v2_put(CMD_GET_PARAMETER);
+	v2_put(STATUS_CMD_OK);
+	v2_put(v);
+	v2_end();
+}
+
+/* v2_load_address() - set the address for the next program/read command
+ *
+ * The address is a word address for flash and a byte address for EEPROM.
+ * If bit 31 is set, the extended address byte (bits 16..23) must be sent to the target
+ * with the "Load Extended Address" instruction before the next access.
+*/
+static void v2_load_address(void)
+{
+	avrpdata.here = avrpdata.buff[3] * 256 + avrpdata.buff[4];
+	avrpdata.v2_ext = avrpdata.buff[2];
+	avrpdata.v2_ext_load = (avrpdata.buff[1] & 0x80) != 0;
+	v2_status(CMD_LOAD_ADDRESS, STATUS_CMD_OK);
+}
+
+static void v2_ext_address(void)
+{
+	if ( avrpdata.v2_ext_load )
+	{
+		spi_transaction(0x4d, 0x00, avrpdata.v2_ext, 0x00);
+		avrpdata.v2_ext_load = 0;
+	}
+}
+
+/* v2_enter_progmode() - enter programming mode
+ *
+ * The host sends the timing parameters and the programming enable instruction, but
+ * start_pmode() negotiates the clock and checks the response itself, so they are not used.
+*/
+static void v2_enter_progmode(void)
+{
+	uint8_t status = STATUS_CMD_OK;
+
+	if ( avrpdata.pmode != 1 )
+	{
+		if ( !start_pmode() )
+			status = STATUS_CMD_FAILED;
+	}
+
+	v2_status(CMD_ENTER_PROGMODE_ISP, status);
+}
+
+/* v2_chip_erase() - erase the target
+ *
+ * Body: cmd, eraseDelay (ms), pollMethod (0 = delay, 1 = RDY/BSY), 4 instruction bytes
+*/
+static void v2_chip_erase(void)
+{
+	uint8_t *b = avrpdata.buff;
+	uint8_t status = STATUS_CMD_OK;
+
+	spi_transaction(b[3], b[4], b[5], b[6]);
+	avrpdata.erased = 1;
+
+	avrpdata.param.polling = b[2];
+	if ( b[2] )
+	{
+		if ( wait_ready(0, 0, 0, MILLIS_TO_TICKS(V2_ERASE_WAIT)) )
+			status = STATUS_RDY_BSY_TOUT;
+	}
+	else
+	{
+		tick_delay(MILLIS_TO_TICKS(1) * b[1]);
+	}
+
+	v2_status(CMD_CHIP_ERASE_ISP, status);
+}
+
+/* v2_program() - program flash or EEPROM
+ *
+ * Body: cmd, NumBytes (2), mode, delay (ms), cmd1, cmd2, cmd3, poll1, poll2, data...
+ *	cmd1 is the load (page mode) or write (word mode) instruction. For flash, bit 3 selects the high byte.
+ *	cmd2 is the write page instruction, cmd3 is the read instruction for value polling.
+ *	poll1 and poll2 are the values that a location reads as while it is being written.
+ *
+ * In page mode, the polling method and timeout are set up for commit()/finish_commit() and,
+ * for flash, the page write is pipelined exactly as in the STK500v1 engine: the answer goes back
+ * before the write is complete, and the result is reported with the next page.
+ *
+ * With differential programming, a flash page that doesn't need writing isn't even loaded.
+*/
+static void v2_program(uint8_t cmd, uint16_t size)
+{
+	uint8_t *b = avrpdata.buff;
+	uint16_t n = beget16(&b[1]);
+	uint8_t mode = b[3];
+	uint8_t delay = b[4];
+	uint8_t cmd1 = b[5];
+	uint8_t cmd2 = b[6];
+	uint8_t cmd3 = b[7];
+	uint8_t poll1 = b[8];
+	uint8_t poll2 = b[9];
+	uint8_t isflash = (cmd == CMD_PROGRAM_FLASH_ISP);
+	unsigned int page = avrpdata.here;
+	uint8_t status = STATUS_CMD_OK;
+	uint32_t maxtime;
+
+	if ( size < 10 || n > size - 10 )
+	{
+		v2_status(cmd, STATUS_CMD_FAILED);
+		return;
+	}
+
+	// The previous page write must be complete before loading the page buffer again
+	if ( finish_commit() )
+		status = STATUS_RDY_BSY_TOUT;
+
+	if ( isflash )
+		v2_ext_address();
+
+	if ( isflash && (mode & MODE_PAGE) && (mode & MODE_PAGE_WRITE) && v2_page_unchanged(n) )
+	{
+		avrpdata.here += n / 2;
+		avrpdata.stats.pages_skipped++;
+		v2_status(cmd, status);
+		return;
+	}
+
+	if ( mode & MODE_PAGE )
+	{
+		avrpdata.param.polling = (mode & MODE_PAGE_RDYBSY) != 0;
+		if ( mode & (MODE_PAGE_RDYBSY | MODE_PAGE_VALUE) )
+			maxtime = MILLIS_TO_TICKS(isflash ? AVRP_FLASH_WAIT : AVRP_EEPROM_WAIT);
+		else
+			maxtime = MILLIS_TO_TICKS(1) * delay;
+	}
+	else
+	{
+		avrpdata.param.polling = (mode & MODE_WORD_RDYBSY) != 0;
+		if ( mode & (MODE_WORD_RDYBSY | MODE_WORD_VALUE) )
+			maxtime = MILLIS_TO_TICKS(isflash ? AVRP_FLASH_WAIT : AVRP_EEPROM_WAIT);
+		else
+			maxtime = MILLIS_TO_TICKS(1) * delay;
+	}
+
+	avrpdata.poll_cmd = 0;
+	prog_lamp(0);
+	avrpdata.stats.bytes_written += n;
+
+	for ( uint16_t i = 0; i < n; i++ )
+	{
+		uint8_t d = b[10+i];
+		uint8_t hilo = isflash ? ((i & 1) << 3) : 0;
+		unsigned int addr = avrpdata.here;
+
+		spi_transaction(cmd1 | hilo, (addr >> 8) & 0xff, addr & 0xff, d);
+
+		// A location can be used for value polling if its new value is not a poll value
+		uint8_t pollable = ( d != poll1 && (isflash || d != poll2) );
+
+		if ( mode & MODE_PAGE )
+		{
+			if ( pollable && (mode & MODE_PAGE_VALUE) )
+			{
+				avrpdata.poll_cmd = cmd3 | hilo;
+				avrpdata.poll_addr = addr;
+				avrpdata.poll_value = d;
+			}
+		}
+		else
+		{
+			uint8_t rdcmd = (pollable && (mode & MODE_WORD_VALUE)) ? (cmd3 | hilo) : 0;
+
+			if ( wait_ready(rdcmd, addr, d, maxtime) )
+				status = STATUS_CMD_TOUT;
+		}
+
+		if ( !isflash || (i & 1) )
+			avrpdata.here++;
+	}
+
+	if ( (mode & MODE_PAGE) && (mode & MODE_PAGE_WRITE) )
+	{
+		avrpdata.commit_wait = maxtime;
+		start_commit(cmd2, page);
+#if AVRP_PIPELINE
+		if ( !isflash )
+#endif
+		{
+			if ( finish_commit() )
+				status = STATUS_CMD_TOUT;
+		}
+	}
+	else
+	{
+		prog_lamp(1);
+	}
+
+	v2_status(cmd, status);
+}
+
+/* v2_page_unchanged() - returns 1 if the flash page in the message body doesn't need writing
+ *
+ * See diff_byte()
+*/
+static uint8_t v2_page_unchanged(uint16_t n)
+{
+	uint8_t *d = &avrpdata.buff[10];
+
+	diff_begin();
+
+	for ( uint16_t i = 0; i < n && !avrpdata.page_dirty; i++ )
+		diff_byte(i & 1, avrpdata.here + i / 2, d[i]);
+
+	return !avrpdata.page_dirty;
+}
+
+/* v2_read() - read flash or EEPROM
+ *
+ * Body: cmd, NumBytes (2), cmd1 (read instruction; for flash, bit 3 selects the high byte)
+ * Answer: cmd, status, data..., status
+*/
+static void v2_read(uint8_t cmd)
+{
+	uint16_t n = beget16(&avrpdata.buff[1]);
+	uint8_t cmd1 = avrpdata.buff[3];
+	uint8_t isflash = (cmd == CMD_READ_FLASH_ISP);
+
+	if ( isflash )
+		v2_ext_address();
+
+	v2_begin(n + 3);
+	v2_put(cmd);
+	v2_put(STATUS_CMD_OK);
+
+	for ( uint16_t i = 0; i < n; i++ )
+	{
+		uint8_t hilo = isflash ? ((i & 1) << 3) : 0;
+		unsigned int addr = avrpdata.here;
+
+		spi_xfer(cmd1 | hilo);
+		spi_xfer((addr >> 8) & 0xff);
+		spi_xfer(addr & 0xff);
+		v2_put(spi_xfer(0x00));
+
+		if ( !isflash || (i & 1) )
+			avrpdata.here++;
+	}
+
+	v2_put(STATUS_CMD_OK);
+	v2_end();
+	avrpdata.stats.bytes_read += n;
+}
+
+/* v2_program_fuse() - program a fuse or lock byte
+ *
+ * Body: cmd, 4 instruction bytes
+ * Answer: cmd, status, status
+*/
+static void v2_program_fuse(uint8_t cmd)
+{
+	uint8_t *b = avrpdata.buff;
+
+	spi_transaction(b[1], b[2], b[3], b[4]);
+
+	v2_begin(3);
+	v2_put(cmd);
+	v2_put(STATUS_CMD_OK);
+	v2_put(STATUS_CMD_OK);
+	v2_end();
+}
+
+/* v2_read_fuse() - read a fuse, lock, signature or calibration byte
+ *
+ * Body: cmd, RetAddr (1..4: which byte of the response to return), 4 instruction bytes
+ * Answer: cmd, status, value, status
+*/
+static void v2_read_fuse(uint8_t cmd)
+{
+	uint8_t *b = avrpdata.buff;
+	uint8_t v = 0;
+
+	for ( uint8_t i = 1; i <= 4; i++ )
+	{
+		uint8_t r = spi_xfer(b[1+i]);
+
+		if ( i == b[1] )
+			v = r;
+	}
+
+	v2_begin(4);
+	v2_put(cmd);
+	v2_put(STATUS_CMD_OK);
+	v2_put(v);
+	v2_put(STATUS_CMD_OK);
+	v2_end();
+}
+
+/* v2_spi_multi() - general SPI transfer
+ *
+ * Body: cmd, NumTx, NumRx, RxStartAddr, TxData...
+ * Answer: cmd, status, RxData..., status
+ *
+ * Bytes are clocked until all of TxData has been sent and NumRx bytes have been received,
+ * starting with the byte received during transfer number RxStartAddr. Zeros are sent after TxData.
+ * If the body holds fewer than NumTx bytes of TxData, the command fails rather than clock out whatever
+ * is left in the buffer from an earlier command.
+*/
+static void v2_spi_multi(uint16_t size)
+{
+	uint8_t *b = avrpdata.buff;
+	uint8_t ntx = b[1];
+	uint8_t nrx = b[2];
+	uint8_t rxstart = b[3];
+	uint8_t rxcount = 0;
+
+	if ( size < 4 || size - 4 < ntx )
+	{
+		v2_status(CMD_SPI_MULTI, STATUS_CMD_FAILED);
+		return;
+	}
+
+	v2_begin(nrx + 3);
+	v2_put(CMD_SPI_MULTI);
+	v2_put(STATUS_CMD_OK);
+
+	for ( uint16_t i = 0; i < ntx || rxcount < nrx; i++ )
+	{
+		uint8_t r = spi_xfer(i < ntx ? b[4+i] : 0x00);
+
+		if ( i >= rxstart && rxcount < nrx )
+		{
+			v2_put(r);
+			rxcount++;
+		}
+	}
+
+	v2_put(STATUS_CMD_OK);
+	v2_end();
+}
+
+/* v2_crc_check() - compare the CRCs of blocks of the target's flash with CRCs sent by the host
+ *
+ * Body: cmd, blksize (2), n, n CRCs (2 bytes each, big-endian)
+ * Answer: cmd, status, number of bad blocks, index of each bad block, status
+ *
+ * The first block is at the address set by CMD_LOAD_ADDRESS. See crc_check()
+*/
+static void v2_crc_check(uint16_t size)
+{
+	uint8_t *b = avrpdata.buff;
+	uint16_t blksize = beget16(&b[1]);
+	uint8_t n = b[3];
+	uint8_t nbad;
+
+	if ( size < 4 || n > AVRP_CRC_MAX || size - 4 < n * 2 || blksize == 0 || (blksize & 1) != 0 )
+	{
+		v2_status(CMD_CRC_CHECK, STATUS_CMD_FAILED);
+		return;
+	}
+
+	v2_ext_address();
+	nbad = crc_check(&b[4], blksize, n);
+
+	v2_begin(nbad + 4);
+	v2_put(CMD_CRC_CHECK);
+	v2_put(STATUS_CMD_OK);
+	v2_put(nbad);
+	for ( uint8_t i = 0; i < nbad; i++ )
+		v2_put(b[4+i]);
+	v2_put(STATUS_CMD_OK);
+	v2_end();
+}
+
+/* v2_get_stats() - send the statistics for the session
+ *
+ * Body: cmd
+ * Answer: cmd, status, avrp_stats_t (little-endian), status
+*/
+static void v2_get_stats(void)
+{
+	uint8_t *p = (uint8_t *)&avrpdata.stats;
+
+	avrp_update_stats();
+
+	v2_begin(sizeof(avrpdata.stats) + 3);
+	v2_put(CMD_GET_STATS);
+	v2_put(STATUS_CMD_OK);
+	for ( uint8_t i = 0; i < sizeof(avrpdata.stats); i++ )
+		v2_put(p[i]);
+	v2_put(STATUS_CMD_OK);
+	v2_end();
+}
+
+/* v2_xprog_setmode() - select the XPROG mode
+ *
+ * Body: cmd, mode
+ * Answer: cmd, status
+*/
+static void v2_xprog_setmode(void)
+{
+	avrpdata.xprog_mode = avrpdata.buff[1];
+	v2_status(CMD_XPROG_SETMODE, (avrpdata.xprog_mode == XPRG_MODE_TPI) ? STATUS_CMD_OK : STATUS_CMD_FAILED);
+}
+
+/* v2_xprog() - TPI programming with the XPROG commands
+ *
+ * Body: cmd, xcmd, parameters...
+ *	ENTER_PROGMODE, LEAVE_PROGMODE: no parameters
+ *	ERASE: type, address (4)
+ *	WRITE_MEM: memtype, mode, address (4), length (2), data...
+ *	READ_MEM: memtype, address (4), length (2)
+ *	SET_PARAM: id, value (1 or 2)
+ * Answer: cmd, xcmd, XPRG status, data (READ_MEM only)
+ *
+ * All the TPI memories are in one address space and the host sends the full address
+ * (e.g. 0x4000 for the start of flash), so the memory type isn't needed. The upper
+ * 16 bits of the address are ignored. The NVM register addresses that the host sets
+ * are the same for all TPI devices, so SET_PARAM is accepted and ignored.
+*/
+static void v2_xprog(uint16_t size)
+{
+	uint8_t *b = avrpdata.buff;
+	uint8_t xcmd = b[1];
+	uint8_t err = XPRG_ERR_FAILED;
+	uint16_t n;
+
+	if ( avrpdata.xprog_mode != XPRG_MODE_TPI )
+	{
+		v2_xprog_status(xcmd, XPRG_ERR_FAILED);
+		return;
+	}
+
+	switch ( xcmd )
+	{
+	case XPRG_CMD_ENTER_PROGMODE:
+		if ( avrpdata.pmode == 1 || tpi_start_pmode() )
+			err = XPRG_ERR_OK;
+		break;
+
+	case XPRG_CMD_LEAVE_PROGMODE:
+		avrpdata.errorcount = 0;
+		avrpdata.errorcode = 0x00;
+		tpi_end_pmode();
+		err = XPRG_ERR_OK;
+		break;
+
+	case XPRG_CMD_ERASE:
+		if ( size >= 7 )
+			err = tpi_erase(b[2] == XPRG_ERASE_CHIP, beget16(&b[5]));
+		break;
+
+	case XPRG_CMD_WRITE_MEM:
+		n = beget16(&b[8]);
+		if ( size >= 10 && n <= size - 10 )
+		{
+			prog_lamp(0);
+			err = tpi_write(beget16(&b[6]), &b[10], n);
+			prog_lamp(1);
+		}
+		break;
+
+	case XPRG_CMD_READ_MEM:
+		n = beget16(&b[7]);
+		if ( size >= 9 && n <= AVRP_BUFFSIZE )
+		{
+			err = tpi_read(beget16(&b[5]), b, n);
+			if ( err == 0 )
+			{
+				v2_begin(n + 3);
+				v2_put(CMD_XPROG);
+				v2_put(xcmd);
+				v2_put(XPRG_ERR_OK);
+				for ( uint16_t i = 0; i < n; i++ )
+					v2_put(b[i]);
+				v2_end();
+				return;
+			}
+		}
+		break;
+
+	case XPRG_CMD_SET_PARAM:
+		err = XPRG_ERR_OK;
+		break;
+
+	default:
+		avrp_error(0x13);
+		break;
+	}
+
+	if ( err == TPI_ERR_TIMEOUT )
+		err = XPRG_ERR_TIMEOUT;
+	else if ( err != XPRG_ERR_OK )
+		err = XPRG_ERR_FAILED;
+
+	v2_xprog_status(xcmd, err);
+}
+
+static void v2_xprog_status(uint8_t xcmd, uint8_t err)
+{
+	v2_begin(3);
+	v2_put(CMD_XPROG);
+	v2_put(xcmd);
+	v2_put(err);
+	v2_end();
+}
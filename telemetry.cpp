@@ -0,0 +1,142 @@
+/* telemetry.cpp - measurements as binary records on the serial port
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <Arduino.h>
+#include <util/crc16.h>
+#include "timing.h"
+#include "uart.h"
+#include "telemetry.h"
+
+#if TELEM_ENABLE
+
+static_assert(TELEM_FRAME_MAX < UART_TXBUF_SIZE, "a telemetry frame must fit in the uart's transmit buffer");
+static_assert(TELEM_RAW_MAX < 254, "telem_send() assumes a frame with a single COBS block");
+
+// The frame being collected: header, records, space for the CRC
+static uint8_t telem_buf[TELEM_RAW_MAX];
+static uint8_t telem_n;				// Number of records in telem_buf
+static uint8_t telem_seq;
+static uint8_t telem_lost;
+static uint8_t telem_on = 1;
+
+static void telem_send(void);
+
+/* telem_init() - start with an empty batch. Called at the start of each measurement mode.
+*/
+void telem_init(void)
+{
+	telem_n = 0;
+	telem_lost = 0;
+}
+
+/* telem_enable() - turn the telemetry on or off
+ *
+ * A batch that has been collected is thrown away when the telemetry is turned off.
+*/
+void telem_enable(uint8_t on)
+{
+	telem_on = on;
+	if ( !on )
+		telem_n = 0;
+}
+
+/* telem_record() - add a record to the batch, and send the batch if the link has room for it
+ *
+ * The record is copied in the processor's byte order, which is little-endian.
+*/
+void telem_record(uint8_t instrument, uint8_t channel, int32_t raw, float value)
+{
+	if ( !telem_on )
+		return;
+
+	uint32_t t = (uint32_t)read_ticks();
+
+	telem_poll();
+
+	if ( telem_n >= TELEM_BATCH )
+	{
+		if ( telem_lost < 255 )
+			telem_lost++;
+		return;
+	}
+
+	uint8_t *r = &telem_buf[TELEM_HDR_SIZE + telem_n * TELEM_REC_SIZE];
+	memcpy(&r[0], &t, 4);
+	r[4] = instrument;
+	r[5] = channel;
+	memcpy(&r[6], &raw, 4);
+	memcpy(&r[10], &value, 4);
+	telem_n++;
+
+	telem_poll();
+}
+
+/* telem_poll() - send the batch if there's room in the transmit buffer
+ *
+ * Called from the main loops of the measurement modes, so that records that were held back while
+ * the link was busy go out as soon as possible.
+*/
+void telem_poll(void)
+{
+	if ( telem_n > 0 && uart_tx_space() >= TELEM_HDR_SIZE + telem_n * TELEM_REC_SIZE + TELEM_CRC_SIZE + 2 )
+		telem_send();
+}
+
+/* telem_send() - add the header and CRC to the batch and queue it, COBS-encoded
+ *
+ * Each zero byte is replaced by the distance to the next one (or to the end of the frame);
+ * the first distance goes in front. The frame is shorter than 254 bytes, so there's no need
+ * for the long-block rule of COBS. Then the delimiter.
+*/
+static void telem_send(void)
+{
+	uint8_t len = TELEM_HDR_SIZE + telem_n * TELEM_REC_SIZE;
+	uint16_t crc = 0;
+	uint8_t i, j;
+
+	telem_buf[0] = telem_seq++;
+	telem_buf[1] = telem_lost;
+
+	for ( i = 0; i < len; i++ )
+		crc = _crc_xmodem_update(crc, telem_buf[i]);
+	telem_buf[len++] = (uint8_t)crc;
+	telem_buf[len++] = (uint8_t)(crc >> 8);
+
+	i = 0;
+	for (;;)
+	{
+		j = i;
+		while ( j < len && telem_buf[j] != 0 )
+			j++;
+
+		uart_putc(j - i + 1);
+		while ( i < j )
+			uart_putc(telem_buf[i++]);
+
+		if ( j >= len )
+			break;
+		i = j + 1;		// Skip the zero
+	}
+	uart_putc(0);
+
+	telem_n = 0;
+	telem_lost = 0;
+}
+
+#endif
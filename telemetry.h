@@ -0,0 +1,89 @@
+/* telemetry.h - measurements as binary records on the serial port
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef TELEMETRY_H
+#define TELEMETRY_H	1
+
+#include <Arduino.h>
+
+/* The measurement modes send every result that they display as a record on the serial port.
+ * bench/telem-csv turns the stream into CSV.
+ *
+ * A record is 14 bytes, little-endian:
+ *	ticks		uint32	time of the measurement (the low 32 bits of read_ticks())
+ *	instrument	uint8	the mode (m_freq, m_cap, m_ind or m_dvm; see joat.h)
+ *	channel		uint8	see below
+ *	raw			int32	the raw reading, see below
+ *	value		float	the result in SI units (Hz, F, H, V)
+ *
+ *	instrument	channel					raw
+ *	m_freq		0						ticks over which the edges were counted (0 = no signal)
+ *	m_cap		0 = divider, 1 = RC		a/d reading, or the charging time in ticks
+ *	m_ind		capacitor (1..5)		ticks over which the oscillations were counted
+ *	m_dvm		input (1..4)			a/d reading
+ *
+ * Records are collected in a batch. The batch is sent as one frame as soon as there's room for it in
+ * the transmit buffer, so records only wait while the link is busy and the link never holds up the
+ * measurement. If the batch is full when a new record arrives, the new record is dropped and counted.
+ *
+ * A frame is
+ *	seq			uint8	incremented for each frame
+ *	lost		uint8	records dropped since the previous frame (saturating)
+ *	records		1..TELEM_BATCH of them
+ *	crc			uint16	CRC-16/XMODEM of the above, little-endian
+ * COBS-encoded (so that it has no zero bytes) and followed by a zero byte. A reader that starts in the
+ * middle of a frame, or loses a byte, finds the start of the next frame at the next zero.
+ *
+ * The serial port is the one that scpi.cpp starts. Telemetry is on after a power-on; any remote command
+ * turns it off, so that it doesn't get mixed up with the replies. SYSTem:TELEMetry ON turns it on again.
+ *
+ * Build with CPPFLAGS += -DTELEM_ENABLE=0 to leave it out.
+*/
+#ifndef TELEM_ENABLE
+#define TELEM_ENABLE	1
+#endif
+
+#define TELEM_BATCH		4			// Records per frame. A whole frame must fit in the uart's transmit buffer.
+
+#define TELEM_REC_SIZE	14
+#define TELEM_HDR_SIZE	2
+#define TELEM_CRC_SIZE	2
+#define TELEM_RAW_MAX	(TELEM_HDR_SIZE + TELEM_BATCH * TELEM_REC_SIZE + TELEM_CRC_SIZE)
+#define TELEM_FRAME_MAX	(TELEM_RAW_MAX + TELEM_RAW_MAX / 254 + 2)	// COBS overhead and the delimiter
+
+#if TELEM_ENABLE
+
+extern void telem_init(void);
+extern void telem_enable(uint8_t on);
+extern void telem_record(uint8_t instrument, uint8_t channel, int32_t raw, float value);
+extern void telem_poll(void);
+
+#else
+
+static inline void telem_init(void)		{}
+static inline void telem_enable(uint8_t on)	{ (void)on; }
+static inline void telem_record(uint8_t instrument, uint8_t channel, int32_t raw, float value)
+{
+	(void)instrument; (void)channel; (void)raw; (void)value;
+}
+static inline void telem_poll(void)		{}
+
+#endif
+
+#endif
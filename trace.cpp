@@ -0,0 +1,92 @@
+/* trace.cpp - event trace buffer
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <Arduino.h>
+#include "timing.h"
+#include "uart.h"
+#include "trace.h"
+
+#if TRACE_ENABLE
+
+trace_event_t trace_buf[TRACE_NEVENTS];
+uint8_t trace_head;
+uint16_t trace_count;			// Number of events recorded, saturating
+volatile uint8_t trace_stopped;	// Nothing is recorded while the buffer is being dumped
+
+static void put_hex(uint32_t v, uint8_t ndigits);
+
+/* trace_dump() - send the buffer to the host, oldest event first
+ *
+ * The format is one event per line, in hex: id, ticks, argument. E.g.
+ *	# trace 32 of 1234
+ *	01 0f3a8c20 1f40
+ *	...
+ *	# end
+ * Events that happen during the dump are not recorded; otherwise a busy interrupt handler would
+ * overwrite the buffer faster than it can be sent.
+*/
+void trace_dump(void)
+{
+	trace_stopped = 1;
+
+	uint16_t count = trace_count;
+	uint8_t n = (count < TRACE_NEVENTS) ? (uint8_t)count : TRACE_NEVENTS;
+	uint8_t i = (trace_head - n) & TRACE_MASK;
+
+	uart_puts_P(PSTR("# trace "));
+	put_hex(n, 2);
+	uart_puts_P(PSTR(" of "));
+	put_hex(count, 4);
+	uart_puts_P(PSTR("\r\n"));
+
+	while ( n > 0 )
+	{
+		trace_event_t *e = &trace_buf[i];
+
+		put_hex(e->id, 2);
+		uart_putc(' ');
+		put_hex(e->ticks, 8);
+		uart_putc(' ');
+		put_hex(e->arg, 4);
+		uart_puts_P(PSTR("\r\n"));
+
+		// A line takes about 1.5 ms at 115200 baud. Keep the timing system going.
+		(void)read_ticks();
+
+		i = (i + 1) & TRACE_MASK;
+		n--;
+	}
+
+	uart_puts_P(PSTR("# end\r\n"));
+	uart_flush();
+
+	trace_stopped = 0;
+}
+
+static void put_hex(uint32_t v, uint8_t ndigits)
+{
+	while ( ndigits > 0 )
+	{
+		ndigits--;
+		uint8_t d = (v >> (ndigits * 4)) & 0x0f;
+		uart_putc((d < 10) ? ('0' + d) : ('a' + d - 10));
+	}
+}
+
+#endif
@@ -0,0 +1,114 @@
+/* trace.h - event trace buffer
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef TRACE_H
+#define TRACE_H	1
+
+#include <Arduino.h>
+#include "timing.h"
+
+/* trace(id, arg) records an event with the time (the low 32 bits of read_ticks()) in a ring buffer.
+ * The buffer keeps the last TRACE_NEVENTS events. The SYSTem:TRACe? command (scpi.cpp) dumps the buffer
+ * as text; bench/trace-decode.sh turns that into a timeline.
+ *
+ * TRACE_ENABLE turns the whole thing on. TRACE_GROUPS selects groups of events: the group of an event
+ * is the upper nibble of its id. When an event isn't enabled, trace() compiles to nothing. An enabled
+ * trace point takes about 40 cycles and can be used in interrupt handlers.
+ *
+ * Build with e.g. CPPFLAGS += -DTRACE_ENABLE=1 -DTRACE_GROUPS=0x0e to trace everything but the ISRs.
+*/
+#ifndef TRACE_ENABLE
+#define TRACE_ENABLE	0
+#endif
+
+#ifndef TRACE_GROUPS
+#define TRACE_GROUPS	0xff
+#endif
+
+#define TRACE_NEVENTS	32			// Must be a power of 2, no larger than 256
+#define TRACE_MASK		(TRACE_NEVENTS-1)
+
+// Group 0: interrupt handlers
+#define TR_FREQ_CAPT	0x01		// Frequency meter capture; arg = ICR1
+#define TR_FREQ_OVF		0x02		// Timer1 overflow in the frequency meter; arg = overflow count
+#define TR_UART_RX		0x03		// Character received; arg = character
+#define TR_BR_START		0x04		// Bridge: start bit from the target; arg = TCNT1
+#define TR_BR_RXBYTE	0x05		// Bridge: character received from the target; arg = character | 0x100 if bad stop bit
+
+// Group 1: AVR programmer
+#define TR_ISP_CMD		0x10		// STK500v1 command; arg = command character
+#define TR_V2_CMD		0x11		// STK500v2 command; arg = command id
+#define TR_COMMIT		0x12		// Page write started; arg = address
+#define TR_COMMIT_DONE	0x13		// Page write finished; arg = 0 if OK
+#define TR_ERROR		0x14		// Error, e.g. out of sync; arg = error code (see avrp_error())
+
+// Group 2: measurements
+#define TR_ADC			0x20		// a/d conversion started; arg = pin
+#define TR_ADC_DONE		0x21		// a/d conversion finished; arg = value
+
+// Group 3: display
+#define TR_LCD			0x30		// Display update started; arg = mode
+#define TR_LCD_DONE		0x31		// Display update finished
+
+typedef struct trace_event_s
+{
+	uint8_t id;
+	uint16_t arg;
+	uint32_t ticks;
+} trace_event_t;
+
+#if TRACE_ENABLE
+
+extern trace_event_t trace_buf[TRACE_NEVENTS];
+extern uint8_t trace_head;
+extern uint16_t trace_count;
+extern volatile uint8_t trace_stopped;
+
+extern void trace_dump(void);
+
+/* trace() - record an event
+ *
+ * The time is worked out like read_ticks() does it, but without updating timing_time, so it is safe
+ * in an interrupt handler. SREG is restored rather than interrupts enabled.
+*/
+static inline void trace(uint8_t id, uint16_t arg)
+{
+	if ( (TRACE_GROUPS & (1 << (id >> 4))) == 0 || trace_stopped )
+		return;
+
+	uint8_t sreg = SREG;
+	cli();
+	uint16_t t1 = TCNT1;
+	trace_event_t *e = &trace_buf[trace_head];
+	e->id = id;
+	e->arg = arg;
+	e->ticks = (uint32_t)timing_time + (uint16_t)(t1 - timing_last_t1);
+	trace_head = (trace_head + 1) & TRACE_MASK;
+	if ( ++trace_count == 0 )
+		trace_count--;
+	SREG = sreg;
+}
+
+#else
+
+static inline void trace(uint8_t id, uint16_t arg)	{ (void)id; (void)arg; }
+
+#endif
+
+#endif
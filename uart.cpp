@@ -0,0 +1,223 @@
+/* uart.cpp - interrupt-driven serial port
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <Arduino.h>
+#include "uart.h"
+#include "trace.h"
+
+/* The arduino HardwareSerial class polls and copies one byte at a time through a virtual
+ * function call, and its default buffers are too small to keep up at high baud rates.
+ * This module drives USART0 directly. Reception and transmission are both interrupt-driven
+ * using ring buffers, so the caller only ever waits when a buffer is empty (receive) or full (transmit).
+ *
+ * Note: the Serial object must not be used anywhere in the firmware. If it is, HardwareSerial gets
+ * linked and its interrupt handlers clash with the ones here.
+*/
+
+static uint8_t uart_rxbuf[UART_RXBUF_SIZE];
+static uint8_t uart_txbuf[UART_TXBUF_SIZE];
+
+volatile uint8_t uart_rx_head;
+volatile uint8_t uart_rx_tail;
+volatile uint8_t uart_rx_overrun;
+static volatile uint8_t uart_tx_head;
+static volatile uint8_t uart_tx_tail;
+
+static void uart_start(uint16_t ubrr);
+
+/* ISR(USART_RX_vect) - interrupt handler for received characters
+ *
+ * Store the character in the ring buffer. If the buffer is full, the character is dropped
+ * and the overrun counter is incremented.
+*/
+ISR(USART_RX_vect)
+{
+	uint8_t c = UDR0;
+	uint8_t h = (uart_rx_head + 1) & UART_RXBUF_MASK;
+
+	trace(TR_UART_RX, c);
+
+	if ( h != uart_rx_tail )
+	{
+		uart_rxbuf[uart_rx_head] = c;
+		uart_rx_head = h;
+	}
+	else
+	{
+		uart_rx_overrun++;
+	}
+}
+
+/* ISR(USART_UDRE_vect) - interrupt handler for transmitter data register empty
+ *
+ * Send the next character from the ring buffer. When the buffer is empty, disable the interrupt.
+*/
+ISR(USART_UDRE_vect)
+{
+	uint8_t t = uart_tx_tail;
+
+	if ( t != uart_tx_head )
+	{
+		UDR0 = uart_txbuf[t];
+		uart_tx_tail = (t + 1) & UART_TXBUF_MASK;
+	}
+	else
+	{
+		UCSR0B &= ~_BV(UDRIE0);
+	}
+}
+
+/* uart_init() - initialise the UART at the given baud rate
+ *
+ * Double-speed mode is always used because it gives a smaller error at the common baud rates.
+ * At 16 MHz, 250000, 500000 and 1000000 baud are exact; 115200 is 2.1% fast, which is tolerated
+ * by all the USB-serial converters that are fitted to nano boards.
+*/
+void uart_init(uint32_t baud)
+{
+	uart_start((uint16_t)(((F_CPU / 8) + (baud / 2)) / baud - 1));
+}
+
+/* uart_init_fast() - initialise the UART at the given baud rate or the nearest faster one
+ *
+ * For passing on a stream that arrives at exactly the given rate without falling behind: 58824 baud
+ * for 57600 (2.1% fast, like 115200), 38462 for 38400, 19231 for 19200, 9615 for 9600.
+*/
+void uart_init_fast(uint32_t baud)
+{
+	uart_start((uint16_t)((F_CPU / 8) / baud - 1));
+}
+
+/* uart_start() - initialise the UART with the given baud rate register value
+*/
+static void uart_start(uint16_t ubrr)
+{
+	UCSR0B = 0;
+	uart_rx_head = uart_rx_tail = 0;
+	uart_tx_head = uart_tx_tail = 0;
+	uart_rx_overrun = 0;
+
+	UCSR0A = _BV(U2X0);
+	UBRR0 = ubrr;
+	UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);						// 8N1
+	UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+}
+
+/* uart_getc() - wait for a character and return it
+*/
+uint8_t uart_getc(void)
+{
+	uint8_t t = uart_rx_tail;
+
+	while ( t == uart_rx_head )
+	{	// Wait
+	}
+
+	uint8_t c = uart_rxbuf[t];
+	uart_rx_tail = (t + 1) & UART_RXBUF_MASK;
+	return c;
+}
+
+/* uart_peek() - returns the i-th character waiting in the receive buffer, without taking it
+ *
+ * i must be less than uart_available().
+*/
+uint8_t uart_peek(uint8_t i)
+{
+	return uart_rxbuf[(uart_rx_tail + i) & UART_RXBUF_MASK];
+}
+
+/* uart_read() - read a block of characters into a buffer
+ *
+ * Each character is copied as soon as it arrives, so the ring buffer never fills up
+ * even when the block is larger than the ring buffer.
+*/
+void uart_read(uint8_t *buf, uint16_t n)
+{
+	uint8_t t = uart_rx_tail;
+
+	while ( n > 0 )
+	{
+		while ( t == uart_rx_head )
+		{	// Wait
+		}
+
+		*buf++ = uart_rxbuf[t];
+		t = (t + 1) & UART_RXBUF_MASK;
+		uart_rx_tail = t;
+		n--;
+	}
+}
+
+/* uart_putc() - queue a character for transmission
+ *
+ * Waits if the buffer is full.
+*/
+void uart_putc(uint8_t c)
+{
+	uint8_t h = uart_tx_head;
+	uint8_t nh = (h + 1) & UART_TXBUF_MASK;
+
+	while ( nh == uart_tx_tail )
+	{	// Wait
+	}
+
+	uart_txbuf[h] = c;
+	uart_tx_head = nh;
+	UCSR0B |= _BV(UDRIE0);
+}
+
+/* uart_write() - queue a block of characters for transmission
+*/
+void uart_write(const uint8_t *buf, uint16_t n)
+{
+	while ( n > 0 )
+	{
+		uart_putc(*buf++);
+		n--;
+	}
+}
+
+/* uart_puts_P() - queue a string from flash for transmission
+*/
+void uart_puts_P(const char *s)
+{
+	char c;
+
+	while ( (c = pgm_read_byte(s++)) != '\0' )
+	{
+		uart_putc((uint8_t)c);
+	}
+}
+
+/* uart_flush() - wait until everything in the transmit buffer has been sent
+*/
+void uart_flush(void)
+{
+	while ( (uart_tx_head != uart_tx_tail) || (UCSR0B & _BV(UDRIE0)) )
+	{	// Wait
+	}
+}
+
+/* uart_tx_space() - returns the number of characters that can be queued without waiting
+*/
+uint8_t uart_tx_space(void)
+{
+	return (uart_tx_tail - uart_tx_head - 1) & UART_TXBUF_MASK;
+}
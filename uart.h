@@ -0,0 +1,54 @@
+/* uart.h - interrupt-driven serial port; replaces the arduino Serial object
+ *
+ * (c) David Haworth
+ *
+ *	This file is part of Joat.
+ *
+ *	Joat is free software: you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	Joat is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with Joat.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef UART_H
+#define UART_H	1
+
+#include <Arduino.h>
+
+// Ring buffer sizes. Must be powers of 2, no larger than 256.
+#define UART_RXBUF_SIZE		128
+#define UART_TXBUF_SIZE		64
+
+#define UART_RXBUF_MASK		(UART_RXBUF_SIZE-1)
+#define UART_TXBUF_MASK		(UART_TXBUF_SIZE-1)
+
+extern volatile uint8_t uart_rx_head;
+extern volatile uint8_t uart_rx_tail;
+extern volatile uint8_t uart_rx_overrun;
+
+extern void uart_init(uint32_t baud);
+extern void uart_init_fast(uint32_t baud);
+extern uint8_t uart_getc(void);
+extern uint8_t uart_peek(uint8_t i);
+extern void uart_read(uint8_t *buf, uint16_t n);
+extern void uart_putc(uint8_t c);
+extern void uart_write(const uint8_t *buf, uint16_t n);
+extern void uart_puts_P(const char *s);
+extern void uart_flush(void);
+extern uint8_t uart_tx_space(void);
+
+/* uart_available() - returns the number of received characters waiting in the buffer
+*/
+static inline uint8_t uart_available(void)
+{
+	return (uart_rx_head - uart_rx_tail) & UART_RXBUF_MASK;
+}
+
+#endif